@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * fsck_bitmapbench
+ *
+ *  Times the volume bitmap operations in dfalib/VolumeBitmapOps.c
+ *  against the plain loops CheckVolumeBitMap and UpdateFreeBlockCount
+ *  used before, over a made-up bitmap of the given size, and checks that
+ *  both give the same answers.  The bitmap is worked through a segment
+ *  (1024 blocks) at a time, as the check does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "VolumeBitmapOps.h"
+
+#define kBytesPerSegment	128
+
+char *progname = "fsck_bitmapbench";
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* The old per-segment compare */
+static int
+OldEqual(const uint8_t *a, const uint8_t *b)
+{
+	return (memcmp(a, b, kBytesPerSegment) == 0);
+}
+
+/* The old first difference: word, then bit, as the debug dump did */
+static int64_t
+OldFirstDifference(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < length; i++)
+		if (a[i] != b[i])
+			for (j = 0; j < 8; j++)
+				if ((a[i] ^ b[i]) & (0x80 >> j))
+					return ((int64_t)i * 8 + j);
+	return (-1);
+}
+
+/* The old under-allocation test */
+static int
+OldHasBitsNotIn(const uint8_t *a, const uint8_t *b)
+{
+	int i;
+
+	for (i = 0; i < kBytesPerSegment; i++)
+		if (a[i] & ~b[i])
+			return (1);
+	return (0);
+}
+
+/* The old count: whole words, else a bit at a time */
+static uint64_t
+OldCountBits(const uint8_t *p)
+{
+	const uint32_t *w = (const uint32_t *)p;
+	uint64_t count = 0;
+	uint32_t word;
+	int i;
+
+	for (i = 0; i < kBytesPerSegment / 4; i++) {
+		if (w[i] == 0xFFFFFFFFu) {
+			count += 32;
+		} else {
+			for (word = w[i]; word; word >>= 1)
+				count += word & 1;
+		}
+	}
+	return (count);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-m megabytes] [-n passes]\n", progname);
+	fprintf(stderr, "  m megabytes = size of the bitmap (default 256: an 8TB volume of 4K blocks)\n");
+	fprintf(stderr, "  n passes = times over the bitmap for each operation (default 4)\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t length, i;
+	uint8_t *memory, *disk;
+	uint64_t oldCount, newCount;
+	int64_t oldDiff, newDiff;
+	long oldMatches, newMatches, oldUnder, newUnder;
+	double start, oldTime, newTime;
+	int megabytes = 256, passes = 4, pass, ch, errors = 0;
+
+	while ((ch = getopt(argc, argv, "m:n:")) != -1) {
+		switch (ch) {
+		case 'm':
+			megabytes = atoi(optarg);
+			break;
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (megabytes <= 0 || passes <= 0)
+		usage();
+
+	length = (size_t)megabytes << 20;
+	memory = malloc(length);
+	disk = malloc(length);
+	if (memory == NULL || disk == NULL) {
+		fprintf(stderr, "%s: can't allocate %d MB bitmaps\n", progname, megabytes);
+		exit(1);
+	}
+
+	/* Runs of used and free blocks, and every 64th segment different */
+	srandom(1);
+	for (i = 0; i < length; ) {
+		size_t run = 1 + random() % 64;
+		int fill = (random() & 1) ? 0xFF : (int)(random() & 0xFF);
+
+		if (run > length - i)
+			run = length - i;
+		memset(memory + i, fill, run);
+		i += run;
+	}
+	memcpy(disk, memory, length);
+	for (i = 0; i < length; i += 64 * kBytesPerSegment)
+		disk[i + random() % kBytesPerSegment] ^= 1 << (random() % 8);
+
+	printf("%d MB bitmap, %d passes, %s operations\n", megabytes, passes, BitmapOpsKind());
+	printf("%-22s %10s %10s %8s\n", "operation", "old MB/s", "new MB/s", "speedup");
+
+#define REPORT(name) \
+	printf("%-22s %10.0f %10.0f %7.1fx\n", name, \
+		megabytes * passes / oldTime, megabytes * passes / newTime, oldTime / newTime)
+
+	/* Segment compare, as CheckVolumeBitMap does */
+	oldMatches = newMatches = 0;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < length; i += kBytesPerSegment)
+			oldMatches += OldEqual(memory + i, disk + i);
+	oldTime = now() - start;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < length; i += kBytesPerSegment)
+			newMatches += BitmapEqual(memory + i, disk + i, kBytesPerSegment);
+	newTime = now() - start;
+	REPORT("segment compare");
+	if (oldMatches != newMatches) {
+		printf("  MISMATCH: %ld equal segments, expected %ld\n", newMatches, oldMatches);
+		errors++;
+	}
+
+	/* Under-allocation test of the segments that differ */
+	oldUnder = newUnder = 0;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < length; i += kBytesPerSegment)
+			oldUnder += OldHasBitsNotIn(memory + i, disk + i);
+	oldTime = now() - start;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < length; i += kBytesPerSegment)
+			newUnder += BitmapHasBitsNotIn(memory + i, disk + i, kBytesPerSegment);
+	newTime = now() - start;
+	REPORT("under-allocation");
+	if (oldUnder != newUnder) {
+		printf("  MISMATCH: %ld segments under-allocated, expected %ld\n", newUnder, oldUnder);
+		errors++;
+	}
+
+	/* First difference, over the whole bitmap less the last segment's change */
+	memcpy(disk, memory, length);
+	disk[length - 1] ^= 0x01;
+	oldDiff = newDiff = 0;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		oldDiff = OldFirstDifference(memory, disk, length);
+	oldTime = now() - start;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		newDiff = BitmapFirstDifference(memory, disk, length);
+	newTime = now() - start;
+	REPORT("first difference");
+	if (oldDiff != newDiff) {
+		printf("  MISMATCH: first difference at bit %lld, expected %lld\n",
+			(long long)newDiff, (long long)oldDiff);
+		errors++;
+	}
+
+	/* Population count, as UpdateFreeBlockCount does */
+	oldCount = newCount = 0;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < length; i += kBytesPerSegment)
+			oldCount += OldCountBits(memory + i);
+	oldTime = now() - start;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < length; i += kBytesPerSegment)
+			newCount += BitmapCountBits(memory + i, kBytesPerSegment);
+	newTime = now() - start;
+	REPORT("count bits");
+	if (oldCount != newCount) {
+		printf("  MISMATCH: %llu bits set, expected %llu\n",
+			(unsigned long long)newCount, (unsigned long long)oldCount);
+		errors++;
+	}
+
+	free(memory);
+	free(disk);
+	return (errors ? 1 : 0);
+}
@@ -23,10 +23,15 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#ifdef __APPLE__
+#include <mach/vm_statistics.h>
+#endif
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -39,6 +44,117 @@
 
 #define CACHE_DEBUG  0
 
+/*
+ * FreeBlock_t
+ *
+ *  Header kept at the start of every unused cache block, linking it into the
+ *  (doubly linked) free list so that a particular block can be claimed.
+ */
+typedef struct FreeBlock_t
+{
+	struct FreeBlock_t *	Next;
+	struct FreeBlock_t *	Prev;
+} FreeBlock_t;
+
+/* Cache memory */
+enum {
+	kCacheHugePageSize	=	0x200000,	/* 2MB */
+	kCacheInitSlice		=	0x10000000,	/* cache memory prepared per thread (256MB) */
+	kCacheInitThreads	=	16			/* most threads preparing it */
+};
+
+/*
+ * ArenaSlice_t
+ *
+ *  A run of cache blocks for one thread to link into the free list (and
+ *  pre-fault) while the cache is set up.
+ */
+typedef struct ArenaSlice_t
+{
+	char *			Start;		/* First block */
+	uint32_t		Count;		/* Number of blocks */
+	uint32_t		BlockSize;
+	int				PreTouch;	/* Fault in every page, not just block headers */
+	pthread_t		Thread;
+} ArenaSlice_t;
+
+/* Stream read clustering */
+enum {
+	kStreamClusterMax	=	256		/* most cache blocks loaded by one cluster read */
+};
+
+/* Readahead tuning */
+enum {
+	kReadAheadStreams	=	8,		/* access streams tracked at once */
+	kReadAheadTrigger	=	2,		/* matching reads before a stream is read ahead */
+	kReadAheadMaxStride	=	16		/* largest stride (in cache blocks) detected */
+};
+
+/* Most cache blocks merged into one write by CacheFlush */
+enum {
+	kCacheWriteRunMax	=	32
+};
+
+/*
+ * RAStream_t
+ *
+ *  One access stream seen by the readahead detector.  Reads of different
+ *  files (a B-tree walk and a bitmap scan, say) land in different areas of
+ *  the disk and so are tracked as separate streams.
+ */
+typedef struct RAStream_t
+{
+	uint64_t	Last;		/* Offset of the last cache block read */
+	int64_t		Stride;		/* Distance between consecutive reads */
+	uint64_t	Next;		/* Next offset to read ahead */
+	uint32_t	Run;		/* Consecutive reads that matched the stride */
+	uint32_t	Used;		/* When the stream was last read (0 if unused) */
+} RAStream_t;
+
+/*
+ * RARequest_t
+ *
+ *  An asynchronous read of one cache block.  The tag and cache page are set
+ *  up by the main thread, which keeps the tag busy until it has reaped the
+ *  request; the I/O threads only fill in the page, Error and Done.
+ */
+typedef struct RARequest_t
+{
+	struct RARequest_t *	Next;	/* Next request on the pending or free list */
+	struct RARequest_t *	Work;	/* Next request waiting for an I/O thread */
+	Tag_t *					Tag;	/* Tag being loaded */
+	uint64_t				Latency;	/* Time the read took, in microseconds */
+	int						Error;	/* Result of the read */
+	int						Done;	/* Set once the read has finished */
+} RARequest_t;
+
+/*
+ * ReadAhead_t
+ *
+ *  Readahead state hanging off the cache.  Lock protects the work queue,
+ *  Shutdown and the Error/Done fields of the requests.
+ */
+typedef struct ReadAhead_t
+{
+	pthread_mutex_t		Lock;
+	pthread_cond_t		WorkCond;	/* Signalled when work is queued */
+	pthread_cond_t		DoneCond;	/* Signalled when a read finishes */
+	RARequest_t *		WorkHead;	/* Requests waiting for an I/O thread */
+	RARequest_t *		WorkTail;
+	RARequest_t *		Pending;	/* Issued requests not yet reaped */
+	RARequest_t *		Free;		/* Unused requests */
+	int					Shutdown;	/* Tells the I/O threads to exit */
+
+	Cache_t *			Cache;
+	uint32_t			Window;		/* Blocks to keep ahead of a stream */
+	uint32_t			Clock;		/* Stream use counter */
+	RAStream_t			Streams[kReadAheadStreams];
+
+	uint32_t			ThreadCount;
+	pthread_t			Threads[MaxReadAheadThreads];
+	RARequest_t *		Requests;	/* Request storage */
+} ReadAhead_t;
+
 /*
  * CacheAllocBlock
  *
@@ -46,6 +162,44 @@
  */
 void *CacheAllocBlock (Cache_t *cache);
 
+/*
+ * CacheTakeBlock
+ *
+ *  Allocate a particular unused cache block.
+ */
+static void CacheTakeBlock (Cache_t *cache, void *block);
+
+/*
+ * CachePutBlock
+ *
+ *  Return a cache block to the free list.
+ */
+static void CachePutBlock (Cache_t *cache, void *block);
+
+/*
+ * CachePageTag
+ *
+ *  Returns the slot in PageTags for the given cache page.
+ */
+static inline Tag_t **CachePageTag (Cache_t *cache, void *block)
+{
+	return (&cache->PageTags[((char *)block - (char *)cache->Arena) / cache->BlockSize]);
+}
+
+/*
+ * CachePaired
+ *
+ *  Returns true if the cache page after a tag's holds the following block.
+ */
+static int CachePaired (Cache_t *cache, Tag_t *tag);
+
+/*
+ * CacheAdjoin
+ *
+ *  Try to make a tag's cache page follow another tag's page in memory.
+ */
+static int CacheAdjoin (Cache_t *cache, Tag_t *prev, Tag_t *tag);
+
 /*
  * CacheFreeBlock
  *
@@ -62,6 +216,56 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag );
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag);
 
+/*
+ * CacheLookupHint
+ *
+ *  CacheLookup, but on a miss prefer to load the block into the given page.
+ */
+static int CacheLookupHint (Cache_t *cache, uint64_t off, void *hint, Tag_t **tag);
+
+/*
+ * CacheHashFind
+ *
+ *  Returns the slot holding the tag for the given offset, or the empty slot
+ *  where it would be inserted.
+ */
+static uint32_t CacheHashFind (Cache_t *cache, uint64_t off);
+
+/*
+ * CacheHashGrow
+ *
+ *  Doubles the size of the lookup table.
+ */
+static int CacheHashGrow (Cache_t *cache);
+
+/*
+ * CacheHashInsert
+ *
+ *  Enters a tag into the lookup table, growing the table if necessary.
+ */
+static int CacheHashInsert (Cache_t *cache, Tag_t *tag);
+
+/*
+ * CacheHashDelete
+ *
+ *  Removes a tag from the lookup table.
+ */
+static void CacheHashDelete (Cache_t *cache, Tag_t *tag);
+
+/*
+ * CacheAddTagSlab
+ *
+ *  Add a slab of count tags to the free tag list.
+ */
+static int CacheAddTagSlab (Cache_t *cache, uint32_t count);
+
+/*
+ * CacheAllocTag
+ *
+ *  Take a zeroed tag from the tag slab.
+ */
+static Tag_t *CacheAllocTag (Cache_t *cache);
+
 /*
  * CacheRawRead
  *
@@ -69,6 +273,50 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag);
  */
 int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf);
 
+/*
+ * CacheRawReadv
+ *
+ *  Perform a direct scattered read on the file.
+ */
+static int CacheRawReadv (Cache_t *cache, uint64_t off, struct iovec *iov, int iovcnt, uint64_t *done);
+
+/*
+ * CacheStreamCluster
+ *
+ *  Load the missing blocks of a stream read's cluster with one I/O.
+ */
+static void CacheStreamCluster (Cache_t *cache, uint64_t cblk, uint64_t end);
+
+/*
+ * CacheReadAhead
+ *
+ *  Feed a block read to the readahead detector, reading ahead if it
+ *  continues a sequential or strided stream.
+ */
+static void CacheReadAhead (Cache_t *cache, uint64_t off, uint32_t readOptions);
+
+/*
+ * CacheReadAheadIssue
+ *
+ *  Start an asynchronous read of one cache block.
+ */
+static int CacheReadAheadIssue (Cache_t *cache, uint64_t off, uint32_t readOptions);
+
+/*
+ * CacheReadAheadReap
+ *
+ *  Finish completed readahead requests, optionally waiting for one tag or
+ *  for all of them.
+ */
+static void CacheReadAheadReap (Cache_t *cache, Tag_t *wait, int drain);
+
+/*
+ * CacheReadAheadThread
+ *
+ *  Body of a readahead I/O thread.
+ */
+static void *CacheReadAheadThread (void *arg);
+
 /*
  * CacheRawWrite
  *
@@ -76,6 +324,99 @@ int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf);
  */
 int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf);
 
+/*
+ * CacheRawWritev
+ *
+ *  Perform a direct gathered write on the file.
+ */
+static int CacheRawWritev (Cache_t *cache, uint64_t off, struct iovec *iov, int iovcnt);
+
+/*
+ * CacheClock
+ *
+ *  Current time in microseconds, for timing disk I/O.
+ */
+static uint64_t CacheClock (void);
+
+/*
+ * CacheNoteLatency
+ *
+ *  Count a disk I/O in the latency histogram.
+ */
+static void CacheNoteLatency (Cache_t *cache, uint64_t usec);
+
+/*
+ * CacheTrace
+ *
+ *  Record a request in the trace, if there is one.
+ */
+static void CacheTrace (Cache_t *cache, int op, uint64_t off, uint32_t len, uint32_t flags);
+
+/*
+ * CacheTracePhase
+ *
+ *  Record the name of a phase in the trace.
+ */
+static void CacheTracePhase (Cache_t *cache, uint32_t phase);
+
+/*
+ * CacheAllocArena
+ *
+ *  Allocate the cache memory, on huge pages if possible.
+ */
+static int CacheAllocArena (Cache_t *cache, uint64_t size);
+
+/*
+ * CacheInitArena
+ *
+ *  Put every cache block on the free list, optionally faulting in all
+ *  of the cache memory.
+ */
+static int CacheInitArena (Cache_t *cache, int preTouch);
+
+/*
+ * CacheInitSlice
+ *
+ *  Thread body for CacheInitArena.
+ */
+static void *CacheInitSlice (void *arg);
+
+/*
+ * CacheMapFile
+ *
+ *  Map a regular file being verified read-only, in place of the cache.
+ */
+static int CacheMapFile (Cache_t *cache);
+
+/*
+ * CacheReleaseMapped
+ *
+ *  Put back a buffer that points into the file mapping.
+ */
+static void CacheReleaseMapped (Cache_t *cache, Buf_t *buf);
+
+/*
+ * CacheMarkDirty / CacheMarkClean
+ *
+ *  Set or clear kLazyWrite on a tag, keeping count of dirty blocks.
+ */
+static void CacheMarkDirty (Cache_t *cache, Tag_t *tag);
+static void CacheMarkClean (Cache_t *cache, Tag_t *tag);
+
+/*
+ * CacheTagCompare
+ *
+ *  qsort comparator ordering tag pointers by disk offset.
+ */
+static int CacheTagCompare (const void *a, const void *b);
+
+/*
+ * CacheWriteTags
+ *
+ *  Write out an array of dirty tags sorted by offset, merging adjacent ones.
+ */
+static int CacheWriteTags (Cache_t *cache, Tag_t **tags, uint32_t count);
+
 /*
  * CacheFlushRange
  *
@@ -115,15 +456,18 @@ static int LRUHit (LRU_t *lru, LRUNode_t *node, int age);
 /*
  * LRUEvict
  *
- *  Chooses a buffer to release.
- *
- *  TODO: Under extreme conditions, it should be possible to release the buffer
- *        of an actively referenced cache buffer, leaving the tag behind as a
- *        placeholder. This would be required for implementing 2Q-LRU
- *        replacement.
+ *  Chooses a buffer to release.  Under 2Q, the tag of a buffer released
+ *  from the In queue is left behind as a placeholder on the Out queue.
  */
 static int LRUEvict (LRU_t *lru, LRUNode_t *node);
 
+/*
+ * LRURemove
+ *
+ *  Takes a node out of whichever queue it is on, before its tag is reused.
+ */
+static void LRURemove (LRU_t *lru, LRUNode_t *node);
+
 /*
  * CalculateCacheSizes
  *
@@ -134,28 +478,50 @@ static int LRUEvict (LRU_t *lru, LRUNode_t *node);
  * If no input values are provided, use default values for cache size
  * and cache block size.
  *
+ * Cache block size should be -
+ *		a. a power of two
+ *		b. between the minimum and maximum cache block size
+ *		c. small enough that the cache has at least MinCacheBlocks blocks
+ *
  * Cache size should be -
  *		a. greater than or equal to minimum cache size
  *		b. less than or equal to maximum cache size.  The maximum cache size
  *		   is limited by the maximum value that can be allocated using malloc
  *		   or mmap (maximum value for size_t)
  *		c. multiple of cache block size
+ *		d. no more than MaxCacheBlocks cache blocks
  *
  *	Returns: void
  *		  *calcBlockSize:  the size of the blocks in the cache
  *		  *calcTotalBlocks:  the number of blocks in the cache
  */
-void CalculateCacheSizes(uint64_t cacheSize, uint32_t *calcBlockSize, uint32_t *calcTotalBlocks, char debug)
+void CalculateCacheSizes(uint64_t cacheSize, uint32_t userBlockSize, uint32_t *calcBlockSize,
+                         uint32_t *calcTotalBlocks, char debug)
 {
 	uint32_t blockSize = DefaultCacheBlockSize;
 	const size_t	max_size_t = ~0;	/* Maximum value represented by size_t */
 
-	/* Simple case - no user cache size, use default values */
-	if (!cacheSize) {
+	/* Simple case - no user values, use default values */
+	if (!cacheSize && !userBlockSize) {
 		*calcBlockSize = DefaultCacheBlockSize;
 		*calcTotalBlocks = DefaultCacheBlocks;
 		goto out;
 	}
+	if (!cacheSize) {
+		cacheSize = DefaultCacheSize;
+	}
+
+	/* User provided block size - round down to a power of two in range */
+	if (userBlockSize) {
+		if (userBlockSize < MinCacheBlockSize || userBlockSize > MaxCacheBlockSize) {
+			if (debug) {
+				printf ("\tCache block size should be between %uK and %uK\n", MinCacheBlockSize/1024, MaxCacheBlockSize/1024);
+			}
+			userBlockSize = (userBlockSize < MinCacheBlockSize) ? MinCacheBlockSize : MaxCacheBlockSize;
+		}
+		for (blockSize = MinCacheBlockSize; blockSize * 2 <= userBlockSize; blockSize *= 2)
+			continue;
+	}
 
 	/* User provided cache size - check with minimum and maximum values */
 	if (cacheSize < MinCacheSize) {
@@ -164,9 +530,19 @@ void CalculateCacheSizes(uint64_t cacheSize, uint32_t *calcBlockSize, uint32_t *
 	if (cacheSize > max_size_t ||
 		cacheSize > MaxCacheSize) {
 		if (debug) {
-			printf ("\tCache size should be greater than %uM and less than %luM\n", MinCacheSize/(1024*1024), max_size_t/(1024*1024));
+			printf ("\tCache size should be greater than %uM and less than %lluM\n", MinCacheSize/(1024*1024),
+			        (unsigned long long)((MaxCacheSize < max_size_t ? MaxCacheSize : max_size_t)/(1024*1024)));
 		}
-		cacheSize = MaxCacheSize;
+		cacheSize = MaxCacheSize < max_size_t ? MaxCacheSize : max_size_t;
+	}
+
+	/* A small cache of big blocks would hardly hold anything; use smaller blocks */
+	while (blockSize > MinCacheBlockSize && cacheSize / blockSize < MinCacheBlocks) {
+		blockSize /= 2;
+	}
+	/* And a big cache of small blocks would need too many tags */
+	if (cacheSize / blockSize > MaxCacheBlocks) {
+		cacheSize = (uint64_t)blockSize * MaxCacheBlocks;
 	}
 
 	/* Cache size should be multiple of cache block size */
@@ -182,7 +558,7 @@ void CalculateCacheSizes(uint64_t cacheSize, uint32_t *calcBlockSize, uint32_t *
 	
 out:
 	if (debug) {
-		printf ("\tUsing cacheBlockSize=%uK cacheTotalBlock=%u cacheSize=%uK.\n", *calcBlockSize/1024, *calcTotalBlocks, ((*calcBlockSize/1024) * (*calcTotalBlocks)));
+		printf ("\tUsing cacheBlockSize=%uK cacheTotalBlock=%u cacheSize=%lluK.\n", *calcBlockSize/1024, *calcTotalBlocks, ((unsigned long long)(*calcBlockSize/1024) * (*calcTotalBlocks)));
 	}
 	return;
 }
@@ -198,49 +574,65 @@ out:
 int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
                uint32_t cacheBlockSize, uint32_t cacheTotalBlocks, uint32_t hashSize, int preTouch)
 {
-	void **		temp;
 	uint32_t	i;
 	Buf_t *		buf;
+	int			error;
 	
 	memset (cache, 0x00, sizeof (Cache_t));
 
 	cache->FD_R = fdRead;
 	cache->FD_W = fdWrite;
 	cache->DevBlockSize = devBlockSize;
-	/* CacheFlush requires cleared cache->Hash  */
-	cache->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * hashSize) );
-	cache->HashSize = hashSize;
 	cache->BlockSize = cacheBlockSize;
-
-	/* Allocate the cache memory */
-	cache->FreeHead = mmap (NULL,
-	                        cacheTotalBlocks * cacheBlockSize,
-	                        PROT_READ | PROT_WRITE,
-	                        MAP_ANON | MAP_PRIVATE,
-	                        -1,
-	                        0);
-	if (cache->FreeHead == (void *)-1) return (ENOMEM);
-
-	/* If necessary, touch a byte in each page */
-	if (preTouch) {
-		size_t pageSize = getpagesize();
-		unsigned char *ptr = (unsigned char *)cache->FreeHead;
-		unsigned char *end = ptr + (cacheTotalBlocks * cacheBlockSize);
-		while (ptr < end) {
-			*ptr = 0;
-			ptr += pageSize;
-		}
+	cache->TotalBlocks = cacheTotalBlocks;
+	cache->Phases[0].Name = "other";
+	cache->PhaseCount = 1;
+
+	/*
+	 * A disk image that won't be written to is mapped rather than copied
+	 * into the cache; the kernel already caches it.  Only the lookup table
+	 * (which CacheFlush walks) and the buffers are needed then.
+	 */
+	if (fdWrite == -1 && CacheMapFile (cache) == EOK) {
+		cache->HashSize = CacheHashSize;
+		cache->HashShift = 64 - 8;
+		cache->Hash = (Tag_t **) calloc (1, sizeof (Tag_t *) * cache->HashSize);
+		if (cache->Hash == NULL) return (ENOMEM);
+		goto InitBufs;
 	}
 
-	/* Initialize the cache memory free list */
-	temp = cache->FreeHead;
-	for (i = 0; i < cacheTotalBlocks - 1; i++) {
-		*temp = ((char *)temp + cacheBlockSize);
-		temp  = (void **)((char *)temp + cacheBlockSize);
+	/*
+	 * Size the lookup table so that it is never more than half full while
+	 * every cache block has a tag.  The table must be a power of two.
+	 */
+	if (hashSize < cacheTotalBlocks * 2)
+		hashSize = cacheTotalBlocks * 2;
+	cache->HashSize = CacheHashSize;
+	cache->HashShift = 64 - 8;
+	while (cache->HashSize < hashSize) {
+		cache->HashSize <<= 1;
+		cache->HashShift--;
 	}
-	*temp = NULL;
-	cache->FreeSize = cacheTotalBlocks;
+	/* CacheFlush requires cleared cache->Hash  */
+	cache->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * cache->HashSize) );
+	if (cache->Hash == NULL) return (ENOMEM);
+
+	/* Preallocate a tag for every cache block, plus one for a pending miss */
+	if (CacheAddTagSlab (cache, cacheTotalBlocks + 1) != EOK) return (ENOMEM);
+
+	/* Allocate the cache memory */
+	error = CacheAllocArena (cache, (uint64_t)cacheTotalBlocks * cacheBlockSize);
+	if (error != EOK) return (error);
+
+	cache->PageTags = (Tag_t **) calloc (cacheTotalBlocks, sizeof (Tag_t *));
+	cache->SwapBlock = malloc (cacheBlockSize);
+	if (cache->PageTags == NULL || cache->SwapBlock == NULL) return (ENOMEM);
+
+	/* Build the free list, touching every page if necessary */
+	error = CacheInitArena (cache, preTouch);
+	if (error != EOK) return (error);
 
+InitBufs:
 	buf = (Buf_t *)malloc(sizeof(Buf_t) * MAXBUFS);
 	if (buf == NULL) return (ENOMEM);
 
@@ -252,93 +644,565 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 
 #if CACHE_DEBUG
 	printf( "%s - cacheTotalBlocks %d cacheBlockSize %d hashSize %d \n", 
-			__FUNCTION__, cacheTotalBlocks, cacheBlockSize, hashSize );
-	printf( "%s - cache memory %d \n", __FUNCTION__, (cacheTotalBlocks * cacheBlockSize) );
+			__FUNCTION__, cacheTotalBlocks, cacheBlockSize, cache->HashSize );
+	printf( "%s - cache memory %llu huge pages %d \n", __FUNCTION__,
+			(unsigned long long)cache->ArenaSize, cache->HugePages );
+	if (cache->Map != NULL)
+		printf( "%s - mapped %llu bytes \n", __FUNCTION__, cache->MapSize );
 #endif  
 
 	return (LRUInit (&cache->LRU));
 }
 
-
 /*
- * CacheDestroy
- * 
- *  Shutdown the cache.
+ * CacheSetPolicy
+ *
+ *  Selects the replacement policy.  This has to happen while the cache is
+ *  still empty, i.e. right after CacheInit.
+ *
+ *  2Q keeps a quarter of the cache for blocks seen only once, and remembers
+ *  (without data) half a cache worth of blocks recently evicted from it.
  */
-int CacheDestroy (Cache_t *cache)
+int CacheSetPolicy (Cache_t *cache, int policy)
 {
-	CacheFlush( cache );
+	LRU_t *		lru = &cache->LRU;
+	int			error;
+
+	if (policy != kCachePolicyLRU && policy != kCachePolicy2Q)
+		return (EINVAL);
+	if (cache->HashCount != 0)
+		return (EBUSY);
+
+	lru->Policy = policy;
+	if (policy == kCachePolicy2Q) {
+		lru->InMax = cache->TotalBlocks / 4;
+		lru->OutMax = cache->TotalBlocks / 2;
+
+		/* Ghost tags need tags and hash slots of their own */
+		error = CacheAddTagSlab (cache, lru->OutMax);
+		if (error != EOK) return (error);
+		while ((cache->TotalBlocks + lru->OutMax + 1) * 2 > cache->HashSize) {
+			error = CacheHashGrow (cache);
+			if (error != EOK) return (error);
+		}
+	}
 
 #if CACHE_DEBUG
-	/* Print cache report */
-	printf ("Cache Report:\n");
-	printf ("\tRead Requests:  %d\n", cache->ReqRead);
-	printf ("\tWrite Requests: %d\n", cache->ReqWrite);
-	printf ("\tDisk Reads:     %d\n", cache->DiskRead);
-	printf ("\tDisk Writes:    %d\n", cache->DiskWrite);
-	printf ("\tSpans:          %d\n", cache->Span);
-#endif	
-	/* Shutdown the LRU */
-	LRUDestroy (&cache->LRU);
-	
-	/* I'm lazy, I'll come back to it :P */
+	printf ("%s - policy %d InMax %d OutMax %d \n", __FUNCTION__,
+			policy, lru->InMax, lru->OutMax);
+#endif
 	return (EOK);
 }
 
 /*
- * CacheRead
- *
- *  Reads a range of bytes from the cache, returning a pointer to a buffer
- *  containing the requested bytes.
+ * CacheSetReadAhead
  *
- *  NOTE: The returned buffer may directly refer to a cache block, or an
- *        anonymous buffer. Do not make any assumptions about the nature of
- *        the returned buffer, except that it is contiguous.
+ *  Starts asynchronous readahead.  Blocks read ahead take cache pages like
+ *  any other, so the window is limited to an eighth of the cache, and at
+ *  most two windows' worth of reads are in flight at a time.
  */
-int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
+int CacheSetReadAhead (Cache_t *cache, uint32_t window, uint32_t threads)
 {
-	Tag_t *		tag;
-	Buf_t *		searchBuf;
-	Buf_t *		buf;
-	uint32_t	coff = (off % cache->BlockSize);
-	uint64_t	cblk = (off - coff);
-	int			error;
+	ReadAhead_t *	ra;
+	uint32_t		count;
+	uint32_t		i;
+	int				error;
+
+	/* The kernel reads ahead of a mapped image */
+	if (window == 0 || cache->Map != NULL)
+		return (EOK);
+	if (cache->ReadAhead != NULL)
+		return (EBUSY);
+	if (threads == 0 || threads > MaxReadAheadThreads)
+		return (EINVAL);
+
+	if (window > cache->TotalBlocks / 8)
+		window = cache->TotalBlocks / 8;
+	if (window == 0)
+		window = 1;
+	count = window * 2;
+
+	ra = (ReadAhead_t *) calloc (1, sizeof (ReadAhead_t));
+	if (ra == NULL) return (ENOMEM);
+	ra->Requests = (RARequest_t *) calloc (count, sizeof (RARequest_t));
+	if (ra->Requests == NULL) {
+		free (ra);
+		return (ENOMEM);
+	}
+	for (i = 0; i < count; i++) {
+		ra->Requests[i].Next = ra->Free;
+		ra->Free = &ra->Requests[i];
+	}
+	ra->Cache = cache;
+	ra->Window = window;
 
-	/* Check for conflicts with other bufs */
-	searchBuf = cache->ActiveBufs;
-	while (searchBuf != NULL) {
-		if ((searchBuf->Offset >= off) && (searchBuf->Offset < off + len)) {
-#if CACHE_DEBUG
-			printf ("ERROR: CacheRead: Deadlock\n");
-#endif
-			return (EDEADLK);
-		}
-		
-		searchBuf = searchBuf->Next;
+	pthread_mutex_init (&ra->Lock, NULL);
+	pthread_cond_init (&ra->WorkCond, NULL);
+	pthread_cond_init (&ra->DoneCond, NULL);
+
+	for (i = 0; i < threads; i++) {
+		error = pthread_create (&ra->Threads[i], NULL, CacheReadAheadThread, ra);
+		if (error != 0) break;
 	}
-	
-	/* get a free buffer */
-	if ((buf = cache->FreeBufs) == NULL) {
+	ra->ThreadCount = i;
+
+	/* Make do with the threads we got */
+	if (ra->ThreadCount == 0) {
+		pthread_cond_destroy (&ra->DoneCond);
+		pthread_cond_destroy (&ra->WorkCond);
+		pthread_mutex_destroy (&ra->Lock);
+		free (ra->Requests);
+		free (ra);
+		return (error);
+	}
+	cache->ReadAhead = ra;
+
 #if CACHE_DEBUG
-		printf ("ERROR: CacheRead: no more bufs!\n");
+	printf ("%s - window %d threads %d \n", __FUNCTION__, window, ra->ThreadCount);
 #endif
-		return (ENOBUFS);
-	}
-	cache->FreeBufs = buf->Next; 
-	*bufp = buf;
+	return (EOK);
+}
 
-	/* Clear the buf structure */
-	buf->Next	= NULL;
-	buf->Prev	= NULL;
+/*
+ * CacheSetStreamCluster
+ *
+ *  A scan over small cache blocks would otherwise cost an I/O per block.
+ *  Clusters are aligned to their size, so that a scan keeps reading whole
+ *  clusters, and limited to kStreamClusterMax blocks and an eighth of the
+ *  cache.  A mapped image has no need for them.
+ */
+int CacheSetStreamCluster (Cache_t *cache, uint32_t bytes)
+{
+	uint32_t	blocks = bytes / cache->BlockSize;
+
+	if (blocks > kStreamClusterMax)
+		blocks = kStreamClusterMax;
+	if (blocks > cache->TotalBlocks / 8)
+		blocks = cache->TotalBlocks / 8;
+
+	/* Round down to a power of two, so clusters stay aligned */
+	while (blocks & (blocks - 1))
+		blocks &= blocks - 1;
+
+	if (blocks < 2 || cache->Map != NULL)
+		cache->StreamCluster = 0;
+	else
+		cache->StreamCluster = blocks * cache->BlockSize;
+
+#if CACHE_DEBUG
+	printf ("%s - cluster %d \n", __FUNCTION__, cache->StreamCluster);
+#endif
+	return (EOK);
+}
+
+/*
+ * CacheSetDirtyLimit
+ *
+ *  Caps the amount of lazy write data held by the cache.  The cap is rounded
+ *  up to whole cache blocks; zero removes it.
+ */
+int CacheSetDirtyLimit (Cache_t *cache, uint64_t bytes)
+{
+	uint64_t	blocks = (bytes + cache->BlockSize - 1) / cache->BlockSize;
+
+	if (blocks > cache->TotalBlocks)
+		blocks = cache->TotalBlocks;
+	cache->DirtyMax = (uint32_t)blocks;
+
+	return (EOK);
+}
+
+/*
+ * CacheAdvise
+ *
+ *  Records how the cache is about to be read, passing it on to the VM
+ *  system for a mapped image.  Returns the previous hint.
+ */
+int CacheAdvise (Cache_t *cache, int advice)
+{
+	int		old = cache->Advice;
+	int		behavior;
+
+	if (cache->Map != NULL && advice != old) {
+		switch (advice) {
+			case kCacheAdviseSequential:
+				behavior = MADV_SEQUENTIAL;
+				break;
+			case kCacheAdviseRandom:
+				behavior = MADV_RANDOM;
+				break;
+			default:
+				behavior = MADV_NORMAL;
+				break;
+		}
+		(void) madvise (cache->Map, cache->MapSize, behavior);
+	}
+	cache->Advice = advice;
+
+	return (old);
+}
+
+/*
+ * CacheGetStats
+ *
+ *  Takes a snapshot of the cache counters.
+ */
+void CacheGetStats (Cache_t *cache, CacheStats_t *stats)
+{
+	stats->ReqRead = cache->ReqRead;
+	stats->ReqWrite = cache->ReqWrite;
+	stats->Hits = cache->Hits;
+	stats->Misses = cache->Misses;
+	stats->DiskRead = cache->DiskRead;
+	stats->DiskWrite = cache->DiskWrite;
+	stats->BytesRead = cache->BytesRead;
+	stats->BytesWritten = cache->BytesWritten;
+	stats->Evictions = cache->Evictions;
+	stats->Span = cache->Span;
+	stats->SpanCopy = cache->SpanCopy;
+	stats->RAIssued = cache->RAIssued;
+	stats->RAHit = cache->RAHit;
+	memcpy (stats->Latency, cache->Latency, sizeof (stats->Latency));
+}
+
+/*
+ * CacheSetPhase
+ *
+ *  Charges what happened since the last call to the phase that was current,
+ *  and makes the named one current.  Phases are matched by name, so a phase
+ *  run twice (verify after repair) adds up; once the table is full, new
+ *  names count as "other".
+ */
+void CacheSetPhase (Cache_t *cache, const char *name)
+{
+	CacheStats_t	now;
+	uint64_t *		total;
+	uint64_t *		cur;
+	uint64_t *		mark;
+	uint32_t		i;
+
+	/* Every field of CacheStats_t is a uint64_t */
+	CacheGetStats (cache, &now);
+	total = (uint64_t *)&cache->Phases[cache->Phase].Stats;
+	cur = (uint64_t *)&now;
+	mark = (uint64_t *)&cache->PhaseMark;
+	for (i = 0; i < sizeof (CacheStats_t) / sizeof (uint64_t); i++)
+		total[i] += cur[i] - mark[i];
+	cache->PhaseMark = now;
+
+	cache->Phase = 0;
+	if (name == NULL)
+		return;
+	for (i = 1; i < cache->PhaseCount; i++) {
+		if (strcmp (cache->Phases[i].Name, name) == 0) {
+			cache->Phase = i;
+			return;
+		}
+	}
+	if (cache->PhaseCount < CacheMaxPhases) {
+		cache->Phases[cache->PhaseCount].Name = name;
+		cache->Phase = cache->PhaseCount++;
+		if (cache->Trace != NULL)
+			CacheTracePhase (cache, cache->Phase);
+	}
+}
+
+/*
+ * CacheWriteStats
+ *
+ *  Writes one set of counters as a JSON object body.
+ */
+static void CacheWriteStats (FILE *fp, const CacheStats_t *stats)
+{
+	int		i;
+
+	fprintf (fp, "\"read_requests\": %llu, \"write_requests\": %llu, ",
+	         (unsigned long long)stats->ReqRead, (unsigned long long)stats->ReqWrite);
+	fprintf (fp, "\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, ",
+	         (unsigned long long)stats->Hits, (unsigned long long)stats->Misses,
+	         (unsigned long long)stats->Evictions);
+	fprintf (fp, "\"disk_reads\": %llu, \"disk_writes\": %llu, ",
+	         (unsigned long long)stats->DiskRead, (unsigned long long)stats->DiskWrite);
+	fprintf (fp, "\"bytes_read\": %llu, \"bytes_written\": %llu, ",
+	         (unsigned long long)stats->BytesRead, (unsigned long long)stats->BytesWritten);
+	fprintf (fp, "\"spans\": %llu, \"span_copies\": %llu, ",
+	         (unsigned long long)stats->Span, (unsigned long long)stats->SpanCopy);
+	fprintf (fp, "\"readaheads\": %llu, \"readahead_hits\": %llu, ",
+	         (unsigned long long)stats->RAIssued, (unsigned long long)stats->RAHit);
+	fprintf (fp, "\"latency\": [");
+	for (i = 0; i < CacheLatencyBuckets; i++)
+		fprintf (fp, "%s%llu", i ? ", " : "", (unsigned long long)stats->Latency[i]);
+	fprintf (fp, "]");
+}
+
+/*
+ * CacheWriteReport
+ *
+ *  Writes the cache configuration and counters, per phase and in total, as
+ *  JSON.  latency_buckets_us gives the upper bound of each latency bucket
+ *  but the last, which is open ended.  "other" covers everything outside a
+ *  named phase.
+ */
+int CacheWriteReport (Cache_t *cache, FILE *fp)
+{
+	CacheStats_t	total;
+	uint32_t		i;
+	uint32_t		n;
+
+	/* Bring the current phase up to date */
+	CacheSetPhase (cache, cache->Phase ? cache->Phases[cache->Phase].Name : NULL);
+	CacheGetStats (cache, &total);
+
+	fprintf (fp, "{\n");
+	fprintf (fp, "  \"cache\": { \"block_size\": %u, \"blocks\": %u, \"policy\": \"%s\", ",
+	         cache->BlockSize, cache->TotalBlocks,
+	         cache->LRU.Policy == kCachePolicy2Q ? "2q" : "lru");
+	fprintf (fp, "\"huge_pages\": \"%s\", ",
+	         cache->HugePages == kCacheHugePagesExplicit ? "explicit" :
+	         cache->HugePages == kCacheHugePagesTransparent ? "transparent" : "none");
+	fprintf (fp, "\"mapped\": %s, \"readahead_window\": %u },\n",
+	         cache->Map != NULL ? "true" : "false",
+	         cache->ReadAhead != NULL ? cache->ReadAhead->Window : 0);
+
+	fprintf (fp, "  \"latency_buckets_us\": [");
+	for (i = 0; i < CacheLatencyBuckets - 1; i++)
+		fprintf (fp, "%s%llu", i ? ", " : "", 1ULL << i);
+	fprintf (fp, "],\n");
+
+	/* Named phases in the order they first ran, then the rest */
+	fprintf (fp, "  \"phases\": [\n");
+	for (n = 1; n <= cache->PhaseCount; n++) {
+		i = n % cache->PhaseCount;
+		fprintf (fp, "    { \"name\": \"%s\", ", cache->Phases[i].Name);
+		CacheWriteStats (fp, &cache->Phases[i].Stats);
+		fprintf (fp, " }%s\n", n < cache->PhaseCount ? "," : "");
+	}
+	fprintf (fp, "  ],\n");
+
+	fprintf (fp, "  \"total\": { ");
+	CacheWriteStats (fp, &total);
+	fprintf (fp, " }\n");
+	fprintf (fp, "}\n");
+
+	return (ferror (fp) ? EIO : EOK);
+}
+
+/*
+ * CacheSetTrace
+ *
+ *  Starts (or, given NULL, stops) recording requests.  The header notes the
+ *  configuration being traced, and phases named so far are recorded up
+ *  front so that the trace is self-contained.
+ */
+int CacheSetTrace (Cache_t *cache, FILE *fp)
+{
+	CacheTraceHeader_t	header;
+	uint32_t			i;
+
+	if (cache->Trace != NULL)
+		(void) fflush (cache->Trace);
+	cache->Trace = NULL;
+	if (fp == NULL)
+		return (EOK);
+
+	cache->TraceStart = CacheClock ();
+
+	memset (&header, 0x00, sizeof (header));
+	header.Magic = CacheTraceMagic;
+	header.Version = CacheTraceVersion;
+	header.DevBlockSize = cache->DevBlockSize;
+	header.BlockSize = cache->BlockSize;
+	header.TotalBlocks = cache->TotalBlocks;
+	header.Policy = cache->LRU.Policy;
+	header.Start = cache->TraceStart;
+	if (fwrite (&header, sizeof (header), 1, fp) != 1)
+		return (EIO);
+
+	cache->Trace = fp;
+	for (i = 1; i < cache->PhaseCount; i++)
+		CacheTracePhase (cache, i);
+
+	return (cache->Trace != NULL ? EOK : EIO);
+}
+
+
+/*
+ * CacheDestroy
+ * 
+ *  Shutdown the cache.
+ */
+int CacheDestroy (Cache_t *cache)
+{
+	ReadAhead_t *	ra = cache->ReadAhead;
+	uint32_t		i;
+
+	/* Stop readahead, counting whatever it loaded in vain */
+	if (ra != NULL) {
+		CacheReadAheadReap (cache, NULL, true);
+
+		pthread_mutex_lock (&ra->Lock);
+		ra->Shutdown = true;
+		pthread_cond_broadcast (&ra->WorkCond);
+		pthread_mutex_unlock (&ra->Lock);
+		for (i = 0; i < ra->ThreadCount; i++)
+			pthread_join (ra->Threads[i], NULL);
+
+		for (i = 0; i < cache->HashSize; i++) {
+			if (cache->Hash[i] != NULL && (cache->Hash[i]->Flags & kReadAhead))
+				cache->RAWaste++;
+		}
+
+		pthread_cond_destroy (&ra->DoneCond);
+		pthread_cond_destroy (&ra->WorkCond);
+		pthread_mutex_destroy (&ra->Lock);
+		free (ra->Requests);
+		free (ra);
+		cache->ReadAhead = NULL;
+	}
+
+	CacheFlush( cache );
+	(void) CacheSetTrace (cache, NULL);
+
+#if CACHE_DEBUG
+	/* Print cache report */
+	printf ("Cache Report:\n");
+	printf ("\tRead Requests:  %llu\n", (unsigned long long)cache->ReqRead);
+	printf ("\tWrite Requests: %llu\n", (unsigned long long)cache->ReqWrite);
+	printf ("\tDisk Reads:     %llu\n", (unsigned long long)cache->DiskRead);
+	printf ("\tDisk Writes:    %llu\n", (unsigned long long)cache->DiskWrite);
+	printf ("\tSpans:          %llu\n", (unsigned long long)cache->Span);
+	printf ("\tSpan Copies:    %llu\n", (unsigned long long)cache->SpanCopy);
+	printf ("\tRelocations:    %llu\n", (unsigned long long)cache->Relocate);
+	printf ("\tReadaheads:     %llu\n", (unsigned long long)cache->RAIssued);
+	printf ("\tReadahead Hits: %llu\n", (unsigned long long)cache->RAHit);
+	printf ("\tReadahead Waste: %llu\n", (unsigned long long)cache->RAWaste);
+	printf ("\tDirty Flushes:  %llu\n", (unsigned long long)cache->DirtyFlush);
+#endif	
+	/* Shutdown the LRU */
+	LRUDestroy (&cache->LRU);
+
+	if (cache->Map != NULL) {
+		(void) munmap (cache->Map, cache->MapSize);
+		cache->Map = NULL;
+	}
+	if (cache->Arena != NULL) {
+		(void) munmap (cache->Arena, cache->ArenaSize);
+		cache->Arena = NULL;
+	}
+	
+	/* I'm lazy, I'll come back to it :P */
+	return (EOK);
+}
+
+/*
+ * CacheRead
+ *
+ *  Reads a range of bytes from the cache, returning a pointer to a buffer
+ *  containing the requested bytes.
+ *
+ *  NOTE: The returned buffer may directly refer to a cache block, or an
+ *        anonymous buffer. Do not make any assumptions about the nature of
+ *        the returned buffer, except that it is contiguous.
+ */
+int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
+{
+	return (CacheReadOptions (cache, off, len, 0, bufp));
+}
+
+/*
+ * CacheMarkStream
+ *
+ *  Note whether a freshly looked up tag is only being read by a scan.  A tag
+ *  that was already in use stays as it is, so a scan passing over a block
+ *  doesn't demote it; any ordinary read makes it a regular block again.
+ */
+static void CacheMarkStream (Tag_t *tag, uint32_t readOptions)
+{
+	if ((readOptions & kStreamRead) == 0)
+		tag->Flags &= ~kStreamRead;
+	else if (tag->LRU.Queue == kLRUQueueNone || tag->LRU.Queue == kLRUQueueOut)
+		tag->Flags |= kStreamRead;
+}
+
+/*
+ * CacheReadOptions
+ *
+ *  Same as CacheRead.  If readOptions contains kStreamRead, blocks that
+ *  were not already cached are treated as part of a one-time scan.  Under
+ *  the 2Q policy they can then never displace the main LRU; plain LRU
+ *  ignores the hint.
+ */
+int CacheReadOptions (Cache_t *cache, uint64_t off, uint32_t len,
+                      uint32_t readOptions, Buf_t **bufp)
+{
+	Tag_t *		tag;
+	Buf_t *		searchBuf;
+	Buf_t *		buf;
+	uint32_t	coff = (off % cache->BlockSize);
+	uint64_t	cblk = (off - coff);
+	uint64_t	first = cblk;
+	uint64_t	misses = cache->Misses;
+	int			error;
+
+	if (cache->Trace != NULL)
+		CacheTrace (cache, kCacheTraceRead, off, len, readOptions);
+
+	/* Check for conflicts with other bufs */
+	searchBuf = cache->ActiveBufs;
+	while (searchBuf != NULL) {
+		if ((searchBuf->Offset >= off) && (searchBuf->Offset < off + len)) {
+#if CACHE_DEBUG
+			printf ("ERROR: CacheRead: Deadlock\n");
+#endif
+			return (EDEADLK);
+		}
+		
+		searchBuf = searchBuf->Next;
+	}
+	
+	/* get a free buffer */
+	if ((buf = cache->FreeBufs) == NULL) {
+#if CACHE_DEBUG
+		printf ("ERROR: CacheRead: no more bufs!\n");
+#endif
+		return (ENOBUFS);
+	}
+	cache->FreeBufs = buf->Next; 
+	*bufp = buf;
+
+	/* Pick up any readahead that has finished */
+	CacheReadAheadReap (cache, NULL, false);
+
+	/* Clear the buf structure */
+	buf->Next	= NULL;
+	buf->Prev	= NULL;
 	buf->Flags	= 0;
 	buf->Offset	= off;
 	buf->Length	= len;
 	buf->Buffer	= NULL;
+
+	/* A mapped image needs no cache blocks */
+	if (cache->Map != NULL) {
+		if (off >= cache->MapSize || len > cache->MapSize - off) {
+			memset (buf, 0x00, sizeof (Buf_t));
+			buf->Next = cache->FreeBufs;
+			cache->FreeBufs = buf;
+			return (ENXIO);
+		}
+		buf->Buffer = cache->Map + off;
+		buf->Flags |= BUF_MAPPED;
+		goto Attach;
+	}
 	
 	/* If this is unaligned or spans multiple cache blocks */
 	if ((cblk / cache->BlockSize) != ((off + len - 1) / cache->BlockSize)) {
 		buf->Flags |= BUF_SPAN;
 	}
+	/* A stream read that misses brings in the rest of its cluster too */
+	if ((readOptions & kStreamRead) && cache->StreamCluster != 0 &&
+	    cache->Hash[CacheHashFind (cache, cblk)] == NULL)
+		CacheStreamCluster (cache, cblk, off + len);
+
 	/* Fetch the first cache block */
 	error = CacheLookup (cache, cblk, &tag);
 	if (error != EOK) {
@@ -347,6 +1211,7 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 #endif
 		return (error);
 	}
+	CacheMarkStream (tag, readOptions);
 
 	/* If we live nicely inside a cache block */
 	if (!(buf->Flags & BUF_SPAN)) {
@@ -359,65 +1224,61 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		/* Kick the node into the right queue */
 		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
 
-	/* Otherwise, things get ugly */
+	/*
+	 * Otherwise, try to have the cache blocks laid out next to each other
+	 * so the caller can use them in place; copy only if that fails.
+	 */
 	} else {
 		uint32_t	boff;	/* Offset into the buffer */
 		uint32_t	blen;	/* Space to fill in the buffer */
 		uint32_t	temp;
+		Tag_t *		prev;
+		void *		anon;
 
-		/* Allocate a temp buffer */
-		buf->Buffer = (void *)malloc (len);
-		if (buf->Buffer == NULL) {
-#if CACHE_DEBUG
-			printf ("ERROR: CacheRead: No Memory\n");
-#endif
-			return (ENOMEM);
-		}
-
-		/* Blit the first chunk into the buffer */
-		boff = cache->BlockSize - coff;
-		blen = len - boff;
-		memcpy (buf->Buffer, tag->Buffer + coff, boff);
-		
 		/* Bump the cache block's reference count */
 		tag->Refs++;
 
 		/* Kick the node into the right queue */
 		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
 
+		/* Point straight at the first cache block, until proven otherwise */
+		buf->Buffer = tag->Buffer + coff;
+		buf->Flags |= BUF_DIRECT;
+		boff = cache->BlockSize - coff;
+		blen = len - boff;
+		prev = tag;
+
 		/* Next cache block */
 		cblk += cache->BlockSize;
 		
 		/* Read data a cache block at a time */
 		while (blen) {
-			/* Fetch the next cache block */
-			error = CacheLookup (cache, cblk, &tag);
-			if (error != EOK) {
-				/* Free the allocated buffer */
-				free (buf->Buffer);
-				buf->Buffer = NULL;
-
-				/* Release all the held tags */
-				cblk -= cache->BlockSize;
-				while (!boff) {
-					if (CacheLookup (cache, cblk, &tag) != EOK) {
-						fprintf (stderr, "CacheRead: Unrecoverable error\n");
-						exit (-1);
-					}
-					tag->Refs--;
-					
-					/* Kick the node into the right queue */
-					LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+			/* Fetch the next cache block, ideally right after the last one */
+			error = CacheLookupHint (cache, cblk,
+			                         (buf->Flags & BUF_DIRECT) ? prev->Buffer + cache->BlockSize : NULL,
+			                         &tag);
+			if (error != EOK) goto SpanError;
+			CacheMarkStream (tag, readOptions);
+
+			/* If the blocks aren't contiguous, switch to an anonymous buffer */
+			if ((buf->Flags & BUF_DIRECT) && !CacheAdjoin (cache, prev, tag)) {
+				anon = (void *)malloc (len);
+				if (anon == NULL) {
+#if CACHE_DEBUG
+					printf ("ERROR: CacheRead: No Memory\n");
+#endif
+					error = ENOMEM;
+					goto SpanError;
 				}
-
-				return (error);
+				memcpy (anon, buf->Buffer, boff);
+				buf->Buffer = anon;
+				buf->Flags &= ~BUF_DIRECT;
 			}
 
 			/* Blit the cache block into the buffer */
 			temp = ((blen > cache->BlockSize) ? cache->BlockSize : blen);
-			memcpy (buf->Buffer + boff,
-			        tag->Buffer,
-					temp);
+			if (!(buf->Flags & BUF_DIRECT))
+				memcpy (buf->Buffer + boff, tag->Buffer, temp);
 
 			/* Update counters */
 			boff += temp;
@@ -426,12 +1287,19 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 
 			/* Kick the node into the right queue */
 			LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+
+			prev = tag;
+			cblk += cache->BlockSize;
 		}
 
 		/* Count the spanned access */
-		cache->Span++;
+		if (buf->Flags & BUF_DIRECT)
+			cache->Span++;
+		else
+			cache->SpanCopy++;
 	}
 
+Attach:
 	/* Attach to head of active buffers list */
 	if (cache->ActiveBufs != NULL) {
 		buf->Next = cache->ActiveBufs;
@@ -445,7 +1313,40 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 
 	/* Update counters */
 	cache->ReqRead++;
+	if (!(buf->Flags & BUF_MAPPED))
+		cache->Hits += (off + len - 1) / cache->BlockSize - off / cache->BlockSize + 1 -
+		               (cache->Misses - misses);
+
+	/* Look for a pattern to read ahead of */
+	CacheReadAhead (cache, (buf->Flags & BUF_SPAN) ? cblk - cache->BlockSize : cblk,
+	                readOptions);
 	return (EOK);
+
+SpanError:
+	/* Free the allocated buffer */
+	if (!(buf->Flags & BUF_DIRECT))
+		free (buf->Buffer);
+	buf->Buffer = NULL;
+
+	/* Release all the held tags */
+	while (cblk != first) {
+		cblk -= cache->BlockSize;
+		if (CacheLookup (cache, cblk, &tag) != EOK) {
+			fprintf (stderr, "CacheRead: Unrecoverable error\n");
+			exit (-1);
+		}
+		tag->Refs--;
+		
+		/* Kick the node into the right queue */
+		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+	}
+
+	/* Put the buf back on the free list */
+	memset (buf, 0x00, sizeof (Buf_t));
+	buf->Next = cache->FreeBufs; 
+	cache->FreeBufs = buf; 		
+
+	return (error);
 }
 
 /* 
@@ -460,6 +1361,15 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 	uint64_t	cblk = (buf->Offset - coff);
 	int			error;
 
+	if (cache->Trace != NULL)
+		CacheTrace (cache, kCacheTraceWrite, buf->Offset, buf->Length, writeOptions);
+
+	/* The mapping is private; nothing can be written through it */
+	if (buf->Flags & BUF_MAPPED) {
+		CacheReleaseMapped (cache, buf);
+		return (EROFS);
+	}
+
 	/* Fetch the first cache block */
 	error = CacheLookup (cache, cblk, &tag);
 	if (error != EOK) return (error);
@@ -470,7 +1380,7 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 		if ( (writeOptions & kLazyWrite) != 0 ) 
 		{
 			/* flag this for lazy write */
-			tag->Flags |= kLazyWrite;
+			CacheMarkDirty (cache, tag);
 		}
 		else
 		{
@@ -487,7 +1397,7 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 		/* Kick the node into the right queue */
 		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
 
-	/* Otherwise, we do the ugly thing again */
+	/* Otherwise, we do the ugly thing again (minus the copies if direct) */
 	} else {
 		uint32_t	boff;	/* Offset into the buffer */
 		uint32_t	blen;	/* Space to fill in the buffer */
@@ -496,13 +1406,14 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 		/* Blit the first chunk back into the cache */
 		boff = cache->BlockSize - coff;
 		blen = buf->Length - boff;
-		memcpy (tag->Buffer + coff, buf->Buffer, boff);
+		if (!(buf->Flags & BUF_DIRECT))
+			memcpy (tag->Buffer + coff, buf->Buffer, boff);
 		
 		/* Commit the dirty block */
 		if ( (writeOptions & kLazyWrite) != 0 ) 
 		{
 			/* flag this for lazy write */
-			tag->Flags |= kLazyWrite;
+			CacheMarkDirty (cache, tag);
 		}
 		else
 		{
@@ -530,15 +1441,16 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 
 			/* Blit the next buffer chunk back into the cache */
 			temp = ((blen > cache->BlockSize) ? cache->BlockSize : blen);
-			memcpy (tag->Buffer,
-					buf->Buffer + boff,
-					temp);
+			if (!(buf->Flags & BUF_DIRECT))
+				memcpy (tag->Buffer,
+						buf->Buffer + boff,
+						temp);
 
 			/* Commit the dirty block */
 			if ( (writeOptions & kLazyWrite) != 0 ) 
 			{
 				/* flag this for lazy write */
-				tag->Flags |= kLazyWrite;
+				CacheMarkDirty (cache, tag);
 			}
 			else
 			{
@@ -556,10 +1468,14 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 
 			/* Kick the node into the right queue */
 			LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+
+			/* Next cache block */
+			cblk += cache->BlockSize;
 		}
 
 		/* Release the anonymous buffer */
-		free (buf->Buffer);
+		if (!(buf->Flags & BUF_DIRECT))
+			free (buf->Buffer);
 	}
 
 	/* Detach the buffer */
@@ -578,6 +1494,12 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 	/* Update counters */
 	cache->ReqWrite++;
 
+	/* Don't let too much dirty data pile up */
+	if (cache->DirtyMax != 0 && cache->DirtyCount > cache->DirtyMax) {
+		cache->DirtyFlush++;
+		return (CacheFlush (cache));
+	}
+
 	return (EOK);
 }
 
@@ -595,6 +1517,11 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 	uint64_t	cblk = (buf->Offset - coff);
 	int			error;
 
+	if (buf->Flags & BUF_MAPPED) {
+		CacheReleaseMapped (cache, buf);
+		return (EOK);
+	}
+
 	/* Fetch the first cache block */
 	error = CacheLookup (cache, cblk, &tag);
 	if (error != EOK) {
@@ -640,10 +1567,14 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 
 			/* Kick the node into the right queue */
 			LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+
+			/* Next cache block */
+			cblk += cache->BlockSize;
 		}
 
 		/* Release the anonymous buffer */
-		free (buf->Buffer);
+		if (!(buf->Flags & BUF_DIRECT))
+			free (buf->Buffer);
 	}
 
 	/* Detach the buffer */
@@ -674,22 +1605,6 @@ int CacheRemove (Cache_t *cache, Tag_t *tag)
 	/* Make sure it's not busy */
 	if (tag->Refs) return (EBUSY);
 	
-	/* Detach the tag */
-	if (tag->Next != NULL)
-		tag->Next->Prev = tag->Prev;
-	if (tag->Prev != NULL)
-		tag->Prev->Next = tag->Next;
-	else
-		cache->Hash[tag->Offset % cache->HashSize] = tag->Next;
-	
-	/* Make sure the head node doesn't have a back pointer */
-	if ((cache->Hash[tag->Offset % cache->HashSize] != NULL) &&
-	    (cache->Hash[tag->Offset % cache->HashSize]->Prev != NULL)) {
-#if CACHE_DEBUG
-		printf ("ERROR: CacheRemove: Corrupt hash chain\n");
-#endif
-	}
-	
 	/* Release it's buffer (if it has one) */
 	if (tag->Buffer != NULL)
 	{
@@ -698,11 +1613,18 @@ int CacheRemove (Cache_t *cache, Tag_t *tag)
 			return( error );
 	}
 
+	/* Detach the tag from the LRU, since the tag will be reused */
+	LRURemove (&cache->LRU, &tag->LRU);
+
+	/* Detach the tag */
+	CacheHashDelete (cache, tag);
+
 	/* Zero the tag (for easy debugging) */
 	memset (tag, 0x00, sizeof (Tag_t));
 
-	/* Free the tag */
-	free (tag);
+	/* Return the tag to the slab */
+	tag->Next = cache->FreeTags;
+	cache->FreeTags = tag;
 
 	return (EOK);
 }
@@ -746,12 +1668,48 @@ void *CacheAllocBlock (Cache_t *cache)
 		return (NULL);
 
 	temp = cache->FreeHead;
-	cache->FreeHead = *((void **)cache->FreeHead);
-	cache->FreeSize--;
+	CacheTakeBlock (cache, temp);
 
 	return (temp);
 }
 
+/*
+ * CacheTakeBlock
+ *
+ *  Allocate a particular unused cache block.
+ */
+static void CacheTakeBlock (Cache_t *cache, void *block)
+{
+	FreeBlock_t *	temp = (FreeBlock_t *)block;
+
+	if (temp->Next != NULL)
+		temp->Next->Prev = temp->Prev;
+	if (temp->Prev != NULL)
+		temp->Prev->Next = temp->Next;
+	else
+		cache->FreeHead = temp->Next;
+	cache->FreeSize--;
+}
+
+/*
+ * CachePutBlock
+ *
+ *  Return a cache block to the free list.
+ */
+static void CachePutBlock (Cache_t *cache, void *block)
+{
+	FreeBlock_t *	temp = (FreeBlock_t *)block;
+
+	*CachePageTag (cache, block) = NULL;
+
+	temp->Next = cache->FreeHead;
+	temp->Prev = NULL;
+	if (temp->Next != NULL)
+		temp->Next->Prev = temp;
+	cache->FreeHead = temp;
+	cache->FreeSize++;
+}
+
 /*
  * CacheFreeBlock
  *
@@ -762,6 +1720,13 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag )
 {
 	int			error;
 	
+	/* Count blocks read ahead for nothing */
+	if ( (tag->Flags & kReadAhead) != 0 )
+	{
+		cache->RAWaste++;
+		tag->Flags &= ~kReadAhead;
+	}
+
 	if ( (tag->Flags & kLazyWrite) != 0 )
 	{
 		/* this cache block has been marked for lazy write - do it now */
@@ -776,12 +1741,10 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag )
 #endif 
 			return ( error );
 		}
-		tag->Flags &= ~kLazyWrite;
+		CacheMarkClean( cache, tag );
 	}
 
-	*((void **)tag->Buffer) = cache->FreeHead;
-	cache->FreeHead = (void **)tag->Buffer;
-	cache->FreeSize++;
+	CachePutBlock (cache, tag->Buffer);
 	
 	return( EOK );
 }
@@ -795,37 +1758,7 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag )
 int 
 CacheFlush( Cache_t *cache )
 {
-	int			error;
-	int			i;
-	Tag_t *		myTagPtr;
-	
-	for ( i = 0; i < cache->HashSize; i++ )
-	{
-		myTagPtr = cache->Hash[ i ];
-		
-		while ( NULL != myTagPtr )
-		{
-			if ( (myTagPtr->Flags & kLazyWrite) != 0 )
-			{
-				/* this cache block has been marked for lazy write - do it now */
-				error = CacheRawWrite( cache,
-									   myTagPtr->Offset,
-									   cache->BlockSize,
-									   myTagPtr->Buffer );
-				if ( EOK != error ) 
-				{
-#if CACHE_DEBUG
-					printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
-#endif 
-					return( error );
-				}
-				myTagPtr->Flags &= ~kLazyWrite;
-			}
-			myTagPtr = myTagPtr->Next; 
-		} /* while */
-	} /* for */
-
-	return( EOK );
+	return( CacheFlushRange( cache, 0, ~0ULL, 0 ) );
 		
 } /* CacheFlush */
 
@@ -858,46 +1791,137 @@ RangeIntersect(uint64_t start1, uint64_t len1, uint64_t start2, uint64_t len2)
 static int
 CacheFlushRange( Cache_t *cache, uint64_t start, uint64_t len, int remove)
 {
-	int error;
+	int error = EOK;
 	int i;
-	Tag_t *currentTag, *nextTag;
+	uint32_t count = 0;
+	Tag_t **dirtyTags;
+	Tag_t *currentTag;
 	
+	/* Readahead in flight must not race with the raw I/O that follows */
+	CacheReadAheadReap( cache, NULL, true );
+
+	if ( cache->DirtyCount == 0 )
+		return EOK;
+
+	/*
+	 * Collect the dirty blocks, so that they can be written in disk order
+	 * with adjacent blocks merged.  If we can't get the memory, write them
+	 * one at a time.
+	 */
+	dirtyTags = (Tag_t **) malloc( sizeof(Tag_t *) * cache->DirtyCount );
+
 	for ( i = 0; i < cache->HashSize; i++ )
 	{
 		currentTag = cache->Hash[ i ];
 		
-		while ( NULL != currentTag )
+		if ( NULL != currentTag &&
+			 currentTag->Flags & kLazyWrite &&
+			 RangeIntersect(currentTag->Offset, cache->BlockSize, start, len))
 		{
-			/* Keep track of the next block, in case we remove the current block */
-			nextTag = currentTag->Next;
+			if ( dirtyTags != NULL )
+			{
+				dirtyTags[ count++ ] = currentTag;
+				continue;
+			}
 
-			if ( currentTag->Flags & kLazyWrite &&
-				 RangeIntersect(currentTag->Offset, cache->BlockSize, start, len))
+			error = CacheRawWrite( cache,
+								   currentTag->Offset,
+								   cache->BlockSize,
+								   currentTag->Buffer );
+			if ( EOK != error )
 			{
-				error = CacheRawWrite( cache,
-									   currentTag->Offset,
-									   cache->BlockSize,
-									   currentTag->Buffer );
-				if ( EOK != error )
-				{
 #if CACHE_DEBUG
-					printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
+				printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
 #endif 
-					return error;
-				}
-				currentTag->Flags &= ~kLazyWrite;
-
-				if ( remove )
-					CacheRemove( cache, currentTag );
+				return error;
 			}
-			
-			currentTag = nextTag;
-		} /* while */
+			CacheMarkClean( cache, currentTag );
+
+			/*
+			 * Removing a tag may shift a later entry of the same probe
+			 * sequence into this slot, so look at it again.
+			 */
+			if ( remove && CacheRemove( cache, currentTag ) == EOK )
+				i--;
+		}
 	} /* for */
-	
-	return EOK;
+
+	if ( dirtyTags == NULL )
+		return EOK;
+
+	qsort( dirtyTags, count, sizeof(Tag_t *), CacheTagCompare );
+	error = CacheWriteTags( cache, dirtyTags, count );
+#if CACHE_DEBUG
+	if ( EOK != error )
+		printf( "%s - CacheWriteTags failed with error %d \n", __FUNCTION__, error );
+#endif 
+
+	/* Drop the blocks that made it to disk, if asked to */
+	for ( i = 0; remove && i < count; i++ )
+	{
+		if ( (dirtyTags[ i ]->Flags & kLazyWrite) == 0 )
+			(void) CacheRemove( cache, dirtyTags[ i ] );
+	}
+
+	free( dirtyTags );
+	return error;
 } /* CacheFlushRange */
 
+/*
+ * CacheTagCompare
+ *
+ *  qsort comparator ordering tag pointers by disk offset.
+ */
+static int
+CacheTagCompare( const void *a, const void *b )
+{
+	uint64_t offA = (*(Tag_t * const *)a)->Offset;
+	uint64_t offB = (*(Tag_t * const *)b)->Offset;
+
+	if ( offA < offB )
+		return -1;
+	return ( offA > offB );
+}
+
+/*
+ * CacheWriteTags
+ *
+ *  Write out an array of dirty tags, sorted by offset.  Runs of blocks that
+ *  follow each other on disk go out as a single writev of up to
+ *  kCacheWriteRunMax blocks.  Tags are marked clean as they are written;
+ *  on error, the rest stay dirty.
+ */
+static int
+CacheWriteTags( Cache_t *cache, Tag_t **tags, uint32_t count )
+{
+	struct iovec iov[ kCacheWriteRunMax ];
+	uint32_t first;
+	uint32_t run;
+	uint32_t i;
+	int error;
+
+	for ( first = 0; first < count; first += run )
+	{
+		run = 0;
+		do {
+			iov[ run ].iov_base = tags[ first + run ]->Buffer;
+			iov[ run ].iov_len = cache->BlockSize;
+			run++;
+		} while ( first + run < count &&
+				  run < kCacheWriteRunMax &&
+				  tags[ first + run ]->Offset == tags[ first ]->Offset + (uint64_t)run * cache->BlockSize );
+
+		error = CacheRawWritev( cache, tags[ first ]->Offset, iov, run );
+		if ( EOK != error )
+			return error;
+
+		for ( i = first; i < first + run; i++ )
+			CacheMarkClean( cache, tags[ i ] );
+	}
+
+	return EOK;
+}
+
 /* Function: CacheCopyDiskBlocks
  *
  * Description: Perform direct disk block copy from from_offset to to_offset
@@ -1151,66 +2175,93 @@ out:
  *  new one is created and inserted into the cache.
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
+{
+	return (CacheLookupHint (cache, off, NULL, tag));
+}
+
+/*
+ * CacheLookupHint
+ *
+ *  CacheLookup, but if the block has to be loaded, prefer to load it into
+ *  the cache page at hint (if any).  If that page belongs to an idle block,
+ *  that block is moved to the page we would otherwise have used.
+ */
+static int CacheLookupHint (Cache_t *cache, uint64_t off, void *hint, Tag_t **tag)
 {
 	Tag_t *		temp;
-	uint32_t	hash = off % cache->HashSize;
+	Tag_t **	owner;
+	void *		block;
+	uint32_t	slot;
 	int			error;
 
 	*tag = NULL;
 	
 	/* Search the hash table */
-	error = 0;
-	temp = cache->Hash[hash];
-	while (temp != NULL) {
-		if (temp->Offset == off) break;
-		temp = temp->Next;
-	}
-
-	/* If it's a hit */
-	if (temp != NULL) {
-		/* Perform MTF if necessary */
-		if (cache->Hash[hash] != temp) {
-			/* Disconnect the tag */
-			if (temp->Next != NULL)
-				temp->Next->Prev = temp->Prev;
-			temp->Prev->Next = temp->Next;
-		}
-		
-	/* Otherwise, it's a miss */
-	} else {
-		/* Allocate a new tag */
-		temp = (Tag_t *)calloc (sizeof (Tag_t), 1);/* We really only need to zero the
-													 LRU portion though */
-		temp->Offset = off;
-
-		/* Kick the tag onto the LRU */
-		//LRUHit (&cache->LRU, (LRUNode_t *)temp, 0);
+again:
+	slot = CacheHashFind (cache, off);
+	temp = cache->Hash[slot];
+
+	/* Wait for a readahead of the block; it may have failed, so look again */
+	if (temp != NULL && (temp->Flags & kReadPending)) {
+		CacheReadAheadReap (cache, temp, false);
+		goto again;
+	}
+	if (temp != NULL && (temp->Flags & kReadAhead)) {
+		cache->RAHit++;
+		temp->Flags &= ~kReadAhead;
 	}
 
-	/* Insert at the head (if it's not already there) */
-	if (cache->Hash[hash] != temp) {
-		temp->Prev = NULL;
-		temp->Next = cache->Hash[hash];
-		if (temp->Next != NULL)
-			temp->Next->Prev = temp;
-		cache->Hash[hash] = temp;
+	/* If it's a miss, create a new tag */
+	if (temp == NULL) {
+		temp = CacheAllocTag (cache);
+		if (temp == NULL) return (ENOMEM);
+		temp->Offset = off;
+
+		error = CacheHashInsert (cache, temp);
+		if (error != EOK) {
+			temp->Next = cache->FreeTags;
+			cache->FreeTags = temp;
+			return (error);
+		}
 	}
 
 	/* Make sure there's a buffer */
 	if (temp->Buffer == NULL) {
 		/* Find a free buffer */
-		temp->Buffer = CacheAllocBlock (cache);
-		if (temp->Buffer == NULL) {
+		block = CacheAllocBlock (cache);
+		if (block == NULL) {
 			/* Try to evict a buffer */
 			error = LRUEvict (&cache->LRU, (LRUNode_t *)temp);
 			if (error != EOK) return (error);
 
 			/* Try again */
-			temp->Buffer = CacheAllocBlock (cache);
-			if (temp->Buffer == NULL) return (ENOMEM);
+			block = CacheAllocBlock (cache);
+			if (block == NULL) return (ENOMEM);
+		}
+
+		/* Use the page we were asked for instead, if we can */
+		if (hint != NULL && hint != block &&
+		    (char *)hint < (char *)cache->Arena + (uint64_t)cache->TotalBlocks * cache->BlockSize) {
+			owner = CachePageTag (cache, hint);
+			if (*owner == NULL) {
+				/* It's free; return the other one */
+				CacheTakeBlock (cache, hint);
+				CachePutBlock (cache, block);
+				block = hint;
+			} else if ((*owner)->Refs == 0 && !CachePaired (cache, *owner)) {
+				/* Move its contents out of the way */
+				memcpy (block, hint, cache->BlockSize);
+				(*owner)->Buffer = block;
+				*CachePageTag (cache, block) = *owner;
+				block = hint;
+				cache->Relocate++;
+			}
 		}
+		temp->Buffer = block;
+		*CachePageTag (cache, block) = temp;
 
 		/* Load the block from disk */
+		cache->Misses++;
 		error = CacheRawRead (cache, off, cache->BlockSize, temp->Buffer);
 		if (error != EOK) return (error);
 	}
@@ -1219,6 +2270,253 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 	return (EOK);
 }
 
+/*
+ * CachePaired
+ *
+ *  Returns true if the cache page after a tag's holds the following block.
+ */
+static int CachePaired (Cache_t *cache, Tag_t *tag)
+{
+	void *		next = tag->Buffer + cache->BlockSize;
+	Tag_t *		owner;
+
+	if ((char *)next >= (char *)cache->Arena + (uint64_t)cache->TotalBlocks * cache->BlockSize)
+		return (false);
+
+	owner = *CachePageTag (cache, next);
+	return (owner != NULL && owner->Offset == tag->Offset + cache->BlockSize);
+}
+
+/*
+ * CacheAdjoin
+ *
+ *  Try to make the cache page of tag immediately follow that of prev, so
+ *  that a request spanning both can be returned without copying.  An idle
+ *  tag can be moved, exchanging pages with whatever idle block is in the
+ *  way; this costs a copy once instead of one on every spanning request.
+ *
+ *  Returns true if the pages are adjacent.
+ */
+static int CacheAdjoin (Cache_t *cache, Tag_t *prev, Tag_t *tag)
+{
+	void *		want = prev->Buffer + cache->BlockSize;
+	Tag_t **	owner;
+
+	if (tag->Buffer == want)
+		return (true);
+
+	/*
+	 * Can't move a block someone is using, or go past the end.  Also leave
+	 * alone blocks that are already followed by their neighbour; that way
+	 * every move adds a contiguous pair, and the layout settles down.
+	 */
+	if (tag->Refs != 0 || CachePaired (cache, tag))
+		return (false);
+	if ((char *)want >= (char *)cache->Arena + (uint64_t)cache->TotalBlocks * cache->BlockSize)
+		return (false);
+
+	owner = CachePageTag (cache, want);
+	if (*owner == NULL) {
+		/* The page is free; move into it */
+		CacheTakeBlock (cache, want);
+		memcpy (want, tag->Buffer, cache->BlockSize);
+		*owner = tag;
+
+		/* And free the old one */
+		CachePutBlock (cache, tag->Buffer);
+
+	} else if ((*owner)->Refs == 0 && !CachePaired (cache, *owner)) {
+		/* Exchange pages with the idle block in the way */
+		memcpy (cache->SwapBlock, want, cache->BlockSize);
+		memcpy (want, tag->Buffer, cache->BlockSize);
+		memcpy (tag->Buffer, cache->SwapBlock, cache->BlockSize);
+
+		(*owner)->Buffer = tag->Buffer;
+		*CachePageTag (cache, tag->Buffer) = *owner;
+		*owner = tag;
+
+	} else {
+		return (false);
+	}
+
+	tag->Buffer = want;
+	cache->Relocate++;
+
+	return (true);
+}
+
+/*
+ * CacheHashSlot
+ *
+ *  Home slot of an offset.  Cache offsets are all multiples of the block
+ *  size, so use a multiplicative (Fibonacci) hash to spread the high bits
+ *  over the whole table.
+ */
+static inline uint32_t CacheHashSlot (Cache_t *cache, uint64_t off)
+{
+	return (uint32_t)((off * 0x9E3779B97F4A7C15ULL) >> cache->HashShift);
+}
+
+/*
+ * CacheHashFind
+ *
+ *  Returns the slot holding the tag for the given offset, or the empty slot
+ *  where it would be inserted.  Uses linear probing; the table is kept at
+ *  most half full, so probe sequences stay short.
+ */
+static uint32_t CacheHashFind (Cache_t *cache, uint64_t off)
+{
+	uint32_t	mask = cache->HashSize - 1;
+	uint32_t	slot = CacheHashSlot (cache, off);
+
+	while (cache->Hash[slot] != NULL && cache->Hash[slot]->Offset != off)
+		slot = (slot + 1) & mask;
+
+	return (slot);
+}
+
+/*
+ * CacheHashGrow
+ *
+ *  Doubles the size of the lookup table and re-enters every tag.
+ */
+static int CacheHashGrow (Cache_t *cache)
+{
+	Tag_t **	oldHash = cache->Hash;
+	uint32_t	oldSize = cache->HashSize;
+	uint32_t	i;
+
+	cache->Hash = (Tag_t **) calloc (1, sizeof (Tag_t *) * oldSize * 2);
+	if (cache->Hash == NULL) {
+		cache->Hash = oldHash;
+		return (ENOMEM);
+	}
+	cache->HashSize = oldSize * 2;
+	cache->HashShift--;
+
+	for (i = 0; i < oldSize; i++) {
+		if (oldHash[i] != NULL)
+			cache->Hash[CacheHashFind (cache, oldHash[i]->Offset)] = oldHash[i];
+	}
+	free (oldHash);
+
+#if CACHE_DEBUG
+	printf ("%s - hashSize %d \n", __FUNCTION__, cache->HashSize);
+#endif
+	return (EOK);
+}
+
+/*
+ * CacheHashInsert
+ *
+ *  Enters a tag into the lookup table, growing the table if necessary.
+ *
+ *  NOTE: The caller must have checked that the offset isn't already present.
+ */
+static int CacheHashInsert (Cache_t *cache, Tag_t *tag)
+{
+	int			error;
+
+	if ((cache->HashCount + 1) * 2 > cache->HashSize) {
+		error = CacheHashGrow (cache);
+		if (error != EOK) return (error);
+	}
+
+	cache->Hash[CacheHashFind (cache, tag->Offset)] = tag;
+	cache->HashCount++;
+
+	return (EOK);
+}
+
+/*
+ * CacheHashDelete
+ *
+ *  Removes a tag from the lookup table.  Rather than leaving a tombstone,
+ *  the entries that follow in the probe sequence are shifted back so that
+ *  every tag remains reachable from its home slot.
+ */
+static void CacheHashDelete (Cache_t *cache, Tag_t *tag)
+{
+	uint32_t	mask = cache->HashSize - 1;
+	uint32_t	hole;
+	uint32_t	next;
+	uint32_t	home;
+
+	hole = CacheHashFind (cache, tag->Offset);
+	if (cache->Hash[hole] != tag) {
+#if CACHE_DEBUG
+		printf ("ERROR: CacheHashDelete: Tag not in hash table\n");
+#endif
+		return;
+	}
+
+	next = hole;
+	while (1) {
+		next = (next + 1) & mask;
+		if (cache->Hash[next] == NULL) break;
+
+		/* Move the entry if the hole lies between its home slot and it */
+		home = CacheHashSlot (cache, cache->Hash[next]->Offset);
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			cache->Hash[hole] = cache->Hash[next];
+			hole = next;
+		}
+	}
+	cache->Hash[hole] = NULL;
+	cache->HashCount--;
+}
+
+/*
+ * CacheAddTagSlab
+ *
+ *  Add a slab of count tags to the free tag list.
+ */
+static int CacheAddTagSlab (Cache_t *cache, uint32_t count)
+{
+	TagSlab_t *	slab;
+	uint32_t	i;
+
+	if (count == 0) return (EOK);
+
+	slab = (TagSlab_t *) calloc (1, sizeof (TagSlab_t) +
+	                                sizeof (Tag_t) * (count - 1));
+	if (slab == NULL) return (ENOMEM);
+	slab->Count = count;
+	for (i = 1; i < count; i++) {
+		slab->Tags[i-1].Next = &slab->Tags[i];
+	}
+	slab->Tags[count-1].Next = cache->FreeTags;
+
+	slab->Next = cache->TagSlabs;
+	cache->TagSlabs = slab;
+	cache->FreeTags = &slab->Tags[0];
+
+	return (EOK);
+}
+
+/*
+ * CacheAllocTag
+ *
+ *  Take a zeroed tag from the tag slab.  The slab is sized so that this
+ *  never has to allocate in normal operation, but add another chunk rather
+ *  than fail if it does run dry.
+ */
+static Tag_t *CacheAllocTag (Cache_t *cache)
+{
+	Tag_t *		tag;
+
+	if (cache->FreeTags == NULL) {
+		if (CacheAddTagSlab (cache, CacheTagSlabGrow) != EOK)
+			return (NULL);
+	}
+
+	tag = cache->FreeTags;
+	cache->FreeTags = tag->Next;
+	tag->Next = NULL;
+
+	return (tag);
+}
+
 /*
  * CacheRawRead
  *
@@ -1226,27 +2524,154 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
  */
 int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 {
-	uint64_t	result;
+	off_t		result;
+	ssize_t		nread;
+	uint64_t	start;
 		
 	/* Both offset and length must be multiples of the device block size */
 	if (off % cache->DevBlockSize) return (EINVAL);
 	if (len % cache->DevBlockSize) return (EINVAL);
 	
+	/* Copy out of a mapped image */
+	if (cache->Map != NULL) {
+		if (off >= cache->MapSize || len > cache->MapSize - off) return (ENXIO);
+		memcpy (buf, cache->Map + off, len);
+		return (EOK);
+	}
+
 	/* Seek to the position */
+	start = CacheClock ();
 	result = lseek (cache->FD_R, off, SEEK_SET);
 	if (result < 0) return (errno);
 	if (result != off) return (ENXIO);
 	/* Read into the buffer */
-	result = read (cache->FD_R, buf, len);
-	if (result < 0) return (errno);
-	if (result == 0) return (ENXIO);
+	nread = read (cache->FD_R, buf, len);
+	if (nread < 0) return (errno);
+	if (nread != len) return (ENXIO);
 
 	/* Update counters */
 	cache->DiskRead++;
+	cache->BytesRead += nread;
+	CacheNoteLatency (cache, CacheClock () - start);
 	
 	return (EOK);
 }
 
+/*
+ * CacheRawReadv
+ *
+ *  Perform a direct scattered read on the file.  *done is set to the
+ *  number of bytes read, which may fall short at the end of the device.
+ */
+static int CacheRawReadv (Cache_t *cache, uint64_t off, struct iovec *iov, int iovcnt, uint64_t *done)
+{
+	off_t		result;
+	ssize_t		nread;
+	uint64_t	start;
+
+	*done = 0;
+
+	/* Seek to the position */
+	start = CacheClock ();
+	result = lseek (cache->FD_R, off, SEEK_SET);
+	if (result < 0) return (errno);
+	if (result != off) return (ENXIO);
+
+	/* Read the whole run */
+	nread = readv (cache->FD_R, iov, iovcnt);
+	if (nread < 0) return (errno);
+	if (nread == 0) return (ENXIO);
+
+	/* Update counters */
+	cache->DiskRead++;
+	cache->BytesRead += nread;
+	CacheNoteLatency (cache, CacheClock () - start);
+
+	*done = nread;
+	return (EOK);
+}
+
+/*
+ * CacheStreamCluster
+ *
+ *  Starting at cblk, which isn't cached, give each following block up to
+ *  the end of its cluster a tag and a cache page, stopping at the first
+ *  block the cache already has, and read them all at once.  The blocks
+ *  are kept busy until the read is done, so that allocating one can't
+ *  evict another.  Blocks up to end count as misses of the request; the
+ *  rest as Clustered.  On any failure the blocks are dropped again, and
+ *  CacheRead reads what it needs itself.
+ */
+static void CacheStreamCluster (Cache_t *cache, uint64_t cblk, uint64_t end)
+{
+	Tag_t *			tags[kStreamClusterMax];
+	struct iovec	iov[kStreamClusterMax];
+	uint64_t		limit;
+	uint64_t		done;
+	uint64_t		off;
+	void *			block;
+	Tag_t *			tag;
+	int				count = 0;
+	int				error;
+	int				i;
+
+	limit = cblk - (cblk % cache->StreamCluster) + cache->StreamCluster;
+	for (off = cblk; off < limit; off += cache->BlockSize) {
+		if (cache->Hash[CacheHashFind (cache, off)] != NULL)
+			break;
+
+		tag = CacheAllocTag (cache);
+		if (tag == NULL) break;
+		tag->Offset = off;
+		if (CacheHashInsert (cache, tag) != EOK) {
+			tag->Next = cache->FreeTags;
+			cache->FreeTags = tag;
+			break;
+		}
+
+		block = CacheAllocBlock (cache);
+		if (block == NULL) {
+			if (LRUEvict (&cache->LRU, (LRUNode_t *)tag) == EOK)
+				block = CacheAllocBlock (cache);
+			if (block == NULL) {
+				CacheRemove (cache, tag);
+				break;
+			}
+		}
+		tag->Buffer = block;
+		*CachePageTag (cache, block) = tag;
+		tag->Flags |= kStreamRead;
+		tag->Refs++;
+		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+
+		tags[count] = tag;
+		iov[count].iov_base = block;
+		iov[count].iov_len = cache->BlockSize;
+		count++;
+	}
+	if (count == 0)
+		return;
+
+	error = CacheRawReadv (cache, cblk, iov, count, &done);
+
+	for (i = 0; i < count; i++) {
+		tag = tags[i];
+		tag->Refs--;
+
+		/* Keep only what was read in full (or in part, at the end of the disk) */
+		if (error != EOK || done <= (uint64_t)i * cache->BlockSize ||
+		    (done < (uint64_t)(i + 1) * cache->BlockSize && i + 1 < count)) {
+			CacheRemove (cache, tag);
+			continue;
+		}
+		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+		if (tag->Offset < end)
+			cache->Misses++;
+		else
+			cache->Clustered++;
+	}
+}
+
 /*
  * CacheRawWrite
  *
@@ -1254,28 +2679,656 @@ int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
  */
 int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 {
-	uint64_t	result;
+	off_t		result;
+	ssize_t		written;
+	uint64_t	start;
 	
 	/* Both offset and length must be multiples of the device block size */
 	if (off % cache->DevBlockSize) return (EINVAL);
 	if (len % cache->DevBlockSize) return (EINVAL);
 	
 	/* Seek to the position */
+	start = CacheClock ();
 	result = lseek (cache->FD_W, off, SEEK_SET);
 	if (result < 0) return (errno);
 	if (result != off) return (ENXIO);
 	
 	/* Write into the buffer */
-	result = write (cache->FD_W, buf, len);
-	if (result < 0) return (errno);
-	if (result == 0) return (ENXIO);
+	written = write (cache->FD_W, buf, len);
+	if (written < 0) return (errno);
+	if (written != len) return (ENXIO);
 	
 	/* Update counters */
 	cache->DiskWrite++;
+	cache->BytesWritten += written;
+	CacheNoteLatency (cache, CacheClock () - start);
 	
 	return (EOK);
 }
 
+/*
+ * CacheRawWritev
+ *
+ *  Perform a direct gathered write on the file.  Short writes are finished
+ *  off with CacheRawWrite.
+ */
+static int CacheRawWritev (Cache_t *cache, uint64_t off, struct iovec *iov, int iovcnt)
+{
+	off_t		result;
+	ssize_t		written;
+	uint64_t	start;
+	int			i;
+
+	/* Seek to the position */
+	start = CacheClock ();
+	result = lseek (cache->FD_W, off, SEEK_SET);
+	if (result < 0) return (errno);
+	if (result != off) return (ENXIO);
+
+	/* Write the whole run */
+	written = writev (cache->FD_W, iov, iovcnt);
+	if (written < 0) return (errno);
+	if (written == 0) return (ENXIO);
+
+	/* Update counters */
+	cache->DiskWrite++;
+	cache->BytesWritten += written;
+	CacheNoteLatency (cache, CacheClock () - start);
+
+	/* Write whatever didn't make it */
+	for (i = 0; i < iovcnt; i++) {
+		if (written >= iov[i].iov_len) {
+			written -= iov[i].iov_len;
+			off += iov[i].iov_len;
+			continue;
+		}
+		if ((written % cache->DevBlockSize) != 0) return (EIO);
+		result = CacheRawWrite (cache, off + written, iov[i].iov_len - written,
+		                        iov[i].iov_base + written);
+		if (result != EOK) return (result);
+		off += iov[i].iov_len;
+		written = 0;
+	}
+
+	return (EOK);
+}
+
+/*
+ * CacheClock
+ *
+ *  Current time in microseconds, for timing disk I/O.
+ */
+static uint64_t CacheClock (void)
+{
+	struct timeval	tv;
+
+	(void) gettimeofday (&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+/*
+ * CacheNoteLatency
+ *
+ *  Count a disk I/O in the latency histogram: bucket i holds times under
+ *  2^i microseconds.
+ */
+static void CacheNoteLatency (Cache_t *cache, uint64_t usec)
+{
+	uint32_t	i = 0;
+
+	while (usec != 0 && i < CacheLatencyBuckets - 1) {
+		usec >>= 1;
+		i++;
+	}
+	cache->Latency[i]++;
+}
+
+/*
+ * CacheTrace
+ *
+ *  Append a record to the trace.  stdio does the buffering; if the trace
+ *  can't be written, tracing simply stops (the caller will find the error
+ *  on the stream).
+ */
+static void CacheTrace (Cache_t *cache, int op, uint64_t off, uint32_t len, uint32_t flags)
+{
+	CacheTraceRecord_t	rec;
+
+	rec.Offset = off;
+	rec.Length = len;
+	rec.Op = op;
+	rec.Phase = cache->Phase;
+	rec.Flags = flags;
+	rec.Time = CacheClock () - cache->TraceStart;
+
+	if (fwrite (&rec, sizeof (rec), 1, cache->Trace) != 1) {
+#if CACHE_DEBUG
+		printf ("ERROR: CacheTrace: trace write failed\n");
+#endif
+		cache->Trace = NULL;
+	}
+}
+
+/*
+ * CacheTracePhase
+ *
+ *  Append a phase name record, followed by the name padded to 8 bytes.
+ */
+static void CacheTracePhase (Cache_t *cache, uint32_t phase)
+{
+	static const char	zeroes[8];
+	const char *		name = cache->Phases[phase].Name;
+	uint32_t			len = strlen (name);
+	uint32_t			saved = cache->Phase;
+
+	cache->Phase = phase;
+	CacheTrace (cache, kCacheTracePhase, 0, len, 0);
+	cache->Phase = saved;
+
+	if (cache->Trace != NULL &&
+	    (fwrite (name, 1, len, cache->Trace) != len ||
+	     fwrite (zeroes, 1, (8 - (len % 8)) % 8, cache->Trace) != (8 - (len % 8)) % 8))
+		cache->Trace = NULL;
+}
+
+/*
+ * CacheAllocArena
+ *
+ *  Large caches spend a good deal of their time in TLB misses, so the cache
+ *  memory is put on huge pages when it is big enough to fill one.  Explicit
+ *  superpages come out of a pool the kernel may not have, so failing to get
+ *  them just means falling back to ordinary memory, which is then aligned
+ *  and offered to the VM system for transparent huge pages where supported.
+ */
+static int CacheAllocArena (Cache_t *cache, uint64_t size)
+{
+	uint64_t	huge = (size + kCacheHugePageSize - 1) & ~(uint64_t)(kCacheHugePageSize - 1);
+	char *		arena;
+	uint64_t	lead;
+
+	if (size != (size_t)size) return (ENOMEM);
+
+	if (size >= kCacheHugePageSize) {
+#if defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+		arena = mmap (NULL, huge, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+		              VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#elif defined(MAP_HUGETLB)
+		arena = mmap (NULL, huge, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB,
+		              -1, 0);
+#else
+		arena = MAP_FAILED;
+#endif
+		if (arena != MAP_FAILED) {
+			cache->Arena = arena;
+			cache->ArenaSize = huge;
+			cache->HugePages = kCacheHugePagesExplicit;
+			return (EOK);
+		}
+	}
+
+#if defined(MADV_HUGEPAGE)
+	if (size >= kCacheHugePageSize) {
+		/* Over-allocate so that the arena can start on a huge page boundary */
+		arena = mmap (NULL, huge + kCacheHugePageSize, PROT_READ | PROT_WRITE,
+		              MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (arena == MAP_FAILED) return (ENOMEM);
+
+		lead = (kCacheHugePageSize - ((uintptr_t)arena & (kCacheHugePageSize - 1))) & (kCacheHugePageSize - 1);
+		if (lead != 0)
+			(void) munmap (arena, lead);
+		(void) munmap (arena + lead + huge, kCacheHugePageSize - lead);
+		arena += lead;
+
+		cache->Arena = arena;
+		cache->ArenaSize = huge;
+		if (madvise (arena, huge, MADV_HUGEPAGE) == 0)
+			cache->HugePages = kCacheHugePagesTransparent;
+		return (EOK);
+	}
+#endif
+	(void) lead;
+
+	arena = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (arena == MAP_FAILED) return (ENOMEM);
+	cache->Arena = arena;
+	cache->ArenaSize = size;
+
+	return (EOK);
+}
+
+/*
+ * CacheInitArena
+ *
+ *  The free list is kept in address order, so that blocks loaded one after
+ *  another also sit next to each other.  Linking it writes to every block
+ *  (and preTouch to every page), which for a cache of many gigabytes is
+ *  mostly page faults; the work is split into slices of kCacheInitSlice
+ *  among up to one thread per CPU, and the slices stitched together after.
+ */
+static int CacheInitArena (Cache_t *cache, int preTouch)
+{
+	ArenaSlice_t	slices[kCacheInitThreads];
+	uint32_t		perSlice;
+	uint32_t		count;
+	uint32_t		first;
+	long			cpus;
+	int				started;
+	int				n;
+	int				i;
+
+	/* One slice per kCacheInitSlice of memory, at most one per CPU */
+	n = (int)(((uint64_t)cache->TotalBlocks * cache->BlockSize + kCacheInitSlice - 1) / kCacheInitSlice);
+	cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n > cpus)
+		n = (int)cpus;
+	if (n > kCacheInitThreads)
+		n = kCacheInitThreads;
+	if (n < 1)
+		n = 1;
+
+	perSlice = (cache->TotalBlocks + n - 1) / n;
+	for (i = 0, first = 0; i < n; i++, first += count) {
+		count = cache->TotalBlocks - first;
+		if (count > perSlice)
+			count = perSlice;
+		slices[i].Start = (char *)cache->Arena + (uint64_t)first * cache->BlockSize;
+		slices[i].Count = count;
+		slices[i].BlockSize = cache->BlockSize;
+		slices[i].PreTouch = preTouch;
+	}
+
+	/* The first slice is done here; if a thread can't be had, so are the rest */
+	for (started = 1; started < n; started++) {
+		if (pthread_create (&slices[started].Thread, NULL, CacheInitSlice, &slices[started]) != 0)
+			break;
+	}
+	for (i = started; i < n; i++)
+		(void) CacheInitSlice (&slices[i]);
+	(void) CacheInitSlice (&slices[0]);
+	for (i = 1; i < started; i++)
+		pthread_join (slices[i].Thread, NULL);
+
+	/* Stitch the slices together */
+	for (i = 1; i < n; i++) {
+		FreeBlock_t *	last = (FreeBlock_t *)(slices[i].Start - cache->BlockSize);
+		FreeBlock_t *	head = (FreeBlock_t *)slices[i].Start;
+
+		last->Next = head;
+		head->Prev = last;
+	}
+	cache->FreeHead = cache->Arena;
+	cache->FreeSize = cache->TotalBlocks;
+
+#if CACHE_DEBUG
+	printf ("%s - %d slices, %d threads \n", __FUNCTION__, n, started);
+#endif
+	return (EOK);
+}
+
+/*
+ * CacheInitSlice
+ *
+ *  Link one slice of cache blocks into a list of its own, faulting in each
+ *  page first if asked to.
+ */
+static void *CacheInitSlice (void *arg)
+{
+	ArenaSlice_t *	slice = (ArenaSlice_t *)arg;
+	char *			end = slice->Start + (uint64_t)slice->Count * slice->BlockSize;
+	FreeBlock_t *	temp;
+	FreeBlock_t *	prev = NULL;
+	char *			ptr;
+
+	if (slice->PreTouch) {
+		size_t pageSize = getpagesize();
+
+		for (ptr = slice->Start; ptr < end; ptr += pageSize)
+			*ptr = 0;
+	}
+
+	for (ptr = slice->Start; ptr < end; ptr += slice->BlockSize) {
+		temp = (FreeBlock_t *)ptr;
+		temp->Prev = prev;
+		temp->Next = NULL;
+		if (prev != NULL)
+			prev->Next = temp;
+		prev = temp;
+	}
+
+	return (NULL);
+}
+
+/*
+ * CacheMapFile
+ *
+ *  Map the file being verified, if it is a regular file.  The mapping is
+ *  private and writable because callers byte swap B-tree nodes in place;
+ *  nothing written to it ever reaches the file.
+ */
+static int CacheMapFile (Cache_t *cache)
+{
+	struct stat	st;
+	void *		map;
+
+	if (fstat (cache->FD_R, &st) != 0) return (errno);
+	if (!S_ISREG (st.st_mode) || st.st_size <= 0) return (ENODEV);
+	if ((uint64_t)(size_t)st.st_size != (uint64_t)st.st_size) return (EFBIG);
+
+	map = mmap (NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	            cache->FD_R, 0);
+	if (map == MAP_FAILED) return (errno);
+
+	cache->Map = map;
+	cache->MapSize = st.st_size;
+	return (EOK);
+}
+
+/*
+ * CacheReleaseMapped
+ *
+ *  Put back a buffer that points into the file mapping.
+ */
+static void CacheReleaseMapped (Cache_t *cache, Buf_t *buf)
+{
+	/* Detach the buffer */
+	if (buf->Next != NULL)
+		buf->Next->Prev = buf->Prev;
+	if (buf->Prev != NULL)
+		buf->Prev->Next = buf->Next;
+	if (cache->ActiveBufs == buf)
+		cache->ActiveBufs = buf->Next;
+
+	/* Clear the buffer and put it back on free list */
+	memset (buf, 0x00, sizeof (Buf_t));
+	buf->Next = cache->FreeBufs;
+	cache->FreeBufs = buf;
+}
+
+/*
+ * CacheMarkDirty
+ *
+ *  Flag a tag for lazy write.
+ */
+static void CacheMarkDirty (Cache_t *cache, Tag_t *tag)
+{
+	if ((tag->Flags & kLazyWrite) == 0) {
+		tag->Flags |= kLazyWrite;
+		cache->DirtyCount++;
+	}
+}
+
+/*
+ * CacheMarkClean
+ *
+ *  Clear a tag's lazy write flag, once it has been written.
+ */
+static void CacheMarkClean (Cache_t *cache, Tag_t *tag)
+{
+	if ((tag->Flags & kLazyWrite) != 0) {
+		tag->Flags &= ~kLazyWrite;
+		cache->DirtyCount--;
+	}
+}
+
+/*
+ * CacheReadAhead
+ *
+ *  Feed a block read to the readahead detector.  A read that continues a
+ *  stream with the same stride kReadAheadTrigger times in a row starts
+ *  readahead of that stream, which then keeps Window blocks in flight ahead
+ *  of it.  A read near a stream's last block changes its stride; any other
+ *  read replaces the least recently used stream.
+ */
+static void CacheReadAhead (Cache_t *cache, uint64_t off, uint32_t readOptions)
+{
+	ReadAhead_t *	ra = cache->ReadAhead;
+	RAStream_t *	stream;
+	RAStream_t *	near = NULL;
+	RAStream_t *	oldest = NULL;
+	int64_t			delta;
+	int64_t			limit;
+	uint64_t		end;
+	uint32_t		i;
+
+	if (ra == NULL)
+		return;
+	limit = (int64_t)kReadAheadMaxStride * cache->BlockSize;
+
+	for (i = 0; i < kReadAheadStreams; i++) {
+		stream = &ra->Streams[i];
+		if (stream->Used == 0) {
+			if (oldest == NULL || oldest->Used != 0)
+				oldest = stream;
+			continue;
+		}
+
+		/* Another read of the same block changes nothing */
+		delta = (int64_t)(off - stream->Last);
+		if (delta == 0) {
+			stream->Used = ++ra->Clock;
+			return;
+		}
+		if (stream->Stride != 0 && delta == stream->Stride)
+			goto match;
+
+		if (delta >= -limit && delta <= limit && near == NULL)
+			near = stream;
+		if (oldest == NULL || (oldest->Used != 0 && stream->Used < oldest->Used))
+			oldest = stream;
+	}
+
+	if (near != NULL) {
+		/* A new stride for a nearby stream */
+		stream = near;
+		stream->Stride = (int64_t)(off - stream->Last);
+		stream->Run = 1;
+		stream->Next = off;
+	} else {
+		/* A new stream */
+		stream = oldest;
+		stream->Stride = 0;
+		stream->Run = 0;
+		stream->Next = off;
+	}
+	stream->Last = off;
+	stream->Used = ++ra->Clock;
+	return;
+
+match:
+	stream->Last = off;
+	stream->Used = ++ra->Clock;
+	if (++stream->Run < kReadAheadTrigger)
+		return;
+
+	/* Top the window back up, staying on the disk */
+	if ((int64_t)(stream->Next - off) / stream->Stride <= 0)
+		stream->Next = off + stream->Stride;
+	end = off + (int64_t)ra->Window * stream->Stride;
+	if (stream->Stride < 0 && off < (uint64_t)(-stream->Stride) * ra->Window)
+		end = off % (uint64_t)(-stream->Stride) + stream->Stride;
+
+	while (stream->Next != end) {
+		if (CacheReadAheadIssue (cache, stream->Next, readOptions) != EOK)
+			break;
+		stream->Next += stream->Stride;
+	}
+}
+
+/*
+ * CacheReadAheadIssue
+ *
+ *  Start an asynchronous read of one cache block, unless the cache already
+ *  knows about it.  The block gets its tag and cache page right away, and
+ *  stays busy until CacheReadAheadReap sees the read finish.
+ */
+static int CacheReadAheadIssue (Cache_t *cache, uint64_t off, uint32_t readOptions)
+{
+	ReadAhead_t *	ra = cache->ReadAhead;
+	RARequest_t *	req;
+	Tag_t *			tag;
+	void *			block;
+	int				error;
+
+	if (cache->Hash[CacheHashFind (cache, off)] != NULL)
+		return (EOK);
+
+	/* Don't have more than two windows in flight */
+	if ((req = ra->Free) == NULL)
+		return (ENOBUFS);
+
+	tag = CacheAllocTag (cache);
+	if (tag == NULL) return (ENOMEM);
+	tag->Offset = off;
+
+	error = CacheHashInsert (cache, tag);
+	if (error != EOK) {
+		tag->Next = cache->FreeTags;
+		cache->FreeTags = tag;
+		return (error);
+	}
+
+	block = CacheAllocBlock (cache);
+	if (block == NULL) {
+		if (LRUEvict (&cache->LRU, (LRUNode_t *)tag) == EOK)
+			block = CacheAllocBlock (cache);
+		if (block == NULL) {
+			CacheRemove (cache, tag);
+			return (ENOMEM);
+		}
+	}
+	tag->Buffer = block;
+	*CachePageTag (cache, block) = tag;
+
+	/* Keep it busy while the read is in flight */
+	tag->Flags |= kReadAhead | kReadPending | (readOptions & kStreamRead);
+	tag->Refs++;
+	LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+
+	ra->Free = req->Next;
+	req->Tag = tag;
+	req->Error = 0;
+	req->Done = false;
+	req->Work = NULL;
+
+	pthread_mutex_lock (&ra->Lock);
+	req->Next = ra->Pending;
+	ra->Pending = req;
+	if (ra->WorkTail != NULL)
+		ra->WorkTail->Work = req;
+	else
+		ra->WorkHead = req;
+	ra->WorkTail = req;
+	pthread_cond_signal (&ra->WorkCond);
+	pthread_mutex_unlock (&ra->Lock);
+
+	cache->RAIssued++;
+	return (EOK);
+}
+
+/*
+ * CacheReadAheadReap
+ *
+ *  Finish the readahead requests that have completed, releasing their tags.
+ *  A block that couldn't be read is dropped again, so that a later
+ *  CacheRead will try it itself and see the error.  If wait is given, wait
+ *  until that tag's read has finished; if drain is set, wait for all reads.
+ */
+static void CacheReadAheadReap (Cache_t *cache, Tag_t *wait, int drain)
+{
+	ReadAhead_t *	ra = cache->ReadAhead;
+	RARequest_t **	link;
+	RARequest_t *	req;
+	Tag_t *			tag;
+
+	if (ra == NULL || ra->Pending == NULL)
+		return;
+
+	pthread_mutex_lock (&ra->Lock);
+	while (1) {
+		link = &ra->Pending;
+		while ((req = *link) != NULL) {
+			if (!req->Done) {
+				link = &req->Next;
+				continue;
+			}
+			*link = req->Next;
+
+			tag = req->Tag;
+			tag->Refs--;
+			tag->Flags &= ~kReadPending;
+			if (req->Error == EOK) {
+				cache->DiskRead++;
+				cache->BytesRead += cache->BlockSize;
+				CacheNoteLatency (cache, req->Latency);
+				LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+			} else {
+				tag->Flags &= ~kReadAhead;
+				CacheRemove (cache, tag);
+			}
+
+			req->Tag = NULL;
+			req->Next = ra->Free;
+			ra->Free = req;
+		}
+
+		if (ra->Pending == NULL)
+			break;
+		if (!drain && (wait == NULL || !(wait->Flags & kReadPending)))
+			break;
+		pthread_cond_wait (&ra->DoneCond, &ra->Lock);
+	}
+	pthread_mutex_unlock (&ra->Lock);
+}
+
+/*
+ * CacheReadAheadThread
+ *
+ *  Body of a readahead I/O thread: read queued blocks into their cache
+ *  pages with pread, which leaves the file offset used by CacheRawRead and
+ *  CacheRawWrite alone.
+ */
+static void *CacheReadAheadThread (void *arg)
+{
+	ReadAhead_t *	ra = (ReadAhead_t *)arg;
+	Cache_t *		cache = ra->Cache;
+	RARequest_t *	req;
+	ssize_t			result;
+	uint64_t		start;
+	int				error;
+
+	pthread_mutex_lock (&ra->Lock);
+	while (1) {
+		while (ra->WorkHead == NULL && !ra->Shutdown)
+			pthread_cond_wait (&ra->WorkCond, &ra->Lock);
+		if (ra->WorkHead == NULL)
+			break;
+
+		req = ra->WorkHead;
+		ra->WorkHead = req->Work;
+		if (ra->WorkHead == NULL)
+			ra->WorkTail = NULL;
+		pthread_mutex_unlock (&ra->Lock);
+
+		start = CacheClock ();
+		result = pread (cache->FD_R, req->Tag->Buffer, cache->BlockSize, req->Tag->Offset);
+		req->Latency = CacheClock () - start;
+		if (result < 0)
+			error = errno;
+		else if (result == 0)
+			error = ENXIO;
+		else
+			error = EOK;
+
+		pthread_mutex_lock (&ra->Lock);
+		req->Error = error;
+		req->Done = true;
+		pthread_cond_broadcast (&ra->DoneCond);
+	}
+	pthread_mutex_unlock (&ra->Lock);
+
+	return (NULL);
+}
+
 
 
 /*
@@ -1292,6 +3345,14 @@ static int LRUInit (LRU_t *lru)
 	lru->Busy.Next = &lru->Busy;
 	lru->Busy.Prev = &lru->Busy;
 
+	lru->In.Next = &lru->In;
+	lru->In.Prev = &lru->In;
+
+	lru->Out.Next = &lru->Out;
+	lru->Out.Prev = &lru->Out;
+
+	lru->Policy = kCachePolicyLRU;
+
 	return (EOK);
 }
 
@@ -1315,10 +3376,16 @@ static int LRUDestroy (LRU_t *lru)
  *  Registers data activity on the given node. If the node is already in the
  *  LRU, it is moved to the front. Otherwise, it is inserted at the front.
  *
+ *  With 2Q, a node seen for the first time goes on the In queue, and stays
+ *  there; only a node brought back from the Out queue joins the main LRU.
+ *  Nodes only read by a scan (kStreamRead) are never promoted.
+ *
  *  NOTE: If the node is not in the LRU, we assume that its pointers are NULL.
  */
 static int LRUHit (LRU_t *lru, LRUNode_t *node, int age)
 {
+	LRUNode_t *	queue;
+
 	/* Handle existing nodes */
 	if ((node->Next != NULL) && (node->Prev != NULL)) {
 		/* Detach the node */
@@ -1326,6 +3393,22 @@ static int LRUHit (LRU_t *lru, LRUNode_t *node, int age)
 		node->Prev->Next = node->Next;
 	}
 
+	/* New and remembered nodes are assigned a queue */
+	if (node->Queue == kLRUQueueOut)
+		lru->OutCount--;
+	if (node->Queue == kLRUQueueNone ||
+	    (node->Queue == kLRUQueueOut && (((Tag_t *)node)->Flags & kStreamRead))) {
+		if (lru->Policy == kCachePolicy2Q) {
+			node->Queue = kLRUQueueIn;
+			lru->InCount++;
+		} else {
+			node->Queue = kLRUQueueMain;
+		}
+	} else if (node->Queue == kLRUQueueOut) {
+		node->Queue = kLRUQueueMain;
+	}
+	queue = (node->Queue == kLRUQueueIn) ? &lru->In : &lru->Head;
+
 	/* If it's busy (we can't evict it) */
 	if (((Tag_t *)node)->Refs) {
 		/* Insert at the head of the Busy queue */
@@ -1333,14 +3416,14 @@ static int LRUHit (LRU_t *lru, LRUNode_t *node, int age)
 		node->Prev = &lru->Busy;
 
 	} else if (age) {
-		/* Insert at the head of the LRU */
-		node->Next = &lru->Head;
-		node->Prev = lru->Head.Prev;
+		/* Insert at the tail of the queue */
+		node->Next = queue;
+		node->Prev = queue->Prev;
 		
 	} else {
-		/* Insert at the head of the LRU */
-		node->Next = lru->Head.Next;
-		node->Prev = &lru->Head;
+		/* Insert at the head of the queue */
+		node->Next = queue->Next;
+		node->Prev = queue;
 	}
 
 	node->Next->Prev = node;
@@ -1354,45 +3437,112 @@ static int LRUHit (LRU_t *lru, LRUNode_t *node, int age)
  *
  *  Chooses a buffer to release.
  *
- *  TODO: Under extreme conditions, it shoud be possible to release the buffer
- *        of an actively referenced cache buffer, leaving the tag behind as a
- *        placeholder. This would be required for implementing 2Q-LRU
- *        replacement.
+ *  With 2Q, the victim comes from the In queue while it holds more than its
+ *  share of the cache, and from the main LRU otherwise.  A node evicted from
+ *  the In queue keeps its tag, without a buffer, on the Out queue, so that a
+ *  second reference can be recognized.
  *
  *  NOTE: Make sure we never evict the node we're trying to find a buffer for!
  */
 static int LRUEvict (LRU_t *lru, LRUNode_t *node)
 {
+	Cache_t *	cache = (Cache_t *)lru;
+	LRUNode_t *	queue;
 	LRUNode_t *	temp;
+	int			pass;
+	int			error;
 
-	/* Find a victim */
-	while (1) {
-		/* Grab the tail */
-		temp = lru->Head.Prev;
-		
-		/* Stop if we're empty */
-		if (temp == &lru->Head) return (ENOMEM);
+	if (lru->Policy == kCachePolicy2Q && lru->InCount > lru->InMax)
+		queue = &lru->In;
+	else
+		queue = &lru->Head;
 
-		/* Detach the tail */
-		temp->Next->Prev = temp->Prev;
-		temp->Prev->Next = temp->Next;
+	/* Find a victim, trying the other queue if this one is exhausted */
+	for (pass = 0; pass < 2; pass++) {
+		while (1) {
+			/* Grab the tail */
+			temp = queue->Prev;
+			
+			/* Stop if we're empty */
+			if (temp == queue) break;
 
-		/* If it's not busy, we have a victim */
-		if (!((Tag_t *)temp)->Refs) break;
+			/* Detach the tail */
+			temp->Next->Prev = temp->Prev;
+			temp->Prev->Next = temp->Next;
 
-		/* Insert at the head of the Busy queue */
-		temp->Next = lru->Busy.Next;
-		temp->Prev = &lru->Busy;
-				
-		temp->Next->Prev = temp;
-		temp->Prev->Next = temp;
+			/* If it's not busy, we have a victim */
+			if (!((Tag_t *)temp)->Refs) {
+				temp->Next = NULL;
+				temp->Prev = NULL;
+				goto found;
+			}
+
+			/* Insert at the head of the Busy queue */
+			temp->Next = lru->Busy.Next;
+			temp->Prev = &lru->Busy;
+					
+			temp->Next->Prev = temp;
+			temp->Prev->Next = temp;
+
+			/* Try again */
+		}
+		queue = (queue == &lru->In) ? &lru->Head : &lru->In;
+	}
+	return (ENOMEM);
 
-		/* Try again */
+found:
+	cache->Evictions++;
+
+	/* Main LRU victims, scanned and unused read ahead blocks are simply forgotten */
+	if (temp->Queue != kLRUQueueIn || (((Tag_t *)temp)->Flags & (kStreamRead | kReadAhead))) {
+		/* Remove the tag */
+		CacheRemove (cache, (Tag_t *)temp);
+		return (EOK);
 	}
 
-	/* Remove the tag */
-	CacheRemove ((Cache_t *)lru, (Tag_t *)temp);
+	/* Release the buffer, and remember the tag on the Out queue */
+	error = CacheEvict (cache, (Tag_t *)temp);
+	if (error != EOK) return (error);
+
+	lru->InCount--;
+	temp->Queue = kLRUQueueOut;
+	temp->Next = lru->Out.Next;
+	temp->Prev = &lru->Out;
+	temp->Next->Prev = temp;
+	temp->Prev->Next = temp;
+	lru->OutCount++;
+
+	/* Forget the oldest ghosts */
+	while (lru->OutCount > lru->OutMax) {
+		temp = lru->Out.Prev;
+		if (temp == node)
+			temp = temp->Prev;
+		if (temp == &lru->Out)
+			break;
+		CacheRemove (cache, (Tag_t *)temp);
+	}
 
 	return (EOK);
 }
 
+/*
+ * LRURemove
+ *
+ *  Takes a node out of whichever queue it is on, before its tag is reused.
+ */
+static void LRURemove (LRU_t *lru, LRUNode_t *node)
+{
+	if ((node->Next != NULL) && (node->Prev != NULL)) {
+		node->Next->Prev = node->Prev;
+		node->Prev->Next = node->Next;
+	}
+	node->Next = NULL;
+	node->Prev = NULL;
+
+	if (node->Queue == kLRUQueueIn)
+		lru->InCount--;
+	else if (node->Queue == kLRUQueueOut)
+		lru->OutCount--;
+	node->Queue = kLRUQueueNone;
+}
+
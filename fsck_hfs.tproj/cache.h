@@ -29,6 +29,7 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 #include <stdint.h>
+#include <stdio.h>
 
 /* Different values for initializing cache */
 enum {
@@ -38,15 +39,39 @@ enum {
 	DefaultCacheSize		=	(DefaultCacheBlockSize * DefaultCacheBlocks),  /* 32MBytes */
 
 	/* Minimum allowed sizes */
-	MinCacheBlockSize		=	0x8000,		/* 32K */
+	MinCacheBlockSize		=	0x1000,		/* 4K */
 	MinCacheBlocks			=	128,
-	MinCacheSize			=	(MinCacheBlockSize * MinCacheBlocks), 	/* 4MBytes */
+	MinCacheSize			=	0x400000, 	/* 4MBytes */
 
-	/* Maximum allowed sizes */
-	MaxCacheBlockSize		=	0x8000,		/* 32K */
-	MaxCacheBlocks			= 	0x18000,
-	MaxCacheSize			=	((unsigned)MaxCacheBlockSize * MaxCacheBlocks),	/* 3Gbytes */
-	CacheHashSize			=	257,		/* prime number */
+	/* Maximum allowed sizes (see MaxCacheSize) */
+	MaxCacheBlockSize		=	0x100000,	/* 1M */
+	MaxCacheBlocks			= 	0x10000000,
+
+	/* Stream reads are clustered into I/Os this big (see CacheSetStreamCluster) */
+	DefaultStreamCluster	=	0x100000,	/* 1M */
+
+	/* Minimum lookup table size; CacheInit scales it with the cache */
+	CacheHashSize			=	256,		/* power of two */
+	CacheTagSlabGrow		=	256,		/* tags added when the slab runs dry */
+
+	/* Readahead (see CacheSetReadAhead) */
+	DefaultReadAheadWindow	=	8,			/* cache blocks kept in flight per stream */
+	DefaultReadAheadThreads	=	2,			/* I/O threads */
+	MaxReadAheadThreads		=	16,
+
+	/* Statistics (see CacheSetPhase) */
+	CacheLatencyBuckets		=	24,			/* log2 buckets of I/O time in microseconds */
+	CacheMaxPhases			=	16,			/* named phases, including "other" */
+};
+
+/* Too big for an enum */
+#define MaxCacheSize	(1ULL << 40)	/* 1Tbyte */
+
+/* Cache_t.HugePages values */
+enum {
+	kCacheHugePagesNone			=	0,
+	kCacheHugePagesExplicit		=	1,		/* Superpages reserved by the kernel */
+	kCacheHugePagesTransparent	=	2		/* Ordinary memory the VM may back with huge pages */
 };
 
 /*
@@ -55,17 +80,54 @@ enum {
 #define EOK					0
 
 #define BUF_SPAN	0x80000000	/* Buffer spans several cache blocks */
+#define BUF_DIRECT	0x40000000	/* Spanning buffer points into adjacent cache pages */
+#define BUF_MAPPED	0x20000000	/* Buffer points into the image file mapping */
+
+/* Access pattern hints (see CacheAdvise) */
+enum {
+	kCacheAdviseNormal		=	0,
+	kCacheAdviseSequential	=	1,		/* Scans, e.g. the volume bitmap */
+	kCacheAdviseRandom		=	2		/* B-tree descents */
+};
+
+/* Replacement policies (see CacheSetPolicy) */
+enum {
+	kCachePolicyLRU		=	0,		/* Plain LRU */
+	kCachePolicy2Q		=	1		/* 2Q; resists being flushed by scans */
+};
+
+/* LRUNode_t.Queue values */
+enum {
+	kLRUQueueNone		=	0,		/* Not yet referenced */
+	kLRUQueueMain		=	1,		/* LRU (2Q: Am) */
+	kLRUQueueIn			=	2,		/* 2Q: first reference FIFO (A1in) */
+	kLRUQueueOut		=	3		/* 2Q: ghost of a block evicted from A1in (A1out) */
+};
 
 typedef struct LRUNode_t
 {
 	struct LRUNode_t *	Next;	/* Next node in the LRU */
 	struct LRUNode_t *	Prev;	/* Previous node in the LRU */
+	uint32_t			Queue;	/* Queue the node belongs to */
 } LRUNode_t;
 
 typedef struct LRU_t
 {
 	LRUNode_t			Head;	/* Dummy node for the head of the LRU */
 	LRUNode_t			Busy;	/* List of busy nodes */
+
+	/*
+	 * 2Q replacement.  Blocks referenced once wait in the In queue and are
+	 * only moved to the main LRU if they are referenced again after being
+	 * evicted from it, while their tag is still remembered on the Out queue.
+	 */
+	uint32_t			Policy;		/* Replacement policy */
+	LRUNode_t			In;			/* Dummy node for the head of A1in */
+	LRUNode_t			Out;		/* Dummy node for the head of A1out */
+	uint32_t			InCount;	/* Tags on A1in (including busy ones) */
+	uint32_t			InMax;		/* Preferred maximum size of A1in */
+	uint32_t			OutCount;	/* Ghost tags on A1out */
+	uint32_t			OutMax;		/* Maximum number of ghost tags */
 } LRU_t;
 
 
@@ -103,8 +165,7 @@ typedef struct Tag_t
 {
 	LRUNode_t		LRU;	/* LRU specific data, must be first! */
 	
-	struct Tag_t *	Next;	/* Next tag in hash chain */
-	struct Tag_t *	Prev;	/* Previous tag in hash chain */
+	struct Tag_t *	Next;	/* Next tag on the free tag list */
 
 	uint32_t		Flags;	
 	uint32_t		Refs;	/* Reference count */
@@ -114,11 +175,106 @@ typedef struct Tag_t
 } Tag_t;
 
 
+/*
+ * TagSlab_t
+ *
+ *  A chunk of preallocated cache tags. The first slab is sized from the
+ *  number of cache blocks at CacheInit; more are chained on only if a tag
+ *  is ever needed while every slab entry is in use.
+ */
+typedef struct TagSlab_t
+{
+	struct TagSlab_t *	Next;	/* Next slab */
+	uint32_t			Count;	/* Number of tags in this slab */
+	Tag_t				Tags[1];	/* Tags (variable length) */
+} TagSlab_t;
+
+
 /* Tag_t.Flags bit settings */
 enum {
-	kLazyWrite		 = 0x00000001 	/* only write this page when evicting or forced */
+	kLazyWrite		 = 0x00000001, 	/* only write this page when evicting or forced */
+	kStreamRead		 = 0x00000002, 	/* only read by a sequential scan; don't promote */
+	kReadAhead		 = 0x00000004,	/* loaded by readahead, not yet asked for */
+	kReadPending	 = 0x00000008	/* readahead I/O still in progress (tag is busy) */
 };
 
+/*
+ * Trace files
+ *
+ *  CacheSetTrace records every read and write request made of the cache, so
+ *  that it can be replayed offline against other cache configurations (see
+ *  cachesim.c).  A trace is a CacheTraceHeader_t followed by
+ *  CacheTraceRecord_t's, in host byte order.  The first time a phase is
+ *  entered, a kCacheTracePhase record gives its name, which follows the
+ *  record padded with zeroes to a multiple of 8 bytes; phase 0 is "other".
+ */
+enum {
+	CacheTraceMagic		=	0x46435452,	/* 'FCTR' */
+	CacheTraceVersion	=	1,
+
+	/* CacheTraceRecord_t.Op */
+	kCacheTraceRead		=	1,		/* CacheRead; Flags are the read options */
+	kCacheTraceWrite	=	2,		/* CacheWrite; Flags are the write options */
+	kCacheTracePhase	=	3		/* Phase name; Length is its length */
+};
+
+typedef struct CacheTraceHeader_t
+{
+	uint32_t	Magic;			/* CacheTraceMagic */
+	uint32_t	Version;		/* CacheTraceVersion */
+	uint32_t	DevBlockSize;	/* Device block size */
+	uint32_t	BlockSize;		/* Cache configuration the trace was taken with */
+	uint32_t	TotalBlocks;
+	uint32_t	Policy;
+	uint64_t	Start;			/* Time the trace began (microseconds since 1970) */
+} CacheTraceHeader_t;
+
+typedef struct CacheTraceRecord_t
+{
+	uint64_t	Offset;			/* Start of the request */
+	uint32_t	Length;			/* Length of the request */
+	uint8_t		Op;				/* kCacheTraceRead, ... */
+	uint8_t		Phase;			/* Phase current at the time (see CacheSetPhase) */
+	uint16_t	Flags;			/* Read or write options */
+	uint64_t	Time;			/* Microseconds since the trace began */
+} CacheTraceRecord_t;
+
+/*
+ * CacheStats_t
+ *
+ *  A snapshot of the cache counters.  Latency[i] counts disk I/Os that took
+ *  less than 2^i microseconds (Latency[0] those under 1us); the last bucket
+ *  also holds everything slower.
+ */
+typedef struct CacheStats_t
+{
+	uint64_t	ReqRead;		/* Read requests */
+	uint64_t	ReqWrite;		/* Write requests */
+	uint64_t	Hits;			/* Cache blocks found in the cache by a read */
+	uint64_t	Misses;			/* Cache blocks a read had to load */
+	uint64_t	DiskRead;		/* Disk reads */
+	uint64_t	DiskWrite;		/* Disk writes */
+	uint64_t	BytesRead;		/* Bytes read from disk */
+	uint64_t	BytesWritten;	/* Bytes written to disk */
+	uint64_t	Evictions;		/* Cache blocks evicted */
+	uint64_t	Span;			/* Spanning reads served without a copy */
+	uint64_t	SpanCopy;		/* Spanning reads that needed a copy */
+	uint64_t	RAIssued;		/* Blocks read ahead */
+	uint64_t	RAHit;			/* Blocks read ahead, then asked for */
+	uint64_t	Latency[CacheLatencyBuckets];
+} CacheStats_t;
+
+/*
+ * CachePhase_t
+ *
+ *  Counters accumulated while a named phase was current.
+ */
+typedef struct CachePhase_t
+{
+	const char *	Name;
+	CacheStats_t	Stats;
+} CachePhase_t;
+
 /*
  * Cache_t
  *
@@ -135,24 +291,77 @@ typedef struct Cache_t
 	int		FD_R;		/* File descriptor (read-only) */
 	int		FD_W;		/* File descriptor (write-only) */
 	uint32_t	DevBlockSize;	/* Device block size */
+
+	/*
+	 * Read-only image files are mapped instead of cached; reads then
+	 * return pointers into the mapping (privately, so that buffers can
+	 * still be byte swapped in place).
+	 */
+	void *		Map;		/* Mapping of the whole file (NULL if not mapped) */
+	uint64_t	MapSize;	/* Size of the mapping */
+	int		Advice;		/* Current access pattern hint */
 	
-	Tag_t **	Hash;		/* Lookup hash table (move to front) */
-	uint32_t	HashSize;	/* Size of the hash table */
+	Tag_t **	Hash;		/* Lookup hash table (open addressing) */
+	uint32_t	HashSize;	/* Size of the hash table (power of two) */
+	uint32_t	HashShift;	/* 64 - log2(HashSize) */
+	uint32_t	HashCount;	/* Number of tags in the hash table */
 	uint32_t	BlockSize;	/* Size of the cache page */
+	uint32_t	TotalBlocks;	/* Number of cache pages */
+
+	TagSlab_t *	TagSlabs;	/* Preallocated tag storage */
+	Tag_t *		FreeTags;	/* List of unused tags */
 
+	void *		Arena;		/* Cache memory */
+	uint64_t	ArenaSize;	/* Size of the Arena mapping */
+	int		HugePages;	/* How the Arena is backed (kCacheHugePages...) */
+	Tag_t **	PageTags;	/* Tag owning each cache page (NULL if free) */
+	struct ReadAhead_t *	ReadAhead;	/* Readahead state (NULL if disabled) */
+	void *		SwapBlock;	/* Scratch page for exchanging two cache pages */
 	void *		FreeHead;	/* Head of the free list */
 	uint32_t	FreeSize;	/* Size of the free list */
 
+	uint32_t	StreamCluster;	/* Size of stream read clusters (0 = off) */
+
+	uint32_t	DirtyCount;	/* Blocks marked for lazy write */
+	uint32_t	DirtyMax;	/* Flush once there are more dirty blocks (0 = no limit) */
+
 	Buf_t *		ActiveBufs;	/* List of active buffers */
 	Buf_t *		FreeBufs;	/* List of free buffers */
 
-	uint32_t	ReqRead;	/* Number of read requests */
-	uint32_t	ReqWrite;	/* Number of write requests */
+	uint64_t	ReqRead;	/* Number of read requests */
+	uint64_t	ReqWrite;	/* Number of write requests */
 	
-	uint32_t	DiskRead;	/* Number of actual disk reads */
-	uint32_t	DiskWrite;	/* Number of actual disk writes */
+	uint64_t	Hits;		/* Cache blocks found in the cache by a read */
+	uint64_t	Misses;		/* Cache blocks a read had to load */
+
+	uint64_t	DiskRead;	/* Number of actual disk reads */
+	uint64_t	DiskWrite;	/* Number of actual disk writes */
+	uint64_t	BytesRead;	/* Bytes read from disk */
+	uint64_t	BytesWritten;	/* Bytes written to disk */
+	uint64_t	Evictions;	/* Cache blocks evicted */
+
+	uint64_t	Span;		/* Spanning requests served without a copy */
+	uint64_t	SpanCopy;	/* Spanning requests that needed a copy */
+	uint64_t	Relocate;	/* Cache pages moved to make a span contiguous */
+
+	uint64_t	RAIssued;	/* Blocks read ahead */
+	uint64_t	RAHit;		/* Blocks read ahead that were then asked for */
+	uint64_t	RAWaste;	/* Blocks read ahead but dropped without being used */
+
+	uint64_t	Clustered;	/* Blocks loaded by stream clusters beyond the request */
+
+	uint64_t	DirtyFlush;	/* Flushes forced by DirtyMax */
+
+	uint64_t	Latency[CacheLatencyBuckets];	/* Disk I/O times (see CacheStats_t) */
 
-	uint32_t	Span;		/* Requests that spanned cache blocks */
+	/* Per-phase breakdown of the counters */
+	CachePhase_t	Phases[CacheMaxPhases];	/* Phases[0] is everything else */
+	uint32_t	PhaseCount;	/* Phases in use */
+	uint32_t	Phase;		/* Current phase */
+	CacheStats_t	PhaseMark;	/* Counters when the current phase began */
+
+	FILE *		Trace;		/* Request trace (NULL if not tracing) */
+	uint64_t	TraceStart;	/* Time the trace began */
 } Cache_t;
 
 extern Cache_t fscache;
@@ -161,19 +370,99 @@ extern Cache_t fscache;
  * CalculateCacheSizes
  *
  * Determine the cache size values (block size and total blocks) that should
- * be used to initialize the cache.
+ * be used to initialize the cache.  userBlockSize is the cache block size
+ * wanted (e.g. the volume's B-tree node size), or zero for the default.
  */
-void CalculateCacheSizes(uint64_t userCacheSize, uint32_t *calcBlockSize, uint32_t *calcTotalBlocks, 
-					   char debug);
+void CalculateCacheSizes(uint64_t userCacheSize, uint32_t userBlockSize, uint32_t *calcBlockSize,
+					   uint32_t *calcTotalBlocks, char debug);
 /*
  * CacheInit
  *
- *  Initializes the cache for use.
+ *  Initializes the cache for use.  hashSize is a lower bound; the lookup
+ *  table is grown to a power of two that keeps it at most half full.
+ *
+ *  If there is no fdWrite and fdRead is a regular file (a disk image being
+ *  verified), the file is mapped and no cache memory is allocated.
+ *  Otherwise the cache memory is backed by huge pages where the system has
+ *  them, and is prepared (and with preTouch, faulted in) by several threads
+ *  when it is large.
  */
 int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
-               uint32_t cacheBlockSize, uint32_t cacheSize, uint32_t hashSize,
+               uint32_t cacheBlockSize, uint32_t cacheTotalBlocks, uint32_t hashSize,
                int preTouch);
 
+/*
+ * CacheSetPolicy
+ *
+ *  Selects the replacement policy.  Must be called before the first read.
+ */
+int CacheSetPolicy (Cache_t *cache, int policy);
+
+/*
+ * CacheSetReadAhead
+ *
+ *  Starts asynchronous readahead of sequential and strided reads, keeping up
+ *  to window cache blocks per stream in flight on the given number of I/O
+ *  threads.  A window of zero leaves readahead off.
+ */
+int CacheSetReadAhead (Cache_t *cache, uint32_t window, uint32_t threads);
+
+/*
+ * CacheSetStreamCluster
+ *
+ *  Has stream reads (kStreamRead) that miss load the following blocks too,
+ *  up to the next multiple of bytes, in a single I/O.  Zero, or anything
+ *  not bigger than the cache block size, turns clustering off.
+ */
+int CacheSetStreamCluster (Cache_t *cache, uint32_t bytes);
+
+/*
+ * CacheSetDirtyLimit
+ *
+ *  Caps the amount of lazy write data held by the cache; writing past the
+ *  cap flushes the cache.  Zero (the default) means no cap.
+ */
+int CacheSetDirtyLimit (Cache_t *cache, uint64_t bytes);
+
+/*
+ * CacheGetStats
+ *
+ *  Takes a snapshot of the cache counters.
+ */
+void CacheGetStats (Cache_t *cache, CacheStats_t *stats);
+
+/*
+ * CacheSetPhase
+ *
+ *  Charges the cache activity from now on to the named phase, until the
+ *  next call.  A NULL name means no phase in particular ("other").  The
+ *  name must stay valid for the life of the cache.
+ */
+void CacheSetPhase (Cache_t *cache, const char *name);
+
+/*
+ * CacheWriteReport
+ *
+ *  Writes the cache configuration and per-phase counters as JSON.
+ */
+int CacheWriteReport (Cache_t *cache, FILE *fp);
+
+/*
+ * CacheSetTrace
+ *
+ *  Starts recording every read and write request to fp, which the caller
+ *  closes after CacheDestroy.  A NULL fp stops recording.
+ */
+int CacheSetTrace (Cache_t *cache, FILE *fp);
+
+/*
+ * CacheAdvise
+ *
+ *  Tells the cache how it is about to be read, for the benefit of a mapped
+ *  image.  Returns the previous hint, so that it can be restored.
+ */
+int CacheAdvise (Cache_t *cache, int advice);
+
 /*
  * CacheDestroy
  * 
@@ -187,12 +476,23 @@ int CacheDestroy (Cache_t *cache);
  *  Reads a range of bytes from the cache, returning a pointer to a buffer
  *  containing the requested bytes.
  *
- *  NOTE: The returned buffer may directly refer to a cache block, or an
- *        anonymous buffer. Do not make any assumptions about the nature of
- *        the returned buffer, except that it is contiguous.
+ *  NOTE: The returned buffer may directly refer to one or more cache blocks,
+ *        or an anonymous buffer. Do not make any assumptions about the nature
+ *        of the returned buffer, except that it is contiguous.
  */
 int CacheRead (Cache_t *cache, uint64_t start, uint32_t len, Buf_t **buf);
 
+/*
+ * CacheReadOptions
+ *
+ *  Same as CacheRead.  If readOptions contains kStreamRead, blocks that
+ *  were not already cached are treated as part of a one-time scan.  Under
+ *  the 2Q policy they can then never displace the main LRU; plain LRU
+ *  ignores the hint.
+ */
+int CacheReadOptions (Cache_t *cache, uint64_t start, uint32_t len,
+                      uint32_t readOptions, Buf_t **buf);
+
 /* 
  * CacheWrite
  *
@@ -225,7 +525,8 @@ int CacheEvict (Cache_t *cache, Tag_t *tag);
 /*
  * CacheFlush
  *
- *  Write out any blocks that are marked for lazy write.
+ *  Write out any blocks that are marked for lazy write, in disk order,
+ *  merging adjacent blocks into larger writes.
  */
 int 
 CacheFlush( Cache_t *cache );
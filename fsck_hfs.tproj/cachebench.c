@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * fsck_cachebench
+ *
+ *  Times cache block lookups against the number of blocks in the cache,
+ *  to show that the cost of one does not grow with cacheTotalBlocks.  For
+ *  each cache size, the cache is filled, and then:
+ *
+ *	hits	CacheLookup of blocks in the cache, in a scattered order;
+ *	misses	CacheRead and CacheRelease of blocks never read before, each
+ *		evicting the least recently used block.
+ *
+ *  The disk is a sparse scratch file, so a miss costs a read of a hole
+ *  (a system call, but no I/O) besides the lookup and the eviction.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+#define MAXCONFIGS	16
+
+char *progname = "fsck_cachebench";
+
+/* Not in cache.h; the cache uses it for every read */
+extern int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag);
+
+static void usage(void);
+static int Bench(int fd, uint32_t blockSize, uint32_t blocks, uint32_t lookups);
+static double Seconds(void);
+
+/* A scattering of the numbers below a power of two, each taken once */
+#define SCATTER(i, mask)	(((uint64_t)(i) * 2654435761ULL) & (mask))
+
+int
+main(int argc, char **argv)
+{
+	uint32_t	counts[MAXCONFIGS] = { 1024, 8192, 65536, 262144, 1048576 };
+	int			nCounts = 5;
+	uint32_t	blockSize = 4096;
+	uint32_t	lookups = 1000000;
+	char		scratch[] = "/tmp/fsck_cachebench.XXXXXX";
+	char *		lastChar;
+	int			fd;
+	int			ch;
+	int			i;
+	int			errors = 0;
+
+	while ((ch = getopt(argc, argv, "b:n:")) != EOF) {
+		switch (ch) {
+		case 'b':
+			blockSize = strtoul(optarg, &lastChar, 0);
+			if (*lastChar == 'k' || *lastChar == 'K') {
+				blockSize *= 1024;
+				lastChar++;
+			}
+			if (*lastChar || blockSize < 512 || (blockSize & (blockSize - 1)) != 0)
+				usage();
+			break;
+
+		case 'n':
+			lookups = strtoul(optarg, &lastChar, 0);
+			if (*lastChar || lookups == 0)
+				usage();
+			break;
+
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > MAXCONFIGS)
+		usage();
+	if (argc > 0) {
+		for (nCounts = 0; nCounts < argc; nCounts++) {
+			counts[nCounts] = strtoul(argv[nCounts], &lastChar, 0);
+			if (*lastChar || counts[nCounts] == 0)
+				usage();
+		}
+	}
+
+	/* A sparse file standing in for the disk */
+	if ((fd = mkstemp(scratch)) == -1) {
+		fprintf(stderr, "%s: can't create %s: %s\n", progname, scratch, strerror(errno));
+		exit(1);
+	}
+	(void) unlink(scratch);
+
+	printf("%u lookups of %uK blocks\n", lookups, blockSize / 1024);
+	printf("%10s %10s %12s %12s\n", "blocks", "cache", "hit ns", "miss ns");
+	for (i = 0; i < nCounts; i++) {
+		if (Bench(fd, blockSize, counts[i], lookups) != 0)
+			errors++;
+	}
+
+	close(fd);
+	exit(errors ? 1 : 0);
+}
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s [-b size] [-n lookups] [blocks ...]\n", progname);
+	fprintf(stderr, "  b size = cache block size (default 4k)\n");
+	fprintf(stderr, "  n lookups = lookups timed of each kind (default 1000000)\n");
+	fprintf(stderr, "  blocks = cache sizes, in cache blocks (default 1024 8192 65536 262144 1048576)\n");
+	exit(1);
+}
+
+/*
+ * Bench
+ *
+ *  Times the hits and misses of one cache size and prints them.
+ */
+static int
+Bench(int fd, uint32_t blockSize, uint32_t blocks, uint32_t lookups)
+{
+	Cache_t		cache;
+	Tag_t *		tag;
+	Buf_t *		buf;
+	uint64_t	mask;
+	uint64_t	span;
+	uint64_t	i;
+	double		start;
+	double		hitTime;
+	double		missTime;
+	int			error;
+
+	/* Misses are taken from the blocks after the cached ones */
+	for (span = 1; span < lookups; span <<= 1)
+		continue;
+	if (ftruncate(fd, ((uint64_t)blocks + span) * blockSize) != 0) {
+		fprintf(stderr, "%s: can't size the scratch file: %s\n", progname, strerror(errno));
+		return (-1);
+	}
+	if ((error = CacheInit(&cache, fd, fd, 512, blockSize, blocks, CacheHashSize, 0)) != EOK) {
+		fprintf(stderr, "%s: can't set up a cache of %u x %u: %s\n",
+		        progname, blocks, blockSize, strerror(error));
+		return (-1);
+	}
+
+	/* Fill the cache */
+	for (i = 0; i < blocks; i++) {
+		if ((error = CacheRead(&cache, i * blockSize, blockSize, &buf)) != EOK ||
+		    (error = CacheRelease(&cache, buf, 0)) != EOK)
+			goto fail;
+	}
+
+	/* Hits, scattered over the cached blocks */
+	for (mask = 1; mask < blocks; mask <<= 1)
+		continue;
+	mask--;
+	start = Seconds();
+	for (i = 0; i < lookups; i++) {
+		if ((error = CacheLookup(&cache, (SCATTER(i, mask) % blocks) * blockSize, &tag)) != EOK)
+			goto fail;
+	}
+	hitTime = Seconds() - start;
+	if (cache.Misses != blocks) {
+		fprintf(stderr, "%s: %llu misses looking up cached blocks\n",
+		        progname, (unsigned long long)(cache.Misses - blocks));
+		(void) CacheDestroy(&cache);
+		return (-1);
+	}
+
+	/* Misses, each a block not read before */
+	start = Seconds();
+	for (i = 0; i < lookups; i++) {
+		if ((error = CacheRead(&cache, (blocks + SCATTER(i, span - 1)) * blockSize,
+		                       blockSize, &buf)) != EOK ||
+		    (error = CacheRelease(&cache, buf, 0)) != EOK)
+			goto fail;
+	}
+	missTime = Seconds() - start;
+
+	printf("%10u %9lluM %12.1f %12.1f\n", blocks,
+	       (unsigned long long)blockSize * blocks / (1024 * 1024),
+	       hitTime * 1e9 / lookups, missTime * 1e9 / lookups);
+
+	(void) CacheDestroy(&cache);
+	return (0);
+
+fail:
+	fprintf(stderr, "%s: lookup failed in a cache of %u x %u: %s\n",
+	        progname, blocks, blockSize, strerror(error));
+	(void) CacheDestroy(&cache);
+	return (-1);
+}
+
+static double
+Seconds(void)
+{
+	struct timeval	tv;
+
+	(void) gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
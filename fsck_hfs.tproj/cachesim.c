@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2008 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * fsck_cachesim
+ *
+ *  Replays a cache request trace recorded by fsck_hfs -T against other
+ *  cache configurations, using the cache code itself, and reports hit
+ *  rates and a modelled I/O time for each.  The disk is a sparse scratch
+ *  file, so only the pattern of requests matters, not the data.
+ *
+ *  Each read in the trace is replayed as a read and an immediate release;
+ *  each write as a read of the same range (not counted as a request) and a
+ *  write.  Modelled time charges every disk I/O the access time, plus the
+ *  bytes moved at the transfer rate.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+#define MAXCONFIGS	16
+
+char *progname = "fsck_cachesim";
+
+/* The trace, read into memory */
+static CacheTraceHeader_t	header;
+static CacheTraceRecord_t *	records;
+static uint64_t				recordCount;
+static char *				phaseNames[CacheMaxPhases];
+static uint64_t				extent;		/* End of the furthest request */
+
+static void usage(void);
+static int ParseList(const char *arg, uint64_t *values, int max, int sizes);
+static int LoadTrace(const char *path);
+static int Replay(int fd, uint32_t blockSize, uint32_t blocks, int policy,
+                  uint32_t window, int phases);
+static double Seconds(void);
+
+/* Model parameters */
+static double accessTime = 0.005;	/* seconds per disk I/O */
+static double transferRate = 100.0;	/* MB per second */
+
+int
+main(int argc, char **argv)
+{
+	uint64_t	blockSizes[MAXCONFIGS];
+	uint64_t	cacheSizes[MAXCONFIGS];
+	uint64_t	policies[MAXCONFIGS];
+	int			nBlockSizes = 0;
+	int			nCacheSizes = 0;
+	int			nPolicies = 0;
+	uint64_t	maxBlockSize = 0;
+	uint32_t	window = 0;
+	int			phases = 0;
+	char		scratch[] = "/tmp/fsck_cachesim.XXXXXX";
+	char *		lastChar;
+	int			fd;
+	int			ch;
+	int			b, c, p;
+	int			errors = 0;
+
+	while ((ch = getopt(argc, argv, "a:b:c:C:ps:t:")) != EOF) {
+		switch (ch) {
+		case 'a':
+			window = strtoul(optarg, &lastChar, 0);
+			if (*lastChar)
+				usage();
+			break;
+
+		case 'b':
+			if ((nBlockSizes = ParseList(optarg, blockSizes, MAXCONFIGS, 1)) <= 0)
+				usage();
+			break;
+
+		case 'c':
+			if ((nCacheSizes = ParseList(optarg, cacheSizes, MAXCONFIGS, 1)) <= 0)
+				usage();
+			break;
+
+		case 'C':
+			if ((nPolicies = ParseList(optarg, policies, MAXCONFIGS, 0)) <= 0)
+				usage();
+			break;
+
+		case 'p':
+			phases++;
+			break;
+
+		case 's':
+			/* Access time, in microseconds */
+			accessTime = strtod(optarg, &lastChar) / 1000000.0;
+			if (*lastChar)
+				usage();
+			break;
+
+		case 't':
+			/* Transfer rate, in MB/s */
+			transferRate = strtod(optarg, &lastChar);
+			if (*lastChar || transferRate <= 0)
+				usage();
+			break;
+
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if (LoadTrace(argv[0]) != 0)
+		exit(1);
+
+	/* By default, replay the configuration the trace was taken with */
+	if (nBlockSizes == 0) {
+		blockSizes[0] = header.BlockSize;
+		nBlockSizes = 1;
+	}
+	if (nCacheSizes == 0) {
+		cacheSizes[0] = (uint64_t)header.BlockSize * header.TotalBlocks;
+		nCacheSizes = 1;
+	}
+	if (nPolicies == 0) {
+		policies[0] = kCachePolicyLRU;
+		policies[1] = kCachePolicy2Q;
+		nPolicies = 2;
+	}
+
+	/* A sparse file standing in for the disk, long enough for every block size */
+	for (b = 0; b < nBlockSizes; b++) {
+		if (blockSizes[b] > maxBlockSize)
+			maxBlockSize = blockSizes[b];
+	}
+	if ((fd = mkstemp(scratch)) == -1) {
+		fprintf(stderr, "%s: can't create %s: %s\n", progname, scratch, strerror(errno));
+		exit(1);
+	}
+	(void) unlink(scratch);
+	if (ftruncate(fd, (extent + maxBlockSize - 1) / maxBlockSize * maxBlockSize) != 0) {
+		fprintf(stderr, "%s: can't size %s: %s\n", progname, scratch, strerror(errno));
+		exit(1);
+	}
+
+	printf("%8s %8s %6s %7s %10s %10s %10s %10s %9s %9s\n",
+	       "block", "cache", "policy", "hit%", "disk reads", "disk writes",
+	       "MB read", "MB written", "model(s)", "replay(s)");
+	for (b = 0; b < nBlockSizes; b++) {
+		for (c = 0; c < nCacheSizes; c++) {
+			for (p = 0; p < nPolicies; p++) {
+				if (Replay(fd, blockSizes[b], cacheSizes[c] / blockSizes[b],
+				           policies[p], window, phases) != 0)
+					errors++;
+			}
+		}
+	}
+
+	close(fd);
+	exit(errors ? 1 : 0);
+}
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: %s [-a blocks] [-b sizes] [-c sizes] [-C policies] [-p] [-s usec] [-t MB/s] trace\n", progname);
+	fprintf(stderr, "  a blocks = readahead window (default 0, off)\n");
+	fprintf(stderr, "  b sizes = cache block sizes, comma separated (ex. 16k,32k,64k)\n");
+	fprintf(stderr, "  c sizes = cache sizes, comma separated (ex. 32m,256m)\n");
+	fprintf(stderr, "  C policies = replacement policies, comma separated (lru, 2q)\n");
+	fprintf(stderr, "  p = also report each check phase\n");
+	fprintf(stderr, "  s usec = modelled access time per disk I/O (default 5000)\n");
+	fprintf(stderr, "  t MB/s = modelled transfer rate (default 100)\n");
+	fprintf(stderr, "Block and cache sizes default to those the trace was taken with.\n");
+	exit(1);
+}
+
+/*
+ * ParseList
+ *
+ *  Parses a comma separated list of sizes (with an optional k, m or g
+ *  suffix) or of policy names into values.  Returns how many there were,
+ *  or -1 if the list is bad.
+ */
+static int
+ParseList(const char *arg, uint64_t *values, int max, int sizes)
+{
+	char		buf[256];
+	char *		next = buf;
+	char *		item;
+	char *		lastChar;
+	int			count = 0;
+
+	(void) snprintf(buf, sizeof(buf), "%s", arg);
+	while ((item = strsep(&next, ",")) != NULL) {
+		if (count == max)
+			return (-1);
+		if (!sizes) {
+			if (strcasecmp(item, "lru") == 0)
+				values[count] = kCachePolicyLRU;
+			else if (strcasecmp(item, "2q") == 0)
+				values[count] = kCachePolicy2Q;
+			else
+				return (-1);
+		} else {
+			values[count] = strtoull(item, &lastChar, 0);
+			switch (tolower(*lastChar)) {
+				case 'g':
+					values[count] *= 1024ULL;
+					/* fall through */
+				case 'm':
+					values[count] *= 1024ULL;
+					/* fall through */
+				case 'k':
+					values[count] *= 1024ULL;
+					lastChar++;
+					break;
+			}
+			if (*lastChar || values[count] == 0)
+				return (-1);
+		}
+		count++;
+	}
+
+	return (count);
+}
+
+/*
+ * LoadTrace
+ *
+ *  Reads the whole trace into memory, collecting the phase names and the
+ *  extent of the requests on the way.
+ */
+static int
+LoadTrace(const char *path)
+{
+	CacheTraceRecord_t	rec;
+	uint64_t			alloc = 0;
+	uint64_t			reads = 0;
+	uint64_t			writes = 0;
+	char				name[256];
+	uint32_t			padded;
+	FILE *				fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "%s: can't open %s: %s\n", progname, path, strerror(errno));
+		return (-1);
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.Magic != CacheTraceMagic || header.Version != CacheTraceVersion ||
+	    header.BlockSize == 0 || header.DevBlockSize == 0) {
+		fprintf(stderr, "%s: %s is not a cache trace from this machine\n", progname, path);
+		fclose(fp);
+		return (-1);
+	}
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		switch (rec.Op) {
+		case kCacheTracePhase:
+			padded = (rec.Length + 7) & ~7;
+			if (padded >= sizeof(name) || fread(name, 1, padded, fp) != padded)
+				goto Bad;
+			name[rec.Length] = '\0';
+			if (rec.Phase > 0 && rec.Phase < CacheMaxPhases && phaseNames[rec.Phase] == NULL)
+				phaseNames[rec.Phase] = strdup(name);
+			continue;
+
+		case kCacheTraceRead:
+			reads++;
+			break;
+
+		case kCacheTraceWrite:
+			writes++;
+			break;
+
+		default:
+			goto Bad;
+		}
+
+		if (rec.Phase >= CacheMaxPhases || rec.Length == 0)
+			goto Bad;
+		if (recordCount == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			if ((records = realloc(records, alloc * sizeof(rec))) == NULL) {
+				fprintf(stderr, "%s: out of memory\n", progname);
+				fclose(fp);
+				return (-1);
+			}
+		}
+		records[recordCount++] = rec;
+		if (rec.Offset + rec.Length > extent)
+			extent = rec.Offset + rec.Length;
+	}
+	if (ferror(fp))
+		goto Bad;
+	fclose(fp);
+
+	printf("%s: %llu reads, %llu writes over %.1f seconds, traced with %u x %u byte blocks (%s)\n",
+	       path, (unsigned long long)reads, (unsigned long long)writes,
+	       recordCount ? records[recordCount - 1].Time / 1000000.0 : 0.0,
+	       header.TotalBlocks, header.BlockSize,
+	       header.Policy == kCachePolicy2Q ? "2q" : "lru");
+	return (0);
+
+Bad:
+	fprintf(stderr, "%s: %s is truncated or damaged\n", progname, path);
+	fclose(fp);
+	return (-1);
+}
+
+/*
+ * Replay
+ *
+ *  Runs the trace through one cache configuration and prints the result.
+ */
+static int
+Replay(int fd, uint32_t blockSize, uint32_t blocks, int policy,
+       uint32_t window, int phases)
+{
+	Cache_t				cache;
+	CacheStats_t		stats;
+	CacheTraceRecord_t *	rec;
+	Buf_t *				buf;
+	uint64_t			hits;
+	uint64_t			reqRead;
+	uint64_t			i;
+	uint32_t			phase = 0;
+	double				start;
+	double				elapsed;
+	double				model;
+	int					error;
+
+	if (blockSize < header.DevBlockSize || (blockSize & (blockSize - 1)) != 0 || blocks == 0) {
+		fprintf(stderr, "%s: can't simulate %u blocks of %u bytes\n", progname, blocks, blockSize);
+		return (-1);
+	}
+	if ((error = CacheInit(&cache, fd, fd, header.DevBlockSize, blockSize, blocks,
+	                       CacheHashSize, 0)) != EOK ||
+	    (error = CacheSetPolicy(&cache, policy)) != EOK ||
+	    (error = CacheSetReadAhead(&cache, window, DefaultReadAheadThreads)) != EOK ||
+	    (error = CacheSetStreamCluster(&cache, DefaultStreamCluster)) != EOK) {
+		fprintf(stderr, "%s: can't set up a cache of %u x %u: %s\n",
+		        progname, blocks, blockSize, strerror(error));
+		return (-1);
+	}
+
+	start = Seconds();
+	for (i = 0, rec = records; i < recordCount; i++, rec++) {
+		if (rec->Phase != phase) {
+			phase = rec->Phase;
+			CacheSetPhase(&cache, phase ? phaseNames[phase] : NULL);
+		}
+
+		if (rec->Op == kCacheTraceRead) {
+			error = CacheReadOptions(&cache, rec->Offset, rec->Length, rec->Flags, &buf);
+			if (error == EOK)
+				error = CacheRelease(&cache, buf, 0);
+		} else {
+			/* The write's own read was traced when the block was first read */
+			hits = cache.Hits;
+			reqRead = cache.ReqRead;
+			error = CacheRead(&cache, rec->Offset, rec->Length, &buf);
+			cache.Hits = hits;
+			cache.ReqRead = reqRead;
+			if (error == EOK)
+				error = CacheWrite(&cache, buf, 0, rec->Flags);
+		}
+		if (error != EOK) {
+			fprintf(stderr, "%s: replay failed at record %llu: %s\n",
+			        progname, (unsigned long long)i, strerror(error));
+			(void) CacheDestroy(&cache);
+			return (-1);
+		}
+	}
+	CacheSetPhase(&cache, NULL);
+	(void) CacheFlush(&cache);
+	elapsed = Seconds() - start;
+
+	CacheGetStats(&cache, &stats);
+	model = (stats.DiskRead + stats.DiskWrite) * accessTime +
+	        (stats.BytesRead + stats.BytesWritten) / (transferRate * 1024 * 1024);
+	printf("%7uK %7lluM %6s %6.2f%% %10llu %10llu %10.1f %10.1f %9.2f %9.2f\n",
+	       blockSize / 1024, (unsigned long long)blockSize * blocks / (1024 * 1024),
+	       policy == kCachePolicy2Q ? "2q" : "lru",
+	       stats.Hits + stats.Misses ? 100.0 * stats.Hits / (stats.Hits + stats.Misses) : 0.0,
+	       (unsigned long long)stats.DiskRead, (unsigned long long)stats.DiskWrite,
+	       stats.BytesRead / 1048576.0, stats.BytesWritten / 1048576.0, model, elapsed);
+
+	if (phases) {
+		for (i = 1; i <= cache.PhaseCount; i++) {
+			const CachePhase_t *ph = &cache.Phases[i % cache.PhaseCount];
+
+			model = (ph->Stats.DiskRead + ph->Stats.DiskWrite) * accessTime +
+			        (ph->Stats.BytesRead + ph->Stats.BytesWritten) / (transferRate * 1024 * 1024);
+			printf("%24s %6.2f%% %10llu %10llu %10.1f %10.1f %9.2f\n", ph->Name,
+			       ph->Stats.Hits + ph->Stats.Misses ?
+			           100.0 * ph->Stats.Hits / (ph->Stats.Hits + ph->Stats.Misses) : 0.0,
+			       (unsigned long long)ph->Stats.DiskRead, (unsigned long long)ph->Stats.DiskWrite,
+			       ph->Stats.BytesRead / 1048576.0, ph->Stats.BytesWritten / 1048576.0, model);
+		}
+	}
+
+	(void) CacheDestroy(&cache);
+	return (0);
+}
+
+static double
+Seconds(void)
+{
+	struct timeval	tv;
+
+	(void) gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
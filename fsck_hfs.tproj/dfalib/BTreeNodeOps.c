@@ -51,6 +51,7 @@
 //	DeleteRecord		- Deletes a record from a BTree node.
 //
 //	SearchNode			- Return index for record that matches key.
+//	SearchIndexNode		- Search an index node without swapping it.
 //	LocateRecord		- Return pointer to key and data, and size of data.
 //
 //	GetNodeDataSize		- Return the amount of space used for data in the node.
@@ -668,6 +669,119 @@ Boolean		SearchNode		(BTreeControlBlockPtr	 btreePtr,
 }
 
 
+
+/*-------------------------------------------------------------------------------
+
+Routine:	SearchIndexNode	-	Search an index node without swapping it.
+
+Function:	Gets an index node as it is in the cache, in big endian order, and
+			picks the record to descend through as SearchTree does: the record
+			that matches the search key, else the one before the insert index.
+			Only the keys the binary search compares, and the child node number
+			of the record picked, are swapped (by hfs_swap_BTIndexRecord); the
+			node is released untouched, so the rest of it is never swapped to
+			host order and back again.  Used by SearchTree with -L.
+
+Input:		btreePtr	- pointer to BTree control block
+			nodeNum		- number of node to search
+			height		- height the node should be at
+			searchKey	- pointer to the key to match
+
+Output:		index		- index of the record picked
+			childNode	- child node number of the record picked
+
+Result:		noErr		- success
+			!= noErr	- the node could not be searched this way; the caller
+						  should get it with GetNode, which reports any damage
+-------------------------------------------------------------------------------*/
+
+OSStatus	SearchIndexNode		(BTreeControlBlockPtr	 btreePtr,
+								 UInt32					 nodeNum,
+								 UInt8					 height,
+								 KeyPtr					 searchKey,
+								 UInt16					*returnIndex,
+								 UInt32					*childNode )
+{
+	OSStatus	err;
+	NodeRec		nodeRec;
+	NodeDescPtr	node;
+	BTreeKey	trialKey;
+	SInt32		lowerBound;
+	SInt32		upperBound;
+	SInt32		index;
+	SInt32		result;
+	SInt32		lastIndex;			// index of the last key swapped
+	UInt32		lastChild;			// and its child node number
+	Boolean		found;
+#if !SupportsKeyDescriptors
+	KeyCompareProcPtr	compareProc = btreePtr->keyCompareProc;
+#endif	
+
+	if (nodeNum == 0 || nodeNum >= btreePtr->totalNodes)
+		return fsBTInvalidNodeErr;
+
+	err = btreePtr->getBlockProc (btreePtr->fcbPtr, nodeNum, kGetBlock, &nodeRec);
+	if (err != noErr)
+		return err;
+	++btreePtr->numGetNodes;
+
+	//	kind and height are single bytes, so need no swapping
+	node = nodeRec.buffer;
+	if (node->kind != kBTIndexNode || node->height != height)
+	{
+		err = fsBTInvalidNodeErr;
+		goto ReleaseAndExit;
+	}
+
+	lowerBound = 0;
+	upperBound = SWAP_BE16 (node->numRecords) - 1;
+	lastIndex = -1;
+	lastChild = 0;
+	found = false;
+	
+	while (lowerBound <= upperBound)
+	{
+		index = (lowerBound + upperBound) >> 1;		// divide by 2
+		
+		err = hfs_swap_BTIndexRecord (&nodeRec, btreePtr->fcbPtr, index, &trialKey, &lastChild);
+		if (err != noErr)
+			goto ReleaseAndExit;
+		lastIndex = index;
+		
+	#if SupportsKeyDescriptors
+		result = CompareKeys (btreePtr, searchKey, (KeyPtr) &trialKey);
+	#else
+		result = compareProc(searchKey, (KeyPtr) &trialKey);
+	#endif
+		
+		if		(result <  0)		upperBound = index - 1;		// search < trial
+		else if (result >  0)		lowerBound = index + 1;		// search > trial
+		else													// search = trial
+		{
+			found = true;
+			break;
+		}
+	}
+	
+	if (found)
+		index = lastIndex;
+	else if ((index = lowerBound) != 0)		// the record before the insert index
+		--index;
+	
+	*returnIndex = index;
+	if (index == lastIndex)
+		*childNode = lastChild;
+	else
+		err = hfs_swap_BTIndexRecord (&nodeRec, btreePtr->fcbPtr, index, &trialKey, childNode);
+
+ReleaseAndExit:
+	(void) btreePtr->releaseBlockProc (btreePtr->fcbPtr, &nodeRec, kReleaseBlock);
+	++btreePtr->numReleaseNodes;
+
+	return err;
+}
+
+
 /*-------------------------------------------------------------------------------
 
 Routine:	GetRecordByIndex	-	Return pointer to key and data, and size of data.
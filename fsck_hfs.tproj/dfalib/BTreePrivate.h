@@ -365,6 +365,13 @@ Boolean		SearchNode				(BTreeControlBlockPtr	 btree,
 									 KeyPtr					 searchKey,
 									 UInt16					*index );
 
+OSStatus	SearchIndexNode			(BTreeControlBlockPtr	 btree,
+									 UInt32					 nodeNum,
+									 UInt8					 height,
+									 KeyPtr					 searchKey,
+									 UInt16					*index,
+									 UInt32					*childNode );
+
 OSStatus	GetRecordByIndex		(BTreeControlBlockPtr	 btree,
 									 NodeDescPtr			 node,
 									 UInt16					 index,
@@ -28,9 +28,64 @@
 #include "Scavenger.h"
 #include "../cache.h"
 #include "../fsck_hfs.h"
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * With BTScanStartThreads, the scan reads ahead: the main thread reads
+ * up to kScanChunksPerThread buffers per worker, in order through the
+ * file, and the workers swap the nodes in them (hfs_swap_BTNode is most
+ * of the cost of a scan) while the main thread goes on reading, and
+ * taking the records out of the buffers that are done, in order.  So
+ * the records, and when the scan stops, are the same as without threads.
+ *
+ * The workers swap with private copies of the control blocks, whose VCB
+ * has no SGlob, so they print nothing.  A node they could not swap is
+ * read again, and swapped again, by the main thread, which prints just
+ * what it would have printed had it swapped the node in the first place.
+ */
+#define	kMaxScanThreads			8
+#define	kScanChunksPerThread	2
+#define	kMaxNodesPerChunk		(kCatScanBufferSize / 512)
+
+typedef struct BTScanChunk
+{
+	void *				buffer;
+	UInt64				diskOffset;			// where the buffer was read from
+	u_int32_t			firstNode;
+	int32_t				nodeCount;
+	int					readErr;			// the scan ends at this chunk
+	Boolean				swapped;			// done by a worker
+	Boolean				badNode[kMaxNodesPerChunk];	// hfs_swap_BTNode failed
+} BTScanChunk;
+
+struct BTScanThreads
+{
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;				// a chunk was read
+	pthread_cond_t		done;				// a chunk was swapped
+	SVCB				vcb;				// private copies for the workers
+	SFCB				fcb;
+	BTreeControlBlock	btcb;
+	int					threadCount;
+	pthread_t			thread[kMaxScanThreads];
+	u_int32_t			chunkCount;
+	BTScanChunk			chunk[kMaxScanThreads * kScanChunksPerThread];
+	u_int32_t			consumed;			// chunks the scan is done with
+	u_int32_t			swapping;			// chunks taken by workers
+	u_int32_t			read;				// chunks read
+	u_int32_t			readNode;			// first node of the next chunk to read
+	Boolean				readDone;			// no more chunks to read
+	Boolean				holding;			// the scan is in chunk "consumed"
+	Boolean				stopping;
+};
 
 static int FindNextLeafNode(	BTScanState *scanState );
 static int ReadMultipleNodes( 	BTScanState *scanState );
+static int NextSwappedChunk(	BTScanState *scanState );
+static int SwapNodeAgain(		BTScanState *scanState, BlockDescriptor *block );
+static void *ScanThread(		void *arg );
+static void StopScanThreads(	BTScanState *scanState );
 
 
 //_________________________________________________________________________________
@@ -146,7 +201,10 @@ static int FindNextLeafNode(	BTScanState *scanState )
 		if ( scanState->nodesLeftInBuffer <= 0 ) 
 		{
 			//	read some more nodes into buffer
-			err = ReadMultipleNodes( scanState );
+			if ( scanState->threads != NULL )
+				err = NextSwappedChunk( scanState );
+			else
+				err = ReadMultipleNodes( scanState );
 			if ( err != noErr ) 
 				break;
 		}
@@ -168,7 +226,10 @@ static int FindNextLeafNode(	BTScanState *scanState )
         myBlockDescriptor.blockSize = scanState->btcb->nodeSize;
         myBlockDescriptor.blockReadFromDisk = false;
         myBlockDescriptor.fragmented = false;
-        err = hfs_swap_BTNode(&myBlockDescriptor, scanState->btcb->fcbPtr, kSwapBTNodeBigToHost);
+		if ( scanState->threads != NULL )
+			err = SwapNodeAgain( scanState, &myBlockDescriptor );
+		else
+			err = hfs_swap_BTNode(&myBlockDescriptor, scanState->btcb->fcbPtr, kSwapBTNodeBigToHost);
 		if ( err != noErr )
 		{
 			err = noErr;
@@ -287,11 +348,14 @@ int		BTScanInitialize(	const SFCB *	btreeFile,
 		return( R_NoMem );
 
 	scanState->btcb					= btcb;
+	scanState->cacheAdvice			= CacheAdvise( btcb->fcbPtr->fcbVolume->vcbBlockCache,
+												   kCacheAdviseSequential );
 	scanState->nodeNum				= 0;
 	scanState->recordNum			= 0;
 	scanState->currentNodePtr		= NULL;
 	scanState->nodesLeftInBuffer	= 0;		// no nodes currently in buffer
 	scanState->recordsFound			= 0;
+	scanState->threads				= NULL;
 		
 	return noErr;
 	
@@ -316,11 +380,16 @@ int		BTScanInitialize(	const SFCB *	btreeFile,
 
 int	 BTScanTerminate(	BTScanState *		scanState	)
 {
+	if ( scanState->threads != NULL )
+		StopScanThreads( scanState );
+
 	if ( scanState->bufferPtr != NULL )
 	{
 		DisposeMemory( scanState->bufferPtr );
 		scanState->bufferPtr = NULL;
 		scanState->currentNodePtr = NULL;
+		(void) CacheAdvise( scanState->btcb->fcbPtr->fcbVolume->vcbBlockCache,
+							scanState->cacheAdvice );
 	}
 	
 	return noErr;
@@ -328,3 +397,310 @@ int	 BTScanTerminate(	BTScanState *		scanState	)
 } /* BTScanTerminate */
 
 
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanStartThreads
+//
+//	Purpose:	Have worker threads swap the nodes of a scan as the main
+//				thread reads them ahead.  Must be called before the first
+//				record is asked for.
+//
+//	Inputs:
+//		scanState		Scanner's state, from BTScanInitialize
+//
+//	Result:
+//		noErr			Workers started
+//		other			The scan goes on without them
+//_________________________________________________________________________________
+
+int	BTScanStartThreads(	BTScanState *	scanState	)
+{
+	struct BTScanThreads *	threads;
+	long					cpus;
+	u_int32_t				i;
+	int						err;
+
+	if ( scanState->threads != NULL || scanState->currentNodePtr != NULL ||
+		 scanState->btcb->nodeSize < 512 )
+		return EINVAL;
+
+	// the main thread reads and takes the records out, the workers swap
+	cpus = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( cpus < 2 )
+		return ENOTSUP;
+
+	threads = (struct BTScanThreads *) AllocateClearMemory( sizeof(*threads) );
+	if ( threads == NULL )
+		return ENOMEM;
+
+	threads->threadCount = (cpus - 1 < kMaxScanThreads) ? (int)(cpus - 1) : kMaxScanThreads;
+	threads->chunkCount = threads->threadCount * kScanChunksPerThread;
+	for ( i = 0; i < threads->chunkCount; i++ )
+	{
+		threads->chunk[i].buffer = AllocateMemory( scanState->bufferSize );
+		if ( threads->chunk[i].buffer == NULL )
+			break;
+	}
+	if ( i < threads->chunkCount )
+	{
+		while ( i > 0 )
+			DisposeMemory( threads->chunk[--i].buffer );
+		DisposeMemory( threads );
+		return ENOMEM;
+	}
+
+	threads->vcb = *scanState->btcb->fcbPtr->fcbVolume;
+	threads->vcb.vcbGPtr = NULL;
+	threads->fcb = *scanState->btcb->fcbPtr;
+	threads->fcb.fcbVolume = &threads->vcb;
+	threads->fcb.fcbBtree = &threads->btcb;
+	threads->btcb = *scanState->btcb;
+	threads->btcb.fcbPtr = &threads->fcb;
+
+	// as FindNextLeafNode would read next
+	threads->readNode = scanState->nodeNum + 1;
+
+	pthread_mutex_init( &threads->lock, NULL );
+	pthread_cond_init( &threads->work, NULL );
+	pthread_cond_init( &threads->done, NULL );
+
+	scanState->threads = threads;
+	for ( i = 0; i < (u_int32_t) threads->threadCount; i++ )
+	{
+		err = pthread_create( &threads->thread[i], NULL, ScanThread, threads );
+		if ( err != 0 )
+		{
+			threads->threadCount = i;
+			StopScanThreads( scanState );
+			return err;
+		}
+	}
+
+	return noErr;
+	
+} /* BTScanStartThreads */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	NextSwappedChunk
+//
+//	Purpose:	With worker threads, the replacement for ReadMultipleNodes.
+//				Read ahead into the buffers that are free, and then wait
+//				for the workers to swap the next buffer in the file.
+//
+//	Inputs:
+//		scanState		Scanner's current state
+//
+//	Result:
+//		noErr				One or nodes are in the buffer
+//		fsEndOfIterationErr		No nodes left in file, none in buffer
+//_________________________________________________________________________________
+
+static int NextSwappedChunk( BTScanState *scanState )
+{
+	struct BTScanThreads *	threads = scanState->threads;
+	BTreeControlBlockPtr  	myBTreeCBPtr = scanState->btcb;
+	BTScanChunk *			myChunk;
+	UInt64					myPhyBlockNum;
+	UInt64					mySectorOffset;
+	UInt32					myContiguousBytes;
+	int						myErr;
+
+	pthread_mutex_lock( &threads->lock );
+	if ( threads->holding )
+	{
+		++threads->consumed;
+		threads->holding = false;
+	}
+	pthread_mutex_unlock( &threads->lock );
+
+	// read ahead, as ReadMultipleNodes reads, while the workers swap
+	while ( !threads->readDone && threads->read - threads->consumed < threads->chunkCount )
+	{
+		myChunk = &threads->chunk[ threads->read % threads->chunkCount ];
+		myChunk->firstNode = threads->readNode;
+		myChunk->nodeCount = 0;
+		myChunk->readErr = noErr;
+		myChunk->swapped = false;
+
+		mySectorOffset = 
+			(((UInt64)threads->readNode * (UInt64)myBTreeCBPtr->fcbPtr->fcbBlockSize) >> kSectorShift);
+		myErr = MapFileBlockC( myBTreeCBPtr->fcbPtr->fcbVolume, myBTreeCBPtr->fcbPtr,
+							   scanState->bufferSize, mySectorOffset, 
+							   &myPhyBlockNum, &myContiguousBytes );
+		if ( myErr == noErr )
+		{
+			myChunk->diskOffset = myPhyBlockNum << kSectorShift;
+			myErr = CacheRawRead( myBTreeCBPtr->fcbPtr->fcbVolume->vcbBlockCache, 
+								  myChunk->diskOffset, myContiguousBytes, myChunk->buffer );
+		}
+		if ( myErr != noErr )
+		{
+			myChunk->readErr = fsEndOfIterationErr;
+			myChunk->swapped = true;
+			threads->readDone = true;
+		}
+		else
+		{
+			myChunk->nodeCount = myContiguousBytes / myBTreeCBPtr->nodeSize;
+			threads->readNode += myChunk->nodeCount;
+			// FindNextLeafNode stops past the last node, so no more is needed
+			if ( threads->readNode > myBTreeCBPtr->totalNodes )
+				threads->readDone = true;
+		}
+
+		pthread_mutex_lock( &threads->lock );
+		++threads->read;
+		pthread_cond_signal( &threads->work );
+		pthread_mutex_unlock( &threads->lock );
+	}
+
+	pthread_mutex_lock( &threads->lock );
+	if ( threads->consumed == threads->read )
+	{
+		pthread_mutex_unlock( &threads->lock );
+		return fsEndOfIterationErr;
+	}
+	myChunk = &threads->chunk[ threads->consumed % threads->chunkCount ];
+	while ( !myChunk->swapped )
+		pthread_cond_wait( &threads->done, &threads->lock );
+	threads->holding = true;
+	pthread_mutex_unlock( &threads->lock );
+
+	if ( myChunk->readErr != noErr )
+		return myChunk->readErr;
+
+	scanState->nodesLeftInBuffer = myChunk->nodeCount;
+	scanState->currentNodePtr = (BTNodeDescriptor *) myChunk->buffer;
+
+	return noErr;
+	
+} /* NextSwappedChunk */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	SwapNodeAgain
+//
+//	Purpose:	With worker threads, the replacement for hfs_swap_BTNode.
+//				The node has been swapped already; if that failed, read it
+//				again and swap it on this thread, to report why.
+//
+//	Inputs:
+//		scanState		Scanner's current state
+//		block			The current node
+//
+//	Result:
+//		what hfs_swap_BTNode returned
+//_________________________________________________________________________________
+
+static int SwapNodeAgain( BTScanState *scanState, BlockDescriptor *block )
+{
+	struct BTScanThreads *	threads = scanState->threads;
+	BTScanChunk *			myChunk;
+	UInt32					myIndex;
+	int						myErr;
+
+	myChunk = &threads->chunk[ threads->consumed % threads->chunkCount ];
+	myIndex = ((UInt8 *) block->buffer - (UInt8 *) myChunk->buffer) / block->blockSize;
+	if ( !myChunk->badNode[myIndex] )
+		return noErr;
+
+	myErr = CacheRawRead( scanState->btcb->fcbPtr->fcbVolume->vcbBlockCache,
+						  myChunk->diskOffset + (UInt64)myIndex * block->blockSize,
+						  block->blockSize, block->buffer );
+	if ( myErr != noErr )
+		return myErr;
+
+	return hfs_swap_BTNode( block, scanState->btcb->fcbPtr, kSwapBTNodeBigToHost );
+	
+} /* SwapNodeAgain */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	ScanThread
+//
+//	Purpose:	Swap the nodes of each buffer read, in turn, until stopped.
+//_________________________________________________________________________________
+
+static void *ScanThread( void *arg )
+{
+	struct BTScanThreads *	threads = (struct BTScanThreads *) arg;
+	BTScanChunk *			myChunk;
+	BlockDescriptor			myBlockDescriptor;
+	int32_t					i;
+
+	pthread_mutex_lock( &threads->lock );
+	while ( true )
+	{
+		while ( !threads->stopping && threads->swapping == threads->read )
+			pthread_cond_wait( &threads->work, &threads->lock );
+		if ( threads->stopping )
+			break;
+
+		myChunk = &threads->chunk[ threads->swapping % threads->chunkCount ];
+		++threads->swapping;
+		if ( myChunk->swapped )
+			continue;
+		pthread_mutex_unlock( &threads->lock );
+
+		for ( i = 0; i < myChunk->nodeCount; i++ )
+		{
+			myBlockDescriptor.buffer = (UInt8 *) myChunk->buffer + i * threads->btcb.nodeSize;
+			myBlockDescriptor.blockHeader = NULL;
+			myBlockDescriptor.blockNum = myChunk->firstNode + i;
+			myBlockDescriptor.blockSize = threads->btcb.nodeSize;
+			myBlockDescriptor.blockReadFromDisk = false;
+			myBlockDescriptor.fragmented = false;
+			myChunk->badNode[i] = (hfs_swap_BTNode( &myBlockDescriptor, &threads->fcb,
+													kSwapBTNodeBigToHost ) != noErr);
+		}
+
+		pthread_mutex_lock( &threads->lock );
+		myChunk->swapped = true;
+		pthread_cond_broadcast( &threads->done );
+	}
+	pthread_mutex_unlock( &threads->lock );
+
+	return NULL;
+	
+} /* ScanThread */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	StopScanThreads
+//
+//	Purpose:	Stop the workers, once they are done with the buffers they
+//				have, and free the buffers.
+//_________________________________________________________________________________
+
+static void StopScanThreads( BTScanState *scanState )
+{
+	struct BTScanThreads *	threads = scanState->threads;
+	u_int32_t				i;
+
+	pthread_mutex_lock( &threads->lock );
+	threads->stopping = true;
+	pthread_cond_broadcast( &threads->work );
+	pthread_mutex_unlock( &threads->lock );
+
+	for ( i = 0; i < (u_int32_t) threads->threadCount; i++ )
+		pthread_join( threads->thread[i], NULL );
+
+	pthread_cond_destroy( &threads->done );
+	pthread_cond_destroy( &threads->work );
+	pthread_mutex_destroy( &threads->lock );
+	for ( i = 0; i < threads->chunkCount; i++ )
+		DisposeMemory( threads->chunk[i].buffer );
+	DisposeMemory( threads );
+
+	scanState->threads = NULL;
+	scanState->currentNodePtr = NULL;
+	scanState->nodesLeftInBuffer = 0;
+	
+} /* StopScanThreads */
@@ -49,6 +49,7 @@ struct BTScanState
 	u_int32_t			bufferSize;
 	void *				bufferPtr;
 	BTreeControlBlock *	btcb;
+	int					cacheAdvice;		// cache access hint to restore when done
 	
 	//	The following fields are the dynamic state of the current scan.
 	u_int32_t			nodeNum;			// zero is first node
@@ -56,6 +57,8 @@ struct BTScanState
 	BTNodeDescriptor *	currentNodePtr;		// points to current node within buffer
 	int32_t				nodesLeftInBuffer;	// number of valid nodes still in the buffer
 	int64_t				recordsFound;		// number of leaf records seen so far
+
+	struct BTScanThreads *	threads;		// nodes read ahead and swapped on worker threads
 };
 typedef struct BTScanState BTScanState;
 
@@ -72,4 +75,6 @@ int BTScanNextRecord(	BTScanState *	scanState,
 
 int	BTScanTerminate(	BTScanState *	scanState	);
 
+int	BTScanStartThreads(	BTScanState *	scanState	);
+
 #endif /* !_BTREESCANNER_H_ */
@@ -34,6 +34,7 @@
 
 #include "BTreePrivate.h"
 extern char debug;
+extern char lazyIndexSwap;
 
 #define DEBUG_TREEOPS 0
 
@@ -198,6 +199,7 @@ OSStatus	SearchTree	(BTreeControlBlockPtr	 btreePtr,
 	KeyPtr		keyPtr;
 	UInt8 *		dataPtr;
 	UInt16		dataSize;
+	UInt32		childNodeNum;
 	
 	
 	curNodeNum		= btreePtr->rootNode;
@@ -229,6 +231,21 @@ OSStatus	SearchTree	(BTreeControlBlockPtr	 btreePtr,
             goto ErrorExit;
         }
 
+        //
+        //	With -L, an index node is searched as it is in the cache, swapping only
+        //	the keys compared.  If that cannot be done, the node is got and swapped
+        //	as usual below, which finds and reports whatever is wrong with it.
+        //
+        if (lazyIndexSwap && level > 1 &&
+            SearchIndexNode (btreePtr, curNodeNum, level, searchKey, &index, &childNodeNum) == noErr)
+        {
+            treePathTable [level].node	= curNodeNum;
+            treePathTable [level].index	= index;
+            curNodeNum = childNodeNum;
+            --level;
+            continue;
+        }
+
 		err = GetNode (btreePtr, curNodeNum, &nodeRec);
 		if (err != noErr)
 		{
@@ -30,7 +30,8 @@
 extern Cache_t fscache;
 
 
-static OSStatus  ReadFragmentedBlock (SFCB *file, UInt32 blockNum, BlockDescriptor *block);
+static OSStatus  ReadFragmentedBlock (SFCB *file, UInt32 blockNum, GetBlockOptions options,
+                                      BlockDescriptor *block);
 static OSStatus  WriteFragmentedBlock( 	SFCB *file, 
 										BlockDescriptor *block, 
 										int age, 
@@ -50,6 +51,7 @@ InitBlockCache(SVCB *volume)
  *  kForceReadBlock
  *  kGetEmptyBlock
  *  kSkipEndianSwap
+ *  kStreamBlock
  */
 OSStatus
 GetVolumeBlock (SVCB *volume, UInt64 blockNum, GetBlockOptions options, BlockDescriptor *block)
@@ -67,7 +69,8 @@ GetVolumeBlock (SVCB *volume, UInt64 blockNum, GetBlockOptions options, BlockDes
 
 	offset = (SInt64) ((UInt64) blockNum) << kSectorShift;
 
-	result = CacheRead (cache, offset, blockSize, &buffer);
+	result = CacheReadOptions (cache, offset, blockSize,
+	                           (options & kStreamBlock) ? kStreamRead : 0, &buffer);
 
 	if (result == 0) {
 		block->blockHeader = buffer;
@@ -139,6 +142,7 @@ ReleaseVolumeBlock (SVCB *volume, BlockDescriptor *block, ReleaseBlockOptions op
  *  kGetBlock
  *  kForceReadBlock
  *  kGetEmptyBlock
+ *  kStreamBlock
  */
 OSStatus
 GetFileBlock (SFCB *file, UInt32 blockNum, GetBlockOptions options, BlockDescriptor *block)
@@ -163,11 +167,12 @@ GetFileBlock (SFCB *file, UInt32 blockNum, GetBlockOptions options, BlockDescrip
 	if (result) return (result);
 
 	if (contiguousBytes < file->fcbBlockSize)
-		return ( ReadFragmentedBlock(file, blockNum, block) );
+		return ( ReadFragmentedBlock(file, blockNum, options, block) );
 
 	offset = (SInt64) ((UInt64) diskBlock) << kSectorShift;
 
-	result = CacheRead (cache, offset, file->fcbBlockSize, &buffer);
+	result = CacheReadOptions (cache, offset, file->fcbBlockSize,
+	                           (options & kStreamBlock) ? kStreamRead : 0, &buffer);
 	if (result)  return (result);
 
 	block->blockHeader = buffer;
@@ -240,7 +245,7 @@ SetFileBlockSize (SFCB *file, ByteCount blockSize)
  *  - the fragmented flag is set
  */
 static OSStatus
-ReadFragmentedBlock (SFCB *file, UInt32 blockNum, BlockDescriptor *block)
+ReadFragmentedBlock (SFCB *file, UInt32 blockNum, GetBlockOptions options, BlockDescriptor *block)
 {
 	UInt64	sector;
 	UInt32	fragSize, blockSize;
@@ -281,7 +286,8 @@ ReadFragmentedBlock (SFCB *file, UInt32 blockNum, BlockDescriptor *block)
 		if (result) goto ErrorExit;
 
 		diskOffset = (SInt64) (sector) << kSectorShift;
-		result = CacheRead (cache, diskOffset, fragSize, &bufs[i]);
+		result = CacheReadOptions (cache, diskOffset, fragSize,
+		                           (options & kStreamBlock) ? kStreamRead : 0, &bufs[i]);
 		if (result) goto ErrorExit;
 		
 		if (bufs[i]->Length != fragSize) {
@@ -71,6 +71,8 @@ static int  CheckCatalogName_HFS(u_int16_t charCount, const u_char *filename,
                                  u_int32_t parentID, Boolean thread);
 
 static int  CaptureMissingThread(UInt32 threadID, const HFSPlusCatalogKey *nextKey);
+static int  AddCatHierFolder(UInt32 parentID, UInt32 folderID, UInt32 valence);
+static int  AddCatHierID(HFSCatalogNodeID **ids, UInt32 *count, UInt32 *size, UInt32 id);
 static 	OSErr	UniqueDotName( 	SGlobPtr GPtr, 
                                 CatalogName * theNewNamePtr, 
                                 UInt32 theParID, 
@@ -79,16 +81,35 @@ static 	OSErr	UniqueDotName( 	SGlobPtr GPtr,
 static Boolean 	FixDecomps(	u_int16_t charCount, const u_int16_t *inFilename, HFSUniStr255 *outFilename );
 
 /*
- * This structure is used to keep track of the folderCount field in
+ * These structures are used to keep track of the folderCount field in
  * HFSPlusCatalogFolder records.  For now, this is only done on HFSX volumes.
+ *
+ * Folders with IDs below denseCount are counted in an array indexed by
+ * folder ID, and any others in an open-addressed hash table, which is
+ * doubled whenever it is half full.  Either way, accounting for a folder
+ * record takes constant time.
  */
-struct folderCountInfo {
-	UInt32 folderID;
+struct folderCount {
 	UInt32 recordedCount;
 	UInt32 computedCount;
-	struct folderCountInfo *next;
 };
 
+struct folderCountInfo {
+	UInt32 folderID;
+	struct folderCount counts;
+};
+
+struct folderCountCache {
+	struct folderCount *dense;
+	UInt32 denseCount;
+	struct folderCountInfo *slots;
+	UInt32 slotCount;		/* zero, or a power of two */
+	UInt32 slotsUsed;
+};
+
+/* Number of hash slots to start with */
+#define kFolderCountMinSlots	1024
+
 /*
  * CountFolderRecords - Counts the number of folder records contained within a
  * given folder.  That is, how many direct subdirectories it has.  This is used
@@ -160,75 +181,113 @@ CountFolderRecords(HFSPlusCatalogKey *myKey, HFSPlusCatalogFolder *folder, SGlob
 	return err;
 }
 
-static void
-releaseFolderCountInfo(struct folderCountInfo *fcip, int numFolders)
+/*
+ * newFolderCountCache - Allocate the cache used by CheckFolderCount.
+ * Folder IDs are counted in the dense array when the array would be no
+ * bigger than a hash table of the folders on the volume, at four slots
+ * a folder; otherwise they are all hashed.  Returns NULL if out of memory.
+ */
+static struct folderCountCache *
+newFolderCountCache(SGlobPtr GPtr)
 {
-	int i;
-
-	for (i = 0; i < numFolders; i++) {
-		struct folderCountInfo *f = &fcip[i];
-
-		f = f->next;
-		while (f) {
-			struct folderCountInfo *t = f->next;
-			free(f);
-			f = t;
-		}
+	struct folderCountCache *cache;
+	UInt64 folders = GPtr->calculatedVCB->vcbFolderCount;
+	UInt32 nextID = GPtr->calculatedVCB->vcbNextCatalogID;
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+
+	if ((UInt64)nextID * sizeof(struct folderCount) <=
+	    (folders + 1) * 4 * sizeof(struct folderCountInfo) + (128 * 1024)) {
+		cache->dense = calloc(nextID, sizeof(struct folderCount));
+		if (cache->dense != NULL)
+			cache->denseCount = nextID;
 	}
-	free(fcip);
+
+	return cache;
 }
 
-static struct folderCountInfo *
-findFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
+static void
+releaseFolderCountInfo(struct folderCountCache *cache)
 {
-	struct folderCountInfo *retval = NULL;
-	int indx;
+	if (cache->dense)
+		free(cache->dense);
+	if (cache->slots)
+		free(cache->slots);
+	free(cache);
+}
 
-	indx = fid % numFolders;	// Slot index
+/* Hash slot at which to start looking for the given folder ID */
+#define FolderCountSlot(cache, fid)	(((fid) * 2654435761U) & ((cache)->slotCount - 1))
 
-	retval = &fcip[indx];
-	if (retval->folderID == fid) {
-		goto done;
-	}
-	while (retval->next != NULL) {
-		retval = retval->next;
-		if (retval->folderID == fid)
-			goto done;
+/*
+ * growFolderCountHash - Double the hash table (or create it), and move
+ * the entries over.  Returns ENOMEM if out of memory.
+ */
+static int
+growFolderCountHash(struct folderCountCache *cache)
+{
+	struct folderCountInfo *old = cache->slots;
+	struct folderCountInfo *slots;
+	UInt32 oldCount = cache->slotCount;
+	UInt32 count;
+	UInt32 i, j;
+
+	count = oldCount ? oldCount * 2 : kFolderCountMinSlots;
+	if (count <= oldCount)
+		return ENOMEM;
+	slots = calloc(count, sizeof(struct folderCountInfo));
+	if (slots == NULL)
+		return ENOMEM;
+
+	cache->slots = slots;
+	cache->slotCount = count;
+	for (i = 0; i < oldCount; i++) {
+		if (old[i].folderID == 0)
+			continue;
+		for (j = FolderCountSlot(cache, old[i].folderID);
+		     slots[j].folderID != 0;
+		     j = (j + 1) & (count - 1))
+			continue;
+		slots[j] = old[i];
 	}
-	retval = NULL;
-done:
-	return retval;
+	if (old)
+		free(old);
+
+	return 0;
 }
 
-static struct folderCountInfo *
-addFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
+/*
+ * findFolderEntry - Return the counts for the given folder ID, adding an
+ * entry for it if there is none.  Returns NULL if out of memory.
+ */
+static struct folderCount *
+findFolderEntry(struct folderCountCache *cache, UInt32 fid)
 {
-	struct folderCountInfo *retval = NULL;
-	int indx;
+	struct folderCountInfo *retval;
+	UInt32 indx;
 
-	indx = fid % numFolders;
-	retval = &fcip[indx];
+	if (fid < cache->denseCount)
+		return &cache->dense[fid];
 
-	if (retval->folderID == fid)
-		goto done;
-	while (retval->folderID != 0) {
-		if (retval->next == NULL) {
-			retval->next = calloc(1, sizeof(struct folderCountInfo));
-			if (retval->next == NULL) {
-				retval = NULL;
-				goto done;
-			} else
-				retval = retval->next;
-		} else if (retval->folderID == fid) {
-			goto done;
-		} else
-			retval = retval->next;
+	if ((cache->slotsUsed + 1) * 2 > cache->slotCount) {
+		if (growFolderCountHash(cache) != 0)
+			return NULL;
 	}
 
-	retval->folderID = fid;
+	for (indx = FolderCountSlot(cache, fid); ; indx = (indx + 1) & (cache->slotCount - 1)) {
+		retval = &cache->slots[indx];
+		if (retval->folderID == fid)
+			break;
+		if (retval->folderID == 0) {
+			retval->folderID = fid;
+			cache->slotsUsed++;
+			break;
+		}
+	}
 
-done:
-	return retval;
+	return &retval->counts;
 }
 
 /*
@@ -236,46 +295,44 @@ done:
  * for folder count of the given parent directory.  For directory hard links, 
  * the folder ID and count should be zero.  For a folder record, the values 
  * read from the catalog record are provided which are used to add the 
- * given folderID to the cache (folderCountInfo *ficp).
+ * given folderID to the cache.
  */
 static int
-folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UInt32 folderID, UInt32 count)
+folderCountAdd(struct folderCountCache *cache, UInt32 parentID, UInt32 folderID, UInt32 count)
 {
 	int retval = 0;
-	struct folderCountInfo *curp = NULL;
+	struct folderCount *curp = NULL;
 
 
 	/* Only add directories represented by folder record to the cache */
 	if (folderID != 0) {
 		/*
 		 * We track two things here.
-		 * First, we need to find the entry matching this folderID.  If we don't find it,
-		 * we add it.  If we do find it, or if we add it, we set the recordedCount.
+		 * First, we need to find the entry matching this folderID, adding
+		 * it if we don't find it, and set the recordedCount.
 		 */
 
-		curp = findFolderEntry(fcip, numFolders, folderID);
+		curp = findFolderEntry(cache, folderID);
 		if (curp == NULL) {
-			curp = addFolderEntry(fcip, numFolders, folderID);
-			if (curp == NULL) {
-				retval = ENOMEM;
-				goto done;
-			}
+			retval = ENOMEM;
+			goto done;
 		}
 		curp->recordedCount = count;
 
 	}
 
 	/*
-	 * After that, we try to find the parent to this entry.  When we find it
-	 * (or if we add it to the list), we increment the computedCount.
+	 * After that, we find the parent to this entry (adding it to the
+	 * cache if need be), and increment the computedCount.  A parent ID of
+	 * zero, from a damaged record, is not counted: there is no folder 0 to
+	 * check, and zero marks an empty hash slot.
 	 */
-	curp = findFolderEntry(fcip, numFolders, parentID);
+	if (parentID == 0)
+		goto done;
+	curp = findFolderEntry(cache, parentID);
 	if (curp == NULL) {
-		curp = addFolderEntry(fcip, numFolders, parentID);
-		if (curp == NULL) {
-			retval = ENOMEM;
-			goto done;
-		}
+		retval = ENOMEM;
+		goto done;
 	}
 	curp->computedCount++;
 
@@ -283,6 +340,28 @@ done:
 	return retval;
 }
 
+/*
+ * checkFolderCountEntry - Request a repair if the recorded count of the
+ * given folder is not the one computed.
+ */
+static OSErr
+checkFolderCountEntry(SGlobPtr GPtr, UInt32 folderID, struct folderCount *curp)
+{
+	if (folderID == 0 || folderID == kHFSRootParentID) {
+		// Root's parent doesn't really exist
+		return 0;
+	}
+	if (curp->recordedCount == curp->computedCount)
+		return 0;
+
+	/* RcdFCntErr requests a repair order to correct the folder count */
+	return RcdFCntErr( GPtr,
+				E_FldCount,
+				curp->computedCount,
+				curp->recordedCount,
+				folderID );
+}
+
 /*
  * CheckFolderCount - Verify the folderCount fields of the HFSPlusCatalogFolder records
  * in the catalog BTree.  This is currently only done for HFSX.
@@ -293,20 +372,18 @@ done:
  *
  * However, since scanning the entire catalog can be a very costly operation, we dot
  * it one of two ways.  The first way is to simply iterate through the catalog once,
- * and keep track of each folder ID we come across.  This uses a fair bit of memory,
- * so we limit the cache to 5MBytes, which works out to some 400k folderCountInfo
- * entries (at the current size of three 4-byte entries per folderCountInfo entry).
- * If the filesystem has more than that, we instead use the slower (but significantly
- * less memory-intensive) method in CountFolderRecords:  for each folder ID we
- * come across, we call CountFolderRecords, which does its own iteration through the
- * catalog, looking for children of the given folder.
+ * and keep track of each folder ID we come across, in a cache indexed by folder ID
+ * (see struct folderCountCache), and then sweep the cache once for mis-counts.
+ * If the cache cannot be allocated, or cannot grow, we instead use the slower (but
+ * significantly less memory-intensive) method in CountFolderRecords:  for each
+ * folder ID we come across, we call CountFolderRecords, which does its own iteration
+ * through the catalog, looking for children of the given folder.
  */
 
 OSErr
 CheckFolderCount( SGlobPtr GPtr )
 {
 	OSErr err = 0;
-	int numFolders;
 	BTreeIterator iterator;
 	FSBufferDescriptor btRecord;
 	HFSPlusCatalogKey *key;
@@ -315,7 +392,7 @@ CheckFolderCount( SGlobPtr GPtr )
 		HFSPlusCatalogFile catFile;
 	} catRecord;
 	UInt16 recordSize = 0;
-	struct folderCountInfo *fcip = NULL;
+	struct folderCountCache *cache = NULL;
 
 	ClearMemory(&iterator, sizeof(iterator));
 	if (!VolumeObjectIsHFSX(GPtr)) {
@@ -327,37 +404,7 @@ CheckFolderCount( SGlobPtr GPtr )
 		goto done;
 	}
 
-#if 0
-	/*
-	 * We add two so we can account for the root folder, and
-	 * the root folder's parent.  Neither of which is real,
-	 * but they show up as parent IDs in the catalog.
-	 */
-	numFolders = GPtr->calculatedVCB->vcbFolderCount + 2;
-#else
-	/*
-	 * Since we're using a slightly smarter hash method,
-	 * we don't care so much about the number of folders
-	 * allegedly on the volume; instead, we'll pick a nice
-	 * prime number to use as the number of buckets.
-	 * This bears some performance checking later.
-	 */
-	numFolders = 257;
-#endif
-
-	/*
-	 * Limit the size of the folder count cache to 5Mbytes;
-	 * if the requested number of folders don't fit, then
-	 * we don't use the cache at all.
-	 */
-#define MAXCACHEMEM	(5 * 1024 * 1024)	/* 5Mbytes */
-#define LCALLOC(c, s, l)	\
-	({ __typeof(c) _count = (c); __typeof(s) _size = (s); __typeof(l) _lim = (l); \
-		((_count * _size) > _lim) ? NULL : calloc(_count, _size); })
-
-	fcip = LCALLOC(numFolders, sizeof(*fcip), MAXCACHEMEM);
-#undef MAXCACHEMEM
-#undef LCALLOC
+	cache = newFolderCountCache(GPtr);
 
 restart:
 	/* these objects are used by the BT* functions to iterate through the catalog */
@@ -393,8 +440,8 @@ restart:
 				if (err != 0)
 					goto done;
 			}
-			if (fcip) {
-				if (folderCountAdd(fcip, numFolders,
+			if (cache) {
+				if (folderCountAdd(cache,
 					key->parentID,
 					catRecord.catRecord.folderID,
 					catRecord.catRecord.folderCount)) {
@@ -407,8 +454,8 @@ restart:
 					 * the cache was allocated, and start over as if we had never
 					 * allocated a cache in the first place.
 					 */
-					releaseFolderCountInfo(fcip, numFolders);
-					fcip = NULL;
+					releaseFolderCountInfo(cache);
+					cache = NULL;
 					goto restart;
 				}
 			} else {
@@ -432,12 +479,12 @@ restart:
 				 * performed, account for directory hard links 
 				 * in CountFolderRecords()
 				 */
-			    	if (fcip) {
-					if (folderCountAdd(fcip, numFolders, 
+			    	if (cache) {
+					if (folderCountAdd(cache, 
 						key->parentID, 0, 0)) {
 						/* See above for why we release & restart */
-						releaseFolderCountInfo(fcip, numFolders);
-						fcip = NULL;
+						releaseFolderCountInfo(cache);
+						cache = NULL;
 						goto restart;
 					}
 				}
@@ -448,42 +495,29 @@ restart:
 
 	if (err == btNotFound)
 		err = 0;	// We hit the end of the file, which is okay
-	if (err == 0 && fcip != NULL) {
-		int i;
+	if (err == 0 && cache != NULL) {
+		UInt32 i;
 
 		/*
-		 * At this point, we are itereating through the cache, looking for
+		 * At this point, we sweep through the cache, looking for
 		 * mis-counts. (If we're not using the cache, then CountFolderRecords has
 		 * already dealt with any miscounts.)
 		 */
-		for (i = 0; i < numFolders; i++) {
-			struct folderCountInfo *curp;
-
-			for (curp = &fcip[i]; curp; curp = curp->next) {
-				if (curp->folderID == 0) {
-					// fplog(stderr, "fcip[%d] has a folderID of 0?\n", i);
-				} else if (curp->folderID == kHFSRootParentID) {
-					// Root's parent doesn't really exist
-					continue;
-				} else {
-					if (curp->recordedCount != curp->computedCount) {
-						/* RcdFCntErr requests a repair order to correct the folder count */
-						err = RcdFCntErr( GPtr,
-									E_FldCount,
-									curp->computedCount,
-									curp->recordedCount,
-									curp->folderID );
-						if (err != 0)
-							goto done;
-					}
-				}
-			}
+		for (i = 0; i < cache->denseCount; i++) {
+			err = checkFolderCountEntry(GPtr, i, &cache->dense[i]);
+			if (err != 0)
+				goto done;
+		}
+		for (i = 0; i < cache->slotCount; i++) {
+			err = checkFolderCountEntry(GPtr, cache->slots[i].folderID, &cache->slots[i].counts);
+			if (err != 0)
+				goto done;
 		}
 	}
 done:
-	if (fcip) {
-		releaseFolderCountInfo(fcip, numFolders);
-		fcip = NULL;
+	if (cache) {
+		releaseFolderCountInfo(cache);
+		cache = NULL;
 	}
 	return err;
 }
@@ -506,6 +540,9 @@ CheckCatalogBTree( SGlobPtr GPtr )
 	gCIS.parentID = kHFSRootParentID;
 	gCIS.nextCNID = kHFSFirstUserCatalogNodeID;
 
+	/* Collected afresh for CatHChk on every pass */
+	DisposeCatHierTable(gScavGlobals);
+
 	if (hfsplus) {
 		/* Initialize check for file hard links */
         	HardLinkCheckBegin(gScavGlobals, &gCIS.hardLinkRef);
@@ -634,6 +671,8 @@ CheckCatalogRecord(SGlobPtr GPtr, const HFSPlusCatalogKey *key, const CatalogRec
 			++gCIS.dirThreads;
 			gCIS.parentID = key->parentID;
 		}
+		result = AddCatHierFolder(key->parentID, rec->hfsPlusFolder.folderID, rec->hfsPlusFolder.valence);
+		if (result) break;
 		result = CheckDirectory(key, (HFSPlusCatalogFolder *)rec);
 		break;
 
@@ -651,6 +690,9 @@ CheckCatalogRecord(SGlobPtr GPtr, const HFSPlusCatalogKey *key, const CatalogRec
 			++gCIS.dirThreads;
 			gCIS.parentID = key->parentID;
 		}
+		result = AddCatHierID(&gScavGlobals->catHier.fileParents, &gScavGlobals->catHier.fileCount,
+		                      &gScavGlobals->catHier.fileSize, key->parentID);
+		if (result) break;
 		result = CheckFile(key, (HFSPlusCatalogFile *)rec);
 		break;
 
@@ -671,6 +713,9 @@ CheckCatalogRecord(SGlobPtr GPtr, const HFSPlusCatalogKey *key, const CatalogRec
 		} else if (reclen == sizeof(HFSPlusCatalogThread)) {
 			gScavGlobals->VeryMinorErrorsStat |= S_BloatedThreadRecordFound;
 		}
+		result = AddCatHierID(&gScavGlobals->catHier.threads, &gScavGlobals->catHier.threadCount,
+		                      &gScavGlobals->catHier.threadSize, key->parentID);
+		if (result) break;
 		result = CheckThread(key, (HFSPlusCatalogThread *)rec);
 		break;
 
@@ -711,6 +756,8 @@ CheckCatalogRecord_HFS(const HFSCatalogKey *key, const CatalogRecord *rec, UInt1
 			++gCIS.dirThreads;
 			gCIS.parentID = key->parentID;
 		}
+		result = AddCatHierFolder(key->parentID, rec->hfsFolder.folderID, rec->hfsFolder.valence);
+		if (result) break;
 		result = CheckDirectory_HFS(key, (HFSCatalogFolder *)rec);
 		break;
 
@@ -730,6 +777,9 @@ CheckCatalogRecord_HFS(const HFSCatalogKey *key, const CatalogRecord *rec, UInt1
 			++gCIS.dirThreads;
 			gCIS.parentID = key->parentID;
 		}
+		result = AddCatHierID(&gScavGlobals->catHier.fileParents, &gScavGlobals->catHier.fileCount,
+		                      &gScavGlobals->catHier.fileSize, key->parentID);
+		if (result) break;
 		result = CheckFile_HFS(key, (HFSCatalogFile *)rec);
 		break;
 
@@ -746,6 +796,9 @@ CheckCatalogRecord_HFS(const HFSCatalogKey *key, const CatalogRecord *rec, UInt1
 			result = E_LenThd;
 			break;
 		}
+		result = AddCatHierID(&gScavGlobals->catHier.threads, &gScavGlobals->catHier.threadCount,
+		                      &gScavGlobals->catHier.threadSize, key->parentID);
+		if (result) break;
 		result = CheckThread_HFS(key, (HFSCatalogThread *)rec);
 		break;
 
@@ -1631,6 +1684,78 @@ RecordTruncation(UInt32 parID, unsigned char * filename, UInt32 forkType, UInt64
 }
 
 
+/*
+ * AddCatHierFolder
+ *
+ * Add a folder record to the catalog hierarchy table for CatHChk,
+ * along with the leaf node it is in (BTCheck sets TarBlock to it).
+ */
+static int
+AddCatHierFolder(UInt32 parentID, UInt32 folderID, UInt32 valence)
+{
+	CatHierTable *table = &gScavGlobals->catHier;
+	CatHierFolder *folders, *folder;
+	UInt32 size;
+
+	if (table->folderCount == table->folderSize) {
+		size = table->folderSize ? 2 * table->folderSize : 1024;
+		folders = SpillReallocate(table->folders, size * sizeof(CatHierFolder));
+		if (folders == NULL)
+			return (R_NoMem);
+		table->folders = folders;
+		table->folderSize = size;
+	}
+
+	folder = &table->folders[table->folderCount++];
+	folder->parentID = parentID;
+	folder->folderID = folderID;
+	folder->valence = valence;
+	folder->node = gScavGlobals->TarBlock;
+
+	return (0);
+}
+
+/*
+ * AddCatHierID
+ *
+ * Add a file's parent ID, or a thread's ID, to one of the
+ * ID arrays of the catalog hierarchy table.
+ */
+static int
+AddCatHierID(HFSCatalogNodeID **ids, UInt32 *count, UInt32 *size, UInt32 id)
+{
+	HFSCatalogNodeID *p;
+	UInt32 newSize;
+
+	if (*count == *size) {
+		newSize = *size ? 2 * *size : 4096;
+		p = SpillReallocate(*ids, newSize * sizeof(HFSCatalogNodeID));
+		if (p == NULL)
+			return (R_NoMem);
+		*ids = p;
+		*size = newSize;
+	}
+	(*ids)[(*count)++] = id;
+
+	return (0);
+}
+
+/*
+ * DisposeCatHierTable
+ *
+ * Free the catalog hierarchy table.
+ */
+void
+DisposeCatHierTable(SGlobPtr GPtr)
+{
+	CatHierTable *table = &GPtr->catHier;
+
+	SpillDispose(table->folders);
+	SpillDispose(table->fileParents);
+	SpillDispose(table->threads);
+	ClearMemory(table, sizeof(*table));
+}
+
 /*
  * CaptureMissingThread
  *
@@ -74,3 +74,8 @@ extern int CheckHFS(	const char *rdevnode, int fsReadRef, int fsWriteRef,
 						fsck_ctx_t fsckContext,
 						int lostAndFoundMode, int canWrite,
 						int *modified, int liveMode, int rebuildOptions );
+
+/* Sizing the cache within a memory budget (-M); see SSpill.c */
+extern uint64_t EstimateVerifyMemory( uint64_t totalBlocks, uint64_t fileCount, uint64_t folderCount );
+
+extern uint64_t BudgetCacheSize( uint64_t budget, uint64_t estimate );
@@ -26,34 +26,10 @@
 
 #define DEBUG_HARDLINKCHECK 0
 
-/* If set, the node in hash is initialized and has valid inodeID */ 
-#define LINKINFO_INIT	0x01
-/* If set, verification of corresponding inode is completed successfully */
-#define LINKINFO_CHECK	0x02
-
-/* info saved for each indirect link encountered */
-struct IndirectLinkInfo {
-	/* linkID is link reference number for file hard links, and 
-	 * inodeID for directory hard links.
-	 */
-	UInt32	linkID;	
-	UInt32	linkCount;
-	UInt32 	flags;
-	struct HardLinkList *list;
-};
-
-#define VISITED_INODE_ID 1
-
 struct HardLinkInfo {
 	UInt32	privDirID;
 	SGlobPtr globals;
-	PrimeBuckets	*fileBucket;
-};
-
-struct HardLinkList {
-	UInt32	prev;
-	UInt32	fileID;
-	UInt32	next;
+	HardLinkTable	links;	/* file hard links with kHFSHasLinkChainBit set */
 };
 
 HFSPlusCatalogKey gMetaDataDirKey = {
@@ -79,44 +55,331 @@ static int  RecordBadHardLinkPrev(SGlobPtr gp, UInt32 fileID, UInt32 is, UInt32
 static int  RecordBadLinkCount(SGlobPtr gp, UInt32 inodeID, UInt32 is, UInt32 shouldbe) ;
 static int  RecordOrphanLink(SGlobPtr gp, Boolean isdir, UInt32 linkID);
 static int  RecordOrphanInode(SGlobPtr gp, Boolean isdir, UInt32 inodeID);
-static void hash_insert(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo);
-static struct IndirectLinkInfo * hash_search(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo);
+
+/*
+ * Hard link tables
+ *
+ * Hard links are appended to a table as they are found, and the table
+ * is sorted once, on inodeID and then linkID, before the links are
+ * checked.  The links to an inode are then a run of the table, and any
+ * one link is found by binary search, so that no link needs to be looked
+ * up in the catalog btree again.
+ */
+#define HARDLINK_TABLE_MIN	1024
+
+/* Sixteen bit digit d of the <inodeID, linkID> key, zero being the lowest */
+#define HARDLINK_DIGIT(t, d)	\
+	((((d) < 2 ? (t)->linkID : (t)->inodeID) >> (((d) & 1) * 16)) & 0xFFFF)
+
+#define HARDLINK_KEY(t)		(((UInt64)(t)->inodeID << 32) | (t)->linkID)
+
+/*
+ * hardlink_table_add
+ *
+ * Append a hard link to the table, growing it by half when full.
+ * Returns ENOMEM, and marks the table failed, if it cannot grow.
+ */
+int
+hardlink_table_add(HardLinkTable *table, UInt32 inodeID, UInt32 linkID,
+		UInt32 prev, UInt32 next)
+{
+	HardLinkTuple *links;
+	HardLinkTuple *link;
+	UInt32 size;
+
+	if (table->count == table->size) {
+		size = table->size ? table->size + table->size / 2 : HARDLINK_TABLE_MIN;
+		if (size <= table->size) {
+			table->failed = true;
+			return ENOMEM;
+		}
+		links = SpillReallocate(table->links, (size_t)size * sizeof(HardLinkTuple));
+		if (links == NULL) {
+			table->failed = true;
+			return ENOMEM;
+		}
+		table->links = links;
+		table->size = size;
+	}
+
+	link = &table->links[table->count++];
+	link->inodeID = inodeID;
+	link->linkID = linkID;
+	link->prev = prev;
+	link->next = next;
+	table->sorted = false;
+
+	return 0;
+}
+
+/*
+ * SortHardLinkTuples
+ *
+ * Least significant digit first radix sort of count tuples on their
+ * <inodeID, linkID> key, sixteen bits a pass, starting at firstDigit
+ * (two sorts on inodeID alone).  The sort is stable.  A pass over a
+ * digit all the tuples share is skipped, so IDs below 65536 cost one
+ * pass each for inodeID and linkID, and tuples already in order cost
+ * none.
+ *
+ * Returns the sorted tuples, which are either those passed in or a new
+ * array from SpillAllocate, in which case the one passed in (which must
+ * be from there too) has been freed.  Returns NULL, leaving the tuples
+ * as they were, if there is no memory.
+ */
+static HardLinkTuple *
+SortHardLinkTuples(HardLinkTuple *tuples, UInt32 count, int firstDigit)
+{
+	HardLinkTuple *from;
+	HardLinkTuple *to;
+	HardLinkTuple *tmp;
+	UInt32 *counts;
+	UInt32 *digit;
+	UInt32 i, n, sum;
+	int d;
+
+	for (i = 1; i < count; i++) {
+		if (firstDigit < 2 ? (HARDLINK_KEY(&tuples[i - 1]) > HARDLINK_KEY(&tuples[i]))
+				   : (tuples[i - 1].inodeID > tuples[i].inodeID)) {
+			break;
+		}
+	}
+	if (i >= count) {
+		return tuples;
+	}
+
+	counts = calloc(4 * 65536, sizeof(UInt32));
+	to = SpillAllocate((size_t)count * sizeof(HardLinkTuple));
+	if ((counts == NULL) || (to == NULL)) {
+		free(counts);
+		SpillDispose(to);
+		return NULL;
+	}
+
+	/* Count every digit in one pass */
+	for (i = 0; i < count; i++) {
+		for (d = firstDigit; d < 4; d++) {
+			counts[d * 65536 + HARDLINK_DIGIT(&tuples[i], d)]++;
+		}
+	}
+
+	from = tuples;
+	for (d = firstDigit; d < 4; d++) {
+		digit = &counts[d * 65536];
+		if (digit[HARDLINK_DIGIT(&from[0], d)] == count) {
+			continue;
+		}
+		for (sum = 0, i = 0; i < 65536; i++) {
+			n = digit[i];
+			digit[i] = sum;
+			sum += n;
+		}
+		for (i = 0; i < count; i++) {
+			to[digit[HARDLINK_DIGIT(&from[i], d)]++] = from[i];
+		}
+		tmp = from;
+		from = to;
+		to = tmp;
+	}
+
+	free(counts);
+	SpillDispose(to);
+
+	return from;
+}
+
+/*
+ * hardlink_table_sort
+ *
+ * Sort the table, and clear the record of which walk reached each link.
+ * Returns ENOMEM if the table is incomplete or there is no memory.
+ */
+int
+hardlink_table_sort(HardLinkTable *table)
+{
+	HardLinkTuple *links;
+
+	if (table->failed) {
+		return ENOMEM;
+	}
+
+	if (!table->sorted && (table->count > 1)) {
+		links = SortHardLinkTuples(table->links, table->count, 0);
+		if (links == NULL) {
+			return ENOMEM;
+		}
+		if (links != table->links) {
+			table->links = links;
+			table->size = table->count;
+		}
+	}
+	table->sorted = true;
+
+	SpillDispose(table->walk);
+	table->walk = SpillAllocate((table->count ? table->count : 1) * sizeof(UInt32));
+	if (table->walk == NULL) {
+		return ENOMEM;
+	}
+	table->walks = 0;
+	table->mismatch = false;
+
+	return 0;
+}
+
+/* Index of the first link in the sorted table not before <inodeID, linkID> */
+static UInt32
+hardlink_table_lower(HardLinkTable *table, UInt32 inodeID, UInt32 linkID)
+{
+	UInt64 key = ((UInt64)inodeID << 32) | linkID;
+	UInt32 lo = 0;
+	UInt32 hi = table->count;
+	UInt32 mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (HARDLINK_KEY(&table->links[mid]) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/*
+ * hardlink_table_find
+ *
+ * Find the link with the given ID to the given inode in the sorted table.
+ * Returns NULL if there is no such link.
+ */
+HardLinkTuple *
+hardlink_table_find(HardLinkTable *table, UInt32 inodeID, UInt32 linkID)
+{
+	UInt32 i;
+
+	i = hardlink_table_lower(table, inodeID, linkID);
+	if ((i < table->count) &&
+	    (table->links[i].inodeID == inodeID) &&
+	    (table->links[i].linkID == linkID)) {
+		return &table->links[i];
+	}
+
+	return NULL;
+}
+
+/* Start the walk of another inode's chain of hard links */
+void
+hardlink_table_begin_walk(HardLinkTable *table)
+{
+	table->walks++;
+}
+
+/*
+ * hardlink_table_visit
+ *
+ * Note that the current walk has reached a link.  Returns non-zero if
+ * it already had.  A link already reached by another walk marks the
+ * table as not matching the chains.
+ */
+int
+hardlink_table_visit(HardLinkTable *table, HardLinkTuple *link)
+{
+	UInt32 *walk = &table->walk[link - table->links];
+
+	if (*walk == table->walks) {
+		return 1;
+	}
+	if (*walk != 0) {
+		table->mismatch = true;
+	}
+	*walk = table->walks;
+
+	return 0;
+}
+
+/*
+ * hardlink_table_mismatch
+ *
+ * Returns zero if the walks of all the chains between them reached every
+ * link in the table once, and no link that is not in the table.
+ */
+int
+hardlink_table_mismatch(HardLinkTable *table)
+{
+	UInt32 i;
+
+	if (table->mismatch) {
+		return 1;
+	}
+	for (i = 0; i < table->count; i++) {
+		if (table->walk[i] == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+hardlink_table_dispose(HardLinkTable *table)
+{
+	SpillDispose(table->links);
+	SpillDispose(table->walk);
+	ClearMemory(table, sizeof(*table));
+}
 
 /*
  * Some functions used when sorting the hard link chain.
- * chain_compare() is used by qsort; find_id is just a linear
- * search to find a specific fileID; and tsort does a
+ * chain_compare() is used by qsort to order the links by their
+ * previous link; find_id finds a link in the run of the table
+ * for one inode, which is in order of link ID; and tsort does a
  * topological sort on the linked list.
  */
 static int
 chain_compare(const void *a1, const void *a2) {
-	struct HardLinkList *left = (struct HardLinkList*)a1;
-	struct HardLinkList *right = (struct HardLinkList*)a2;
+	const HardLinkTuple *left = *(HardLinkTuple * const *)a1;
+	const HardLinkTuple *right = *(HardLinkTuple * const *)a2;
 
-	return (left->prev - right->prev);
+	return (left->prev < right->prev) ? -1 : (left->prev > right->prev);
 }
 
 static int
-find_id(struct HardLinkList *list, int nel, int id)
+find_id(HardLinkTuple *list, int nel, UInt32 id)
 {
-	int i;
-	for (i = 0; i < nel; i++) {
-		if (list[i].fileID == id)
-			return i;
+	int lo = 0, hi = nel, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (list[mid].linkID < id)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return 0;
+	return (lo < nel && list[lo].linkID == id) ? lo : -1;
 }
 
+/*
+ * tsort
+ *
+ * Return in *chain a copy of the list in chain order.  The list is
+ * left as it was.
+ */
 static int
-tsort(struct HardLinkList *list, int nel)
+tsort(HardLinkTuple *list, int nel, HardLinkTuple **chain)
 {
-	struct HardLinkList *tmp;
+	HardLinkTuple *tmp = NULL;
+	HardLinkTuple **order = NULL;
+	UInt8 *seen = NULL;
 	int cur_indx, tmp_indx = 0;
+	int i;
 
 	int rv = 0;
 
-	tmp = calloc(sizeof(struct HardLinkList), nel);
-	if (tmp == NULL) {
+	tmp = malloc(nel * sizeof(HardLinkTuple));
+	order = malloc(nel * sizeof(HardLinkTuple *));
+	seen = calloc(nel, sizeof(UInt8));
+	if (tmp == NULL || order == NULL || seen == NULL) {
 		rv = ENOMEM;
 		goto done;
 	}
@@ -127,41 +390,42 @@ tsort(struct HardLinkList *list, int nel)
 	 * graph, in other words).  If there aren't any with a prev of 0,
 	 * then the chain is broken somehow, and we'll repair it later.
 	 */
-	qsort(list, nel, sizeof(list[0]), chain_compare);
+	for (i = 0; i < nel; i++)
+		order[i] = &list[i];
+	qsort(order, nel, sizeof(order[0]), chain_compare);
 
 	for (cur_indx = 0; cur_indx < nel; cur_indx++) {
-		int i;
 		/* Skip nodes we've already come across */
-		if (list[cur_indx].fileID == 0)
+		i = order[cur_indx] - list;
+		if (seen[i])
 			continue;
 
-		/* Copy this node over to the new list */
-		tmp[tmp_indx++] = list[cur_indx];
-		list[cur_indx].fileID = 0;
-
-		/* ... and then find all its children. */
-		for (i = tmp[tmp_indx-1].next; i != 0; ) {
-			// look for the node in list with that fileID
-			int j = find_id(list, nel, i);
-			if (j == 0) {
-				// We couldn't find it
-				// So we're done
-				i = 0;
-			} else {
-				// we add this one to tmp
-				tmp[tmp_indx++] = list[j];
-				list[j].fileID = 0;
-				i = tmp[tmp_indx-1].next;
-			}
+		/* Copy this node over to the new list, and then all its children. */
+		for (;;) {
+			tmp[tmp_indx++] = list[i];
+			seen[i] = 1;
+			if (list[i].next == 0)
+				break;
+			// look for the node in list with that fileID;
+			// if we can't find it, we're done
+			i = find_id(list, nel, list[i].next);
+			if (i < 0 || seen[i])
+				break;
 		}
 	}
 
-	/* Copy the temporary list over, and we're done. */
-	memcpy(list, tmp, nel * sizeof(struct HardLinkList));
+	*chain = tmp;
+	tmp = NULL;
 done:
 	if (tmp) {
 		free(tmp);
 	}
+	if (order) {
+		free(order);
+	}
+	if (seen) {
+		free(seen);
+	}
 
 	return rv;
 }
@@ -174,12 +438,13 @@ done:
  * are detected, create repair order.
  *
  * To do this, we need to topologically sort the list, and then ensure that the prev/next
- * chains are correct.
+ * chains are correct.  The list is the run of a sorted table for one inode.
  *
  */
 static int
-CheckHardLinkList(SGlobPtr gp, UInt32 inodeID, struct HardLinkList *list, int calc_link_count, UInt32 firstID)
+CheckHardLinkList(SGlobPtr gp, UInt32 inodeID, HardLinkTuple *links, int calc_link_count, UInt32 firstID)
 {
+	HardLinkTuple *list = links;
 	int retval;
 	int indx;
 
@@ -194,7 +459,7 @@ CheckHardLinkList(SGlobPtr gp, UInt32 inodeID, struct HardLinkList *list, int ca
 	 * we're sorted, and tsort() above does the hard work for that.
 	 */
 	if (calc_link_count > 1) {
-		retval = tsort(list, calc_link_count);
+		retval = tsort(links, calc_link_count, &list);
 		if (retval) {
 			goto done;
 		}
@@ -202,28 +467,28 @@ CheckHardLinkList(SGlobPtr gp, UInt32 inodeID, struct HardLinkList *list, int ca
 
 	/* Previous link of first link should always be zero */
 	if (list[0].prev != 0) {
-		RecordBadHardLinkPrev(gp, list[0].fileID, list[0].prev, 0);
+		RecordBadHardLinkPrev(gp, list[0].linkID, list[0].prev, 0);
 	}
 
 	/* First ID in the inode should match the ID of the first hard link */
-	if (list[0].fileID != firstID) {
-		RecordBadHardLinkChainFirst(gp, inodeID, firstID, list[0].fileID);
+	if (list[0].linkID != firstID) {
+		RecordBadHardLinkChainFirst(gp, inodeID, firstID, list[0].linkID);
 	}
 
 	/* Check if the previous/next IDs for all nodes except the first node are valid */
 	for (indx = 1; indx < calc_link_count; indx++) {
-		if (list[indx-1].next != list[indx].fileID) {
-			RecordBadHardLinkNext(gp, list[indx-1].fileID, list[indx-1].next, list[indx].fileID);
+		if (list[indx-1].next != list[indx].linkID) {
+			RecordBadHardLinkNext(gp, list[indx-1].linkID, list[indx-1].next, list[indx].linkID);
 		}
 
-		if (list[indx].prev != list[indx-1].fileID) {
-			RecordBadHardLinkPrev(gp, list[indx].fileID, list[indx].prev, list[indx-1].fileID);
+		if (list[indx].prev != list[indx-1].linkID) {
+			RecordBadHardLinkPrev(gp, list[indx].linkID, list[indx].prev, list[indx-1].linkID);
 		}
 	}
 
 	/* Next ID for the last link should always be zero */
 	if (list[calc_link_count-1].next != 0) {
-		RecordBadHardLinkNext(gp, list[calc_link_count-1].fileID, list[calc_link_count-1].next, 0);
+		RecordBadHardLinkNext(gp, list[calc_link_count-1].linkID, list[calc_link_count-1].next, 0);
 	}
 
 done:
@@ -231,10 +496,13 @@ done:
 	/* This is just for debugging -- it's useful to know what the list looks like */
 	if (fsckGetVerbosity(gp->context) >= kDebugLog) {
 		for (indx = 0; indx < calc_link_count; indx++) {
-			fplog(stderr, "CNID %u: #%u:  <%u, %u, %u>\n", inodeID, indx, list[indx].prev, list[indx].fileID, list[indx].next);
+			fplog(stderr, "CNID %u: #%u:  <%u, %u, %u>\n", inodeID, indx, list[indx].prev, list[indx].linkID, list[indx].next);
 		}
 	}
 #endif
+	if (list != links) {
+		free(list);
+	}
 
 	return 0;
 }
@@ -276,13 +544,7 @@ HardLinkCheckBegin(SGlobPtr gp, void** cookie)
 	 */
 	gp->filelink_priv_dir_id = folderID;
 
-
-	info->fileBucket = calloc(1, sizeof(PrimeBuckets));
-	if (info->fileBucket == NULL) {
-		if (fsckGetVerbosity(gp->context) >= kDebugLog) {
-			plog("HardLinkCheckBegin: prime bucket allocation failed\n");
-		}
-	}
+	ClearMemory(&info->links, sizeof(info->links));
 
 	* cookie = info;
 	return (0);
@@ -301,158 +563,116 @@ HardLinkCheckEnd(void * cookie)
 		struct HardLinkInfo *		infoPtr;
 		
 		infoPtr = (struct HardLinkInfo *) cookie;
-		if (infoPtr->fileBucket) {
-			free(infoPtr->fileBucket);
-			infoPtr->fileBucket = NULL;
-		}
+		hardlink_table_dispose(&infoPtr->links);
 		DisposeMemory(cookie);
 	}
 
 }
 
-/* Structures for file hard link hash used when a 
- * file hard link created in pre-Leopard OS is detected 
- * i.e. the file inode and hard links do not have the 
- * kHFSHasLinkChainBit set, and the first link, the 
- * previous link and the next link IDs are zero.  The 
- * link count for such hard links cannot be verified 
- * using CRT, therefore it is accounted in this hash.
+/* Tables for file hard links created in pre-Leopard OS, i.e.
+ * the file inode and hard links do not have the
+ * kHFSHasLinkChainBit set, and the first link, the
+ * previous link and the next link IDs are zero.  The
+ * link count for such hard links cannot be verified
+ * from the chains, therefore the links are kept in one
+ * table, as <link reference number, link ID>, and the
+ * inodes in another, as <link reference number, link count>,
+ * and the two are merged once sorted.
  */
-#define FILELINK_HASH_SIZE 257
-
-struct filelink_hash {
-	UInt32 link_ref_num;
-	UInt32 found_link_count;
-	UInt32 calc_link_count;
-	struct filelink_hash *next;
-};
+static HardLinkTable filelink_links;
+static HardLinkTable filelink_inodes;
 
-struct filelink_hash **filelink_head = NULL;
-UInt32 filelink_entry_count = 0;
-
-/* Search and return pointer to the entry for given inode ID.
- * If no entry is found, return NULL.
+/* Add a file hard link that points to given inode to the table.
+ * Returns zero if it was added, and ENOMEM on error.
  */
-static struct filelink_hash *filelink_hash_search(UInt32 link_ref_num) 
+static int filelink_add_link(UInt32 link_ref_num, UInt32 link_id)
 {
-	struct filelink_hash *cur;
-
-	if (filelink_head == NULL) {
-		return NULL;
-	}
-
-	cur = filelink_head[link_ref_num % FILELINK_HASH_SIZE];
-	while (cur) {
-		if (link_ref_num == cur->link_ref_num) {
-			break;
-		}
-		cur = cur->next;
-	}
-
-	return cur;
+	return hardlink_table_add(&filelink_links, link_ref_num, link_id, 0, 0);
 }
 
-/* Allocate and insert entry for given inode ID in the 
- * hash.  The caller function is responsible for searching 
- * for duplicates before calling this function.  
- * Returns the pointer to the new hash entry.
+/* Add given file inode, with the link count value provided,
+ * to the table.
+ * Returns zero if it was added, and ENOMEM on error.
  */
-static struct filelink_hash *filelink_hash_insert(UInt32 link_ref_num) 
+int filelink_add_inode(UInt32 link_ref_num, UInt32 linkCount)
 {
-	struct filelink_hash *cur;
-
-	cur = malloc(sizeof(struct filelink_hash));
-	if (!cur) {
-		return cur;
-	}
-	cur->link_ref_num = link_ref_num;
-	cur->found_link_count = 0;
-	cur->calc_link_count = 0;
-	cur->next = filelink_head[link_ref_num % FILELINK_HASH_SIZE];
-	filelink_head[link_ref_num % FILELINK_HASH_SIZE] = cur; 
-	filelink_entry_count++;
-	return cur;
+	return hardlink_table_add(&filelink_inodes, link_ref_num, linkCount, 0, 0);
 }
 
-/* Update the hash with information about a file hard link 
- * that points to given inode ID.  The calculated link count 
- * for given inode is incremented.
- * Returns zero if the value was successfully updated to hash,
- * and ENOMEM on error.
+/* Compare the number of pre-Leopard hard links found for
+ * each link reference number with the link count of its
+ * inode.  Returns non-zero if they differ for any, or an
+ * inode has no links or the links have no inode.  If more
+ * than one inode has the same link reference number, the
+ * last one found is used.
  */
-static int filelink_hash_link(UInt32 link_ref_num)
+static int filelink_count_mismatch(void)
 {
-	struct filelink_hash *cur;
-	
-	/* If no hash exists, allocate the hash */
-	if (filelink_head == NULL) {
-		filelink_head = calloc(FILELINK_HASH_SIZE, sizeof(struct filelink_hash *));
-		if (filelink_head == NULL) {
-			return ENOMEM;
-		}
-	}
+	HardLinkTuple *links;
+	HardLinkTuple *inodes;
+	UInt32 i = 0, j = 0;
+	UInt32 link_ref_num;
+	UInt32 calc_link_count;
+	UInt32 found_link_count;
 
-	cur = filelink_hash_search(link_ref_num);
-	if (!cur) {
-		cur = filelink_hash_insert(link_ref_num);
+	/* If the tables are incomplete the counts cannot be checked */
+	if (filelink_links.failed || filelink_inodes.failed) {
+		return 0;
 	}
-	if (cur) {
-		cur->calc_link_count++;
+
+	/* The inodes are sorted on link reference number alone so
+	 * that those with the same number stay in the order found.
+	 */
+	if (hardlink_table_sort(&filelink_links) != 0) {
 		return 0;
 	}
+	inodes = filelink_inodes.links;
+	if (filelink_inodes.count > 1) {
+		inodes = SortHardLinkTuples(inodes, filelink_inodes.count, 2);
+		if (inodes == NULL) {
+			return 0;
+		}
+		if (inodes != filelink_inodes.links) {
+			filelink_inodes.links = inodes;
+			filelink_inodes.size = filelink_inodes.count;
+		}
+	}
+	links = filelink_links.links;
 
-	return ENOMEM;
-}
+	while ((i < filelink_links.count) || (j < filelink_inodes.count)) {
+		if ((j == filelink_inodes.count) ||
+		    ((i < filelink_links.count) && (links[i].inodeID < inodes[j].inodeID))) {
+			link_ref_num = links[i].inodeID;
+		} else {
+			link_ref_num = inodes[j].inodeID;
+		}
 
-/* Update the hash with information about given file inode. 
- * The found link count in the hash is updated with the 
- * link count value provided.
- * Returns zero if the value was successfully updated to hash,
- * and ENOMEM on error.
- */ 
-int filelink_hash_inode(UInt32 link_ref_num, UInt32 linkCount)
-{
-	struct filelink_hash *cur;
+		for (calc_link_count = 0;
+		     (i < filelink_links.count) && (links[i].inodeID == link_ref_num);
+		     i++) {
+			calc_link_count++;
+		}
+		for (found_link_count = 0;
+		     (j < filelink_inodes.count) && (inodes[j].inodeID == link_ref_num);
+		     j++) {
+			found_link_count = inodes[j].linkID;
+		}
 
-	/* If no hash exists, allocate the hash */
-	if (filelink_head == NULL) {
-		filelink_head = calloc(FILELINK_HASH_SIZE, sizeof(struct filelink_hash *));
-		if (filelink_head == NULL) {
-			return ENOMEM;
+		if ((found_link_count == 0) ||
+		    (calc_link_count == 0) ||
+		    (found_link_count != calc_link_count)) {
+			return 1;
 		}
 	}
 
-	cur = filelink_hash_search(link_ref_num);
-	if (!cur) {
-		cur = filelink_hash_insert(link_ref_num);
-	}
-	if (cur) {
-		cur->found_link_count = linkCount;
-		return 0;
-	} 
-	return ENOMEM;
+	return 0;
 }
 
-/* If the file link hash was used to account for 
- * link count of file hard links created on pre-Leopard
- * OS, destroy the hash by freeing all allocated 
- * memory.
- */
-static void filelink_hash_destroy(void) 
+/* Free the tables of pre-Leopard file hard links */
+static void filelink_destroy(void)
 {
-	int i;
-	struct filelink_hash *cur;
-
-	for (i = 0; i < FILELINK_HASH_SIZE; i++) {
-		while (filelink_head[i]) {
-			cur = filelink_head[i];
-			filelink_head[i] = cur->next;
-			free (cur);
-		}
-	}
-	free(filelink_head);
-	filelink_head = NULL;
-	filelink_entry_count = 0;
+	hardlink_table_dispose(&filelink_links);
+	hardlink_table_dispose(&filelink_inodes);
 }
 
 /*
@@ -472,21 +692,23 @@ CaptureHardLink(void *cookie, const HFSPlusCatalogFile *file)
 	 * and instead account the information in hash to verify the 
 	 * link counts later.
 	 */
-	if ((info->fileBucket == NULL) || 
-	    (((file->flags & kHFSHasLinkChainMask) == 0) && 
-	     (file->hl_prevLinkID == 0) && 
-	     (file->hl_nextLinkID == 0))) {
-		filelink_hash_link(file->hl_linkReference);
+	if (((file->flags & kHFSHasLinkChainMask) == 0) && 
+	    (file->hl_prevLinkID == 0) && 
+	    (file->hl_nextLinkID == 0)) {
+		(void) filelink_add_link(file->hl_linkReference, file->fileID);
+	} else if ((file->flags & kHFSHasLinkChainMask) == 0) {
+		/* The link is in a chain without the bit that says so.  
+		 * It is left out of the table, so that a walk of the 
+		 * chain looks it up in the catalog and stops there.
+		 */
+		record_link_badchain(info->globals, false);
 	} else {
-		/* For file hard links, add link reference number 
-		 * and catalog link ID pair to the prime buckets.
+		/* For file hard links, add link reference number, 
+		 * catalog link ID and the IDs of the links either side 
+		 * to the table, to be sorted and walked later.
 		 */
-		hardlink_add_bucket(info->fileBucket, file->hl_linkReference, 
-			file->fileID);
-
-		if ((file->flags & kHFSHasLinkChainMask) == 0) {
-			record_link_badchain(info->globals, false);
-		}
+		(void) hardlink_table_add(&info->links, file->hl_linkReference, 
+			file->fileID, file->hl_prevLinkID, file->hl_nextLinkID);
 	}
 
 	return;
@@ -502,7 +724,7 @@ int
 RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 {
 	int result = 0;
-	struct IndirectLinkInfo *linkInfo = NULL;
+	HardLinkTable	links;
 	CatalogRecord	rec;
 	HFSPlusCatalogKey	*keyp;
 	BTreeIterator	iterator;
@@ -512,13 +734,13 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 	UInt32	metadirid;
 	SFCB	*fcb;
 	size_t	prefixlen;
-	int	slotsUsed = 0, slots = 0;
 	char *prefixName;
-	UInt32 folderID;
 	UInt32 link_ref_num;
-	int entries;
+	UInt32 first, last, i;
 	UInt32 flags;
 
+	ClearMemory(&links, sizeof(links));
+
 	if (isdir) {
 		metadirid = gp->dirlink_priv_dir_id;
 		prefixlen = strlen(HFS_DIRINODE_PREFIX);
@@ -541,29 +763,6 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 		goto done;
 	}
 
-	// Initialize the hash
-	if (GetPrivateDir(gp, &rec) == 0 && rec.hfsPlusFolder.valence != 0) {
-		entries = rec.hfsPlusFolder.valence + 10;
-		folderID = rec.hfsPlusFolder.folderID;
-	} else {
-		entries = 1000;
-		folderID = 0;
-	}
-
-	for (slots = 1; slots <= entries; slots <<= 1)
-		continue;
-	if (slots < (entries + (entries/3)))
-		slots <<= 1;
-	linkInfo = calloc(slots, sizeof(struct IndirectLinkInfo));
-	if (linkInfo == NULL) {
-		if (fsckGetVerbosity(gp->context) >= kDebugLog) {
-			plog("RepairHardLinkChains:  calloc(%d, %zu) failed\n", slots, sizeof(struct IndirectLinkInfo));
-		}
-		result = ENOMEM;
-		goto done;
-	}
-	// Done initializing the hash
-
 	// Set up the catalog BTree iterator
 	// (start from the root folder, and work our way down)
 	fcb = gp->calculatedCatalogFCB;
@@ -574,22 +773,13 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 	btrec.itemCount = 1;
 	btrec.itemSize = sizeof(rec);
 
-	/* Counter for number of inodes found and verified in the
-	 * hash.  When an inode is found when checking the hard links,
-	 * the value is incremented.  When an inode's linked list and 
-	 * link count are verified, the value is decremented.  If 
-	 * this value remains non-zero at the end, there are 
-	 * orphan hard links.
-	 */
-	entries = 0;
-
 	/*
 	 * This chunk of code iterates through the entire catalog BTree.
 	 * For each hard link node (that is, the "directory entry" that
-	 * points to the actual node in the metadata directory), it may
-	 * add it to the hash (if it doesn't exist yet; it also then increments
-	 * the link count for that "inode"); it also creates an array
-	 * of <previous, fileid, next> for the linked list.
+	 * points to the actual node in the metadata directory), it
+	 * adds <inode, fileid, previous, next> to a table, which is
+	 * sorted afterwards so that the links to each "inode" are
+	 * together, in order of fileid.
 	 */
 	for (result = BTIterateRecord(fcb, kBTreeFirstRecord, &iterator, &btrec, &reclen);
 		result == 0;
@@ -623,11 +813,6 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 			islink = true;
 		}
 		if (islink) {
-			struct IndirectLinkInfo *li = NULL;
-			struct HardLinkList *tlist = NULL;
-			int i;
-			int count;
-
 			linkID = file->fileID;
 			inodeID = file->bsdInfo.special.iNodeNum;
 
@@ -664,55 +849,17 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 				}
 			}
 
-			/* For directory hard links, hash using inodeID.  For 
-			 * file hard links, hash using link reference number 
+			/* For directory hard links, key the table using inodeID.  
+			 * For file hard links, key using link reference number 
 			 * (which is same as inode ID for file hard links 
-			 * created post-Tiger).  For each inodeID, add the 
+			 * created post-Tiger).  For each link, add the 
 			 * <prev, id, next> triad.
 			 */
-			li = hash_search(inodeID, slots, slotsUsed, linkInfo);
-			if (li) {
-				li->linkCount++;
-			} else {
-				entries++;
-				/* hash_insert() initializes linkCount to 1 */
-				hash_insert(inodeID, slots, slotsUsed++, linkInfo);
-				li = hash_search(inodeID, slots, slotsUsed, linkInfo);
-			}
-			if (li == NULL) {
-				/*
-				 * Either the hash passed in should have the entry, or
-				 * the one we just created should (because we just added it);
-				 * either way, if it's not here, we've got something weird
-				 * going on, so let's just abort now.
-				 */
-				result = ENOENT;
+			result = hardlink_table_add(&links, inodeID, linkID,
+					file->hl_prevLinkID, file->hl_nextLinkID);
+			if (result) {
 				goto done;
 			}
-
-			count = li->linkCount - 1;
-			/* Reallocate memory to store information about file/directory hard links */
-			if ((count % 10) == 0) {
-				tlist = realloc(li->list, (count + 10) * sizeof(struct HardLinkList));
-				if (tlist == NULL) {
-					free(li->list);
-					li->list = NULL;
-					result = ENOMEM;
-					goto done;
-				} else {
-					li->list = tlist;	// May be the same
-					for (i = count; i < (count + 10); i++) {
-						memset(&li->list[i], 0, sizeof(li->list[i]));
-					}
-				}
-			}
-
-			/* Store information about this hard link */
-			if (li->list) {
-				li->list[count].fileID = linkID;
-				li->list[count].prev = file->hl_prevLinkID;
-				li->list[count].next = file->hl_nextLinkID;
-			}
 		}
 	}
 
@@ -723,6 +870,11 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 		goto done;
 	}
 
+	result = hardlink_table_sort(&links);
+	if (result) {
+		goto done;
+	}
+
 	/*
 	 * Next, we iterate through the metadata directory, and check the linked list.
 	 */
@@ -739,7 +891,6 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 		result = BTIterateRecord(fcb, kBTreeNextRecord, &iterator, &btrec, &reclen)) {
 		unsigned char filename[64];
 		size_t len;
-		struct IndirectLinkInfo *li = NULL;
 
 		if (rec.recordType == kHFSPlusFolderThreadRecord ||
 		    rec.recordType == kHFSPlusFileThreadRecord)
@@ -760,12 +911,22 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 			inodeID = rec.hfsPlusFolder.folderID;
 			link_ref_num = 0;
 			flags = rec.hfsPlusFolder.flags;
-			li = hash_search(inodeID, slots, slotsUsed, linkInfo);
+			first = hardlink_table_lower(&links, inodeID, 0);
 		} else {
 			inodeID = rec.hfsPlusFile.fileID;
 			link_ref_num = atol((char*)&filename[prefixlen]);
 			flags = rec.hfsPlusFile.flags;
-			li = hash_search(link_ref_num, slots, slotsUsed, linkInfo);
+			first = hardlink_table_lower(&links, link_ref_num, 0);
+		}
+
+		/* The links to this inode are the run of the table from 
+		 * first, and are marked as checked.
+		 */
+		for (last = first; 
+		     (last < links.count) && 
+		     (links.links[last].inodeID == (isdir ? inodeID : link_ref_num));
+		     last++) {
+			links.walk[last] = 1;
 		}
 
 		/* file/directory inode should always have kHFSHasLinkChainBit set */
@@ -774,7 +935,7 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 				flags | kHFSHasLinkChainMask, true);
 		}
 
-		if (li) {
+		if (last > first) {
 			UInt32 first_link_id = 0;
 			uint32_t linkCount = 0;
 
@@ -785,17 +946,14 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 			}
 
 			/* Check and create repairs for doubly linked list */
-			result = CheckHardLinkList(gp, inodeID, li->list, li->linkCount, first_link_id);
+			result = CheckHardLinkList(gp, inodeID, &links.links[first], last - first, first_link_id);
 
 			linkCount = isdir ? rec.hfsPlusFolder.bsdInfo.special.linkCount : rec.hfsPlusFile.bsdInfo.special.linkCount;
-			if (linkCount != li->linkCount) {
-				RecordBadLinkCount(gp, inodeID, linkCount, li->linkCount);
+			if (linkCount != last - first) {
+				RecordBadLinkCount(gp, inodeID, linkCount, last - first);
 			}
-		
-			li->flags |= LINKINFO_CHECK;
-			entries--;
 		} else {
-			/* Not found in hash, this is orphaned file/directory inode */
+			/* Not found in table, this is orphaned file/directory inode */
 			RecordOrphanInode(gp, isdir, inodeID);
 		}
 	}
@@ -807,29 +965,15 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 		goto done;
 	}
 
-	/* Check for orphan hard links */
-	if (entries) {
-	 	int i, j;
-		for (i = 0; i < slots; i++) {
-			/* If node is initialized but never checked, record orphan link */
-			if ((linkInfo[i].flags & LINKINFO_INIT) && 
-			    ((linkInfo[i].flags & LINKINFO_CHECK) == 0)) {
-				for (j = 0; j < linkInfo[i].linkCount; j++) {
-					RecordOrphanLink(gp, isdir, linkInfo[i].list[j].fileID);
-				}
-			}
+	/* Check for orphan hard links: if a link was never checked, record orphan link */
+	for (i = 0; i < links.count; i++) {
+		if (links.walk[i] == 0) {
+			RecordOrphanLink(gp, isdir, links.links[i].linkID);
 		}
 	}
 
 done:
-	if (linkInfo) {
-		int i;
-		for (i = 0; i < slots; i++) {
-			if (linkInfo[i].list)
-				free(linkInfo[i].list);
-		}
-		free(linkInfo);
-	}
+	hardlink_table_dispose(&links);
 
 	return result;
 }
@@ -861,7 +1005,7 @@ CheckHardLinks(void *cookie)
 	size_t prefixlen;
 	int result;
 	unsigned char filename[64];
-	PrimeBuckets *catBucket;
+	HardLinkTable *links;
 
 	/* All done if no hard links exist. */
 	if (info == NULL)
@@ -872,15 +1016,18 @@ CheckHardLinks(void *cookie)
 
 	folderID = info->privDirID;
 
-	catBucket = calloc(1, sizeof(PrimeBuckets));
-	if (catBucket == NULL) {
+	/* Sort the links found in the catalog so that the chains can 
+	 * be walked from the table.  If the table could not be made, 
+	 * the chains are walked in the catalog btree instead, and 
+	 * cannot be compared with the links found.
+	 */
+	links = &info->links;
+	if (hardlink_table_sort(links) != 0) {
 		if (fsckGetVerbosity(gp->context) >= kDebugLog) {
-			plog("CheckHardLinks:  calloc(1, %zu) failed\n", sizeof(PrimeBuckets));
+			plog("CheckHardLinks:  no table of %u hard links\n", links->count);
 		}
-		result = ENOMEM;
-		goto exit;
+		links = NULL;
 	}
-		
 
 	fcb = gp->calculatedCatalogFCB;
 	prefixlen = strlen(HFS_INODE_PREFIX);
@@ -926,7 +1073,7 @@ CheckHardLinks(void *cookie)
 		if (strstr((char *)filename, HFS_INODE_PREFIX) != (char *)filename)
 			continue;
 		
-		result = inode_check(gp, catBucket, (CatalogRecord*)&rec, (CatalogKey*)keyp, false);
+		result = inode_check(gp, NULL, links, (CatalogRecord*)&rec, (CatalogKey*)keyp, false);
 		if (result) {
 			break;
 		}
@@ -939,32 +1086,29 @@ CheckHardLinks(void *cookie)
 
 	/*
 	 * If we've reached this point, and result is clean,
-	 * then we need to compare the two hard link
-	 * buckets:  if they don't match, then we have a hard link chain error, and
-	 * need to either repair it, or just mark the error.
+	 * then we need to compare the links the chains reached with 
+	 * the links in the table:  if they don't match, then we have a hard 
+	 * link chain error, and need to either repair it, or just mark the error.
 	 */
-	if ((result == 0) && (info->fileBucket != NULL)) {
-		result = compare_prime_buckets(catBucket, info->fileBucket);
+	if ((result == 0) && (links != NULL)) {
+		result = hardlink_table_mismatch(links);
 		if (result) {
 			record_link_badchain(gp, false);
 			if (fsckGetVerbosity(gp->context) >= kDebugLog) {
-				plog("\tfilelink prime buckets do not match\n");
+				plog("\tfilelink chains do not match hard links found\n");
 			}
 			goto exit;
 		}
 	}
 
 	/* If hard links created in pre-Leopard OS were detected, they were 
-	 * added to the hash for checking link counts later.  Check the 
-	 * link counts from the hash.  Note that the hard links created in 
+	 * added to tables for checking link counts later.  Check the 
+	 * link counts from the tables.  Note that the hard links created in 
 	 * pre-Leopard OS do not have kHFSHasLinkChainBit set in the inode 
 	 * and the hard links, and the first/prev/next ID is zero --- and 
-	 * hence they were ignored from CRT check and added to hash.
+	 * hence they were ignored from the chain check and added to tables.
 	 */
-	if (filelink_entry_count) {
-		int i;
-		struct filelink_hash *cur;
-
+	if (filelink_links.count || filelink_inodes.count) {
 		/* Since pre-Leopard OS hard links were detected, they 
 		 * should be updated to new version.  This is however 
 		 * an opportunistic repair and no corruption will be 
@@ -972,30 +1116,17 @@ CheckHardLinks(void *cookie)
 		 * file hard link repairs are performed.
 		 */
 		if (fsckGetVerbosity(gp->context) >= kDebugLog) {
-			plog("\tCheckHardLinks: found %u pre-Leopard file inodes.\n", filelink_entry_count);
+			plog("\tCheckHardLinks: found %u pre-Leopard file inodes.\n", filelink_inodes.count);
 		}
 
-		for (i = 0; i < FILELINK_HASH_SIZE; i++) {
-			cur = filelink_head[i];
-			while (cur) {
-				if ((cur->found_link_count == 0) || 
-				    (cur->calc_link_count == 0) ||
-				    (cur->found_link_count != cur->calc_link_count)) {
-					record_link_badchain(gp, false);
-					goto exit;
-				}
-				cur = cur->next;
-			}
+		if (filelink_count_mismatch()) {
+			record_link_badchain(gp, false);
+			goto exit;
 		}
 	}
 
 exit:
-	if (filelink_entry_count) {
-		filelink_hash_destroy();
-	}
-
-	if (catBucket)
-		free(catBucket);
+	filelink_destroy();
 
 	return (result);
 }
@@ -1216,61 +1347,3 @@ RecordBadLinkCount(SGlobPtr gp, UInt32 inodeID, UInt32 is, UInt32 shouldbe)
 	p->parid = inodeID;	// *Not* the parent ID
 	return (0);
 }
-
-
-static void
-hash_insert(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo)
-{
-	int i, last;
-	
-	i = linkID & (totalSlots - 1);
-	
-	last = (i + (totalSlots-1)) % totalSlots;
-	while ((i != last) && 
-	       (linkInfo[i].flags & LINKINFO_INIT) &&
-	       (linkInfo[i].linkID != linkID)) {
-		i = (i + 1) % totalSlots;
-	}
-
-	if ((linkInfo[i].flags & LINKINFO_INIT) == 0) {
-		if (linkInfo[i].list) {
-			plog ("hash: overwriting data! (old:%u, new:%u)\n", linkInfo[i].linkID, linkID);
-			exit(13);
-		}
-		linkInfo[i].flags |= LINKINFO_INIT;
-		linkInfo[i].linkID = linkID;
-		linkInfo[i].linkCount = 1;
-	} else if (linkInfo[i].linkID == linkID) {
-		plog("hash: duplicate insert! (%d)\n", linkID);
-		exit(13);
-	} else {
-		plog("hash table full (%d entries) \n", slotsUsed);
-		exit(14);
-	}
-}
-
-
-static struct IndirectLinkInfo *
-hash_search(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo)
-{
-	int i, last;
-	int p = 1;
-
-	
-	i = linkID & (totalSlots - 1);
-
-	last = (i + (slotsUsed-1)) % totalSlots;
-	while ((i != last) && 
-	       (linkInfo[i].flags & LINKINFO_INIT) &&
-	       (linkInfo[i].linkID != linkID)) {
-		i = (i + 1) % totalSlots;
-		++p;
-	}
-	
-	if ((linkInfo[i].flags & LINKINFO_INIT) && 
-	    (linkInfo[i].linkID == linkID)) {
-		return (&linkInfo[i]);
-	} else {
-		return (NULL);
-	}
-}
@@ -40,6 +40,7 @@
 
 // local routines
 static void	InvalidateBTreeIterator ( SFCB *fcb );
+static void	ExtentsWritten ( SFCB *fcb );
 static OSErr	CheckBTreeKey(const BTreeKey *key, const BTreeControlBlock *btcb);
 static Boolean	ValidHFSRecord(const void *record, const BTreeControlBlock *btcb, UInt16 recordSize);
 
@@ -249,6 +250,7 @@ OSErr InsertBTreeRecord(SFCB *fcb, const void* key, const void* data, UInt16 dat
 	*newHint = iterator.hint.nodeNum;
 
 	InvalidateBTreeIterator(fcb);	// invalidate current record markers
+	ExtentsWritten(fcb);
 	
 ErrorExit:
 
@@ -275,6 +277,7 @@ OSErr DeleteBTreeRecord(SFCB *fcb, const void* key)
 	result = BTDeleteRecord( fcb, &iterator );
 
 	InvalidateBTreeIterator(fcb);	// invalidate current record markers
+	ExtentsWritten(fcb);
 
 ErrorExit:
 
@@ -311,6 +314,7 @@ OSErr ReplaceBTreeRecord(SFCB *fcb, const void* key, UInt32 hint, void *newData,
 	*newHint = iterator.hint.nodeNum;
 
 	//do we need to invalidate the iterator?
+	ExtentsWritten(fcb);
 
 ErrorExit:
 
@@ -427,6 +431,15 @@ InvalidateBTreeIterator(SFCB *fcb)
 }
 
 
+//	A change to the extents B-tree makes any extent map MapFileBlockC built from it stale.
+static void
+ExtentsWritten(SFCB *fcb)
+{
+	if ( fcb->fcbFileID == kHFSExtentsFileID && fcb->fcbVolume != NULL )
+		++fcb->fcbVolume->vcbExtentsWriteCount;
+}
+
+
 static OSErr CheckBTreeKey(const BTreeKey *key, const BTreeControlBlock *btcb)
 {
 	UInt16	keyLen;
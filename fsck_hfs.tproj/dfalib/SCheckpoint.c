@@ -0,0 +1,718 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Checkpoints of the verify pass (-k).
+ *
+ * With -k, ScavCtrl writes what the verify has found so far to a state
+ * file each time a group of checks finishes, and a later fsck_hfs given
+ * the same file carries on after the last group written, as long as the
+ * volume has not changed in between.  The groups are:
+ *
+ *	kCheckpointExtents	ExtBTChk, BadBlockFileExtentCheck
+ *	kCheckpointCatalog	CheckCatalogBTree, CatHChk, CheckFolderCount
+ *	kCheckpointAttributes	AttrBTChk, FindOrigOverlapFiles, dirhardlink_check
+ *
+ * Checkpoints are only taken between groups because that is where the
+ * state carried forward is small and complete.  The tables a group
+ * builds for itself -- the hard link tables, the folder counts, catHier,
+ * the position of each B-tree walk -- have been used up by its end, and
+ * all that is left of them is status bits and repair orders.  So what
+ * is kept is: the status words and repair level; the calculated volume
+ * counts, and the calculated header and node map of each B-tree; the
+ * in-memory volume bitmap; the repair orders, missing threads and
+ * overlapped extents; and the xattr and directory hard link counts that
+ * the later checks compare against.
+ *
+ * A checkpoint is only used if the volume header (or MDB) -- its size,
+ * create and modify dates and write count -- and the start of the
+ * journal header are as they were when it was taken.  Mounting the
+ * volume changes its write count, and replaying its journal changes the
+ * journal header.  A repair keeps the dates, and may write outside the
+ * journal, so fsck_hfs counts each write of the volume header (or MDB)
+ * in the write count itself (see FlushVolumeControlBlock), and ScavCtrl
+ * removes the checkpoint before any repair and only resumes from one on
+ * the first verify pass.  The file is written beside itself and renamed into
+ * place, so it always holds the whole of one checkpoint.  It is in the
+ * host's byte order, to be resumed on the same machine, and is removed
+ * once a verify completes.
+ */
+
+#include "Scavenger.h"
+#include <unistd.h>
+
+#define kCheckpointMagic	0x68667363	/* 'hfsc' */
+#define kCheckpointVersion	1
+#define kJournalHeaderBytes	64
+#define kMaxRepairOrderExtra	(64 * 1024)
+
+/* What identifies the state of the volume a checkpoint was taken of */
+typedef struct CheckpointVolume {
+	UInt32		signature;
+	UInt32		blockSize;
+	UInt64		totalBlocks;
+	UInt32		createDate;
+	UInt32		modifyDate;
+	UInt32		writeCount;
+	UInt32		journalInfoBlock;
+	UInt8		journal[kJournalHeaderBytes];	/* Journal header, as on disk */
+} CheckpointVolume;
+
+typedef struct CheckpointHeader {
+	UInt32		magic;
+	UInt32		version;
+	UInt32		phase;			/* Last group of checks done */
+	UInt32		chkLevel;
+	CheckpointVolume volume;
+} CheckpointHeader;
+
+/* The scavenger globals carried from one group of checks to the next */
+typedef struct CheckpointGlobals {
+	SInt16		RepLevel;
+	UInt16		VIStat;
+	UInt16		ABTStat;
+	UInt16		EBTStat;
+	UInt16		CBTStat;
+	UInt16		VeryMinorErrorsStat;
+	UInt16		JStat;
+	UInt16		PrintStat;
+	UInt32		CatStat;
+	UInt64		itemsProcessed;
+
+	UInt64		vcbEncodingsBitmap;
+	UInt32		vcbNextCatalogID;
+	UInt32		vcbFolderCount;
+	UInt32		vcbFileCount;
+	SInt16		vcbNmFls;
+	SInt16		vcbNmRtDirs;
+
+	uint32_t	cat_ea_count;
+	uint32_t	cat_acl_count;
+	uint32_t	attr_ea_count;
+	uint32_t	attr_acl_count;
+	PrimeBuckets	CBTAttrBucket;
+	PrimeBuckets	CBTSecurityBucket;
+	PrimeBuckets	ABTAttrBucket;
+	PrimeBuckets	ABTSecurityBucket;
+
+	uint32_t	filelink_priv_dir_id;
+	uint32_t	dirlink_priv_dir_id;
+	uint32_t	dirlink_priv_dir_valence;
+	uint32_t	calculated_dirinodes;
+	uint32_t	calculated_dirlinks;
+
+	/* Number of each kind of entry that follows the B-trees and bitmap */
+	UInt32		repairOrders;
+	UInt32		missingThreads;
+	UInt32		overlappedExtents;
+	UInt32		validFiles;
+} CheckpointGlobals;
+
+/* The calculated header of a B-tree; its node map follows */
+typedef struct CheckpointBTree {
+	UInt32		totalNodes;
+	UInt32		freeNodes;
+	UInt32		treeDepth;
+	UInt32		rootNode;
+	UInt32		leafRecords;
+	UInt32		firstLeafNode;
+	UInt32		lastLeafNode;
+	UInt32		mapSize;		/* Bytes of node map */
+} CheckpointBTree;
+
+/* An overlapped extent; its attribute name, if any, follows */
+typedef struct CheckpointExtent {
+	UInt32		fileID;
+	UInt32		startBlock;
+	UInt32		blockCount;
+	UInt32		attrnameSize;		/* Including the NUL, or 0 */
+	UInt32		forkType;
+} CheckpointExtent;
+
+#define kCheckpointBTrees	3
+
+static const char *gCheckpointPhaseNames[] = {
+	"", "extents", "catalog", "attribute"
+};
+
+static BTreeControlBlock *CheckpointBTCB( SGlobPtr GPtr, int i );
+static int  GetCheckpointVolume( SGlobPtr GPtr, CheckpointVolume *volume );
+static void GetCheckpointGlobals( SGlobPtr GPtr, CheckpointGlobals *globals );
+static void SetCheckpointGlobals( SGlobPtr GPtr, const CheckpointGlobals *globals );
+static int  WriteCheckpoint( SGlobPtr GPtr, FILE *fp, CheckpointHeader *header, CheckpointGlobals *globals );
+static int  ReadCheckpointLists( SGlobPtr GPtr, FILE *fp, const CheckpointGlobals *globals );
+
+
+/*
+ * SaveCheckpoint - Write the state of the verify, after the group of
+ * checks given, to the checkpoint file at path.
+ *
+ * Returns zero on success, or an errno; the file is then left as it
+ * was.  Failing to write a checkpoint is not an error for the verify.
+ */
+int
+SaveCheckpoint( SGlobPtr GPtr, const char *path, int phase )
+{
+	CheckpointHeader header;
+	CheckpointGlobals globals;
+	char tmpPath[PATH_MAX];
+	FILE *fp;
+	int error;
+
+	if (snprintf(tmpPath, sizeof(tmpPath), "%s.new", path) >= (int)sizeof(tmpPath))
+		return (ENAMETOOLONG);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = kCheckpointMagic;
+	header.version = kCheckpointVersion;
+	header.phase = phase;
+	header.chkLevel = GPtr->chkLevel;
+	if ((error = GetCheckpointVolume(GPtr, &header.volume)) != 0)
+		return (error);
+
+	memset(&globals, 0, sizeof(globals));
+	GetCheckpointGlobals(GPtr, &globals);
+
+	if ((fp = fopen(tmpPath, "w")) == NULL)
+		return (errno);
+
+	error = WriteCheckpoint(GPtr, fp, &header, &globals);
+	if (error == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) != 0))
+		error = errno;
+	if (fclose(fp) != 0 && error == 0)
+		error = errno;
+	if (error == 0 && rename(tmpPath, path) != 0)
+		error = errno;
+	if (error != 0)
+		(void) unlink(tmpPath);
+
+	if (error != 0)
+		plog("\tcannot write checkpoint %s: %s\n", path, strerror(error));
+	else if (fsckGetVerbosity(GPtr->context) >= kDebugLog)
+		plog("\twrote checkpoint after the %s checks\n", gCheckpointPhaseNames[phase]);
+
+	return (error);
+
+} /* SaveCheckpoint */
+
+
+/*
+ * LoadCheckpoint - Restore the state of the verify from the checkpoint
+ * file at path, if it was taken of the volume as it is now.  The
+ * calculated B-tree control blocks and the volume bitmap must have
+ * been set up.
+ *
+ * Returns the last group of checks done, for the verify to carry on
+ * after; kCheckpointNone if there is no usable checkpoint, and nothing
+ * was changed; or -1 if the checkpoint could only be partly restored,
+ * and the verify cannot go on.
+ */
+int
+LoadCheckpoint( SGlobPtr GPtr, const char *path )
+{
+	CheckpointHeader header;
+	CheckpointVolume volume;
+	CheckpointGlobals globals;
+	CheckpointBTree trees[kCheckpointBTrees];
+	Ptr maps[kCheckpointBTrees];
+	BTreeControlBlock *btcb;
+	BTreeExtensionsRec *ext;
+	const char *reason = NULL;
+	UInt32 trailer;
+	off_t bodyEnd;
+	FILE *fp;
+	int result = kCheckpointNone;
+	int i, error;
+
+	memset(maps, 0, sizeof(maps));
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			plog("\tcannot read checkpoint %s: %s\n", path, strerror(errno));
+		return (kCheckpointNone);
+	}
+
+	/* Everything up to the bitmap is checked before anything is changed */
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.magic != kCheckpointMagic ||
+	    header.version != kCheckpointVersion ||
+	    header.phase == kCheckpointNone || header.phase > kCheckpointAttributes) {
+		reason = "not a checkpoint";
+		goto out;
+	}
+	if (header.chkLevel != (UInt32)GPtr->chkLevel) {
+		reason = "taken with other options";
+		goto out;
+	}
+	memset(&volume, 0, sizeof(volume));
+	if (GetCheckpointVolume(GPtr, &volume) != 0 ||
+	    memcmp(&volume, &header.volume, sizeof(volume)) != 0) {
+		reason = "the volume has changed since";
+		goto out;
+	}
+
+	/* A file cut short would leave the verify half restored */
+	if (fseeko(fp, -(off_t)sizeof(trailer), SEEK_END) != 0 ||
+	    (bodyEnd = ftello(fp)) < 0 ||
+	    fread(&trailer, sizeof(trailer), 1, fp) != 1 ||
+	    trailer != kCheckpointMagic ||
+	    fseeko(fp, sizeof(header), SEEK_SET) != 0) {
+		reason = "incomplete";
+		goto out;
+	}
+
+	if (fread(&globals, sizeof(globals), 1, fp) != 1) {
+		reason = "incomplete";
+		goto out;
+	}
+	if (GPtr->missingThreadList != NULL || GPtr->overlappedExtents != nil) {
+		reason = "the verify has already begun";
+		goto out;
+	}
+
+	for (i = 0; i < kCheckpointBTrees; i++) {
+		btcb = CheckpointBTCB(GPtr, i);
+		ext = btcb ? (BTreeExtensionsRec *) btcb->refCon : NULL;
+
+		if (fread(&trees[i], sizeof(trees[i]), 1, fp) != 1 ||
+		    trees[i].mapSize != (ext ? ext->BTCBMSize : 0) ||
+		    (btcb != NULL && trees[i].totalNodes != btcb->totalNodes)) {
+			reason = "the B-trees have changed since";
+			goto out;
+		}
+		if (trees[i].mapSize == 0)
+			continue;
+		if ((maps[i] = (Ptr) malloc(trees[i].mapSize)) == NULL) {
+			reason = strerror(ENOMEM);
+			goto out;
+		}
+		if (fread(maps[i], trees[i].mapSize, 1, fp) != 1) {
+			reason = "incomplete";
+			goto out;
+		}
+	}
+
+	/* EINVAL means the bitmap is untouched; anything else, that it is not */
+	error = BitMapCheckRestore(fp);
+	if (error == EINVAL) {
+		reason = "the volume has changed since";
+		goto out;
+	}
+	result = -1;
+	if (error != 0) {
+		reason = strerror(error);
+		goto out;
+	}
+
+	SetCheckpointGlobals(GPtr, &globals);
+	for (i = 0; i < kCheckpointBTrees; i++) {
+		if ((btcb = CheckpointBTCB(GPtr, i)) == NULL)
+			continue;
+		btcb->freeNodes = trees[i].freeNodes;
+		btcb->treeDepth = trees[i].treeDepth;
+		btcb->rootNode = trees[i].rootNode;
+		btcb->leafRecords = trees[i].leafRecords;
+		btcb->firstLeafNode = trees[i].firstLeafNode;
+		btcb->lastLeafNode = trees[i].lastLeafNode;
+		if (trees[i].mapSize != 0)
+			CopyMemory(maps[i], ((BTreeExtensionsRec *) btcb->refCon)->BTCBMPtr, trees[i].mapSize);
+	}
+
+	if ((error = ReadCheckpointLists(GPtr, fp, &globals)) != 0 ||
+	    ftello(fp) != bodyEnd) {
+		reason = error ? strerror(error) : "incomplete";
+		goto out;
+	}
+	/* AllocMinorRepairOrder raises the repair level; put it back */
+	GPtr->RepLevel = globals.RepLevel;
+
+	plog("** Resuming the verify after the %s checks, from %s\n",
+	     gCheckpointPhaseNames[header.phase], path);
+	result = header.phase;
+
+out:
+	if (reason != NULL) {
+		if (result == -1)
+			plog("\tcannot restore checkpoint %s: %s\n", path, reason);
+		else
+			plog("\tnot resuming from checkpoint %s: %s\n", path, reason);
+	}
+	for (i = 0; i < kCheckpointBTrees; i++)
+		free(maps[i]);
+	(void) fclose(fp);
+	return (result);
+
+} /* LoadCheckpoint */
+
+
+/*
+ * RemoveCheckpoint - Remove the checkpoint file once the verify it was
+ * for is complete.
+ */
+void
+RemoveCheckpoint( const char *path )
+{
+	(void) unlink(path);
+
+} /* RemoveCheckpoint */
+
+
+/* The calculated B-trees, in the order they are kept in a checkpoint */
+static BTreeControlBlock *
+CheckpointBTCB( SGlobPtr GPtr, int i )
+{
+	switch (i) {
+	case 0:
+		return (GPtr->calculatedExtentsBTCB);
+	case 1:
+		return (GPtr->calculatedCatalogBTCB);
+	default:
+		return (GPtr->calculatedAttributesBTCB);
+	}
+}
+
+
+/*
+ * GetCheckpointVolume - Read what identifies the state of the volume
+ * from its volume header or MDB, and its journal header.
+ */
+static int
+GetCheckpointVolume( SGlobPtr GPtr, CheckpointVolume *volume )
+{
+	VolumeObjectPtr myVOPtr;
+	HFSPlusVolumeHeader *vhp;
+	HFSMasterDirectoryBlock *mdbp;
+	JournalInfoBlock *jibp;
+	BlockDescriptor block;
+	SVCB *vcb = GPtr->calculatedVCB;
+	UInt64 offset = 0;
+	OSErr err;
+
+	block.buffer = NULL;
+	err = GetVolumeObjectVHBorMDB(&block);
+	if (err != noErr) {
+		if (block.buffer != NULL)
+			(void) ReleaseVolumeBlock(vcb, &block, kReleaseBlock);
+		return (EIO);
+	}
+
+	myVOPtr = GetVolumeObjectPtr();
+	if (VolumeObjectIsHFSPlus()) {
+		vhp = (HFSPlusVolumeHeader *) block.buffer;
+		volume->signature = vhp->signature;
+		volume->blockSize = vhp->blockSize;
+		volume->totalBlocks = vhp->totalBlocks;
+		volume->createDate = vhp->createDate;
+		volume->modifyDate = vhp->modifyDate;
+		volume->writeCount = vhp->writeCount;
+		if (vhp->attributes & kHFSVolumeJournaledMask) {
+			volume->journalInfoBlock = vhp->journalInfoBlock;
+			offset = myVOPtr->embeddedOffset +
+			         (UInt64) vhp->journalInfoBlock * vhp->blockSize;
+		}
+	} else {
+		mdbp = (HFSMasterDirectoryBlock *) block.buffer;
+		volume->signature = mdbp->drSigWord;
+		volume->blockSize = mdbp->drAlBlkSiz;
+		volume->totalBlocks = mdbp->drNmAlBlks;
+		volume->createDate = mdbp->drCrDate;
+		volume->modifyDate = mdbp->drLsMod;
+		volume->writeCount = mdbp->drWrCnt;
+	}
+	(void) ReleaseVolumeBlock(vcb, &block, kReleaseBlock);
+
+	if (offset == 0)
+		return (0);
+
+	/*
+	 * A journal in the volume is identified by its header, whose start
+	 * and end move with every transaction; one on another device, by
+	 * the journal info block that names the device.
+	 */
+	if (GetVolumeBlock(vcb, offset >> kSectorShift, kGetBlock | kSkipEndianSwap, &block) != noErr)
+		return (EIO);
+	jibp = (JournalInfoBlock *) block.buffer;
+	if (SWAP_BE32(jibp->flags) & kJIJournalInFSMask) {
+		offset = myVOPtr->embeddedOffset + SWAP_BE64(jibp->offset);
+		(void) ReleaseVolumeBlock(vcb, &block, kReleaseBlock | kSkipEndianSwap);
+		if (GetVolumeBlock(vcb, offset >> kSectorShift, kGetBlock | kSkipEndianSwap, &block) != noErr)
+			return (EIO);
+	}
+	CopyMemory(block.buffer, volume->journal, kJournalHeaderBytes);
+	(void) ReleaseVolumeBlock(vcb, &block, kReleaseBlock | kSkipEndianSwap);
+
+	return (0);
+}
+
+
+static void
+GetCheckpointGlobals( SGlobPtr GPtr, CheckpointGlobals *globals )
+{
+	SVCB *vcb = GPtr->calculatedVCB;
+	RepairOrderPtr p;
+	MissingThread *mtp;
+
+	globals->RepLevel = GPtr->RepLevel;
+	globals->VIStat = GPtr->VIStat;
+	globals->ABTStat = GPtr->ABTStat;
+	globals->EBTStat = GPtr->EBTStat;
+	globals->CBTStat = GPtr->CBTStat;
+	globals->VeryMinorErrorsStat = GPtr->VeryMinorErrorsStat;
+	globals->JStat = GPtr->JStat;
+	globals->PrintStat = GPtr->PrintStat;
+	globals->CatStat = GPtr->CatStat;
+	globals->itemsProcessed = GPtr->itemsProcessed;
+
+	globals->vcbEncodingsBitmap = vcb->vcbEncodingsBitmap;
+	globals->vcbNextCatalogID = vcb->vcbNextCatalogID;
+	globals->vcbFolderCount = vcb->vcbFolderCount;
+	globals->vcbFileCount = vcb->vcbFileCount;
+	globals->vcbNmFls = vcb->vcbNmFls;
+	globals->vcbNmRtDirs = vcb->vcbNmRtDirs;
+
+	globals->cat_ea_count = GPtr->cat_ea_count;
+	globals->cat_acl_count = GPtr->cat_acl_count;
+	globals->attr_ea_count = GPtr->attr_ea_count;
+	globals->attr_acl_count = GPtr->attr_acl_count;
+	globals->CBTAttrBucket = GPtr->CBTAttrBucket;
+	globals->CBTSecurityBucket = GPtr->CBTSecurityBucket;
+	globals->ABTAttrBucket = GPtr->ABTAttrBucket;
+	globals->ABTSecurityBucket = GPtr->ABTSecurityBucket;
+
+	globals->filelink_priv_dir_id = GPtr->filelink_priv_dir_id;
+	globals->dirlink_priv_dir_id = GPtr->dirlink_priv_dir_id;
+	globals->dirlink_priv_dir_valence = GPtr->dirlink_priv_dir_valence;
+	globals->calculated_dirinodes = GPtr->calculated_dirinodes;
+	globals->calculated_dirlinks = GPtr->calculated_dirlinks;
+
+	for (p = GPtr->MinorRepairsP; p != NULL; p = p->link)
+		globals->repairOrders++;
+	for (mtp = GPtr->missingThreadList; mtp != NULL; mtp = mtp->link)
+		globals->missingThreads++;
+	if (GPtr->overlappedExtents != nil)
+		globals->overlappedExtents = (**GPtr->overlappedExtents).count;
+	if (GPtr->validFilesList != nil)
+		globals->validFiles = GetHandleSize((Handle) GPtr->validFilesList) / sizeof(UInt32);
+}
+
+
+static void
+SetCheckpointGlobals( SGlobPtr GPtr, const CheckpointGlobals *globals )
+{
+	SVCB *vcb = GPtr->calculatedVCB;
+
+	GPtr->RepLevel = globals->RepLevel;
+	GPtr->VIStat = globals->VIStat;
+	GPtr->ABTStat = globals->ABTStat;
+	GPtr->EBTStat = globals->EBTStat;
+	GPtr->CBTStat = globals->CBTStat;
+	GPtr->VeryMinorErrorsStat = globals->VeryMinorErrorsStat;
+	GPtr->JStat = globals->JStat;
+	GPtr->PrintStat = globals->PrintStat;
+	GPtr->CatStat = globals->CatStat;
+	GPtr->itemsProcessed = globals->itemsProcessed;
+
+	vcb->vcbEncodingsBitmap = globals->vcbEncodingsBitmap;
+	vcb->vcbNextCatalogID = globals->vcbNextCatalogID;
+	vcb->vcbFolderCount = globals->vcbFolderCount;
+	vcb->vcbFileCount = globals->vcbFileCount;
+	vcb->vcbNmFls = globals->vcbNmFls;
+	vcb->vcbNmRtDirs = globals->vcbNmRtDirs;
+
+	GPtr->cat_ea_count = globals->cat_ea_count;
+	GPtr->cat_acl_count = globals->cat_acl_count;
+	GPtr->attr_ea_count = globals->attr_ea_count;
+	GPtr->attr_acl_count = globals->attr_acl_count;
+	GPtr->CBTAttrBucket = globals->CBTAttrBucket;
+	GPtr->CBTSecurityBucket = globals->CBTSecurityBucket;
+	GPtr->ABTAttrBucket = globals->ABTAttrBucket;
+	GPtr->ABTSecurityBucket = globals->ABTSecurityBucket;
+
+	GPtr->filelink_priv_dir_id = globals->filelink_priv_dir_id;
+	GPtr->dirlink_priv_dir_id = globals->dirlink_priv_dir_id;
+	GPtr->dirlink_priv_dir_valence = globals->dirlink_priv_dir_valence;
+	GPtr->calculated_dirinodes = globals->calculated_dirinodes;
+	GPtr->calculated_dirlinks = globals->calculated_dirlinks;
+}
+
+
+/*
+ * WriteCheckpoint - Write a whole checkpoint: the header and globals,
+ * the B-trees, the volume bitmap, then the lists, in the order
+ * ReadCheckpointLists reads them, and the magic number again to show
+ * the file is complete.
+ */
+static int
+WriteCheckpoint( SGlobPtr GPtr, FILE *fp, CheckpointHeader *header, CheckpointGlobals *globals )
+{
+	CheckpointBTree tree;
+	CheckpointExtent extent;
+	BTreeControlBlock *btcb;
+	BTreeExtensionsRec *ext;
+	ExtentInfo *info;
+	RepairOrderPtr p;
+	MissingThread *mtp;
+	UInt32 trailer = kCheckpointMagic;
+	UInt32 i;
+	int error;
+
+	if (fwrite(header, sizeof(*header), 1, fp) != 1 ||
+	    fwrite(globals, sizeof(*globals), 1, fp) != 1)
+		goto fail;
+
+	for (i = 0; i < kCheckpointBTrees; i++) {
+		memset(&tree, 0, sizeof(tree));
+		btcb = CheckpointBTCB(GPtr, i);
+		ext = btcb ? (BTreeExtensionsRec *) btcb->refCon : NULL;
+		if (btcb != NULL) {
+			tree.totalNodes = btcb->totalNodes;
+			tree.freeNodes = btcb->freeNodes;
+			tree.treeDepth = btcb->treeDepth;
+			tree.rootNode = btcb->rootNode;
+			tree.leafRecords = btcb->leafRecords;
+			tree.firstLeafNode = btcb->firstLeafNode;
+			tree.lastLeafNode = btcb->lastLeafNode;
+		}
+		if (ext != NULL && ext->BTCBMPtr != NULL)
+			tree.mapSize = ext->BTCBMSize;
+		if (fwrite(&tree, sizeof(tree), 1, fp) != 1 ||
+		    (tree.mapSize != 0 && fwrite(ext->BTCBMPtr, tree.mapSize, 1, fp) != 1))
+			goto fail;
+	}
+
+	if ((error = BitMapCheckSave(fp)) != 0)
+		return (error);
+
+	for (p = GPtr->MinorRepairsP; p != NULL; p = p->link)
+		if (fwrite(p, sizeof(RepairOrder) + p->extraBytes, 1, fp) != 1)
+			goto fail;
+
+	for (mtp = GPtr->missingThreadList; mtp != NULL; mtp = mtp->link)
+		if (fwrite(mtp, sizeof(MissingThread), 1, fp) != 1)
+			goto fail;
+
+	for (i = 0; i < globals->overlappedExtents; i++) {
+		info = &(**GPtr->overlappedExtents).extentInfo[i];
+		extent.fileID = info->fileID;
+		extent.startBlock = info->startBlock;
+		extent.blockCount = info->blockCount;
+		extent.attrnameSize = info->attrname ? strlen(info->attrname) + 1 : 0;
+		extent.forkType = info->forkType;
+		if (fwrite(&extent, sizeof(extent), 1, fp) != 1 ||
+		    (extent.attrnameSize != 0 && fwrite(info->attrname, extent.attrnameSize, 1, fp) != 1))
+			goto fail;
+	}
+
+	if (globals->validFiles != 0 &&
+	    fwrite(*GPtr->validFilesList, sizeof(UInt32), globals->validFiles, fp) != globals->validFiles)
+		goto fail;
+
+	if (fwrite(&trailer, sizeof(trailer), 1, fp) != 1)
+		goto fail;
+
+	return (0);
+
+fail:
+	return (errno ? errno : EIO);
+}
+
+
+/*
+ * ReadCheckpointLists - Read back the repair orders, missing threads,
+ * overlapped extents and valid file IDs, in the order they were found.
+ * Returns zero on success, or an errno.
+ */
+static int
+ReadCheckpointLists( SGlobPtr GPtr, FILE *fp, const CheckpointGlobals *globals )
+{
+	RepairOrder order;
+	RepairOrderPtr p, next, reversed;
+	MissingThread *mtp, **tail;
+	CheckpointExtent extent;
+	char attrname[XATTR_MAXNAMELEN + 1];
+	UInt32 fileID;
+	UInt32 i;
+
+	/* Any repair orders from the initial check are in the checkpoint too */
+	while ((p = GPtr->MinorRepairsP) != NULL) {
+		GPtr->MinorRepairsP = p->link;
+		DisposeMemory(p);
+	}
+
+	/* AllocMinorRepairOrder pushes each order on the front of the list */
+	for (i = 0; i < globals->repairOrders; i++) {
+		if (fread(&order, sizeof(order), 1, fp) != 1 ||
+		    order.extraBytes > kMaxRepairOrderExtra)
+			return (EIO);
+		if ((p = AllocMinorRepairOrder(GPtr, order.extraBytes)) == NULL)
+			return (ENOMEM);
+		next = p->link;
+		CopyMemory(&order, p, sizeof(order));
+		p->link = next;
+		if (order.extraBytes != 0 &&
+		    fread((char *)p + sizeof(order), order.extraBytes, 1, fp) != 1)
+			return (EIO);
+	}
+	for (reversed = NULL; (p = GPtr->MinorRepairsP) != NULL; reversed = p) {
+		GPtr->MinorRepairsP = p->link;
+		p->link = reversed;
+	}
+	GPtr->MinorRepairsP = reversed;
+
+	tail = &GPtr->missingThreadList;
+	for (i = 0; i < globals->missingThreads; i++) {
+		if ((mtp = (MissingThread *) AllocateClearMemory(sizeof(MissingThread))) == NULL)
+			return (ENOMEM);
+		if (fread(mtp, sizeof(MissingThread), 1, fp) != 1) {
+			DisposeMemory(mtp);
+			return (EIO);
+		}
+		mtp->link = NULL;
+		*tail = mtp;
+		tail = &mtp->link;
+	}
+
+	for (i = 0; i < globals->overlappedExtents; i++) {
+		if (fread(&extent, sizeof(extent), 1, fp) != 1 ||
+		    extent.attrnameSize > sizeof(attrname))
+			return (EIO);
+		if (extent.attrnameSize != 0 &&
+		    (fread(attrname, extent.attrnameSize, 1, fp) != 1 ||
+		     attrname[extent.attrnameSize - 1] != '\0'))
+			return (EIO);
+		if (AddExtentToOverlapList(GPtr, extent.fileID,
+		                           extent.attrnameSize ? attrname : NULL,
+		                           extent.startBlock, extent.blockCount,
+		                           extent.forkType) != noErr)
+			return (ENOMEM);
+	}
+
+	for (i = 0; i < globals->validFiles; i++) {
+		if (fread(&fileID, sizeof(fileID), 1, fp) != 1)
+			return (EIO);
+		if (PtrAndHand(&fileID, (Handle) GPtr->validFilesList, sizeof(fileID)) != noErr)
+			return (ENOMEM);
+	}
+
+	return (0);
+}
@@ -40,6 +40,7 @@
 #endif
 
 #include "Scavenger.h"
+#include "../cache.h"
 #include <setjmp.h>
 
 #define	DisplayTimeRemaining 0
@@ -542,6 +543,8 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 {
 	OSErr			result;
 	unsigned int		stat;
+	int			resumePhase = kCheckpointNone;
+	Boolean			checkpoints = false;
 #if SHOW_ELAPSED_TIMES
 	struct timeval 	myStartTime;
 	struct timeval 	myEndTime;
@@ -637,6 +640,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			}
 
 			result = IVChk( GPtr );
+
+			/* Keep the verify tables within -M beside the cache; see SSpill.c */
+			if ( result == noErr )
+				CheckMemoryBudget( GPtr );
 			
 			break;
 		}
@@ -679,6 +686,26 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			if ( ( result = CreateExtendedAllocationsFCB( GPtr ) ) )
 				break;
 
+			/*
+			 * Pick up after the checks an earlier verify got through (-k); see
+			 * SCheckpoint.c.  Only the first pass resumes: a later one follows a
+			 * repair, which removed the checkpoint, and must check the volume afresh.
+			 */
+			checkpoints = ( checkpointFile != NULL && GPtr->chkLevel != kPartialCheck && !GPtr->liveVerifyState );
+			if ( checkpoints && GPtr->scanCount == 0 &&
+			     ( resumePhase = LoadCheckpoint( GPtr, checkpointFile ) ) < 0 ) {
+				result = R_IntErr;
+				break;
+			}
+
+			/*
+			 * Walk the B-trees on worker threads, or from a scan; see SVerifyThreads.c.
+			 * A resumed verify only walks the trees it has yet to check.
+			 */
+			if ( (threadedVerify || scanVerify) && !debug && GPtr->chkLevel != kPartialCheck &&
+			     resumePhase < kCheckpointAttributes )
+				(void) StartBTreeVerifyThreads( GPtr, resumePhase );
+
 #if SHOW_ELAPSED_TIMES
 			gettimeofday( &myEndTime, &zone );
 			timersub( &myEndTime, &myStartTime, &myElapsedTime );
@@ -695,6 +722,17 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 				break;
 
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
+
+			/* The B-tree checks mostly descend trees, all over the disk */
+			(void) CacheAdvise(GPtr->calculatedVCB->vcbBlockCache, kCacheAdviseRandom);
+
+			if ( resumePhase == kCheckpointAttributes )
+				goto ResumeAfterAttributes;
+			if ( resumePhase == kCheckpointCatalog )
+				goto ResumeAfterCatalog;
+			if ( resumePhase == kCheckpointExtents )
+				goto ResumeAfterExtents;
+
 			fsckPrint(GPtr->context, hfsExtBTCheck);
 
 #if SHOW_ELAPSED_TIMES
@@ -702,7 +740,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 #endif
 				
 			/* Verify extent btree structure */
-			if ((result = ExtBTChk(GPtr)))
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, "ExtBTChk");
+			result = ExtBTChk(GPtr);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, NULL);
+			if (result)
 				break;
 
 #if SHOW_ELAPSED_TIMES
@@ -723,7 +764,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 				break;
 			if ((result = CheckForStop(GPtr)))
 				break;
-			
+			if ( checkpoints )
+				(void) SaveCheckpoint( GPtr, checkpointFile, kCheckpointExtents );
+
+ResumeAfterExtents:
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
 			GPtr->itemsProcessed += GPtr->onePercent;
 			fsckPrint(GPtr->context, hfsCatBTCheck);
@@ -754,7 +798,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			 * for all extents existing in catalog record as well as in
 			 * overflow extent btree
 			 */
-			if ((result = CheckCatalogBTree(GPtr)))
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, "CheckCatalogBTree");
+			result = CheckCatalogBTree(GPtr);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, NULL);
+			if (result)
 				break;
 
 #if SHOW_ELAPSED_TIMES
@@ -775,7 +822,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 #endif
 				
 			/* Check catalog hierarchy */
-			if ((result = CatHChk(GPtr)))
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, "CatHChk");
+			result = CatHChk(GPtr);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, NULL);
+			if (result)
 				break;
 
 #if SHOW_ELAPSED_TIMES
@@ -797,11 +847,18 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 				if ((result=CheckForStop(GPtr)))
 					break;
 			}
+			if ( checkpoints )
+				(void) SaveCheckpoint( GPtr, checkpointFile, kCheckpointCatalog );
+
+ResumeAfterCatalog:
 			/* Check attribute btree.  The function accounts for all extents
 			 * for extended attributes whose values are stored in 
 			 * allocation blocks
 			 */
-			if ((result = AttrBTChk(GPtr)))
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, "AttrBTChk");
+			result = AttrBTChk(GPtr);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, NULL);
+			if (result)
 				break;
 
 			if ((result = CheckForStop(GPtr)))
@@ -831,7 +888,9 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			 * an extended attribute.  Therefore start directory 
 			 * hard link check after extended attribute checks.
 			 */
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, "dirhardlink_check");
 			result = dirhardlink_check(GPtr);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, NULL);
 			/* On error or unrepairable corruption, stop the verification */
 			if ((result != 0) || (GPtr->CatStat & S_LinkErrNoRepair)) {
 				if (result == 0) {
@@ -840,7 +899,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 
 				break;
 			}
+			if ( checkpoints )
+				(void) SaveCheckpoint( GPtr, checkpointFile, kCheckpointAttributes );
 
+ResumeAfterAttributes:
 			fsckPrint(GPtr->context, hfsVolBitmapCheck);
 
 #if SHOW_ELAPSED_TIMES
@@ -848,7 +910,11 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 #endif
 				
 			/* Compare in-memory volume bitmap with on-disk bitmap */
-			if ((result = CheckVolumeBitMap(GPtr, false)))
+			(void) CacheAdvise(GPtr->calculatedVCB->vcbBlockCache, kCacheAdviseSequential);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, "CheckVolumeBitMap");
+			result = CheckVolumeBitMap(GPtr, false);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, NULL);
+			if (result)
 				break;
 
 #if SHOW_ELAPSED_TIMES
@@ -869,7 +935,11 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 #endif
 
 			/* Verify volume level information */
-			if ((result = VInfoChk(GPtr)))
+			(void) CacheAdvise(GPtr->calculatedVCB->vcbBlockCache, kCacheAdviseNormal);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, "VInfoChk");
+			result = VInfoChk(GPtr);
+			CacheSetPhase(GPtr->calculatedVCB->vcbBlockCache, NULL);
+			if (result)
 				break;
 
 #if SHOW_ELAPSED_TIMES
@@ -901,6 +971,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			{
 			}
 
+			/* The verify is complete, so nothing is left to resume */
+			if ( checkpoints )
+				RemoveCheckpoint( checkpointFile );
+
 			GPtr->itemsProcessed = GPtr->itemsToProcess;
 			result = CheckForStop(GPtr);				//	one last check for modified volume
 			break;
@@ -921,6 +995,9 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			} else {
 				fsckPrint(GPtr->context, fsckRepairingVolume);
 			}
+			/* What a checkpoint holds is no longer true of the volume once it is repaired */
+			if ( checkpointFile != NULL )
+				RemoveCheckpoint( checkpointFile );
 			result = RepairVolume( GPtr );
 			break;
 		}
@@ -932,6 +1009,9 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 		}
 	}													//	end ScavOp switch
 
+	/* Walks made on worker threads only hold for the verify pass that started them */
+	StopBTreeVerifyThreads( GPtr );
+
 
 	//
 	//	Map internal error codes to scavenger result codes
@@ -1096,16 +1176,6 @@ static int ScavSetUp( SGlob *GPtr)
 		}
 		GPtr->scavStaticPtr = pointer;
 
-		GPtr->DirPTPtr = AllocateClearMemory(sizeof(SDPR) * CMMaxDepth);
-		if ( GPtr->DirPTPtr == nil ) {
-			if ( fsckGetVerbosity(GPtr->context) >= kDebugLog ) {
-				plog( "\t error %d - could not allocate %ld bytes of memory \n",
-					R_NoMem, sizeof(SDPR) * CMMaxDepth );
-			}
-			return( R_NoMem );
-		}
-		GPtr->dirPathCount = CMMaxDepth;
-
 		GPtr->calculatedVCB = vcb	= &pointer->vcb;
 		vcb->vcbGPtr = GPtr;
 
@@ -1317,6 +1387,7 @@ static int ScavTerm( SGlobPtr GPtr )
 	int			i;
 
 	(void) BitMapCheckEnd();
+	StopBTreeVerifyThreads(GPtr);
 
 	while( (rP = GPtr->MinorRepairsP) != nil )		//	loop freeing leftover (undone) repair orders
 	{
@@ -1342,7 +1413,9 @@ static int ScavTerm( SGlobPtr GPtr )
 		}
 
 		DisposeHandle( (Handle) GPtr->overlappedExtents );
+		GPtr->overlappedExtents = nil;
 	}
+	DisposeOverlapIndex( GPtr );
 	
 	if( GPtr->fileIdentifierTable != nil )
 		DisposeHandle( (Handle) GPtr->fileIdentifierTable );
@@ -1386,7 +1459,9 @@ static int ScavTerm( SGlobPtr GPtr )
 		}
 	}
 
-	DisposeMemory(GPtr->DirPTPtr);
+	DisposeCatHierTable(GPtr);
+	for (i = 0; i < 6; i++)		//	free the FCBs' extent maps
+		InvalidateExtentMap(&((ScavStaticStructures *)GPtr->scavStaticPtr)->fcbList[i]);
 	DisposeMemory((ScavStaticStructures *)GPtr->scavStaticPtr);
 	GPtr->scavStaticPtr = nil;
 	GPtr->calculatedVCB = nil;
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include <IOKit/storage/IOMediaBSDClient.h>
 
@@ -45,6 +46,14 @@ OSErr GetDeviceSize(int driveRefNum, UInt64 *numBlocks, UInt32 *blockSize)
 #if BSD
 	UInt64 devBlockCount = 0;
 	int devBlockSize = 0;
+	struct stat statb;
+
+	/* A disk image has no device ioctls; it is counted in 512-byte blocks */
+	if (fstat(driveRefNum, &statb) == 0 && S_ISREG(statb.st_mode)) {
+		*numBlocks = (UInt64)statb.st_size / 512;
+		*blockSize = 512;
+		return (0);
+	}
 
 	if (ioctl(driveRefNum, DKIOCGETBLOCKCOUNT, &devBlockCount) < 0) {
 		plog("ioctl(DKIOCGETBLOCKCOUNT) for fd %d: %s\n", driveRefNum, strerror(errno));
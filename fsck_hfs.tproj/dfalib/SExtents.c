@@ -194,6 +194,14 @@ static Boolean ExtentsAreIntegral(
 	UInt32		*blocksChecked,
 	Boolean		*checkedLastExtent);
 
+static OSErr MapFileBlockFromExtentMap(
+	const SVCB		*vcb,
+	SFCB				*fcb,
+	UInt64					sectorOffset,	// Desired offset in sectors from start of file
+	UInt32					*firstFABN,		// FABN of first block of found extent
+	UInt32					*firstBlock,	// Corresponding allocation block number
+	UInt32					*nextFABN);		// FABN of block after end of extent
+
 //_________________________________________________________________________________
 //
 //	Routine:	FindExtentRecord
@@ -396,6 +404,200 @@ OSErr DeleteExtentRecord(
 
 
 
+//_________________________________________________________________________________
+//
+//	Extent maps
+//
+//	A position past the extents in the FCB's own extent record used to cost a
+//	search of the extents B-tree every time MapFileBlockC mapped it.  Now the first
+//	such position maps all of the fork's extent records, in order, and the rest are
+//	found by binary search of that map.  The map is thrown away by ExtendFileC,
+//	TruncateFileC and UpdateExtentRecord, and is not used once the FCB's extent
+//	record or the extents B-tree (vcbExtentsWriteCount) has changed since it was
+//	built.  If the records overlap, are out of order, or cannot be read, the
+//	B-tree is searched as before, so the answers are always SearchExtentFile's.
+//_________________________________________________________________________________
+
+typedef struct ExtentMapEntry {
+	UInt32		firstFABN;		//	FABN of first block of extent
+	UInt32		startBlock;		//	Corresponding allocation block number
+	UInt32		blockCount;
+} ExtentMapEntry;
+
+struct ExtentMap {
+	UInt32				fileID;			//	fork the map is for
+	UInt8				forkType;
+	Boolean				usable;			//	false if the records are not in order
+	UInt32				writeCount;		//	vcbExtentsWriteCount when built
+	HFSPlusExtentRecord	fcbExtents;		//	FCB's extent record when built
+	UInt32				count;
+	UInt32				size;
+	ExtentMapEntry		*entries;		//	in order of FABN
+};
+
+enum {
+	kExtentMapMinEntries	= 64
+};
+
+
+static void DisposeExtentMap( struct ExtentMap *map )
+{
+	if (map->entries != NULL)
+		DisposeMemory(map->entries);
+	DisposeMemory(map);
+}
+
+
+//	Throw away the FCB's extent map, if it has one.
+void InvalidateExtentMap( SFCB *fcb )
+{
+	if (fcb->fcbExtentMap != NULL) {
+		DisposeExtentMap(fcb->fcbExtentMap);
+		fcb->fcbExtentMap = NULL;
+	}
+}
+
+
+//	Append the extents of one extent record, which starts at FABN startFABN, to the
+//	map.  *nextFABN is the end of the records before it, and is moved to the end of
+//	this one.  Returns false if the record overlaps those before it, or there is no
+//	memory.
+static Boolean AddExtentMapRecord(
+	struct ExtentMap		*map,
+	const HFSPlusExtentRecord	extents,
+	UInt32					numberOfExtents,
+	UInt32					startFABN,
+	UInt32					*nextFABN)
+{
+	ExtentMapEntry	*entries;
+	UInt32			index;
+	UInt32			size;
+
+	if (startFABN < *nextFABN)
+		return false;
+
+	for (index = 0; index < numberOfExtents && extents[index].blockCount != 0; index++) {
+		if (startFABN + extents[index].blockCount < startFABN)
+			return false;				//	FABNs wrap
+
+		if (map->count == map->size) {
+			size = map->size ? map->size * 2 : kExtentMapMinEntries;
+			entries = realloc(map->entries, (size_t)size * sizeof(ExtentMapEntry));
+			if (entries == NULL)
+				return false;
+			map->entries = entries;
+			map->size = size;
+		}
+		map->entries[map->count].firstFABN = startFABN;
+		map->entries[map->count].startBlock = extents[index].startBlock;
+		map->entries[map->count].blockCount = extents[index].blockCount;
+		map->count++;
+
+		startFABN += extents[index].blockCount;
+	}
+
+	*nextFABN = startFABN;
+	return true;
+}
+
+
+//	Map the extent records of the FCB's fork, reading the extents B-tree with an
+//	iterator of our own so that the B-tree's current record is left alone.  Returns
+//	NULL if the records could not be read.
+static struct ExtentMap *BuildExtentMap(
+	const SVCB		*vcb,
+	SFCB				*fcb,
+	UInt8					forkType,
+	const HFSPlusExtentRecord	fcbExtents)
+{
+	struct ExtentMap	*map;
+	BTreeIterator		iterator;
+	FSBufferDescriptor	btRecord;
+	HFSPlusExtentRecord	extentData;
+	HFSPlusExtentRecord	extents;
+	UInt32				numberOfExtents;
+	UInt32				fileID;
+	UInt32				startFABN;
+	UInt32				nextFABN;
+	UInt16				recordSize;
+	UInt8				foundForkType;
+	OSStatus			err;
+
+	map = (struct ExtentMap *) AllocateClearMemory(sizeof(struct ExtentMap));
+	if (map == NULL)
+		return NULL;
+	map->fileID = fcb->fcbFileID;
+	map->forkType = forkType;
+	map->writeCount = vcb->vcbExtentsWriteCount;
+	CopyMemory(fcbExtents, map->fcbExtents, sizeof(HFSPlusExtentRecord));
+
+	ClearMemory(&iterator, sizeof(iterator));
+	btRecord.bufferAddress = &extentData;
+	btRecord.itemCount = 1;
+
+	if (vcb->vcbSignature == kHFSSigWord) {
+		HFSExtentKey	*key = (HFSExtentKey *) &iterator.key;
+
+		key->keyLength	= kHFSExtentKeyMaximumLength;
+		key->forkType	= forkType;
+		key->fileID		= fcb->fcbFileID;
+		key->startBlock	= 0;
+		btRecord.itemSize = sizeof(HFSExtentRecord);
+		numberOfExtents = kHFSExtentDensity;
+	}
+	else {
+		HFSPlusExtentKey	*key = (HFSPlusExtentKey *) &iterator.key;
+
+		key->keyLength	= kHFSPlusExtentKeyMaximumLength;
+		key->forkType	= forkType;
+		key->pad		= 0;
+		key->fileID		= fcb->fcbFileID;
+		key->startBlock	= 0;
+		btRecord.itemSize = sizeof(HFSPlusExtentRecord);
+		numberOfExtents = kHFSPlusExtentDensity;
+	}
+
+	nextFABN = 0;
+	err = BTSearchRecord(vcb->vcbExtentsFile, &iterator, kInvalidMRUCacheKey, &btRecord, &recordSize, &iterator);
+	if (err == fsBTRecordNotFoundErr)
+		err = BTIterateRecord(vcb->vcbExtentsFile, kBTreeNextRecord, &iterator, &btRecord, &recordSize);
+
+	for ( ; err == noErr; err = BTIterateRecord(vcb->vcbExtentsFile, kBTreeNextRecord, &iterator, &btRecord, &recordSize)) {
+		if (vcb->vcbSignature == kHFSSigWord) {
+			HFSExtentKey	*key = (HFSExtentKey *) &iterator.key;
+
+			fileID = key->fileID;
+			foundForkType = key->forkType;
+			startFABN = key->startBlock;
+			ExtDataRecToExtents(*(HFSExtentRecord *) &extentData, extents);
+		}
+		else {
+			HFSPlusExtentKey	*key = (HFSPlusExtentKey *) &iterator.key;
+
+			fileID = key->fileID;
+			foundForkType = key->forkType;
+			startFABN = key->startBlock;
+			CopyMemory(&extentData, extents, sizeof(HFSPlusExtentRecord));
+		}
+
+		if (fileID != map->fileID || foundForkType != forkType)
+			break;
+
+		if (!AddExtentMapRecord(map, extents, numberOfExtents, startFABN, &nextFABN))
+			return map;					//	map stays unusable
+	}
+
+	if (err != noErr && err != fsBTEndOfIterationErr && err != fsBTRecordNotFoundErr) {
+		DisposeExtentMap(map);
+		return NULL;
+	}
+
+	map->usable = true;
+	return map;
+}
+
+
+
 //_________________________________________________________________________________
 //
 // Routine:		MapFileBlock
@@ -444,6 +646,8 @@ OSErr MapFileBlockC (
 	allocBlockSize = vcb->vcbBlockSize >> kSectorShift;
 	
 	err = MapFileBlockFromFCB(vcb, fcb, sectorOffset, &firstFABN, &startBlock, &nextFABN);
+	if (err != noErr)
+		err = MapFileBlockFromExtentMap(vcb, fcb, sectorOffset, &firstFABN, &startBlock, &nextFABN);
 	if (err != noErr) {
 		err = SearchExtentFile(vcb, fcb, sectorOffset, &foundKey, foundData, &foundIndex, &hint, &nextFABN);
 		if (err == noErr) {
@@ -1000,6 +1204,7 @@ Exit:
 		fcb->fcbPhysicalSize = (UInt64)eofBlocks * (UInt64)vcb->vcbBlockSize;
 		fcb->fcbFlags |= fcbModifiedMask;
 	}
+	InvalidateExtentMap(fcb);
 
 	// [2355121] If we created a new extent record, then update the B-tree header
 	if (needsFlush)
@@ -1196,6 +1401,7 @@ OSErr TruncateFileC (
 
 Done:
 ErrorExit:
+	InvalidateExtentMap(fcb);
 
 #if DEBUG_BUILD
 	if (err == fxRangeErr)
@@ -1483,6 +1689,7 @@ OSErr UpdateExtentRecord (
 				err = ReplaceBTreeRecord(vcb->vcbExtentsFile, &foundKey, foundHint, &foundData, foundDataSize, &foundHint);
 		}
 	}
+	InvalidateExtentMap(fcb);
 	
 	return err;
 }
@@ -1674,6 +1881,95 @@ static OSErr MapFileBlockFromFCB(
 }
 
 
+//
+//	Routine:	MapFileBlockFromExtentMap
+//
+//	Function: 	Find the given file offset in the FCB's extent map, building the
+//				map first if there is none or it is stale.  Called when the offset
+//				is beyond the extents in the FCB; returns the same as
+//				MapFileBlockFromFCB.
+//
+//	Result:		noErr		= ok
+//				fxRangeErr	= not in the map; search the extents file
+//
+static OSErr MapFileBlockFromExtentMap(
+	const SVCB		*vcb,
+	SFCB				*fcb,
+	UInt64					sectorOffset,	// Desired offset in sectors from start of file
+	UInt32					*firstFABN,		// FABN of first block of found extent
+	UInt32					*firstBlock,	// Corresponding allocation block number
+	UInt32					*nextFABN)		// FABN of block after end of extent
+{
+	struct ExtentMap	*map;
+	HFSPlusExtentRecord	fcbExtents;
+	ExtentMapEntry		*entry;
+	UInt32				numberOfExtents;
+	UInt32				offsetBlocks;
+	UInt32				index;
+	UInt32				lo, hi, mid;
+	UInt64				fcbBlocks;
+	UInt8				forkType;
+
+	//	The extents file has no extent records of its own
+	if (fcb->fcbFileID == kHFSExtentsFileID || vcb->vcbExtentsFile == NULL)
+		return fxRangeErr;
+
+	if (vcb->vcbSignature == kHFSPlusSigWord)
+		numberOfExtents = kHFSPlusExtentDensity;
+	else
+		numberOfExtents = kHFSExtentDensity;
+
+	//	SearchExtentFile only looks in the extents file if the FCB's record is full
+	(void) GetFCBExtentRecord(vcb, fcb, fcbExtents);
+	fcbBlocks = 0;
+	for (index = 0; index < numberOfExtents; index++) {
+		if (fcbExtents[index].blockCount == 0)
+			return fxRangeErr;
+		fcbBlocks += fcbExtents[index].blockCount;
+	}
+	if (fcbBlocks > 0xFFFFFFFFULL)
+		return fxRangeErr;
+
+	forkType = (fcb->fcbFlags & fcbResourceMask) ? kResourceForkType : kDataForkType;
+
+	map = fcb->fcbExtentMap;
+	if (map != NULL &&
+		(map->fileID != fcb->fcbFileID ||
+		 map->forkType != forkType ||
+		 map->writeCount != vcb->vcbExtentsWriteCount ||
+		 CmpBlock(map->fcbExtents, fcbExtents, sizeof(HFSPlusExtentRecord)) != 0)) {
+		InvalidateExtentMap(fcb);
+		map = NULL;
+	}
+	if (map == NULL) {
+		map = BuildExtentMap(vcb, fcb, forkType, fcbExtents);
+		fcb->fcbExtentMap = map;
+	}
+	if (map == NULL || !map->usable || map->count == 0)
+		return fxRangeErr;
+
+	//	Find the last extent starting at or before the offset
+	offsetBlocks = sectorOffset / (vcb->vcbBlockSize >> kSectorShift);
+	lo = 0;
+	hi = map->count;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (map->entries[mid].firstFABN <= offsetBlocks)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	entry = &map->entries[lo];
+	if (offsetBlocks < entry->firstFABN || offsetBlocks - entry->firstFABN >= entry->blockCount)
+		return fxRangeErr;
+
+	*firstFABN	= entry->firstFABN;
+	*firstBlock	= entry->startBlock;
+	*nextFABN	= entry->firstFABN + entry->blockCount;
+	return noErr;
+}
+
+
 //
 //	Routine:	ZeroFileBlocks
 //
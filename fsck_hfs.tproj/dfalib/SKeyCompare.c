@@ -25,171 +25,7 @@
 
 #include "Scavenger.h"
 #include "BTree.h"
-#include "CaseFolding.h"
-
-
-SInt32 FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
-							register ConstUniCharArrayPtr str2, register ItemCount length2);
-
-//_______________________________________________________________________
-//
-//	Routine:	FastRelString
-//
-//	Output:		returns -1 if str1 < str2
-//				returns  1 if str1 > str2
-//				return	 0 if equal
-//
-//_______________________________________________________________________
-
-SInt32	FastRelString( ConstStr255Param str1, ConstStr255Param str2 )
-{
-	SInt32 bestGuess;
-	UInt8 length, length2;
-
-	
-	length = *(str1++);
-	length2 = *(str2++);
-
-	if (length == length2)
-		bestGuess = 0;
-	else if (length < length2)
-		bestGuess = -1;
-	else
-	{
-		bestGuess = 1;
-		length = length2;
-	}
-
-	while (length--)
-	{
-		UInt32	aChar, bChar;
-
-		aChar = *(str1++);
-		bChar = *(str2++);
-		
-		if (aChar != bChar)	/* If they don't match exacly, do case conversion */
-		{	
-			UInt16	aSortWord, bSortWord;
-
-			aSortWord = gCompareTable[aChar];
-			bSortWord = gCompareTable[bChar];
-
-			if (aSortWord > bSortWord)
-				return 1;
-
-			if (aSortWord < bSortWord)
-				return -1;
-		}
-		
-		/*
-		 * If characters match exactly, then go on to next character
-		 * immediately without doing any extra work.
-		 */
-	}
-	
-	/* if you got to here, then return bestGuess */
-	return bestGuess;
-}	
-
-
-
-//
-//	FastUnicodeCompare - Compare two Unicode strings; produce a relative ordering
-//
-//	    IF				RESULT
-//	--------------------------
-//	str1 < str2		=>	-1
-//	str1 = str2		=>	 0
-//	str1 > str2		=>	+1
-//
-//	The lower case table starts with 256 entries (one for each of the upper bytes
-//	of the original Unicode char).  If that entry is zero, then all characters with
-//	that upper byte are already case folded.  If the entry is non-zero, then it is
-//	the _index_ (not byte offset) of the start of the sub-table for the characters
-//	with that upper byte.  All ignorable characters are folded to the value zero.
-//
-//	In pseudocode:
-//
-//		Let c = source Unicode character
-//		Let table[] = lower case table
-//
-//		lower = table[highbyte(c)]
-//		if (lower == 0)
-//			lower = c
-//		else
-//			lower = table[lower+lowbyte(c)]
-//
-//		if (lower == 0)
-//			ignore this character
-//
-//	To handle ignorable characters, we now need a loop to find the next valid character.
-//	Also, we can't pre-compute the number of characters to compare; the string length might
-//	be larger than the number of non-ignorable characters.  Further, we must be able to handle
-//	ignorable characters at any point in the string, including as the first or last characters.
-//	We use a zero value as a sentinel to detect both end-of-string and ignorable characters.
-//	Since the File Manager doesn't prevent the NUL character (value zero) as part of a filename,
-//	the case mapping table is assumed to map u+0000 to some non-zero value (like 0xFFFF, which is
-//	an invalid Unicode character).
-//
-//	Pseudocode:
-//
-//		while (1) {
-//			c1 = GetNextValidChar(str1)			//	returns zero if at end of string
-//			c2 = GetNextValidChar(str2)
-//
-//			if (c1 != c2) break					//	found a difference
-//
-//			if (c1 == 0)						//	reached end of string on both strings at once?
-//				return 0;						//	yes, so strings are equal
-//		}
-//
-//		// When we get here, c1 != c2.  So, we just need to determine which one is less.
-//		if (c1 < c2)
-//			return -1;
-//		else
-//			return 1;
-//
-
-SInt32 FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
-							register ConstUniCharArrayPtr str2, register ItemCount length2)
-{
-	register UInt16 c1,c2;
-	register UInt16 temp;
-
-	while (1) {
-		/* Set default values for c1, c2 in case there are no more valid chars */
-		c1 = 0;
-		c2 = 0;
-		
-		/* Find next non-ignorable char from str1, or zero if no more */
-		while (length1 && c1 == 0) {
-			c1 = *(str1++);
-			--length1;
-			if ((temp = gLowerCaseTable[c1>>8]) != 0)		// is there a subtable for this upper byte?
-				c1 = gLowerCaseTable[temp + (c1 & 0x00FF)];	// yes, so fold the char
-		}
-		
-		
-		/* Find next non-ignorable char from str2, or zero if no more */
-		while (length2 && c2 == 0) {
-			c2 = *(str2++);
-			--length2;
-			if ((temp = gLowerCaseTable[c2>>8]) != 0)		// is there a subtable for this upper byte?
-				c2 = gLowerCaseTable[temp + (c2 & 0x00FF)];	// yes, so fold the char
-		}
-		
-		if (c1 != c2)	/* found a difference, so stop looping */
-			break;
-		
-		if (c1 == 0)		/* did we reach the end of both strings at the same time? */
-			return 0;	/* yes, so strings are equal */
-	}
-	
-	if (c1 < c2)
-		return -1;
-	else
-		return 1;
-}
+#include "UnicodeCompare.h"
 
 
 //
@@ -43,6 +43,34 @@ extern void MyIndirectLog(const char *);
 #include "Scavenger.h"
 #include "../cache.h"
 
+/*
+ * Records salvaged from the old B-Tree are copied, key then data, into
+ * one buffer as the scan finds them.  Once the scan is done they are
+ * sorted and packed into the new B-Tree a level at a time, leaves first,
+ * by BulkLoadBTree.  The same entries describe the nodes of each level
+ * as the index records of the level above, whose data is the node number.
+ */
+#define kBulkLoadFillPercent	90		/* how full BulkLoadBTree packs each node */
+#define kSalvageBufferMinSize	(64 * 1024)
+
+typedef struct BulkLoadEntry {
+	BTreeKeyPtr		key;
+	void *			data;
+	UInt32			offset;			/* of a salvaged record in the buffer */
+	UInt32			nodeNum;		/* child node of an index record */
+	UInt16			dataSize;
+} BulkLoadEntry;
+
+typedef struct SalvagedRecords {
+	UInt8 *			buffer;
+	UInt32			bufferUsed;
+	UInt32			bufferSize;
+	BulkLoadEntry *	entries;
+	UInt32			count;
+	UInt32			size;
+	Boolean			failed;			/* out of memory, so insert records one at a time */
+} SalvagedRecords;
+
 /* internal routine prototypes */
 
 /*static*/ OSErr 	CreateNewBTree( SGlobPtr theSGlobPtr, int FileID );
@@ -60,6 +88,14 @@ static OSErr ValidateExtentRecordLength (SGlobPtr s, ExtentRecord * theRecPtr, U
 static OSErr 	WriteMapNodes(  BTreeControlBlock * theBTreeCBPtr, 
 								UInt32 				theFirstMapNode, 
 								UInt32 				theNodeCount );
+static OSErr 	AddSalvagedRecord(	SalvagedRecords * theRecordsPtr,
+									BTreeControlBlock * theBTreeCBPtr,
+									BTreeKeyPtr theKeyPtr,
+									void * theDataPtr,
+									UInt32 theDataSize );
+static OSErr 	InsertSalvagedRecords( SFCB * theFCBPtr, SalvagedRecords * theRecordsPtr );
+static void 	DisposeSalvagedRecords( SalvagedRecords * theRecordsPtr );
+static OSErr 	BulkLoadBTree( SFCB * theFCBPtr, SalvagedRecords * theRecordsPtr );
 
 #if DEBUG_REBUILD 
 static void PrintBTHeaderRec( BTHeaderRec * thePtr );
@@ -91,6 +127,12 @@ void SETOFFSET ( void *buffer, UInt16 btNodeSize, SInt16 recOffset, SInt16 vecOf
 //				when the index nodes are non-reliable, or the leaf node links
 //				are damaged.
 //
+//				The records are kept in memory as they are found, and once
+//				the scan is done they are sorted and bulk loaded into the new
+//				tree, leaves first, rather than inserted one at a time.  If
+//				there is not enough memory to keep them, those kept so far and
+//				the rest of the records are inserted one at a time instead.
+//
 //				The rebuild will be aborted (leaving the existing btree
 //				as it was found) if there are errors retreiving the nodes or
 //				records, or if there are errors inserting the records into
@@ -137,6 +179,7 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	Boolean 				isHFSPlus;
 	UInt32					numRecords = 0;
 	Boolean				printEvery = false;
+	SalvagedRecords			mySalvaged;
 	
 #if SHOW_ELAPSED_TIMES 
 	struct timeval 			myStartTime;
@@ -148,6 +191,7 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	theSGlobPtr->TarID = FileID;
 	theSGlobPtr->TarBlock = 0;
 	myBlockDescriptor.buffer = NULL;
+	ClearMemory( &mySalvaged, sizeof(mySalvaged) );
 	myVCBPtr = theSGlobPtr->calculatedVCB;
 	if (kHFSCatalogFileID == FileID) {
 		oldFCBPtr = theSGlobPtr->calculatedCatalogFCB;
@@ -163,6 +207,11 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	if ( noErr != myErr )
 		goto ExitThisRoutine;
 
+	/* with -t, the old btree's nodes are swapped on worker threads as they are read; */
+	/* not with -d, as the swap prints its diagnostics */
+	if ( threadedVerify && !debug )
+		(void) BTScanStartThreads( &theSGlobPtr->scanState );
+
 	// some VCB fields that we need may not have been calculated so we get it from the MDB.
 	// this can happen because the fsck_hfs code path to fully set up the VCB may have been 
 	// aborted if an error was found that would trigger a rebuild.  For example,
@@ -297,9 +346,25 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 			break;  // this implementation does not handle partial rebuilds (all or none)
 		}
 
-		/* insert this record into the new btree file */
-		myErr = InsertBTreeRecord( myFCBPtr, myCurrentKeyPtr,
-								   myCurrentDataPtr, myDataSize, &myHint );
+		if ( !mySalvaged.failed )
+		{
+			/* keep this record to bulk load into the new btree file */
+			myErr = AddSalvagedRecord( &mySalvaged, myFCBPtr->fcbBtree, myCurrentKeyPtr,
+									   myCurrentDataPtr, myDataSize );
+			if ( memFullErr == myErr )
+			{
+				/* no room to keep any more, so insert them one at a time */
+				myErr = InsertSalvagedRecords( myFCBPtr, &mySalvaged );
+				DisposeSalvagedRecords( &mySalvaged );
+				mySalvaged.failed = true;
+			}
+		}
+		if ( noErr == myErr && mySalvaged.failed )
+		{
+			/* insert this record into the new btree file */
+			myErr = InsertBTreeRecord( myFCBPtr, myCurrentKeyPtr,
+									   myCurrentDataPtr, myDataSize, &myHint );
+		}
 		if ( noErr != myErr )
 		{
 #if DEBUG_REBUILD 
@@ -336,6 +401,28 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 
 	if ( btNotFound == myErr )
 		myErr = noErr;
+	if ( noErr == myErr && mySalvaged.count > 0 )
+	{
+		myErr = BulkLoadBTree( myFCBPtr, &mySalvaged );
+		if ( memFullErr == myErr )
+		{
+			/* the new btree file has not been touched yet */
+			myErr = InsertSalvagedRecords( myFCBPtr, &mySalvaged );
+		}
+		if ( noErr != myErr )
+		{
+#if DEBUG_REBUILD 
+			plog( "%s - bulk load failed with err %d 0x%02X \n", 
+				__FUNCTION__, myErr, myErr );
+#endif
+			if (dskFulErr == myErr)
+			{
+				fsckPrint(theSGlobPtr->context, E_DiskFull);
+			}               
+			myErr = R_RFail;
+		}
+	}
+	DisposeSalvagedRecords( &mySalvaged );
 	if ( noErr != myErr )
 		goto ExitThisRoutine;
 
@@ -407,6 +494,7 @@ ExitThisRoutine:
 
 	if ( myErr != noErr && myFCBPtr != NULL ) 
 		(void) DeleteBTree( theSGlobPtr, myFCBPtr );
+	DisposeSalvagedRecords( &mySalvaged );
 	BTScanTerminate( &theSGlobPtr->scanState  );
 
 	return( myErr );
@@ -457,6 +545,7 @@ ExitThisRoutine:
 	
 	myBTreeCBPtr = theSGlobPtr->calculatedRepairBTCB;
 	myFCBPtr = theSGlobPtr->calculatedRepairFCB;
+	InvalidateExtentMap( myFCBPtr );
 	ClearMemory( (Ptr) myFCBPtr, sizeof( *myFCBPtr ) );
 	ClearMemory( (Ptr) myBTreeCBPtr, sizeof( *myBTreeCBPtr ) );
 
@@ -737,6 +826,376 @@ ErrorExit:
 } /* WriteMapNodes */
 
 
+/*
+ * AddSalvagedRecord
+ *	
+ * This routine keeps a copy of a record found by the scan of the
+ * old B-Tree so that it can be bulk loaded into the new one.  The
+ * record gets the checks InsertBTreeRecord would have made of it.
+ * memFullErr is returned if there is no room to keep it.
+ */
+static OSErr AddSalvagedRecord(	SalvagedRecords * theRecordsPtr,
+								BTreeControlBlock * theBTreeCBPtr,
+								BTreeKeyPtr theKeyPtr,
+								void * theDataPtr,
+								UInt32 theDataSize )
+{
+	BulkLoadEntry *		myEntries;
+	UInt8 *				myBuffer;
+	UInt32				mySize;
+	UInt32				myRecordSize;
+	UInt16				myKeyLength;
+	UInt16				myKeySize;
+
+	myKeyLength = KeyLength( theBTreeCBPtr, theKeyPtr );
+	if ( myKeyLength < 6 || myKeyLength > theBTreeCBPtr->maxKeyLength )
+		return( fsBTInvalidKeyLengthErr );
+	myKeySize = CalcKeySize( theBTreeCBPtr, theKeyPtr );
+	if ( theDataSize > theBTreeCBPtr->nodeSize ||
+		 CalcKeyRecordSize( myKeySize, theDataSize ) > (theBTreeCBPtr->nodeSize >> 1) )
+		return( fsBTRecordTooLargeErr );
+
+	if ( theRecordsPtr->count == theRecordsPtr->size )
+	{
+		mySize = theRecordsPtr->size + theRecordsPtr->size / 2 + 1024;
+		if ( mySize > (UINT32_MAX / sizeof(BulkLoadEntry)) )
+			return( memFullErr );
+		myEntries = realloc( theRecordsPtr->entries, mySize * sizeof(BulkLoadEntry) );
+		if ( myEntries == NULL )
+			return( memFullErr );
+		theRecordsPtr->entries = myEntries;
+		theRecordsPtr->size = mySize;
+	}
+
+	/* keep the keys long word aligned for the key compare routines */
+	myRecordSize = (myKeySize + theDataSize + 3) & ~3;
+	if ( theRecordsPtr->bufferSize - theRecordsPtr->bufferUsed < myRecordSize )
+	{
+		mySize = theRecordsPtr->bufferSize + theRecordsPtr->bufferSize / 2 + kSalvageBufferMinSize;
+		if ( mySize < theRecordsPtr->bufferSize )
+			return( memFullErr );
+		myBuffer = realloc( theRecordsPtr->buffer, mySize );
+		if ( myBuffer == NULL )
+			return( memFullErr );
+		theRecordsPtr->buffer = myBuffer;
+		theRecordsPtr->bufferSize = mySize;
+	}
+
+	/* the buffer may move as it grows, so the pointers are set by BulkLoadBTree */
+	myBuffer = theRecordsPtr->buffer + theRecordsPtr->bufferUsed;
+	CopyMemory( theKeyPtr, myBuffer, myKeySize );
+	CopyMemory( theDataPtr, myBuffer + myKeySize, theDataSize );
+
+	myEntries = &theRecordsPtr->entries[ theRecordsPtr->count++ ];
+	myEntries->key = NULL;
+	myEntries->data = NULL;
+	myEntries->offset = theRecordsPtr->bufferUsed;
+	myEntries->nodeNum = 0;
+	myEntries->dataSize = theDataSize;
+	theRecordsPtr->bufferUsed += myRecordSize;
+
+	return( noErr );
+
+} /* AddSalvagedRecord */
+
+
+/*
+ * InsertSalvagedRecords
+ *	
+ * This routine inserts the records kept by AddSalvagedRecord into 
+ * the new B-Tree one at a time, when there is not enough memory
+ * to bulk load them.
+ */
+static OSErr InsertSalvagedRecords( SFCB * theFCBPtr, SalvagedRecords * theRecordsPtr )
+{
+	BTreeControlBlock *	myBTreeCBPtr;
+	BTreeKeyPtr			myKeyPtr;
+	UInt32				myHint;
+	UInt32				i;
+	OSErr				myErr;
+
+	myBTreeCBPtr = (BTreeControlBlock *) theFCBPtr->fcbBtree;
+	for ( i = 0; i < theRecordsPtr->count; i++ )
+	{
+		myKeyPtr = (BTreeKeyPtr) (theRecordsPtr->buffer + theRecordsPtr->entries[i].offset);
+		myErr = InsertBTreeRecord( theFCBPtr, myKeyPtr,
+								   (UInt8 *) myKeyPtr + CalcKeySize( myBTreeCBPtr, myKeyPtr ),
+								   theRecordsPtr->entries[i].dataSize, &myHint );
+		if ( noErr != myErr )
+			return( myErr );
+	}
+
+	return( noErr );
+
+} /* InsertSalvagedRecords */
+
+
+static void DisposeSalvagedRecords( SalvagedRecords * theRecordsPtr )
+{
+	if ( theRecordsPtr->buffer != NULL )
+		free( theRecordsPtr->buffer );
+	if ( theRecordsPtr->entries != NULL )
+		free( theRecordsPtr->entries );
+	theRecordsPtr->buffer = NULL;
+	theRecordsPtr->bufferUsed = 0;
+	theRecordsPtr->bufferSize = 0;
+	theRecordsPtr->entries = NULL;
+	theRecordsPtr->count = 0;
+	theRecordsPtr->size = 0;
+
+} /* DisposeSalvagedRecords */
+
+
+/* qsort has no argument for the B-Tree, so its key compare routine is kept here */
+static KeyCompareProcPtr	gBulkLoadKeyCompare;
+
+static int CompareBulkLoadEntries( const void * theLeftPtr, const void * theRightPtr )
+{
+	SInt32		myResult;
+
+	myResult = (*gBulkLoadKeyCompare)( ((const BulkLoadEntry *) theLeftPtr)->key,
+									   ((const BulkLoadEntry *) theRightPtr)->key );
+
+	return( (myResult < 0) ? -1 : (myResult > 0) );
+
+} /* CompareBulkLoadEntries */
+
+
+/*
+ * AllocateBulkLoadNode
+ *	
+ * This routine allocates a node in the new B-Tree, extending
+ * the B-Tree file as BTInsertRecord would when it is full.
+ */
+static OSErr AllocateBulkLoadNode( BTreeControlBlock * theBTreeCBPtr, UInt32 * theNodeNumPtr )
+{
+	UInt32				myNodesNeeded;
+	OSErr				myErr;
+
+	if ( theBTreeCBPtr->freeNodes == 0 )
+	{
+		myNodesNeeded = theBTreeCBPtr->totalNodes + 1;
+		if ( myNodesNeeded > CalcMapBits( theBTreeCBPtr ) )	// we'll need to add a map node too!
+			++myNodesNeeded;
+
+		myErr = ExtendBTree( theBTreeCBPtr, myNodesNeeded );
+		ReturnIfError( myErr );
+	}
+
+	return( AllocateNode( theBTreeCBPtr, theNodeNumPtr ) );
+
+} /* AllocateBulkLoadNode */
+
+
+/*
+ * BuildBTreeLevel
+ *	
+ * This routine packs the records given, which are in key order,
+ * into a row of nodes of one level of the new B-Tree, linked to each
+ * other.  Nodes are filled to kBulkLoadFillPercent, but each holds
+ * at least two records when they fit, so that every index level has
+ * at most half as many nodes as the level below it.  An entry for each
+ * node, keyed by its first record, is returned in theNodesPtr, ready
+ * to be packed into the level above.
+ */
+static OSErr BuildBTreeLevel(	BTreeControlBlock * theBTreeCBPtr,
+								SInt8 theKind,
+								UInt8 theHeight,
+								BulkLoadEntry * theEntriesPtr,
+								UInt32 theEntryCount,
+								BulkLoadEntry * theNodesPtr,
+								UInt32 * theNodeCountPtr )
+{
+	BlockDescriptor		myNode;
+	NodeDescPtr			myNodeDescPtr = NULL;
+	UInt32				myNodeCount = 0;
+	UInt32				myNodeNum;
+	UInt32				i;
+	UInt16				myKeyLength;
+	UInt16				myKeySize;
+	UInt16				myRecordSize;
+	UInt16				myFreeSize;
+	UInt16				myReserve;
+	OSErr				myErr;
+
+	myNode.buffer = NULL;
+	myReserve = (theBTreeCBPtr->nodeSize - sizeof(BTNodeDescriptor)) * (100 - kBulkLoadFillPercent) / 100;
+
+	for ( i = 0; i < theEntryCount; i++ )
+	{
+		// index keys are the maximum length unless they are variable (see GetKeyLength)
+		if ( theKind == kBTLeafNode || (theBTreeCBPtr->attributes & kBTVariableIndexKeysMask) )
+			myKeyLength = KeyLength( theBTreeCBPtr, theEntriesPtr[i].key );
+		else
+			myKeyLength = theBTreeCBPtr->maxKeyLength;
+		myKeySize = myKeyLength + ((theBTreeCBPtr->attributes & kBTBigKeysMask) ? sizeof(UInt16) : sizeof(UInt8));
+		myRecordSize = CalcKeyRecordSize( myKeySize, theEntriesPtr[i].dataSize ) + sizeof(UInt16);
+
+		/* start a new node once this one is as full as it should be */
+		if ( myNode.buffer != NULL )
+		{
+			myFreeSize = GetNodeFreeSize( theBTreeCBPtr, myNodeDescPtr );
+			if ( myFreeSize < myRecordSize ||
+				 (myNodeDescPtr->numRecords > 1 && myFreeSize < myRecordSize + myReserve) )
+			{
+				myErr = AllocateBulkLoadNode( theBTreeCBPtr, &myNodeNum );
+				M_ExitOnError( myErr );
+
+				myNodeDescPtr->fLink = myNodeNum;
+				myErr = UpdateNode( theBTreeCBPtr, &myNode );
+				myNode.buffer = NULL;
+				M_ExitOnError( myErr );
+			}
+		}
+		else
+		{
+			myErr = AllocateBulkLoadNode( theBTreeCBPtr, &myNodeNum );
+			M_ExitOnError( myErr );
+		}
+
+		if ( myNode.buffer == NULL )
+		{
+			myErr = GetNewNode( theBTreeCBPtr, myNodeNum, &myNode );
+			M_ExitOnError( myErr );
+
+			myNodeDescPtr = (NodeDescPtr) myNode.buffer;
+			myNodeDescPtr->kind = theKind;
+			myNodeDescPtr->height = theHeight;
+			if ( myNodeCount > 0 )
+				myNodeDescPtr->bLink = theNodesPtr[ myNodeCount - 1 ].nodeNum;
+
+			theNodesPtr[ myNodeCount ].key = theEntriesPtr[i].key;
+			theNodesPtr[ myNodeCount ].data = &theNodesPtr[ myNodeCount ].nodeNum;
+			theNodesPtr[ myNodeCount ].offset = 0;
+			theNodesPtr[ myNodeCount ].nodeNum = myNodeNum;
+			theNodesPtr[ myNodeCount ].dataSize = sizeof(UInt32);
+			myNodeCount++;
+		}
+
+		if ( !InsertKeyRecord( theBTreeCBPtr, myNodeDescPtr, myNodeDescPtr->numRecords,
+							   theEntriesPtr[i].key, myKeyLength,
+							   theEntriesPtr[i].data, theEntriesPtr[i].dataSize ) )
+		{
+			myErr = fsBTRecordTooLargeErr;
+			goto ErrorExit;
+		}
+	}
+
+	if ( myNode.buffer != NULL )
+	{
+		myErr = UpdateNode( theBTreeCBPtr, &myNode );
+		myNode.buffer = NULL;
+		M_ExitOnError( myErr );
+	}
+
+	*theNodeCountPtr = myNodeCount;
+	return( noErr );
+
+ErrorExit:
+	if ( myNode.buffer != NULL )
+		(void) ReleaseNode( theBTreeCBPtr, &myNode );
+
+	return( myErr );
+
+} /* BuildBTreeLevel */
+
+
+/*
+ * BulkLoadBTree
+ *	
+ * This routine sorts the records kept by AddSalvagedRecord and builds
+ * the new (empty) B-Tree from them bottom up: the leaf nodes are packed
+ * in key order, and then each index level above them in one pass, until
+ * a level fits in a single node, the root.  memFullErr is returned,
+ * leaving the new B-Tree untouched, if there is no memory to do it.
+ */
+static OSErr BulkLoadBTree( SFCB * theFCBPtr, SalvagedRecords * theRecordsPtr )
+{
+	BTreeControlBlock *	myBTreeCBPtr;
+	BulkLoadEntry *		myEntries;
+	BulkLoadEntry *		myLevels[2];
+	BulkLoadEntry *		myLevelPtr;
+	UInt32				myLevelCount;
+	UInt32				myNodeCount;
+	UInt32				i;
+	UInt8				myHeight;
+	OSErr				myErr;
+
+	myBTreeCBPtr = (BTreeControlBlock *) theFCBPtr->fcbBtree;
+	myEntries = theRecordsPtr->entries;
+
+	for ( i = 0; i < theRecordsPtr->count; i++ )
+	{
+		myEntries[i].key = (BTreeKeyPtr) (theRecordsPtr->buffer + myEntries[i].offset);
+		myEntries[i].data = (UInt8 *) myEntries[i].key + CalcKeySize( myBTreeCBPtr, myEntries[i].key );
+	}
+
+	gBulkLoadKeyCompare = myBTreeCBPtr->keyCompareProc;
+	qsort( myEntries, theRecordsPtr->count, sizeof(BulkLoadEntry), CompareBulkLoadEntries );
+
+	/* a key found twice could not have been inserted either */
+	for ( i = 1; i < theRecordsPtr->count; i++ )
+	{
+		if ( CompareKeys( myBTreeCBPtr, myEntries[i - 1].key, myEntries[i].key ) == 0 )
+			return( fsBTDuplicateRecordErr );
+	}
+
+	/* each level is built from the one below into the other of these */
+	myLevels[0] = malloc( theRecordsPtr->count * sizeof(BulkLoadEntry) );
+	myLevels[1] = malloc( theRecordsPtr->count * sizeof(BulkLoadEntry) );
+	if ( myLevels[0] == NULL || myLevels[1] == NULL )
+	{
+		myErr = memFullErr;
+		goto ExitThisRoutine;
+	}
+
+	myLevelPtr = myEntries;
+	myLevelCount = theRecordsPtr->count;
+	for ( myHeight = 1; ; myHeight++ )
+	{
+		myErr = BuildBTreeLevel( myBTreeCBPtr, (myHeight == 1) ? kBTLeafNode : kBTIndexNode,
+								 myHeight, myLevelPtr, myLevelCount,
+								 myLevels[ (myHeight - 1) & 1 ], &myNodeCount );
+		if ( noErr != myErr )
+			goto ExitThisRoutine;
+		if ( myHeight > 1 && myNodeCount >= myLevelCount )
+		{
+			/* index records too big to pack two to a node */
+			myErr = fsBTRecordTooLargeErr;
+			goto ExitThisRoutine;
+		}
+
+		myLevelPtr = myLevels[ (myHeight - 1) & 1 ];
+		myLevelCount = myNodeCount;
+		if ( myHeight == 1 )
+		{
+			myBTreeCBPtr->firstLeafNode = myLevelPtr[0].nodeNum;
+			myBTreeCBPtr->lastLeafNode = myLevelPtr[ myLevelCount - 1 ].nodeNum;
+		}
+		if ( myLevelCount == 1 )
+			break;
+	}
+
+	myBTreeCBPtr->rootNode = myLevelPtr[0].nodeNum;
+	myBTreeCBPtr->treeDepth = myHeight;
+	myBTreeCBPtr->leafRecords = theRecordsPtr->count;
+	M_BTreeHeaderDirty( myBTreeCBPtr );
+
+	/* as InsertBTreeRecord would have noted */
+	if ( theFCBPtr->fcbFileID == kHFSExtentsFileID )
+		theFCBPtr->fcbVolume->vcbExtentsWriteCount++;
+
+ExitThisRoutine:
+	if ( myLevels[0] != NULL )
+		free( myLevels[0] );
+	if ( myLevels[1] != NULL )
+		free( myLevels[1] );
+
+	return( myErr );
+
+} /* BulkLoadBTree */
+
+
 /*
  * DeleteBTree
  *	
@@ -211,6 +211,9 @@ static int MRepair( SGlobPtr GPtr )
 		MarkVCBDirty(calculatedVCB);
 	}
 
+	/* Always write the MDB / VolumeHeader, so that its write count records the repair */
+	MarkVCBDirty(calculatedVCB);
+
 	/*
 	 * We do this check here because it may make set up some minor repair orders;
 	 * however, because determining the repairs to be done is expensive, we have only
@@ -6376,7 +6379,7 @@ static int ZeroFillUnusedNodes(SGlobPtr GPtr, short fileRefNum)
 		if ((*bitmap & mask) == 0)
 		{
 			/* Read the raw node, without going through hfs_swap_BTNode. */
-			err = btcb->getBlockProc(btcb->fcbPtr, nodeNum, kGetBlock|kGetEmptyBlock, &node);
+			err = btcb->getBlockProc(btcb->fcbPtr, nodeNum, kGetBlock|kGetEmptyBlock|kStreamBlock, &node);
 			if (err)
 			{
 				if (debug) plog("Couldn't read node #%u\n", nodeNum);
@@ -255,7 +255,8 @@ enum {
 	kGetBlock	= 0x00000000,
 	kForceReadBlock	= 0x00000002,
 	kGetEmptyBlock	= 0x00000008,
-	kSkipEndianSwap	= 0x00000010
+	kSkipEndianSwap	= 0x00000010,
+	kStreamBlock	= 0x00000020	/* part of a sequential scan; see CacheReadOptions */
 };
 typedef OptionBits  GetBlockOptions;
 
@@ -284,6 +285,7 @@ typedef BlockDescriptor *BlockDescPtr;
 
 
 struct SFCB;
+struct ExtentMap;
 
 struct SVCB {
 	UInt16		vcbSignature;
@@ -331,6 +333,7 @@ struct SVCB {
 	SInt16		vcbDriverWriteRef;
 
 	void *		vcbBlockCache;
+	UInt32		vcbExtentsWriteCount;	/* changes to the extents B-tree */
 
 	struct SGlob *	vcbGPtr;
 
@@ -352,6 +355,7 @@ struct SFCB {
 	UInt64 			fcbLogicalSize;
 	UInt64			fcbPhysicalSize;
 	UInt32			fcbBlockSize;
+	struct ExtentMap *	fcbExtentMap;	/* built by MapFileBlockC */
 };
 typedef struct SFCB SFCB;
 
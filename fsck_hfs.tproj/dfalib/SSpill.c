@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Out-of-core verify tables (-M).
+ *
+ * The in-memory volume bitmap, the catHier table and the hard link
+ * tables are the verify state that grows with the volume: a bit for
+ * each allocation block, and a few words for each catalog record.  On
+ * a very large volume with small blocks they can outgrow memory.
+ *
+ * With -M, fsck_hfs is given a budget for the disk cache and these
+ * tables together.  setup() estimates what the tables need from the
+ * volume header and sizes the cache from what is left (BudgetCacheSize).
+ * Once IVChk has found the volume, the estimate is made again against
+ * the cache actually allocated (CheckMemoryBudget), and if the tables do
+ * not fit beside it they are spilled: their large blocks are put in
+ * unlinked temporary files mapped shared, so that under memory pressure
+ * the kernel writes their pages back and drops them rather than swapping,
+ * and a file takes no disk space beyond the pages written, as it is only
+ * ever extended with ftruncate.
+ *
+ * The tables are already kept compact and sorted -- the bitmap holds
+ * only partial segments, catHier is built in key order, and the hard
+ * link tables are sorted in place -- so spilling them is only a matter
+ * of where their memory comes from.  Each large block is reached through
+ * one pointer, and grows by extending its file and mapping it again,
+ * without a copy.  Blocks smaller than kSpillMinimum, and every block
+ * when the tables fit, are on the heap.
+ *
+ * The files are made in $TMPDIR, or /tmp, which must not be on the
+ * volume being checked.
+ */
+
+#include "Scavenger.h"
+#include <sys/mman.h>
+#include <paths.h>
+#include <unistd.h>
+
+#define kSpillMinimum	(1024 * 1024)	/* Smallest block put in a file */
+
+/* Precedes each block, on the heap or at the start of its file */
+typedef struct SpillHeader {
+	UInt64		size;		/* Bytes in the block, after this header */
+	SInt32		fd;		/* Its file, or -1 if on the heap */
+	UInt32		reserved;
+} SpillHeader;
+
+Boolean gSpillVerifyState = false;	/* Put large verify tables in files */
+
+/*
+ * SpillMap
+ *
+ * Map a block's file, header and all; NULL on failure.
+ */
+static SpillHeader *
+SpillMap(int fd, size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, sizeof(SpillHeader) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return (p == MAP_FAILED ? NULL : (SpillHeader *)p);
+}
+
+/*
+ * SpillCreate
+ *
+ * Make a zero-filled block of size bytes in a new temporary file.
+ * Returns NULL if the file can't be made or mapped.
+ */
+static SpillHeader *
+SpillCreate(size_t size)
+{
+	char path[PATH_MAX];
+	const char *dir;
+	SpillHeader *h;
+	int fd;
+
+	if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+		dir = _PATH_TMP;
+	if (snprintf(path, sizeof(path), "%s/fsck_hfs.XXXXXX", dir) >= (int)sizeof(path))
+		return (NULL);
+	if ((fd = mkstemp(path)) < 0)
+		return (NULL);
+	(void) unlink(path);
+
+	if (ftruncate(fd, sizeof(SpillHeader) + size) < 0 ||
+	    (h = SpillMap(fd, size)) == NULL) {
+		(void) close(fd);
+		return (NULL);
+	}
+	h->size = size;
+	h->fd = fd;
+
+	return (h);
+}
+
+/*
+ * SpillAllocate
+ *
+ * Allocate a zero-filled block for a verify table: in a temporary file if
+ * the tables are being spilled and the block is large, on the heap if not
+ * (or if no file can be made).  Free it with SpillDispose.
+ */
+void *
+SpillAllocate(size_t size)
+{
+	SpillHeader *h = NULL;
+
+	if (gSpillVerifyState && size >= kSpillMinimum)
+		h = SpillCreate(size);
+	if (h == NULL) {
+		if ((h = calloc(1, sizeof(SpillHeader) + size)) == NULL)
+			return (NULL);
+		h->size = size;
+		h->fd = -1;
+	}
+
+	return (h + 1);
+}
+
+/*
+ * SpillReallocate
+ *
+ * Resize a block from SpillAllocate, like realloc, except that any bytes
+ * added are zero.  A block in a file stays in it and is not copied; a
+ * large block on the heap is moved to a file if the tables are being
+ * spilled.  Returns NULL, leaving the block as it was, on failure.
+ */
+void *
+SpillReallocate(void *ptr, size_t size)
+{
+	SpillHeader *h, *n;
+	size_t old;
+
+	if (ptr == NULL)
+		return (SpillAllocate(size));
+	h = (SpillHeader *)ptr - 1;
+	old = h->size;
+
+	if (h->fd >= 0) {
+		/* Only grow the file; the bytes past a smaller block are not mapped */
+		if (size > old && ftruncate(h->fd, sizeof(SpillHeader) + size) < 0)
+			return (NULL);
+		if ((n = SpillMap(h->fd, size)) == NULL)
+			return (NULL);
+		(void) munmap(h, sizeof(SpillHeader) + old);
+		n->size = size;
+		return (n + 1);
+	}
+
+	if (gSpillVerifyState && size >= kSpillMinimum && (n = SpillCreate(size)) != NULL) {
+		memcpy(n + 1, ptr, old < size ? old : size);
+		free(h);
+		return (n + 1);
+	}
+
+	if ((n = realloc(h, sizeof(SpillHeader) + size)) == NULL)
+		return (NULL);
+	if (size > old)
+		memset((char *)(n + 1) + old, 0, size - old);
+	n->size = size;
+
+	return (n + 1);
+}
+
+/*
+ * SpillDispose
+ *
+ * Free a block from SpillAllocate or SpillReallocate, and its file.
+ */
+void
+SpillDispose(void *ptr)
+{
+	SpillHeader *h;
+	int fd;
+
+	if (ptr == NULL)
+		return;
+	h = (SpillHeader *)ptr - 1;
+
+	if ((fd = h->fd) >= 0) {
+		(void) munmap(h, sizeof(SpillHeader) + h->size);
+		(void) close(fd);
+	} else {
+		free(h);
+	}
+}
+
+/*
+ * EstimateVerifyMemory
+ *
+ * Bytes the verify tables may need for a volume of totalBlocks allocation
+ * blocks, fileCount files and folderCount folders.  The bitmap is taken to
+ * have every segment partly full -- a bit a block, and a table entry a
+ * segment -- and catHier to have grown by doubling to twice the records
+ * it holds.  The hard link tables are left out, as the volume header does
+ * not say how many links there are.
+ */
+uint64_t
+EstimateVerifyMemory(uint64_t totalBlocks, uint64_t fileCount, uint64_t folderCount)
+{
+	uint64_t bytes;
+
+	bytes = totalBlocks / 8 + (totalBlocks / 1024) * sizeof(void *);
+	bytes += 2 * (folderCount * sizeof(CatHierFolder) +
+	              fileCount * sizeof(HFSCatalogNodeID) +
+	              (fileCount + folderCount) * sizeof(HFSCatalogNodeID));
+
+	return (bytes);
+}
+
+/*
+ * BudgetCacheSize
+ *
+ * Size the disk cache within a memory budget (-M), given the estimate of
+ * what the verify tables need.  The cache gets what the tables leave, as
+ * long as that is at least a quarter of the budget; otherwise the tables
+ * will be spilled, and the cache gets three quarters, the rest being left
+ * for the pages of the tables in use.
+ */
+uint64_t
+BudgetCacheSize(uint64_t budget, uint64_t estimate)
+{
+	if (estimate > budget - budget / 4)
+		return (budget - budget / 4);
+
+	return (budget - estimate);
+}
+
+/*
+ * CheckMemoryBudget
+ *
+ * Decide, once IVChk has found the volume, whether the verify tables are
+ * spilled: they are if the estimate of what they need, from the volume
+ * header (or MDB) and the calculated size of the volume, does not fit in
+ * the budget beside the cache.  An HFS volume, or one whose header could
+ * not be read before the cache was set up, is only estimated here.
+ */
+void
+CheckMemoryBudget(SGlobPtr GPtr)
+{
+	BlockDescriptor		block;
+	UInt64			fileCount = 0;
+	UInt64			folderCount = 0;
+	UInt64			estimate;
+	UInt64			cacheBytes;
+
+	if (memoryBudget == 0)
+		return;
+
+	block.buffer = NULL;
+	if (GetVolumeObjectVHBorMDB(&block) == noErr) {
+		if (VolumeObjectIsHFSPlus()) {
+			HFSPlusVolumeHeader *vh = (HFSPlusVolumeHeader *)block.buffer;
+
+			fileCount = vh->fileCount;
+			folderCount = vh->folderCount;
+		} else {
+			HFSMasterDirectoryBlock *mdb = (HFSMasterDirectoryBlock *)block.buffer;
+
+			fileCount = mdb->drFilCnt;
+			folderCount = mdb->drDirCnt;
+		}
+	}
+	if (block.buffer != NULL)
+		(void) ReleaseVolumeBlock(GPtr->calculatedVCB, &block, kReleaseBlock);
+
+	estimate = EstimateVerifyMemory(GPtr->calculatedVCB->vcbTotalBlocks, fileCount, folderCount);
+	cacheBytes = (UInt64)fscache.BlockSize * fscache.TotalBlocks;
+	gSpillVerifyState = (cacheBytes >= memoryBudget || estimate > memoryBudget - cacheBytes);
+
+	if (fsckGetVerbosity(GPtr->context) >= kDebugLog)
+		plog("\tverify tables need up to %lluK beside a %lluK cache; %s\n",
+		     (unsigned long long)(estimate / 1024), (unsigned long long)(cacheBytes / 1024),
+		     gSpillVerifyState ? "spilling them to temporary files" : "keeping them in memory");
+}
@@ -196,6 +196,10 @@ OSErr PtrAndHand(const void *ptr1, Handle hand2, long size)
 /* deprecated call, use fsckPrint() instead */
 void WriteError( SGlobPtr GPtr, short msgID, UInt32 tarID, UInt64 tarBlock )  
 {
+	/* Errors found on B-tree verify threads are found again, and reported, later */
+	if (GPtr == NULL)
+		return;
+
 	fsckPrint(GPtr->context, msgID);
 
 	if ((fsckGetVerbosity(GPtr->context) > 0) && 
@@ -439,6 +439,7 @@ RepairOrderPtr AllocMinorRepairOrder( SGlobPtr GPtr, size_t n )						/* #extra b
 	
 	if ( p != NULL )							//	if we got one...
 	{
+		p->extraBytes = n - sizeof( RepairOrder );
 		p->link = GPtr->MinorRepairsP;			//	then link into list of repairs
 		GPtr->MinorRepairsP = p;
 	}
@@ -2190,6 +2191,8 @@ OSErr	FlushVolumeControlBlock( SVCB *vcb )
 		volumeHeader->rsrcClumpSize		= vcb->vcbRsrcClumpSize;
 		volumeHeader->dataClumpSize		= vcb->vcbDataClumpSize;
 		volumeHeader->nextCatalogID		= vcb->vcbNextCatalogID;
+		/* Counting fsck's writes shows that the volume changed (see SCheckpoint.c) */
+		vcb->vcbWriteCount			= volumeHeader->writeCount + 1;
 		volumeHeader->writeCount		= vcb->vcbWriteCount;
 		volumeHeader->encodingsBitmap		= vcb->vcbEncodingsBitmap;
 
@@ -2243,6 +2246,8 @@ OSErr	FlushVolumeControlBlock( SVCB *vcb )
 		mdbP->drNmRtDirs  = vcb->vcbNmRtDirs;
 		mdbP->drFilCnt    = vcb->vcbFileCount;
 		mdbP->drDirCnt    = vcb->vcbFolderCount;
+		vcb->vcbWriteCount = mdbP->drWrCnt + 1;
+		mdbP->drWrCnt     = vcb->vcbWriteCount;
 
 		fcb = vcb->vcbExtentsFile;
 		CopyMemory( fcb->fcbExtents16, mdbP->drXTExtRec, sizeof( mdbP->drXTExtRec ) );
@@ -49,9 +49,12 @@ static OSErr	ScavengeVolumeType( SGlobPtr GPtr, HFSMasterDirectoryBlock *mdb, UI
 static OSErr	SeekVolumeHeader( SGlobPtr GPtr, UInt64 startSector, UInt32 numSectors, UInt64 *vHSector );
 
 /* overlapping extents verification functions prototype */
-static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrName, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType );
 
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo);
+static	Boolean	ExtentInfoExists( SGlobPtr GPtr, ExtentInfo *extentInfo);
+
+static	OSErr	AddOverlapRun( OverlapIndex *index, UInt32 startBlock, UInt32 blockCount );
+
+static	OSErr	AddOverlapSlot( OverlapIndex *index, ExtentInfo *extentInfo );
 
 static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, UInt32 fileID, const char *attrname, HFSPlusExtentRecord extent, UInt8 forkType); 
 
@@ -1381,11 +1384,167 @@ exit:
 }
 
 
+/*
+ * Lower bound: the index of the first folder in the catalog hierarchy
+ * table with the given parent ID, or of the first after it.
+ */
+static UInt32 CatHierFirstFolder( const CatHierTable *table, HFSCatalogNodeID parentID )
+{
+	UInt32 low = 0, high = table->folderCount, mid;
+
+	while ( low < high )
+	{
+		mid = low + (high - low) / 2;
+		if ( table->folders[mid].parentID < parentID )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return( low );
+}
+
+/* The same, for one of the sorted ID arrays; upper selects the upper bound */
+static UInt32 CatHierFindID( const HFSCatalogNodeID *ids, UInt32 count, HFSCatalogNodeID id, Boolean upper )
+{
+	UInt32 low = 0, high = count, mid;
+
+	while ( low < high )
+	{
+		mid = low + (high - low) / 2;
+		if ( ids[mid] < id || (upper && ids[mid] == id) )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return( low );
+}
+
+static int CompareCatHierFolders( const void *first, const void *second )
+{
+	HFSCatalogNodeID a = ((const CatHierFolder *)first)->parentID;
+	HFSCatalogNodeID b = ((const CatHierFolder *)second)->parentID;
+
+	return( (a > b) - (a < b) );
+}
+
+static int CompareCatHierIDs( const void *first, const void *second )
+{
+	HFSCatalogNodeID a = *(const HFSCatalogNodeID *)first;
+	HFSCatalogNodeID b = *(const HFSCatalogNodeID *)second;
+
+	return( (a > b) - (a < b) );
+}
+
+/*
+ * The table is collected in key order, and so is sorted already unless
+ * the B-tree check let keys out of order through.
+ */
+static void SortCatHierTable( CatHierTable *table )
+{
+	UInt32 i;
+
+	for ( i = 1; i < table->folderCount; i++ )
+		if ( table->folders[i].parentID < table->folders[i - 1].parentID )
+			break;
+	if ( i < table->folderCount )
+		qsort( table->folders, table->folderCount, sizeof(CatHierFolder), CompareCatHierFolders );
+
+	for ( i = 1; i < table->fileCount; i++ )
+		if ( table->fileParents[i] < table->fileParents[i - 1] )
+			break;
+	if ( i < table->fileCount )
+		qsort( table->fileParents, table->fileCount, sizeof(HFSCatalogNodeID), CompareCatHierIDs );
+
+	for ( i = 1; i < table->threadCount; i++ )
+		if ( table->threads[i] < table->threads[i - 1] )
+			break;
+	if ( i < table->threadCount )
+		qsort( table->threads, table->threadCount, sizeof(HFSCatalogNodeID), CompareCatHierIDs );
+}
+
+/*
+ * Read a folder's name from its key, in the leaf node the table noted,
+ * for a valence repair or a missing thread.
+ */
+static OSErr GetCatHierFolderName( SGlobPtr GPtr, const CatHierFolder *folder, CatalogName *name )
+{
+	BTreeControlBlock	*btcb = GPtr->calculatedCatalogBTCB;
+	NodeRec				node;
+	BTNodeDescriptor	*nodeDesc;
+	CatalogKey			*keyPtr;
+	CatalogRecord		*recPtr;
+	UInt16				recSize;
+	UInt16				i;
+	OSErr				err;
+	Boolean				isHFSPlus;
+
+	isHFSPlus = VolumeObjectIsHFSPlus( );
+
+	err = GetNode( btcb, folder->node, &node );
+	if ( err != noErr )
+		return( err );
+	nodeDesc = node.buffer;
+
+	err = btNotFound;
+	for ( i = 0; i < nodeDesc->numRecords; i++ )
+	{
+		if ( GetRecordByIndex( btcb, nodeDesc, i, (KeyPtr *)&keyPtr, (UInt8 **)&recPtr, &recSize ) != noErr )
+			break;
+		if ( isHFSPlus )
+		{
+			if ( keyPtr->hfsPlus.parentID == folder->parentID &&
+			     recPtr->recordType == kHFSPlusFolderRecord &&
+			     recPtr->hfsPlusFolder.folderID == folder->folderID )
+			{
+				CopyCatalogName( (const CatalogName *) &keyPtr->hfsPlus.nodeName, name, isHFSPlus );
+				err = noErr;
+				break;
+			}
+		}
+		else
+		{
+			if ( keyPtr->hfs.parentID == folder->parentID &&
+			     recPtr->recordType == kHFSFolderRecord &&
+			     recPtr->hfsFolder.folderID == folder->folderID )
+			{
+				CopyCatalogName( (const CatalogName *) &keyPtr->hfs.nodeName, name, isHFSPlus );
+				err = noErr;
+				break;
+			}
+		}
+	}
+
+	(void) ReleaseNode( btcb, &node );
+	return( err );
+}
+
+/*
+ * A folder being enumerated by CatHChk: its children are the folders
+ * [next, end) in the table, and the files counted into offspring.
+ */
+typedef struct CatHierLevel {
+	UInt32		folder;				//	index of the folder in the table
+	UInt32		first;				//	its first child folder
+	UInt32		next;				//	the next child folder to visit
+	UInt32		end;				//	past its last child folder
+	UInt32		offspring;			//	folders and files in it
+} CatHierLevel;
+
+
 /*------------------------------------------------------------------------------
 
 Function:	CatHChk - (Catalog Hierarchy Check)
 
 Function:	Verifies the catalog hierarchy.
+
+			The hierarchy is walked from the table of folder, file and thread
+			records collected in key order by CheckCatalogBTree rather than
+			through the B-tree, so that finding a folder's thread and its
+			children takes a binary search instead of B-tree lookups.  The
+			folders are visited depth first, in key order, as a walk through
+			the B-tree would visit them, so errors are found and reported in
+			the same order.  Folder names are read from the B-tree only for
+			the folders that need repair.
 			
 Input:		GPtr		-	pointer to scavenger global area
 
@@ -1396,32 +1555,28 @@ Output:		CatHChk	-	function result:
 
 OSErr CatHChk( SGlobPtr GPtr )
 {
-	SInt16					i;
+	CatHierTable			*table = &GPtr->catHier;
+	CatHierFolder			*folder;
+	CatHierLevel			*stack = NULL;
+	CatHierLevel			*level;
+	void					*ptr;
+	UInt8					*onStack = NULL;
+	UInt32					depth;
+	UInt32					stackSize;
+	UInt32					index;
+	UInt32					childFirst;
+	UInt32					childEnd;
+	UInt32					files;
+	UInt32					thread;
 	OSErr					result;
-	UInt16 					recSize;
-	SInt16					selCode;
-	UInt32					hint;
 	UInt32					dirCnt;
 	UInt32					filCnt;
 	SInt16					rtdirCnt;
 	SInt16					rtfilCnt;
 	SVCB					*calculatedVCB;
-	SDPR					*dprP;
-	SDPR					*dprP1;
-	CatalogKey				foundKey;
-	Boolean					validKeyFound;
-	CatalogKey				key;
-	CatalogRecord			record;
-	CatalogRecord			record2;
-	HFSPlusCatalogFolder	*largeCatalogFolderP;
-	HFSPlusCatalogFile		*largeCatalogFileP;
-	HFSCatalogFile			*smallCatalogFileP;
-	HFSCatalogFolder		*smallCatalogFolderP;
-	CatalogName				catalogName;
-	UInt32					valence;
-	CatalogRecord			threadRecord;
-	HFSCatalogNodeID		parID;
+	struct MissingThread	*mtp;
 	Boolean					isHFSPlus;
+	Boolean					descend;
 
 	//	set up
 	isHFSPlus = VolumeObjectIsHFSPlus( );
@@ -1429,334 +1584,213 @@ OSErr CatHChk( SGlobPtr GPtr )
 	GPtr->TarID		= kHFSCatalogFileID;						/* target = catalog file */
 	GPtr->TarBlock	= 0;										/* no target block yet */
 
-	//
-	//	position to the beginning of catalog
-	//
-	
-	// Can we ignore this part by just taking advantage of setting the selCode = 0x8001;
-	{ 
-		BuildCatalogKey( 1, (const CatalogName *)nil, isHFSPlus, &key );
-		result = SearchBTreeRecord( GPtr->calculatedCatalogFCB, &key, kNoHint, &foundKey, &threadRecord, &recSize, &hint );
-	
-		GPtr->TarBlock = hint;									/* set target block */
-		if ( result != btNotFound )
-		{
-			RcdError( GPtr, E_CatRec );
-			return( E_CatRec );
-		}
+	SortCatHierTable( table );
+
+	//	there should be no thread for the root's parent
+	index = CatHierFindID( table->threads, table->threadCount, kHFSRootParentID, false );
+	if ( index < table->threadCount && table->threads[index] == kHFSRootParentID )
+	{
+		RcdError( GPtr, E_CatRec );
+		result = E_CatRec;
+		goto exit;
 	}
-	
-	GPtr->DirLevel    = 1;
-	dprP              = &(GPtr->DirPTPtr)[0];
-	dprP->directoryID = 1;
 
-	dirCnt = filCnt = rtdirCnt = rtfilCnt = 0;
+	//	start with the root directory, the first folder in the root's parent
+	index = CatHierFirstFolder( table, kHFSRootParentID );
+	if ( index == table->folderCount || table->folders[index].parentID != kHFSRootParentID )
+	{
+		result = IntError( GPtr, btNotFound );
+		goto exit;
+	}
+
+	stackSize = 64;
+	stack = (CatHierLevel *) malloc( stackSize * sizeof(CatHierLevel) );
+	onStack = (UInt8 *) calloc( table->folderCount, sizeof(UInt8) );
+	if ( stack == NULL || onStack == NULL )
+	{
+		fsckPrint(GPtr->context, E_CatDepth, 0);
+		result = noErr;											/* abort this check, but let other checks proceed */
+		goto exit;
+	}
 
-	result	= noErr;
-	selCode = 0x8001;  /* start with root directory */			
+	depth = 0;
+	dirCnt = filCnt = rtdirCnt = rtfilCnt = 0;
 
 	//
 	//	enumerate the entire catalog 
 	//
-	while ( (GPtr->DirLevel > 0) && (result == noErr) )
+	for ( ;; )
 	{
-		dprP = &(GPtr->DirPTPtr)[GPtr->DirLevel - 1];
-		
-		validKeyFound = true;
-		record.recordType = 0;
-		
-		//	get the next record
-		result = GetBTreeRecord( GPtr->calculatedCatalogFCB, selCode, &foundKey, &record, &recSize, &hint );
-		
-		GPtr->TarBlock = hint;									/* set target block */
-		if ( result != noErr )
-		{
-			if ( result == btNotFound )
-			{
-				result = noErr;
-				validKeyFound = false;
-			}
-			else
-			{
-				result = IntError( GPtr, result );				/* error from BTGetRecord */
-				return( result );
-			}
-		}
-		selCode = 1;											/* get next rec from now on */
+		result = CheckForStop( GPtr ); 							//	Permit the user to interrupt
+		if ( result )
+			goto exit;
 
+		folder = &table->folders[index];
+		GPtr->TarID = folder->folderID;							//	target ID = directory ID 
+		GPtr->TarBlock = folder->node;							//	target block = its leaf node
+		GPtr->CNType = isHFSPlus ? kHFSPlusFolderRecord : kHFSFolderRecord;
 		GPtr->itemsProcessed++;
-		
-		//
-		//	 if same ParID ...
-		//
-		parID = isHFSPlus == true ? foundKey.hfsPlus.parentID : foundKey.hfs.parentID;
-		if ( (validKeyFound == true) && (parID == dprP->directoryID) )
-		{
-			dprP->offspringIndex++;								/* increment offspring index */
-
-			//	if new directory ...
-	
-			if ( record.recordType == kHFSPlusFolderRecord )
-			{
- 				result = CheckForStop( GPtr ); ReturnIfError( result );				//	Permit the user to interrupt
-			
-				largeCatalogFolderP = (HFSPlusCatalogFolder *) &record;				
-				GPtr->TarID = largeCatalogFolderP->folderID;				//	target ID = directory ID 
-				GPtr->CNType = record.recordType;							//	target CNode type = directory ID 
-				CopyCatalogName( (const CatalogName *) &foundKey.hfsPlus.nodeName, &GPtr->CName, isHFSPlus );
-
-				if ( dprP->directoryID > 1 )
-				{
-					GPtr->DirLevel++;										//	we have a new directory level 
-					dirCnt++;
-				}
-				if ( dprP->directoryID == kHFSRootFolderID )				//	bump root dir count 
-					rtdirCnt++;
-
-				if ( GPtr->DirLevel > GPtr->dirPathCount )
-				{
-					void *ptr;
-
-					ptr = realloc(GPtr->DirPTPtr, (GPtr->dirPathCount + CMMaxDepth) * sizeof(SDPR));
-					if (ptr == nil)
-					{
-						fsckPrint(GPtr->context, E_CatDepth, GPtr->dirPathCount);
-						return noErr;											/* abort this check, but let other checks proceed */
-					}
-					ClearMemory((char *)ptr + (GPtr->dirPathCount * sizeof(SDPR)), (CMMaxDepth * sizeof(SDPR)));
-					GPtr->dirPathCount += CMMaxDepth;
-					GPtr->DirPTPtr = ptr;
-				}
 
-				dprP = &(GPtr->DirPTPtr)[GPtr->DirLevel - 1];
-				dprP->directoryID		= largeCatalogFolderP->folderID;
-				dprP->offspringIndex	= 1;
-				dprP->directoryHint		= hint;
-				dprP->parentDirID		= foundKey.hfsPlus.parentID;
-				CopyCatalogName( (const CatalogName *) &foundKey.hfsPlus.nodeName, &dprP->directoryName, isHFSPlus );
+		if ( folder->parentID > kHFSRootParentID )
+			dirCnt++;
+		if ( folder->parentID == kHFSRootFolderID )				//	bump root dir count 
+			rtdirCnt++;
 
-				for ( i = 1; i < GPtr->DirLevel; i++ )
-				{
-					dprP1 = &(GPtr->DirPTPtr)[i - 1];
-					if (dprP->directoryID == dprP1->directoryID)
-					{
-						RcdError( GPtr,E_DirLoop );							//	loop in directory hierarchy 
-						return( E_DirLoop );
-					}
-				}
-				
-				/* 
-				 * Find thread record
-				 */
-				BuildCatalogKey( dprP->directoryID, (const CatalogName *) nil, isHFSPlus, &key );
-				result = SearchBTreeRecord( GPtr->calculatedCatalogFCB, &key, kNoHint, &foundKey, &threadRecord, &recSize, &hint );
-				if ( result != noErr ) {
-					struct MissingThread *mtp;
-					
-					/* Report the error */
-					fsckPrint(GPtr->context, E_NoThd, dprP->directoryID);
-					
-					/* HFS will exit here */
-					if ( !isHFSPlus )
-						return (E_NoThd);
-					/* 
-					 * A directory thread is missing.  If we can find this
-					 * ID on the missing-thread list then we know where the
-					 * child entries reside and can resume our enumeration.
-					 */
-					for (mtp = GPtr->missingThreadList; mtp != NULL; mtp = mtp->link) {
-						if (mtp->threadID == dprP->directoryID) {
-							mtp->thread.recordType = kHFSPlusFolderThreadRecord;
-							mtp->thread.parentID = dprP->parentDirID;
-							CopyCatalogName(&dprP->directoryName, (CatalogName *)&mtp->thread.nodeName, isHFSPlus);
-
-							/* Reposition to the first child of target directory */
-							result = SearchBTreeRecord(GPtr->calculatedCatalogFCB, &mtp->nextKey,
-							                           kNoHint, &foundKey, &threadRecord, &recSize, &hint);
-							if (result) {
-								return (E_NoThd);
-							}
-							selCode = 0; /* use current record instead of next */
-							break;
-						}
-					}
-					if (selCode != 0) {
-						/* 
-						 * A directory thread is missing but we know this
-						 * directory has no children (since we didn't find
-						 * its ID on the missing-thread list above).
-						 *
-						 * At this point we can resume the enumeration at
-						 * our previous position in our parent directory.
-						 */
-						goto resumeAtParent;
-					}
-				}	
-				dprP->threadHint = hint;
-				GPtr->TarBlock = hint; 
-			}
+		//	its child folders; if they are being enumerated, it is its own ancestor
+		childFirst = CatHierFirstFolder( table, folder->folderID );
+		for ( childEnd = childFirst; childEnd < table->folderCount; childEnd++ )
+			if ( table->folders[childEnd].parentID != folder->folderID )
+				break;
+		if ( childEnd > childFirst && onStack[childFirst] )
+		{
+			RcdError( GPtr, E_DirLoop );						//	loop in directory hierarchy 
+			result = E_DirLoop;
+			goto exit;
+		}
 
-			//	LargeCatalogFile
-			else if ( record.recordType == kHFSPlusFileRecord )
-			{
-				largeCatalogFileP = (HFSPlusCatalogFile *) &record;
-				GPtr->TarID = largeCatalogFileP->fileID;					//	target ID = file number 
-				GPtr->CNType = record.recordType;							//	target CNode type = thread 
-				CopyCatalogName( (const CatalogName *) &foundKey.hfsPlus.nodeName, &GPtr->CName, isHFSPlus );
-				filCnt++;
-				if (dprP->directoryID == kHFSRootFolderID)
-					rtfilCnt++;
-			}	
-
-			else if ( record.recordType == kHFSFolderRecord )
+		/* 
+		 * Find thread record
+		 */
+		descend = true;
+		thread = CatHierFindID( table->threads, table->threadCount, folder->folderID, false );
+		if ( thread == table->threadCount || table->threads[thread] != folder->folderID )
+		{
+			/* HFS will exit here */
+			if ( !isHFSPlus )
 			{
- 				result = CheckForStop( GPtr ); ReturnIfError( result );				//	Permit the user to interrupt
-			
-				smallCatalogFolderP = (HFSCatalogFolder *) &record;				
-				GPtr->TarID = smallCatalogFolderP->folderID;				/* target ID = directory ID */
-				GPtr->CNType = record.recordType;							/* target CNode type = directory ID */
-				CopyCatalogName( (const CatalogName *) &key.hfs.nodeName, &GPtr->CName, isHFSPlus );	/* target CName = directory name */
-
-				if (dprP->directoryID > 1)
-				{
-					GPtr->DirLevel++;										/* we have a new directory level */
-					dirCnt++;
-				}
-				if (dprP->directoryID == kHFSRootFolderID)					/* bump root dir count */
-					rtdirCnt++;
-
-				if ( GPtr->DirLevel > GPtr->dirPathCount )
-				{
-					void *ptr;
-
-					ptr = realloc(GPtr->DirPTPtr, (GPtr->dirPathCount + CMMaxDepth) * sizeof(SDPR));
-					if (ptr == nil)
-					{
-						fsckPrint(GPtr->context, E_CatDepth, GPtr->dirPathCount);
-						return noErr;											/* abort this check, but let other checks proceed */
-					}
-					ClearMemory((char *)ptr + (GPtr->dirPathCount * sizeof(SDPR)), (CMMaxDepth * sizeof(SDPR)));
-					GPtr->dirPathCount += CMMaxDepth;
-					GPtr->DirPTPtr = ptr;
-				}
-				
-				dprP = &(GPtr->DirPTPtr)[GPtr->DirLevel - 1];
-				dprP->directoryID		= smallCatalogFolderP->folderID;
-				dprP->offspringIndex	= 1;
-				dprP->directoryHint		= hint;
-				dprP->parentDirID		= foundKey.hfs.parentID;
+				result = IntError( GPtr, btNotFound );
+				goto exit;
+			}
 
-				CopyCatalogName( (const CatalogName *) &foundKey.hfs.nodeName, &dprP->directoryName, isHFSPlus );
+			/* Report the error */
+			fsckPrint(GPtr->context, E_NoThd, folder->folderID);
 
-				for (i = 1; i < GPtr->DirLevel; i++)
-				{
-					dprP1 = &(GPtr->DirPTPtr)[i - 1];
-					if (dprP->directoryID == dprP1->directoryID)
-					{
-						RcdError( GPtr,E_DirLoop );				/* loop in directory hierarchy */
-						return( E_DirLoop );
-					}
+			/* 
+			 * A directory thread is missing.  If we can find this
+			 * ID on the missing-thread list then it has children,
+			 * and we can fill in the thread for the repair.
+			 * Otherwise this directory has no children.
+			 */
+			for (mtp = GPtr->missingThreadList; mtp != NULL; mtp = mtp->link) {
+				if (mtp->threadID == folder->folderID)
+					break;
+			}
+			if (mtp != NULL) {
+				mtp->thread.recordType = kHFSPlusFolderThreadRecord;
+				mtp->thread.parentID = folder->parentID;
+				if (GetCatHierFolderName(GPtr, folder, (CatalogName *)&mtp->thread.nodeName) != noErr) {
+					result = E_NoThd;
+					goto exit;
 				}
-				
-				BuildCatalogKey( dprP->directoryID, (const CatalogName *)0, isHFSPlus, &key );
-				result = SearchBTreeRecord( GPtr->calculatedCatalogFCB, &key, kNoHint, &foundKey, &threadRecord, &recSize, &hint );
-				if  (result != noErr )
-				{
-					result = IntError(GPtr,result);				/* error from BTSearch */
-					return(result);
-				}	
-				dprP->threadHint	= hint;						/* save hint for thread */
-				GPtr->TarBlock		= hint;						/* set target block */
+			} else {
+				descend = false;
 			}
+		}
 
-			//	HFSCatalogFile...
-			else if ( record.recordType == kHFSFileRecord )
-			{
-				smallCatalogFileP = (HFSCatalogFile *) &record;
-				GPtr->TarID = smallCatalogFileP->fileID;							/* target ID = file number */
-				GPtr->CNType = record.recordType;									/* target CNode type = thread */
-				CopyCatalogName( (const CatalogName *) &foundKey.hfs.nodeName, &GPtr->CName, isHFSPlus );	/* target CName = directory name */
-				filCnt++;
-				if (dprP->directoryID == kHFSRootFolderID)
-					rtfilCnt++;
-			}
-			
-			//	Unknown/Bad record type
-			else
+		//	we have a new directory level 
+		if ( depth == stackSize )
+		{
+			ptr = realloc( stack, 2 * stackSize * sizeof(CatHierLevel) );
+			if ( ptr == NULL )
 			{
-				M_DebugStr("\p Unknown-Bad record type");
-				return( 123 );
+				fsckPrint(GPtr->context, E_CatDepth, depth);
+				result = noErr;									/* abort this check, but let other checks proceed */
+				goto exit;
 			}
-		} 
-		
-		//
-		//	 if not same ParID or no record
-		//
-		else if ( (record.recordType == kHFSFileThreadRecord) || (record.recordType == kHFSPlusFileThreadRecord) )			/* it's a file thread, skip past it */
+			stack = ptr;
+			stackSize *= 2;
+		}
+		level = &stack[depth++];
+		level->folder = index;
+		if ( descend )
 		{
-			GPtr->TarID				= parID;						//	target ID = file number
-			GPtr->CNType			= record.recordType;			//	target CNode type = thread
-			GPtr->CName.ustr.length	= 0;							//	no target CName
+			files = CatHierFindID( table->fileParents, table->fileCount, folder->folderID, true ) -
+			        CatHierFindID( table->fileParents, table->fileCount, folder->folderID, false );
+			filCnt += files;
+			if ( folder->folderID == kHFSRootFolderID )
+				rtfilCnt += files;
+			GPtr->itemsProcessed += files;
+
+			level->first = level->next = childFirst;
+			level->end = childEnd;
+			level->offspring = (childEnd - childFirst) + files;
+			if ( childEnd > childFirst )
+				onStack[childFirst] = 1;
 		}
-		
 		else
 		{
-resumeAtParent:
-			GPtr->TarID = dprP->directoryID;						/* target ID = current directory ID */
-			GPtr->CNType = record.recordType;						/* target CNode type = directory */
-			CopyCatalogName( (const CatalogName *) &dprP->directoryName, &GPtr->CName, isHFSPlus );	// copy the string name
-
-			//	re-locate current directory
-			CopyCatalogName( (const CatalogName *) &dprP->directoryName, &catalogName, isHFSPlus );
-			BuildCatalogKey( dprP->parentDirID, (const CatalogName *)&catalogName, isHFSPlus, &key );
-			result = SearchBTreeRecord( GPtr->calculatedCatalogFCB, &key, dprP->directoryHint, &foundKey, &record2, &recSize, &hint );
-			
-			if ( result != noErr )
+			level->first = level->next = level->end = childFirst;
+			level->offspring = 0;
+		}
+
+		//
+		//	find the next directory to enter, moving up a level
+		//	and checking the valence of each directory finished
+		//
+		for ( ;; )
+		{
+			level = &stack[depth - 1];
+			if ( level->next < level->end )
 			{
-				result = IntError(GPtr,result);						/* error from BTSearch */
-				return(result);
+				index = level->next++;
+				break;
 			}
-			GPtr->TarBlock = hint;									/* set target block */
-			
-
-			valence = isHFSPlus == true ? record2.hfsPlusFolder.valence : (UInt32)record2.hfsFolder.valence;
 
-			if ( valence != dprP->offspringIndex -1 ) 				/* check its valence */
-				if ( ( result = RcdValErr( GPtr, E_DirVal, dprP->offspringIndex -1, valence, dprP->parentDirID ) ) )
-					return( result );
+			folder = &table->folders[level->folder];
+			GPtr->TarID = folder->folderID;						/* target ID = current directory ID */
+			GPtr->TarBlock = folder->node;
 
-			GPtr->DirLevel--;										/* move up a level */			
-			
-			if(GPtr->DirLevel > 0)
-			{										
-				dprP = &(GPtr->DirPTPtr)[GPtr->DirLevel - 1];
-				GPtr->TarID	= dprP->directoryID;					/* target ID = current directory ID */
-				GPtr->CNType = record.recordType;					/* target CNode type = directory */
-				CopyCatalogName( (const CatalogName *) &dprP->directoryName, &GPtr->CName, isHFSPlus );
+			if ( folder->valence != level->offspring )			/* check its valence */
+			{
+				result = GetCatHierFolderName( GPtr, folder, &GPtr->CName );
+				if ( result != noErr )
+				{
+					result = IntError( GPtr, result );
+					goto exit;
+				}
+				if ( ( result = RcdValErr( GPtr, E_DirVal, level->offspring, folder->valence, folder->parentID ) ) )
+					goto exit;
 			}
+
+			if ( level->end > level->first )
+				onStack[level->first] = 0;
+			if ( --depth == 0 )
+				goto counts;									/* back out of the root */
 		}
-	}		//	end while
+	}
 
+counts:
 	//
 	//	verify directory and file counts (all nonfatal, repairable errors)
 	//
 	if (!isHFSPlus && (rtdirCnt != calculatedVCB->vcbNmRtDirs)) /* check count of dirs in root */
 		if ( ( result = RcdValErr(GPtr,E_RtDirCnt,rtdirCnt,calculatedVCB->vcbNmRtDirs,0) ) )
-			return( result );
+			goto exit;
 
 	if (!isHFSPlus && (rtfilCnt != calculatedVCB->vcbNmFls)) /* check count of files in root */
 		if ( ( result = RcdValErr(GPtr,E_RtFilCnt,rtfilCnt,calculatedVCB->vcbNmFls,0) ) )
-			return( result );
+			goto exit;
 
 	if (dirCnt != calculatedVCB->vcbFolderCount) /* check count of dirs in volume */
 		if ( ( result = RcdValErr(GPtr,E_DirCnt,dirCnt,calculatedVCB->vcbFolderCount,0) ) )
-			return( result );
+			goto exit;
 		
 	if (filCnt != calculatedVCB->vcbFileCount) /* check count of files in volume */
 		if ( ( result = RcdValErr(GPtr,E_FilCnt,filCnt,calculatedVCB->vcbFileCount,0) ) )
-			return( result );
+			goto exit;
 
-	return( noErr );
+	result = noErr;
+
+exit:
+	if ( stack != NULL )
+		free( stack );
+	if ( onStack != NULL )
+		free( onStack );
+
+	/* The table is collected again by the next catalog B-tree check */
+	DisposeCatHierTable( GPtr );
+
+	return( result );
 
 }	/* end of CatHChk */
 
@@ -3667,15 +3701,230 @@ void	BuildExtentKey( Boolean isHFSPlus, UInt8 forkType, HFSCatalogNodeID fileNum
 
 
 
+/*
+ * The overlapped extents table is looked up once for every extent on the
+ * volume by FindOrigOverlapFiles, and once for every extent added to it.
+ * Rather than search the table itself, AddExtentToOverlapList keeps an
+ * index of it alongside:
+ *
+ * runs[] is the union of the extents in the table, as disjoint runs of
+ * blocks [start, end) in increasing order, for DoesOverlap.  Runs that
+ * only touch are kept apart, so that an empty extent at the block where
+ * they meet overlaps neither, as it overlapped neither extent before.
+ *
+ * slots[] is an open-addressed hash of the extents in the table, for
+ * ExtentInfoExists.  The slots hold their own copies of the keys (the
+ * attribute name is shared with the table entry) so that the table can
+ * be sorted without disturbing them.
+ */
+typedef struct OverlapRun {
+	UInt64			start;
+	UInt64			end;
+} OverlapRun;
+
+typedef struct OverlapSlot {
+	char			*attrname;
+	HFSCatalogNodeID	fileID;
+	UInt32			startBlock;
+	UInt32			blockCount;
+	UInt8			forkType;
+	Boolean			used;
+} OverlapSlot;
+
+struct OverlapIndex {
+	OverlapRun		*runs;
+	UInt32			runCount;
+	UInt32			runSize;
+	OverlapSlot		*slots;
+	UInt32			slotCount;		/* slots in use */
+	UInt32			slotSize;		/* a power of two */
+};
+
+enum {
+	kOverlapRunsInitial	= 64,
+	kOverlapSlotsInitial	= 256
+};
+
+static UInt32 HashExtentInfo(const char *attrname, HFSCatalogNodeID fileID, UInt32 startBlock, UInt32 blockCount, UInt8 forkType)
+{
+	UInt32 hash;
+
+	hash = fileID * 0x9E3779B1;
+	hash = (hash ^ startBlock) * 0x85EBCA6B;
+	hash = (hash ^ blockCount) * 0xC2B2AE35;
+	hash ^= forkType;
+	if (attrname != NULL) {
+		while (*attrname)
+			hash = (hash ^ (UInt8)*attrname++) * 0x01000193;
+	}
+	return (hash ^ (hash >> 16));
+}
+
+/* Same extent, and same attribute name or both without one */
+static Boolean SameExtentInfo(const OverlapSlot *slot, const ExtentInfo *extentInfo)
+{
+	if ((slot->fileID != extentInfo->fileID) ||
+	    (slot->startBlock != extentInfo->startBlock) ||
+	    (slot->blockCount != extentInfo->blockCount) ||
+	    (slot->forkType != extentInfo->forkType)) {
+		return (false);
+	}
+	if ((slot->attrname == NULL) || (extentInfo->attrname == NULL)) {
+		return (slot->attrname == extentInfo->attrname);
+	}
+	return (strcmp(slot->attrname, extentInfo->attrname) == 0);
+}
+
+/*
+ * AddOverlapRun
+ *
+ * Fold the blocks of an extent into runs[], merging it with every run
+ * it overlaps.  An empty extent falls inside a run already there, since
+ * it is only added when DoesOverlap finds it overlapping, so it is left
+ * out.
+ */
+static OSErr AddOverlapRun(OverlapIndex *index, UInt32 startBlock, UInt32 blockCount)
+{
+	UInt64 start = startBlock;
+	UInt64 end = (UInt64)startBlock + blockCount;
+	UInt32 first, last, low, high, mid;
+	OverlapRun *runs;
+
+	if (blockCount == 0)
+		return (noErr);
+
+	/* The first run that ends after this extent starts */
+	low = 0;
+	high = index->runCount;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (index->runs[mid].end > start)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	first = low;
+
+	/* ...and the runs from there that start before it ends */
+	for (last = first; last < index->runCount && index->runs[last].start < end; last++)
+		;
+
+	if (last > first) {
+		if (index->runs[first].start < start)
+			start = index->runs[first].start;
+		if (index->runs[last - 1].end > end)
+			end = index->runs[last - 1].end;
+		index->runs[first].start = start;
+		index->runs[first].end = end;
+		if (last - first > 1) {
+			memmove(&index->runs[first + 1], &index->runs[last],
+			        (index->runCount - last) * sizeof(OverlapRun));
+			index->runCount -= last - first - 1;
+		}
+		return (noErr);
+	}
+
+	if (index->runCount == index->runSize) {
+		runs = realloc(index->runs, 2 * index->runSize * sizeof(OverlapRun));
+		if (runs == NULL)
+			return (memFullErr);
+		index->runs = runs;
+		index->runSize *= 2;
+	}
+	memmove(&index->runs[first + 1], &index->runs[first],
+	        (index->runCount - first) * sizeof(OverlapRun));
+	index->runs[first].start = start;
+	index->runs[first].end = end;
+	index->runCount++;
+
+	return (noErr);
+}
+
+/*
+ * AddOverlapSlot
+ *
+ * Enter an extent in slots[], which is kept no more than half full.  The
+ * caller has checked that it isn't there already.
+ */
+static OSErr AddOverlapSlot(OverlapIndex *index, ExtentInfo *extentInfo)
+{
+	OverlapSlot *slots, *slot;
+	UInt32 size, i, mask;
+
+	if (2 * (index->slotCount + 1) > index->slotSize) {
+		size = 2 * index->slotSize;
+		slots = calloc(size, sizeof(OverlapSlot));
+		if (slots == NULL)
+			return (memFullErr);
+		mask = size - 1;
+		for (i = 0; i < index->slotSize; i++) {
+			UInt32 h;
+
+			slot = &index->slots[i];
+			if (!slot->used)
+				continue;
+			h = HashExtentInfo(slot->attrname, slot->fileID, slot->startBlock,
+			                   slot->blockCount, slot->forkType) & mask;
+			while (slots[h].used)
+				h = (h + 1) & mask;
+			slots[h] = *slot;
+		}
+		free(index->slots);
+		index->slots = slots;
+		index->slotSize = size;
+	}
+
+	mask = index->slotSize - 1;
+	i = HashExtentInfo(extentInfo->attrname, extentInfo->fileID, extentInfo->startBlock,
+	                   extentInfo->blockCount, extentInfo->forkType) & mask;
+	while (index->slots[i].used)
+		i = (i + 1) & mask;
+
+	slot = &index->slots[i];
+	slot->attrname = extentInfo->attrname;
+	slot->fileID = extentInfo->fileID;
+	slot->startBlock = extentInfo->startBlock;
+	slot->blockCount = extentInfo->blockCount;
+	slot->forkType = extentInfo->forkType;
+	slot->used = true;
+	index->slotCount++;
+
+	return (noErr);
+}
+
+/* Function: DisposeOverlapIndex
+ *
+ * Description: Free the index of the overlapped extents table.  The
+ * attribute names belong to the table, and are freed with it.
+ *
+ * Input: GPtr - global scavenger pointer.
+ *
+ * Output: nothing (void)
+ */
+void DisposeOverlapIndex(SGlobPtr GPtr)
+{
+	OverlapIndex *index = GPtr->overlapIndex;
+
+	if (index == NULL)
+		return;
+
+	free(index->runs);
+	free(index->slots);
+	free(index);
+	GPtr->overlapIndex = NULL;
+}
+
 //
 //	Adds this extent to our OverlappedExtentList for later repair.
 //
-static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrname, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType )
+OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrname, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType )
 {
 	size_t			newHandleSize;
 	ExtentInfo		extentInfo;
 	ExtentsTable	**extentsTableH;
+	OverlapIndex	*index;
 	size_t attrlen;
+	OSErr			err;
 	
 	ClearMemory(&extentInfo, sizeof(extentInfo));
 	extentInfo.fileID		= fileNumber;
@@ -3697,21 +3946,51 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	//	If it's uninitialized
 	if ( GPtr->overlappedExtents == nil )
 	{
+		index = (OverlapIndex *) calloc( 1, sizeof(OverlapIndex) );
+		if ( index != NULL ) {
+			index->runs = (OverlapRun *) malloc( kOverlapRunsInitial * sizeof(OverlapRun) );
+			index->runSize = kOverlapRunsInitial;
+			index->slots = (OverlapSlot *) calloc( kOverlapSlotsInitial, sizeof(OverlapSlot) );
+			index->slotSize = kOverlapSlotsInitial;
+		}
 		GPtr->overlappedExtents	= (ExtentsTable **) NewHandleClear( sizeof(ExtentsTable) );
+		GPtr->overlapIndex = index;
+		if ( (GPtr->overlappedExtents == nil) || (index == NULL) ||
+		     (index->runs == NULL) || (index->slots == NULL) ) {
+			DisposeHandle( (Handle) GPtr->overlappedExtents );
+			GPtr->overlappedExtents = nil;
+			DisposeOverlapIndex( GPtr );
+			err = memFullErr;
+			goto fail;
+		}
 		extentsTableH	= GPtr->overlappedExtents;
 	}
 	else
 	{
 		extentsTableH	= GPtr->overlappedExtents;
 
-		if ( ExtentInfoExists( extentsTableH, &extentInfo) == true )
+		if ( ExtentInfoExists( GPtr, &extentInfo) == true ) {
+			if (extentInfo.attrname)
+				free(extentInfo.attrname);
 			return( noErr );
+		}
 
-		//	Grow the Extents table for a new entry.
-		newHandleSize = ( sizeof(ExtentInfo) ) + ( GetHandleSize( (Handle)extentsTableH ) );
-		SetHandleSize( (Handle)extentsTableH, newHandleSize );
+		//	Grow the Extents table, by half again, when it is full
+		newHandleSize = sizeof(ExtentsTable) + ((**extentsTableH).count * sizeof(ExtentInfo));
+		if ( newHandleSize > GetHandleSize( (Handle)extentsTableH ) ) {
+			newHandleSize += ((**extentsTableH).count / 2) * sizeof(ExtentInfo);
+			SetHandleSize( (Handle)extentsTableH, newHandleSize );
+			if ( GetHandleSize( (Handle)extentsTableH ) != newHandleSize ) {
+				err = memFullErr;
+				goto fail;
+			}
+		}
 	}
 
+	if ( ((err = AddOverlapRun( GPtr->overlapIndex, extentStartBlock, extentBlockCount )) != noErr) ||
+	     ((err = AddOverlapSlot( GPtr->overlapIndex, &extentInfo )) != noErr) )
+		goto fail;
+
 	//	Copy the new extents into the end of the table
 	CopyMemory( &extentInfo, &((**extentsTableH).extentInfo[(**extentsTableH).count]), sizeof(ExtentInfo) );
 	
@@ -3722,51 +4001,31 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	(**extentsTableH).count++;
 	
 	return( noErr );
+
+fail:
+	if (extentInfo.attrname)
+		free(extentInfo.attrname);
+	return( err );
 }
 
 
 /* Compare if the given extentInfo exsists in the extents table */
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo)
+static	Boolean	ExtentInfoExists( SGlobPtr GPtr, ExtentInfo *extentInfo)
 {
-	UInt32		i;
-	ExtentInfo	*aryExtentInfo;
-	
-
-	for ( i = 0 ; i < (**extentsTableH).count ; i++ )
-	{
-		aryExtentInfo	= &((**extentsTableH).extentInfo[i]);
-		
-		if ( extentInfo->fileID == aryExtentInfo->fileID )
-		{
-			if (	(extentInfo->startBlock == aryExtentInfo->startBlock)	&& 
-					(extentInfo->blockCount == aryExtentInfo->blockCount)	&&
-					(extentInfo->forkType	== aryExtentInfo->forkType)		)
-			{
-				/* startBlock, blockCount, forkType are same.  
-				 * Compare the extended attribute names, if they exist.
-				 */
-
-				/* If no attribute name exists, the two extents are same */
-				if ((extentInfo->attrname == NULL) &&
-					(aryExtentInfo->attrname == NULL)) {
-					return(true);
-				}
-
-				/* If only one attribute name exists, the two extents are not same */
-				if (((extentInfo->attrname != NULL) && (aryExtentInfo->attrname == NULL)) ||
-					((extentInfo->attrname == NULL) && (aryExtentInfo->attrname != NULL))) {
-					return(false);
-				}
+	OverlapIndex	*index = GPtr->overlapIndex;
+	UInt32			i, mask;
 
-				/* Both attribute name exist.  Compare the names */
-				if (!strcmp(extentInfo->attrname, aryExtentInfo->attrname)) {
-					return (true);
-				} else {
-					return (false);
-				}
+	mask = index->slotSize - 1;
+	i = HashExtentInfo(extentInfo->attrname, extentInfo->fileID, extentInfo->startBlock,
+	                   extentInfo->blockCount, extentInfo->forkType) & mask;
 
-			}
-		}
+	/* startBlock, blockCount, forkType are same, and so are the
+	 * extended attribute names, if they exist.
+	 */
+	for ( ; index->slots[i].used ; i = (i + 1) & mask )
+	{
+		if ( SameExtentInfo( &index->slots[i], extentInfo ) )
+			return( true );
 	}
 	
 	return( false );
@@ -3777,7 +4036,8 @@ static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *exten
  * Description: 
  * This function takes a start block and the count of blocks in a 
  * given extent and compares it against the list of overlapped 
- * extents in the global structure.   
+ * extents in the global structure, by way of the runs of blocks
+ * in its index.
  * This is useful in finding the original files that overlap with
  * the files found in catalog btree check.  If a file is found
  * overlapping, it is added to the overlap list. 
@@ -3794,26 +4054,33 @@ static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *exten
  */
 static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, UInt32 startBlock, UInt32 blockCount, UInt8 forkType) 
 {
-	int i;
+	UInt32 low, high, mid;
 	Boolean isOverlapped = false;
-	ExtentInfo	*curExtentInfo;
-	ExtentsTable **extentsTableH = GPtr->overlappedExtents;
-
-	for (i = 0; i < (**extentsTableH).count; i++) {
-		curExtentInfo = &((**extentsTableH).extentInfo[i]);
-		/* Check extents */
-		if (curExtentInfo->startBlock < startBlock) {
-			if ((curExtentInfo->startBlock + curExtentInfo->blockCount) > startBlock) {
-				isOverlapped = true;
-				break;
-			}
-		} else {	/* curExtentInfo->startBlock >= startBlock */
-			if (curExtentInfo->startBlock < (startBlock + blockCount)) {
-				isOverlapped = true;
-				break;
-			}
+	OverlapIndex *index = GPtr->overlapIndex;
+
+	if (index == NULL) {
+		return false;
+	}
+
+	/* Find the first run of overlapped blocks that ends after this
+	 * extent starts; the extent overlaps if that run starts before
+	 * the extent ends.  An empty extent overlaps only a run that
+	 * starts before it.
+	 */
+	low = 0;
+	high = index->runCount;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (index->runs[mid].end > startBlock) {
+			high = mid;
+		} else {
+			low = mid + 1;
 		}
-	} /* for loop Extents Table */	
+	}
+	if ((low < index->runCount) &&
+	    (index->runs[low].start < (UInt64)startBlock + blockCount)) {
+		isOverlapped = true;
+	}
 
 	/* Add this extent to overlap list */
 	if (isOverlapped) {
@@ -209,6 +209,8 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 	NodeDescPtr		nodeDescP;
 	UInt16			*statusFlag = NULL;
 	UInt32			leafRecords = 0;
+	BTreeWalk		*walk;
+	UInt32			n;
 	BTreeControlBlock	*calculatedBTCB	= GetBTreeControlBlock( refNum );
 
 	//	Set up
@@ -328,6 +330,69 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 	plog( "    totalNodes    = %d \n", header->totalNodes );
 	plog( "    freeNodes     = %d \n", header->freeNodes );
 #endif
+
+	/*
+	 * If the tree was walked on a worker thread (-t) or from a scan (-s)
+	 * and found sound, replay the walk: allocate, count and check for a
+	 * stop at each node just as the enumeration below would, but read only
+	 * the leaf nodes, for checkLeafRecord.
+	 */
+	walk = GetBTreeWalk( GPtr, refNum );
+	if ( walk != NULL )
+	{
+		for ( n = 0; n < walk->count; n++ )
+		{
+			nodeNum = walk->order[n];
+			GPtr->TarBlock = nodeNum;
+
+			result = AllocBTN( GPtr, refNum, nodeNum );
+			if ( result )
+				goto RebuildBTreeExit;
+
+			if ( walk->indexMap[nodeNum / 8] & (0x80 >> (nodeNum % 8)) )
+			{
+				if ( ( result = CheckForStop( GPtr ) ) )
+					goto exit;
+				GPtr->itemsProcessed++;
+				continue;
+			}
+			GPtr->itemsProcessed++;
+
+			(void) ReleaseNode(calculatedBTCB, &node);
+			result = GetNode( calculatedBTCB, nodeNum, &node );
+			if ( result != noErr )
+			{
+				if ( result == fsBTInvalidNodeErr )	/* hfs_swap_BTNode failed */
+				{
+					RcdError( GPtr, E_BadNode );
+					result	= E_BadNode;
+				}
+				node.buffer = NULL;
+				goto exit;
+			}
+			nodeDescP = node.buffer;
+
+			if ( nodeNum == walk->firstLeafNode )
+				calculatedBTCB->firstLeafNode = nodeNum;
+			if ( nodeNum == walk->lastLeafNode )
+				calculatedBTCB->lastLeafNode = nodeNum;
+			leafRecords	+= nodeDescP->numRecords;
+
+			if (checkLeafRecord != NULL) {
+				for (i = 0; i < nodeDescP->numRecords; i++) {
+					GetRecordByIndex(calculatedBTCB, nodeDescP, i, &keyPtr, &dataPtr, &recSize);
+					result = checkLeafRecord(GPtr, keyPtr, dataPtr, recSize);
+					if (result) goto exit;
+				}
+			}
+		}
+
+		/* Where the enumeration would have left off: back at the root */
+		GPtr->BTLevel = 0;
+		GPtr->TarBlock = calculatedBTCB->rootNode;
+		calculatedBTCB->leafRecords = leafRecords;
+		goto exit;
+	}
 		
 	/*
 	 * Set up tree path record for root level
@@ -761,7 +826,13 @@ int BTCheckUnusedNodes(SGlobPtr GPtr, short fileRefNum, UInt16 *btStat)
 	OSErr err;
 	UInt32 nodeNum;
 	BlockDescriptor node;
+	BTreeWalk *walk;
 	
+	/* Already done on a worker thread (-t)? */
+	walk = GetBTreeWalk(GPtr, fileRefNum);
+	if (walk != NULL && walk->unusedOK)
+		return 0;
+
 	node.buffer = NULL;
 	
 	for (nodeNum = 0; nodeNum < btcb->totalNodes; ++nodeNum)
@@ -773,7 +844,7 @@ int BTCheckUnusedNodes(SGlobPtr GPtr, short fileRefNum, UInt16 *btStat)
 			UInt32 *buffer;
 			
 			/* Read the raw node, without going through hfs_swap_BTNode. */
-			err = btcb->getBlockProc(btcb->fcbPtr, nodeNum, kGetBlock, &node);
+			err = btcb->getBlockProc(btcb->fcbPtr, nodeNum, kGetBlock | kStreamBlock, &node);
 			if (err)
 			{
 				if (debug) plog("Couldn't read node #%u\n", nodeNum);
@@ -0,0 +1,949 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Verifying the structure of the B-trees ahead of BTCheck (-t, -s).
+ *
+ * The extents, catalog and attributes B-trees are separate files, so the
+ * walk BTCheck makes of each -- node linkage, heights, key order, index
+ * links -- and the walks of BTMapChk and BTCheckUnusedNodes can be done
+ * for all three at once, while the main thread is busy with the earlier
+ * checks.  The workers share nothing with the rest of fsck: each reads
+ * its tree with pread() from the extents in the tree's FCB, into private
+ * buffers, and checks it against private copies of the control blocks.
+ * They record nothing and print nothing.
+ *
+ * With -s the walk is made from a scan of the tree instead: every node
+ * is read once, in order through the file, kCatScanBufferSize at a time,
+ * as BTScanNextRecord reads the catalog.  Each node is checked as it
+ * goes by, and what the walk needs of it -- its descriptor, its first
+ * key, and the whole node for the header, map and index nodes -- is kept
+ * in memory; the walk then follows the links there rather than seeking
+ * for every node.  Without -t the scan is made on the main thread, when
+ * BTCheck first asks for the tree.
+ *
+ * All accounting is still done by the main thread, in the usual order.
+ * BTCheck asks for the walk of its tree with GetBTreeWalk; if the walk
+ * found nothing wrong, BTCheck replays it -- allocating, counting and
+ * checking for a stop request at each node as it would have -- and
+ * reads only the leaf nodes, for the leaf record checks.  Anything the
+ * walk finds wrong, and any write to the volume meanwhile, makes the
+ * main thread check that tree itself, exactly as without -t or -s; so
+ * the output, and any repairs, are the same either way.
+ */
+
+#include "Scavenger.h"
+#include "../cache.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#define kMaxVerifyThreads	3	/* extents, catalog, attributes */
+
+/* A contiguous piece of a B-tree file on disk */
+typedef struct BTreeRun {
+	UInt64		fileOffset;	/* Byte offset in the file */
+	UInt64		diskOffset;	/* Byte offset on the device */
+	UInt64		length;		/* Length, in bytes */
+} BTreeRun;
+
+/* What a scan (-s) keeps of each node */
+typedef struct BTreeScanNode {
+	UInt32		fLink;
+	UInt32		bLink;
+	UInt32		keyOffset;	/* Of the first key, in keys */
+	UInt32		wholeOffset;	/* Of the whole node, in wholeNodes */
+	UInt16		numRecords;
+	SInt16		status;		/* Why the node can't be used, or 0 */
+	SInt8		kind;
+	UInt8		height;
+	Boolean		zeroed;		/* Nothing but zeroes */
+} BTreeScanNode;
+
+#define	kNoScanOffset	0xFFFFFFFF
+
+/* Memory which only grows, for the keys and nodes a scan keeps */
+typedef struct BTreeArena {
+	UInt8		*base;
+	size_t		used;
+	size_t		size;
+} BTreeArena;
+
+/* A node as the walks see it, whether read or scanned */
+typedef struct WalkNode {
+	SInt8		kind;
+	UInt8		height;
+	UInt16		numRecords;
+	UInt32		fLink;
+	UInt32		bLink;
+	NodeDescPtr	node;		/* The whole node, if at hand */
+	KeyPtr		firstKey;	/* Key of record 0, if any */
+} WalkNode;
+
+typedef struct BTreeVerifyThread {
+	short			refNum;		/* kCalculated*RefNum of the tree */
+	pthread_t		thread;
+	Boolean			running;	/* Not yet joined */
+	Boolean			pending;	/* To be walked on the main thread */
+	uint64_t		writes;		/* cache->ReqWrite when read */
+	int			fd;
+	SVCB			vcb;		/* Private copies, so that nothing */
+	SFCB			fcb;		/*   the main thread changes is read */
+	BTreeControlBlock	btcb;
+	BTreeRun		runs[kHFSPlusExtentDensity];
+	UInt32			runCount;
+	UInt8			*nodeMap;	/* Nodes in use, as AllocBTN marks them */
+	BTreeScanNode		*scanNodes;	/* With -s, every node of the tree */
+	BTreeArena		keys;
+	BTreeArena		wholeNodes;
+	BTreeWalk		walk;
+} BTreeVerifyThread;
+
+struct BTreeVerifyThreads {
+	Cache_t			*cache;
+	int			count;
+	BTreeVerifyThread	tree[kMaxVerifyThreads];
+};
+
+static int	SetUpVerifyThread( BTreeVerifyThread *t, short refNum );
+static void	*VerifyThread( void *arg );
+static void	FreeVerifyThread( BTreeVerifyThread *t );
+static int	ReadBTreeFile( BTreeVerifyThread *t, UInt64 offset, UInt32 length, void *buffer );
+static int	ReadBTreeNode( BTreeVerifyThread *t, UInt32 nodeNum, void *buffer, Boolean swap );
+static int	ScanBTree( BTreeVerifyThread *t );
+static int	ScanBTreeNode( BTreeVerifyThread *t, UInt32 nodeNum, NodeDescPtr nodeP );
+static int	ArenaAdd( BTreeArena *arena, const void *data, size_t length, UInt32 *offset );
+static int	GetWalkNode( BTreeVerifyThread *t, UInt32 nodeNum, UInt8 *buffer, WalkNode *wn );
+static int	WalkBTree( BTreeVerifyThread *t, UInt8 *buffers );
+static int	WalkBTreeMap( BTreeVerifyThread *t, UInt8 *buffer );
+static int	CheckBTreeUnusedNodes( BTreeVerifyThread *t, UInt8 *buffer );
+static int	KeysInOrder( BTreeControlBlock *btcb, NodeDescPtr nodeP );
+
+#define	TestNodeBit(map, n)	((map)[(n) >> 3] & (0x80 >> ((n) & 7)))
+#define	SetNodeBit(map, n)	((map)[(n) >> 3] |= (0x80 >> ((n) & 7)))
+
+
+/*
+ * StartBTreeVerifyThreads
+ *
+ * Start a worker on each of the volume's B-trees or, with -s alone, get
+ * them ready to be scanned on the main thread.  Trees which can't be
+ * read without the extents B-tree, because they have overflow extents,
+ * are left to the main thread.  Trees whose checks a resumed verify
+ * (-k) skips, those of the groups before resumePhase, are not walked.
+ * Failing to start is not an error: the trees are then all checked on
+ * the main thread.
+ */
+int
+StartBTreeVerifyThreads( SGlobPtr GPtr, int resumePhase )
+{
+	struct BTreeVerifyThreads *threads;
+	Cache_t *cache;
+	short refNums[kMaxVerifyThreads];
+	int i, n, err;
+
+	StopBTreeVerifyThreads(GPtr);
+
+	cache = (Cache_t *) GPtr->calculatedVCB->vcbBlockCache;
+
+	/* The workers read the disk directly, so it must be up to date */
+	if (threadedVerify && cache->DirtyCount != 0 && (err = CacheFlush(cache)) != 0)
+		return (err);
+
+	threads = (struct BTreeVerifyThreads *) calloc(1, sizeof(*threads));
+	if (threads == NULL)
+		return (ENOMEM);
+	threads->cache = cache;
+
+	n = 0;
+	if (resumePhase < kCheckpointExtents)
+		refNums[n++] = kCalculatedExtentRefNum;
+	if (resumePhase < kCheckpointCatalog)
+		refNums[n++] = kCalculatedCatalogRefNum;
+	if (GPtr->calculatedVCB->vcbAttributesFile != NULL)
+		refNums[n++] = kCalculatedAttributesRefNum;
+
+	for (i = 0; i < n; i++) {
+		BTreeVerifyThread *t = &threads->tree[threads->count];
+
+		if (SetUpVerifyThread(t, refNums[i]) != 0) {
+			FreeVerifyThread(t);
+			continue;
+		}
+		if (!threadedVerify) {
+			t->pending = true;
+		} else {
+			t->writes = cache->ReqWrite;
+			if (pthread_create(&t->thread, NULL, VerifyThread, t) != 0) {
+				FreeVerifyThread(t);
+				continue;
+			}
+			t->running = true;
+		}
+		threads->count++;
+	}
+
+	GPtr->verifyThreads = threads;
+
+	return (0);
+
+} /* StartBTreeVerifyThreads */
+
+
+/*
+ * StopBTreeVerifyThreads
+ *
+ * Wait for any workers still running and throw away their walks.  The
+ * walks only hold for the verify pass they were started in.
+ */
+void
+StopBTreeVerifyThreads( SGlobPtr GPtr )
+{
+	struct BTreeVerifyThreads *threads = GPtr->verifyThreads;
+	int i;
+
+	if (threads == NULL)
+		return;
+
+	for (i = 0; i < threads->count; i++) {
+		BTreeVerifyThread *t = &threads->tree[i];
+
+		if (t->running)
+			(void) pthread_join(t->thread, NULL);
+		FreeVerifyThread(t);
+		free(t->walk.order);
+		free(t->walk.indexMap);
+	}
+	free(threads);
+	GPtr->verifyThreads = NULL;
+
+} /* StopBTreeVerifyThreads */
+
+
+/*
+ * GetBTreeWalk
+ *
+ * Return the walk made of the given tree, waiting for its worker, or
+ * making the walk now, if need be.  Returns NULL if the tree has to be
+ * walked the usual way: there was no walk, it found something wrong,
+ * or the volume has been written since the tree was read.
+ */
+BTreeWalk *
+GetBTreeWalk( SGlobPtr GPtr, short refNum )
+{
+	struct BTreeVerifyThreads *threads = GPtr->verifyThreads;
+	int i;
+
+	if (threads == NULL)
+		return (NULL);
+
+	for (i = 0; i < threads->count; i++) {
+		BTreeVerifyThread *t = &threads->tree[i];
+
+		if (t->refNum != refNum)
+			continue;
+		if (t->running) {
+			(void) pthread_join(t->thread, NULL);
+			t->running = false;
+		}
+		if (t->pending) {
+			t->pending = false;
+			if (threads->cache->DirtyCount != 0 && CacheFlush(threads->cache) != 0)
+				return (NULL);
+			t->writes = threads->cache->ReqWrite;
+			(void) VerifyThread(t);
+		}
+		if (threads->cache->ReqWrite != t->writes)
+			return (NULL);
+		return (t->walk.treeOK ? &t->walk : NULL);
+	}
+
+	return (NULL);
+
+} /* GetBTreeWalk */
+
+
+/*
+ * SetUpVerifyThread
+ *
+ * Copy what the worker needs to know about a tree, and find where the
+ * tree is on disk from the extents in its FCB.
+ */
+static int
+SetUpVerifyThread( BTreeVerifyThread *t, short refNum )
+{
+	SFCB *fcb = ResolveFCB(refNum);
+	SVCB *vcb = fcb->fcbVolume;
+	Boolean isHFSPlus = (vcb->vcbSignature == kHFSPlusSigWord);
+	UInt64 fileOffset, volumeStart, treeSize;
+	UInt32 i, startBlock, blockCount;
+
+	memset(t, 0, sizeof(*t));
+	t->refNum = refNum;
+	t->fd = ((Cache_t *) vcb->vcbBlockCache)->FD_R;
+
+	t->vcb = *vcb;
+	t->vcb.vcbGPtr = NULL;		/* WriteError is then silent */
+	t->btcb = *(BTreeControlBlock *) fcb->fcbBtree;
+	t->fcb = *fcb;
+	t->fcb.fcbVolume = &t->vcb;
+	t->fcb.fcbBtree = &t->btcb;
+	t->btcb.fcbPtr = &t->fcb;
+
+	if (t->btcb.totalNodes == 0 || t->btcb.nodeSize == 0)
+		return (EINVAL);
+
+	if (isHFSPlus)
+		volumeStart = vcb->vcbEmbeddedOffset;
+	else
+		volumeStart = (UInt64) vcb->vcbAlBlSt << kSectorShift;
+
+	fileOffset = 0;
+	for (i = 0; i < (isHFSPlus ? kHFSPlusExtentDensity : kHFSExtentDensity); i++) {
+		if (isHFSPlus) {
+			startBlock = fcb->fcbExtents32[i].startBlock;
+			blockCount = fcb->fcbExtents32[i].blockCount;
+		} else {
+			startBlock = fcb->fcbExtents16[i].startBlock;
+			blockCount = fcb->fcbExtents16[i].blockCount;
+		}
+		if (blockCount == 0)
+			break;
+
+		t->runs[i].fileOffset = fileOffset;
+		t->runs[i].diskOffset = volumeStart + (UInt64) startBlock * vcb->vcbBlockSize;
+		t->runs[i].length = (UInt64) blockCount * vcb->vcbBlockSize;
+		fileOffset += t->runs[i].length;
+	}
+	t->runCount = i;
+
+	treeSize = (UInt64) t->btcb.totalNodes * t->btcb.nodeSize;
+	if (fileOffset < treeSize || fcb->fcbPhysicalSize < treeSize)
+		return (EINVAL);	/* Needs the extents B-tree */
+
+	t->nodeMap = (UInt8 *) calloc(1, (t->btcb.totalNodes + 7) / 8);
+	if (t->nodeMap == NULL)
+		return (ENOMEM);
+
+	return (0);
+
+} /* SetUpVerifyThread */
+
+
+/*
+ * VerifyThread
+ *
+ * The worker: scan the tree with -s, walk it as BTCheck would, then the
+ * map nodes as BTMapChk would, then look at the unused nodes as
+ * BTCheckUnusedNodes would.  Each stage is only trusted if all those
+ * before it passed.
+ */
+static void *
+VerifyThread( void *arg )
+{
+	BTreeVerifyThread *t = (BTreeVerifyThread *) arg;
+	UInt8 *buffers;
+
+	buffers = (UInt8 *) malloc((size_t) BTMaxDepth * t->btcb.nodeSize);
+	if (buffers == NULL)
+		goto done;
+
+	if (scanVerify && ScanBTree(t) != 0)
+		goto done;
+
+	if (WalkBTree(t, buffers) == 0) {
+		t->walk.treeOK = true;
+		if (WalkBTreeMap(t, buffers) == 0 &&
+		    CheckBTreeUnusedNodes(t, buffers) == 0)
+			t->walk.unusedOK = true;
+	}
+
+done:
+	/* Only the walk is wanted from here on */
+	FreeVerifyThread(t);
+	free(buffers);
+	return (NULL);
+
+} /* VerifyThread */
+
+
+/*
+ * FreeVerifyThread
+ *
+ * Free what the worker used to make its walk.
+ */
+static void
+FreeVerifyThread( BTreeVerifyThread *t )
+{
+	free(t->nodeMap);
+	free(t->scanNodes);
+	free(t->keys.base);
+	free(t->wholeNodes.base);
+	t->nodeMap = NULL;
+	t->scanNodes = NULL;
+	memset(&t->keys, 0, sizeof(t->keys));
+	memset(&t->wholeNodes, 0, sizeof(t->wholeNodes));
+
+} /* FreeVerifyThread */
+
+
+/*
+ * ReadBTreeFile
+ *
+ * Read part of the tree file, which may run across several extents.
+ */
+static int
+ReadBTreeFile( BTreeVerifyThread *t, UInt64 offset, UInt32 length, void *buffer )
+{
+	UInt32 done, i;
+
+	for (done = 0, i = 0; done < length && i < t->runCount; i++) {
+		BTreeRun *run = &t->runs[i];
+		UInt64 start = offset + done;
+		UInt64 count;
+
+		if (start >= run->fileOffset + run->length)
+			continue;
+		count = run->fileOffset + run->length - start;
+		if (count > length - done)
+			count = length - done;
+		if (pread(t->fd, (UInt8 *) buffer + done, (size_t) count,
+		    (off_t) (run->diskOffset + (start - run->fileOffset))) != (ssize_t) count)
+			return (EIO);
+		done += count;
+	}
+
+	return (done == length ? 0 : EIO);
+
+} /* ReadBTreeFile */
+
+
+/*
+ * ReadBTreeNode
+ *
+ * Read a node of the tree into the given buffer, and swap it (checking
+ * its record offsets and keys) as GetNode would.
+ */
+static int
+ReadBTreeNode( BTreeVerifyThread *t, UInt32 nodeNum, void *buffer, Boolean swap )
+{
+	UInt32 nodeSize = t->btcb.nodeSize;
+	BlockDescriptor block;
+
+	if (nodeNum >= t->btcb.totalNodes)
+		return (fsBTInvalidNodeErr);
+
+	if (ReadBTreeFile(t, (UInt64) nodeNum * nodeSize, nodeSize, buffer) != 0)
+		return (EIO);
+
+	if (!swap)
+		return (0);
+
+	memset(&block, 0, sizeof(block));
+	block.buffer = buffer;
+	block.blockNum = nodeNum;
+	block.blockSize = nodeSize;
+	return (hfs_swap_BTNode(&block, &t->fcb, kSwapBTNodeBigToHost));
+
+} /* ReadBTreeNode */
+
+
+/*
+ * ScanBTree
+ *
+ * Read the whole tree, from the first node to the last, and keep what
+ * the walks need to know of each node in scanNodes.
+ */
+static int
+ScanBTree( BTreeVerifyThread *t )
+{
+	UInt32 nodeSize = t->btcb.nodeSize;
+	UInt32 totalNodes = t->btcb.totalNodes;
+	UInt32 bufferNodes, nodeNum, count, i;
+	UInt8 *buffer;
+	int err = 0;
+
+	bufferNodes = kCatScanBufferSize / nodeSize;
+	if (bufferNodes == 0)
+		bufferNodes = 1;
+
+	buffer = (UInt8 *) malloc((size_t) bufferNodes * nodeSize);
+	t->scanNodes = (BTreeScanNode *) calloc(totalNodes, sizeof(BTreeScanNode));
+	if (buffer == NULL || t->scanNodes == NULL) {
+		err = ENOMEM;
+		goto exit;
+	}
+
+	for (nodeNum = 0; nodeNum < totalNodes; nodeNum += count) {
+		count = totalNodes - nodeNum;
+		if (count > bufferNodes)
+			count = bufferNodes;
+
+		err = ReadBTreeFile(t, (UInt64) nodeNum * nodeSize, count * nodeSize, buffer);
+		if (err)
+			goto exit;
+
+		for (i = 0; i < count; i++) {
+			err = ScanBTreeNode(t, nodeNum + i, (NodeDescPtr) (buffer + (size_t) i * nodeSize));
+			if (err)
+				goto exit;
+		}
+	}
+
+exit:
+	free(buffer);
+	return (err);
+
+} /* ScanBTree */
+
+
+/*
+ * ScanBTreeNode
+ *
+ * Check one node of a scan as GetWalkNode would, and keep its descriptor,
+ * its first key, and the node itself if the walks will need its records.
+ * A node which fails a check is only marked: it only matters if a walk
+ * gets to it.
+ */
+static int
+ScanBTreeNode( BTreeVerifyThread *t, UInt32 nodeNum, NodeDescPtr nodeP )
+{
+	BTreeScanNode *sn = &t->scanNodes[nodeNum];
+	UInt32 nodeSize = t->btcb.nodeSize;
+	UInt32 *words = (UInt32 *) nodeP;
+	BlockDescriptor block;
+	KeyPtr keyPtr;
+	UInt8 *dataPtr;
+	UInt16 recSize;
+	UInt32 i, keyLen;
+	int err;
+
+	sn->keyOffset = kNoScanOffset;
+	sn->wholeOffset = kNoScanOffset;
+
+	for (i = 0; i < nodeSize / sizeof(UInt32) && words[i] == 0; i++)
+		continue;
+	sn->zeroed = (i == nodeSize / sizeof(UInt32));
+
+	memset(&block, 0, sizeof(block));
+	block.buffer = nodeP;
+	block.blockNum = nodeNum;
+	block.blockSize = nodeSize;
+	if (hfs_swap_BTNode(&block, &t->fcb, kSwapBTNodeBigToHost) != 0) {
+		sn->status = E_BadNode;
+		return (0);
+	}
+
+	sn->fLink = nodeP->fLink;
+	sn->bLink = nodeP->bLink;
+	sn->numRecords = nodeP->numRecords;
+	sn->kind = nodeP->kind;
+	sn->height = nodeP->height;
+
+	if (nodeP->kind != kBTIndexNode && nodeP->kind != kBTLeafNode) {
+		if (nodeP->kind == kBTHeaderNode || nodeP->kind == kBTMapNode)
+			return (ArenaAdd(&t->wholeNodes, nodeP, nodeSize, &sn->wholeOffset));
+		return (0);
+	}
+
+	sn->status = KeysInOrder(&t->btcb, nodeP);
+	if (sn->status != 0)
+		return (0);
+
+	if (nodeP->numRecords > 0 &&
+	    GetRecordByIndex(&t->btcb, nodeP, 0, &keyPtr, &dataPtr, &recSize) == noErr) {
+		keyLen = (t->btcb.attributes & kBTBigKeysMask)
+				? keyPtr->length16 + sizeof(UInt16)
+				: keyPtr->length8 + sizeof(UInt8);
+		if ((err = ArenaAdd(&t->keys, keyPtr, keyLen, &sn->keyOffset)) != 0)
+			return (err);
+	}
+
+	if (nodeP->kind == kBTIndexNode)
+		return (ArenaAdd(&t->wholeNodes, nodeP, nodeSize, &sn->wholeOffset));
+
+	return (0);
+
+} /* ScanBTreeNode */
+
+
+/*
+ * ArenaAdd
+ *
+ * Append a copy of the data to the arena, returning where it went.
+ * Everything starts on an even offset, as keys do in a node; whole
+ * nodes, being all one size, stay aligned.
+ */
+static int
+ArenaAdd( BTreeArena *arena, const void *data, size_t length, UInt32 *offset )
+{
+	size_t start = (arena->used + 1) & ~(size_t) 1;
+	size_t size;
+	UInt8 *base;
+
+	if (start + length >= kNoScanOffset)
+		return (ENOMEM);
+
+	if (start + length > arena->size) {
+		size = arena->size ? arena->size * 2 : 64 * 1024;
+		while (size < start + length)
+			size *= 2;
+		base = (UInt8 *) realloc(arena->base, size);
+		if (base == NULL)
+			return (ENOMEM);
+		arena->base = base;
+		arena->size = size;
+	}
+
+	memcpy(arena->base + start, data, length);
+	arena->used = start + length;
+	*offset = (UInt32) start;
+	return (0);
+
+} /* ArenaAdd */
+
+
+/*
+ * GetWalkNode
+ *
+ * Get a node for the walks: from the scan, if there was one, or else by
+ * reading it into the given buffer.  Returns non-zero if the node can't
+ * be read, or its keys are out of order.
+ */
+static int
+GetWalkNode( BTreeVerifyThread *t, UInt32 nodeNum, UInt8 *buffer, WalkNode *wn )
+{
+	NodeDescPtr nodeP;
+	KeyPtr keyPtr;
+	UInt8 *dataPtr;
+	UInt16 recSize;
+
+	if (nodeNum >= t->btcb.totalNodes)
+		return (E_BadNode);
+
+	if (t->scanNodes != NULL) {
+		BTreeScanNode *sn = &t->scanNodes[nodeNum];
+
+		if (sn->status != 0)
+			return (sn->status);
+		wn->kind = sn->kind;
+		wn->height = sn->height;
+		wn->numRecords = sn->numRecords;
+		wn->fLink = sn->fLink;
+		wn->bLink = sn->bLink;
+		wn->node = (sn->wholeOffset == kNoScanOffset) ? NULL
+				: (NodeDescPtr) (t->wholeNodes.base + sn->wholeOffset);
+		wn->firstKey = (sn->keyOffset == kNoScanOffset) ? NULL
+				: (KeyPtr) (t->keys.base + sn->keyOffset);
+		return (0);
+	}
+
+	nodeP = (NodeDescPtr) buffer;
+	if (ReadBTreeNode(t, nodeNum, nodeP, true) != 0)
+		return (E_BadNode);
+	wn->kind = nodeP->kind;
+	wn->height = nodeP->height;
+	wn->numRecords = nodeP->numRecords;
+	wn->fLink = nodeP->fLink;
+	wn->bLink = nodeP->bLink;
+	wn->node = nodeP;
+	wn->firstKey = NULL;
+	if (nodeP->numRecords > 0 &&
+	    GetRecordByIndex(&t->btcb, nodeP, 0, &keyPtr, &dataPtr, &recSize) == noErr)
+		wn->firstKey = keyPtr;
+
+	if (nodeP->kind == kBTIndexNode || nodeP->kind == kBTLeafNode)
+		return (KeysInOrder(&t->btcb, nodeP));
+	return (0);
+
+} /* GetWalkNode */
+
+
+/*
+ * WalkBTree
+ *
+ * BTCheck's enumeration, returning non-zero where BTCheck would report
+ * an error.  The nodes are recorded in the order they are first visited,
+ * for BTCheck to replay.  BTCheck rereads each index node on the way
+ * back up; here each level keeps its node, in one of the buffers or in
+ * the scan.
+ */
+static int
+WalkBTree( BTreeVerifyThread *t, UInt8 *buffers )
+{
+	BTreeControlBlock *btcb = &t->btcb;
+	BTreeWalk *walk = &t->walk;
+	STPR path[BTMaxDepth];
+	WalkNode nodes[BTMaxDepth];
+	STPR *tprP, *parentP;
+	UInt8 parKey[kMaxKeyLength + 2 + 2];
+	Boolean hasParKey = false;
+	WalkNode *wn;
+	BTHeaderRec *header;
+	KeyPtr keyPtr;
+	UInt8 *dataPtr;
+	UInt16 recSize;
+	UInt32 nodeNum;
+	SInt16 index;
+	short keyLen;
+	int level;
+
+	/* The header node */
+	wn = &nodes[0];
+	if (GetWalkNode(t, kHeaderNodeNum, buffers, wn) != 0)
+		return (E_BadNode);
+	SetNodeBit(t->nodeMap, kHeaderNodeNum);
+
+	if (wn->kind != kBTHeaderNode ||
+	    wn->numRecords != Num_HRecs ||
+	    wn->height != 0 ||
+	    wn->node == NULL)
+		return (E_BadHdrN);
+	header = (BTHeaderRec *) ((Byte *) wn->node + sizeof(BTNodeDescriptor));
+	if (GetRecordSize(btcb, wn->node, 0) != sizeof(BTHeaderRec))
+		return (E_LenBTH);
+	if (header->treeDepth > BTMaxDepth)
+		return (E_BTDepth);
+	if (header->rootNode >= btcb->totalNodes ||
+	    (header->treeDepth != 0 && header->rootNode == kHeaderNodeNum))
+		return (E_BTRoot);
+
+	btcb->treeDepth = header->treeDepth;
+	btcb->rootNode = header->rootNode;
+	if (btcb->treeDepth == 0 || btcb->rootNode == 0)
+		return (btcb->treeDepth == btcb->rootNode ? 0 : E_BTDepth);
+
+	walk->order = (UInt32 *) malloc((size_t) btcb->totalNodes * sizeof(UInt32));
+	walk->indexMap = (UInt8 *) calloc(1, (btcb->totalNodes + 7) / 8);
+	if (walk->order == NULL || walk->indexMap == NULL)
+		return (ENOMEM);
+
+	level = 1;
+	tprP = &path[0];
+	tprP->TPRNodeN = btcb->rootNode;
+	tprP->TPRRIndx = -1;
+	tprP->TPRLtSib = 0;
+	tprP->TPRRtSib = 0;
+
+	while (level > 0) {
+		tprP = &path[level - 1];
+		nodeNum = tprP->TPRNodeN;
+		index = tprP->TPRRIndx;
+		wn = &nodes[level - 1];
+
+		/* First visit: get the node and check it out */
+		if (index < 0) {
+			if (GetWalkNode(t, nodeNum, buffers + (size_t) (level - 1) * btcb->nodeSize, wn) != 0)
+				return (E_BadNode);
+			if (TestNodeBit(t->nodeMap, nodeNum))
+				return (E_OvlNode);
+			SetNodeBit(t->nodeMap, nodeNum);
+
+			if (wn->bLink != tprP->TPRLtSib)
+				return (E_SibLk);
+			if (tprP->TPRRtSib == -1)
+				tprP->TPRRtSib = nodeNum;
+			else if (wn->fLink != tprP->TPRRtSib)
+				return (E_SibLk);
+			if (wn->kind != kBTIndexNode && wn->kind != kBTLeafNode)
+				return (E_NType);
+			if (wn->height != btcb->treeDepth - level + 1)
+				return (E_NHeight);
+			if (hasParKey) {
+				if (wn->firstKey == NULL ||
+				    CompareKeys(btcb, (BTreeKey *) parKey, wn->firstKey) != 0)
+					return (E_IKey);
+			}
+
+			walk->order[walk->count++] = nodeNum;
+			if (wn->kind == kBTIndexNode)
+				SetNodeBit(walk->indexMap, nodeNum);
+		}
+
+		if (wn->kind == kBTIndexNode) {
+			index++;
+			if (index >= wn->numRecords) {
+				level--;
+				continue;
+			}
+			tprP->TPRRIndx = index;
+			parentP = tprP;
+			if (++level > BTMaxDepth)
+				return (E_BTDepth);
+			tprP = &path[level - 1];
+
+			GetRecordByIndex(btcb, wn->node, index, &keyPtr, &dataPtr, &recSize);
+			nodeNum = *(UInt32 *) dataPtr;
+			if (nodeNum == kHeaderNodeNum || nodeNum >= btcb->totalNodes)
+				return (E_IndxLk);
+
+			keyLen = (btcb->attributes & kBTBigKeysMask)
+					? keyPtr->length16 + sizeof(UInt16)
+					: keyPtr->length8 + sizeof(UInt8);
+			CopyMemory(keyPtr, parKey, keyLen);
+			hasParKey = true;
+
+			tprP->TPRNodeN = nodeNum;
+			tprP->TPRRIndx = -1;
+
+			tprP->TPRLtSib = 0;
+			if (index > 0) {
+				GetRecordByIndex(btcb, wn->node, index - 1, &keyPtr, &dataPtr, &recSize);
+				nodeNum = *(UInt32 *) dataPtr;
+				if (nodeNum == kHeaderNodeNum || nodeNum >= btcb->totalNodes)
+					return (E_IndxLk);
+				tprP->TPRLtSib = nodeNum;
+			} else if (parentP->TPRLtSib != 0) {
+				tprP->TPRLtSib = tprP->TPRRtSib;
+			}
+
+			tprP->TPRRtSib = 0;
+			if (index < wn->numRecords - 1) {
+				GetRecordByIndex(btcb, wn->node, index + 1, &keyPtr, &dataPtr, &recSize);
+				nodeNum = *(UInt32 *) dataPtr;
+				if (nodeNum == kHeaderNodeNum || nodeNum >= btcb->totalNodes)
+					return (E_IndxLk);
+				tprP->TPRRtSib = nodeNum;
+			} else if (parentP->TPRRtSib != 0) {
+				tprP->TPRRtSib = -1;
+			}
+		} else {
+			if (tprP->TPRLtSib == 0)
+				walk->firstLeafNode = nodeNum;
+			if (tprP->TPRRtSib == 0)
+				walk->lastLeafNode = nodeNum;
+			level--;
+		}
+	}
+
+	return (0);
+
+} /* WalkBTree */
+
+
+/*
+ * WalkBTreeMap
+ *
+ * BTMapChk's walk of the map records, marking the map nodes in use.
+ */
+static int
+WalkBTreeMap( BTreeVerifyThread *t, UInt8 *buffer )
+{
+	WalkNode wn;
+	SInt32 mapSize = (t->btcb.totalNodes + 7) / 8;
+	SInt16 recIndx = 2;
+	UInt32 nodeNum = 0;
+
+	while (mapSize > 0) {
+		if (GetWalkNode(t, nodeNum, buffer, &wn) != 0)
+			return (E_BadNode);
+
+		if (nodeNum != 0) {
+			if (TestNodeBit(t->nodeMap, nodeNum))
+				return (E_OvlNode);
+			SetNodeBit(t->nodeMap, nodeNum);
+			if (wn.kind != kBTMapNode ||
+			    wn.numRecords != Num_MRecs ||
+			    wn.height != 0)
+				return (E_BadMapN);
+		}
+		if (wn.node == NULL)
+			return (E_BadMapN);
+
+		mapSize -= GetRecordSize(&t->btcb, wn.node, recIndx);
+		recIndx = 0;
+		nodeNum = wn.fLink;
+		if (nodeNum == 0)
+			break;
+	}
+
+	return ((nodeNum != 0 || mapSize > 0) ? E_MapLk : 0);
+
+} /* WalkBTreeMap */
+
+
+/*
+ * CheckBTreeUnusedNodes
+ *
+ * Make sure every node not in use is zero filled.
+ */
+static int
+CheckBTreeUnusedNodes( BTreeVerifyThread *t, UInt8 *buffer )
+{
+	UInt32 nodeNum, i;
+	UInt32 *words = (UInt32 *) buffer;
+
+	for (nodeNum = 0; nodeNum < t->btcb.totalNodes; nodeNum++) {
+		if (TestNodeBit(t->nodeMap, nodeNum))
+			continue;
+		if (t->scanNodes != NULL) {
+			if (!t->scanNodes[nodeNum].zeroed)
+				return (E_UnusedNodeNotZeroed);
+			continue;
+		}
+		if (ReadBTreeNode(t, nodeNum, buffer, false) != 0)
+			return (EIO);
+		for (i = 0; i < t->btcb.nodeSize / sizeof(UInt32); i++)
+			if (words[i] != 0)
+				return (E_UnusedNodeNotZeroed);
+	}
+
+	return (0);
+
+} /* CheckBTreeUnusedNodes */
+
+
+/*
+ * KeysInOrder
+ *
+ * BTKeyChk, without reporting anything.  A misplaced "HFS+ Private Data"
+ * key counts as out of order here; BTCheck deals with it.
+ */
+static int
+KeysInOrder( BTreeControlBlock *btcb, NodeDescPtr nodeP )
+{
+	KeyPtr keyPtr, prevKeyP = NULL;
+	UInt8 *dataPtr;
+	UInt16 dataSize, keyLength;
+	SInt16 index;
+
+	if (nodeP->numRecords == 0)
+		return ((nodeP->fLink == 0 && nodeP->bLink == 0) ? E_BadNode : 0);
+
+	for (index = 0; index < nodeP->numRecords; index++) {
+		GetRecordByIndex(btcb, nodeP, (UInt16) index, &keyPtr, &dataPtr, &dataSize);
+
+		if (btcb->attributes & kBTBigKeysMask)
+			keyLength = keyPtr->length16;
+		else
+			keyLength = keyPtr->length8;
+		if (keyLength > btcb->maxKeyLength)
+			return (E_KeyLen);
+
+		if (prevKeyP != NULL && CompareKeys(btcb, prevKeyP, keyPtr) >= 0)
+			return (E_KeyOrd);
+		prevKeyP = keyPtr;
+	}
+
+	return (0);
+
+} /* KeysInOrder */
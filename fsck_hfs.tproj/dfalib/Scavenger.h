@@ -170,8 +170,6 @@ typedef	STPR SBTPT[BTMaxDepth]; 		/* BTree path table */
 //
 //	Misc constants
 //
-#define CMMaxDepth	100				/* max catalog depth (Same as Finder 7.0) */
-
 #define fNameLocked 4096
 
 union CatalogName {
@@ -181,16 +179,28 @@ union CatalogName {
 typedef union CatalogName				CatalogName;
 	
 //
-//	Scavenger Directory Path Record (SDPR)
+//	Catalog hierarchy table, collected in key order by CheckCatalogBTree for
+//	CatHChk: every folder record, the parent ID of every file record and the
+//	ID of every thread record.  Each array is sorted by its first field.
 //
-typedef struct SDPR {
-	UInt32				directoryID;		//	directory ID
-	UInt32				offspringIndex;		//	offspring index
-	UInt32				directoryHint;		//	BTree hint for directory record
-	long				threadHint;			//	BTree hint for thread record
-	HFSCatalogNodeID	parentDirID;		//	parent directory ID
-	CatalogName			directoryName;		//	directory CName
-} SDPR;
+typedef struct CatHierFolder {
+	HFSCatalogNodeID	parentID;			//	parent ID from the key
+	HFSCatalogNodeID	folderID;			//	folder ID
+	UInt32				valence;			//	valence from the folder record
+	UInt32				node;				//	leaf node holding the record, for its name
+} CatHierFolder;
+
+typedef struct CatHierTable {
+	CatHierFolder		*folders;
+	HFSCatalogNodeID	*fileParents;
+	HFSCatalogNodeID	*threads;
+	UInt32				folderCount;
+	UInt32				folderSize;
+	UInt32				fileCount;
+	UInt32				fileSize;
+	UInt32				threadCount;
+	UInt32				threadSize;
+} CatHierTable;
 	
 enum {
 //	kInvalidMRUCacheKey			= -1L,							/* flag to denote current MRU cache key is invalid*/
@@ -347,6 +357,7 @@ enum {
 	UInt32		maskBit;	/* incorrect bit */
 	UInt32		hint;		/* B-tree node hint */
 	UInt32		parid;		/* parent ID */
+	UInt32		extraBytes;	/* allocated past the node, for name */
 	unsigned char name[1];	/* dir or file name */
  } RepairOrder, *RepairOrderPtr;
 
@@ -412,6 +423,9 @@ struct ExtentsTable {
 };
 typedef struct ExtentsTable ExtentsTable;
 
+/* Lookup structures for the overlapped extents table; see SVerify1.c */
+typedef struct OverlapIndex OverlapIndex;
+
 
 struct FileIdentifier {
 	Boolean 						hasThread;
@@ -629,6 +643,32 @@ typedef struct PrimeBuckets {
 	UInt32	n31[31];
 } PrimeBuckets;
 
+/* A hard link as found in the catalog.  inodeID is the link reference
+ * number for file hard links, and the inode ID for directory hard links.
+ */
+typedef struct HardLinkTuple {
+	UInt32	inodeID;
+	UInt32	linkID;
+	UInt32	prev;
+	UInt32	next;
+} HardLinkTuple;
+
+/* Hard links in the order they were found, and once sorted, in order 
+ * of inodeID and then linkID, so that the links to each inode are a run
+ * of the table.  walk records which walk of an inode's chain reached 
+ * each link.
+ */
+typedef struct HardLinkTable {
+	HardLinkTuple	*links;
+	UInt32		*walk;
+	UInt32		count;
+	UInt32		size;
+	UInt32		walks;
+	Boolean		sorted;
+	Boolean		failed;		/* a link could not be added */
+	Boolean		mismatch;	/* a walk reached a link twice, or one not in the table */
+} HardLinkTable;
+
 /* Record last attribute ID checked, used in CheckAttributeRecord, initialized in ScavSetup */
 typedef struct attributeInfo {
 	Boolean isValid;
@@ -695,9 +735,7 @@ typedef struct SGlob {
 	UInt64				TarBlock;				//	target block/node number being verified
 	SInt16				BTLevel;				//	current BTree enumeration level
 	SBTPT				*BTPTPtr;				//	BTree path table pointer
-	SInt16				DirLevel;				//	current directory enumeration level
-	SDPR				*DirPTPtr;				//	directory path table pointer (pointer to array of SDPR)
-	uint32_t			dirPathCount;			//  number of SDPR entries allocated in directory path table
+	CatHierTable		catHier;				//	folders, files and threads for CatHChk
 	SInt16				CNType;					//	current CNode type
 	UInt32				ParID;					//	current parent DirID
 	CatalogName			CName;					//	current CName
@@ -707,6 +745,7 @@ typedef struct SGlob {
 	UInt32				**validFilesList;		//	List of valid HFS file IDs
 
 	ExtentsTable		**overlappedExtents;	//	List of overlapped extents
+	OverlapIndex		*overlapIndex;			//	Runs and hash of overlappedExtents
 	FileIdentifierTable	**fileIdentifierTable;	//	List of files for post processing
 
 	UInt32				inputFlags;				//	Caller can specify some DFA behaviors
@@ -758,6 +797,7 @@ typedef struct SGlob {
 	int				lostAndFoundMode;  // used when creating lost+found directory
 	int				liveVerifyState; // indicates if live verification is being done or not 
 	BTScanState		scanState;
+	struct BTreeVerifyThreads *verifyThreads;	/* B-tree walks on worker threads (-t) */
 	int		scanCount;	/* Number of times fsck_hfs has looped */		
 
 	unsigned char	volumeName[256]; /* volume name in ASCII or UTF-8 */
@@ -1027,6 +1067,8 @@ int compare_prime_buckets(PrimeBuckets *bucket1, PrimeBuckets *bucket2);
 
 extern	OSErr	CheckCatalogBTree( SGlobPtr GPtr );	//	catalog btree check
 
+extern	void	DisposeCatHierTable( SGlobPtr GPtr );
+
 extern	OSErr	CheckFolderCount( SGlobPtr GPtr );	//	Compute folderCount
 
 extern int  RecordBadAllocation(UInt32 parID, unsigned char * filename, UInt32 forkType, UInt32 oldBlkCnt, UInt32 newBlkCnt);
@@ -1075,6 +1117,10 @@ extern  int FindOrigOverlapFiles(SGlobPtr GPtr);
 
 extern  void PrintOverlapFiles (SGlobPtr GPtr);
 
+extern  void DisposeOverlapIndex (SGlobPtr GPtr);
+
+extern  OSErr AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrname, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType );
+
 extern int journal_replay(SGlobPtr gptr);
 
 /* ------------------------------- From SVerify2.c -------------------------------- */
@@ -1102,6 +1148,60 @@ extern	OSErr	ChkExtRec ( SGlobPtr GPtr, const void *extents , unsigned int *last
 extern	int		BTCheckUnusedNodes(SGlobPtr GPtr, short fileRefNum, UInt16 *btStat);
 
 
+/* ------------------------------- From SVerifyThreads.c -------------------------------- */
+
+/*
+ * A B-tree walked on a worker thread.  If treeOK, BTCheck would have
+ * found nothing wrong, and may replay the walk instead of making it; if
+ * unusedOK too, neither would BTMapChk or BTCheckUnusedNodes.
+ */
+typedef struct BTreeWalk {
+	UInt32		*order;			/* Nodes, in the order BTCheck first visits them */
+	UInt8		*indexMap;		/* Bit set for each index node */
+	UInt32		count;			/* Entries in order */
+	UInt32		firstLeafNode;
+	UInt32		lastLeafNode;
+	Boolean		treeOK;
+	Boolean		unusedOK;
+} BTreeWalk;
+
+extern	int		StartBTreeVerifyThreads( SGlobPtr GPtr, int resumePhase );
+
+extern	void		StopBTreeVerifyThreads( SGlobPtr GPtr );
+
+extern	BTreeWalk	*GetBTreeWalk( SGlobPtr GPtr, short refNum );
+
+
+/* ------------------------------- From SCheckpoint.c -------------------------------- */
+
+/* Groups of checks in the verify, after which a checkpoint is taken (-k) */
+enum {
+	kCheckpointNone		= 0,
+	kCheckpointExtents	= 1,	/* ExtBTChk, BadBlockFileExtentCheck */
+	kCheckpointCatalog	= 2,	/* CheckCatalogBTree, CatHChk, CheckFolderCount */
+	kCheckpointAttributes	= 3	/* AttrBTChk, FindOrigOverlapFiles, dirhardlink_check */
+};
+
+extern	int		SaveCheckpoint( SGlobPtr GPtr, const char *path, int phase );
+
+extern	int		LoadCheckpoint( SGlobPtr GPtr, const char *path );
+
+extern	void		RemoveCheckpoint( const char *path );
+
+
+/* ------------------------------- From SSpill.c -------------------------------- */
+
+extern	Boolean		gSpillVerifyState;
+
+extern	void *		SpillAllocate( size_t size );
+
+extern	void *		SpillReallocate( void *ptr, size_t size );
+
+extern	void		SpillDispose( void *ptr );
+
+extern	void		CheckMemoryBudget( SGlobPtr GPtr );
+
+
 /* -------------------------- From SRebuildBTree.c ------------------------- */
 
 extern	OSErr 	RebuildBTree( SGlobPtr theSGlobPtr, int FileID );
@@ -1127,6 +1227,8 @@ OSErr MapFileBlockC (
 	UInt64			*startSector,		// first 512-byte volume sector (NOT an allocation block)
 	UInt32			*availableBytes);	// number of contiguous bytes (up to numberOfBytes)
 
+void InvalidateExtentMap( SFCB *fcb );
+
 OSErr DeallocateFile(SVCB *vcb, CatalogRecord * fileRec);
 
 OSErr ExtendFileC (
@@ -1380,8 +1482,16 @@ extern void  HardLinkCheckEnd(void * cookie);
 extern void  CaptureHardLink(void * cookie, const HFSPlusCatalogFile *file);
 extern int   CheckHardLinks(void *cookie);
 
+extern int hardlink_table_add(HardLinkTable *table, UInt32 inodeID, UInt32 linkID, UInt32 prev, UInt32 next);
+extern int hardlink_table_sort(HardLinkTable *table);
+extern HardLinkTuple *hardlink_table_find(HardLinkTable *table, UInt32 inodeID, UInt32 linkID);
+extern void hardlink_table_begin_walk(HardLinkTable *table);
+extern int hardlink_table_visit(HardLinkTable *table, HardLinkTuple *link);
+extern int hardlink_table_mismatch(HardLinkTable *table);
+extern void hardlink_table_dispose(HardLinkTable *table);
+
 extern void hardlink_add_bucket(PrimeBuckets *bucket, uint32_t inode_id, uint32_t cur_link_id);
-extern int inode_check(SGlobPtr, PrimeBuckets *, CatalogRecord *, CatalogKey *, Boolean);
+extern int inode_check(SGlobPtr, PrimeBuckets *, HardLinkTable *, CatalogRecord *, CatalogKey *, Boolean);
 extern void record_link_badchain(SGlobPtr, Boolean);
 extern int record_link_badflags(SGlobPtr, uint32_t, Boolean, uint32_t, uint32_t);
 extern int record_inode_badflags(SGlobPtr, uint32_t, Boolean, uint32_t, uint32_t, Boolean);
@@ -1389,7 +1499,7 @@ extern int record_dirlink_badownerflags(SGlobPtr, uint32_t, uint8_t, uint8_t, in
 extern int record_link_badfinderinfo(SGlobPtr, uint32_t, Boolean);
 
 extern int get_first_link_id(SGlobPtr gptr, CatalogRecord *inode_rec, uint32_t inode_id, Boolean isdir, uint32_t *first_link_id);
-extern int filelink_hash_inode(UInt32 inode_id, UInt32 linkCount);
+extern int filelink_add_inode(UInt32 inode_id, UInt32 linkCount);
 
 /* 
  * Directory Hard Link checking routines 
@@ -1407,6 +1517,8 @@ extern int RepairHardLinkChains(SGlobPtr, Boolean);
  */
 extern int  BitMapCheckBegin(SGlobPtr g);
 extern int  BitMapCheckEnd(void);
+extern int  BitMapCheckSave(FILE *fp);
+extern int  BitMapCheckRestore(FILE *fp);
 extern int  CaptureBitmapBits(UInt32 startBit, UInt32 bitCount);
 extern int  ReleaseBitmapBits(UInt32 startBit, UInt32 bitCount);
 extern int  CheckVolumeBitMap(SGlobPtr g, Boolean repair);
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 1999-2003 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * UnicodeCompare.c
+ *
+ * The name comparisons used by the catalog key compare routines in
+ * SKeyCompare.c.
+ */
+
+#include "UnicodeCompare.h"
+#include "CaseFolding.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Fold a character from U+0001 to U+007F as gLowerCaseTable does:
+ * 'A' to 'Z' become 'a' to 'z', and all the others are left alone.
+ */
+#define AsciiFold(c)	((UInt16)((c) - 'A') <= ('Z' - 'A') ? (UInt16)((c) + 0x20) : (UInt16)(c))
+
+/* Non-zero if c is from U+0001 to U+007F */
+#define IsAsciiChar(c)	((UInt16)((c) - 1) < 0x7F)
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+typedef __m256i		AsciiVector;
+#define kAsciiVectorChars	16
+#define VLoad(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define VSet(x)			_mm256_set1_epi16((short)(x))
+#define VZero()			_mm256_setzero_si256()
+#define VAnd(a, b)		_mm256_and_si256((a), (b))
+#define VOr(a, b)		_mm256_or_si256((a), (b))
+#define VAdd(a, b)		_mm256_add_epi16((a), (b))
+#define VEqual(a, b)		_mm256_cmpeq_epi16((a), (b))
+#define VGreater(a, b)		_mm256_cmpgt_epi16((a), (b))
+#define VMask(a)		((UInt32)_mm256_movemask_epi8(a))
+#define kAllEqual		0xFFFFFFFFU
+#else
+typedef __m128i		AsciiVector;
+#define kAsciiVectorChars	8
+#define VLoad(p)		_mm_loadu_si128((const __m128i *)(p))
+#define VSet(x)			_mm_set1_epi16((short)(x))
+#define VZero()			_mm_setzero_si128()
+#define VAnd(a, b)		_mm_and_si128((a), (b))
+#define VOr(a, b)		_mm_or_si128((a), (b))
+#define VAdd(a, b)		_mm_add_epi16((a), (b))
+#define VEqual(a, b)		_mm_cmpeq_epi16((a), (b))
+#define VGreater(a, b)		_mm_cmpgt_epi16((a), (b))
+#define VMask(a)		((UInt32)_mm_movemask_epi8(a))
+#define kAllEqual		0xFFFFU
+#endif
+
+/* AsciiFold a vector of ASCII characters */
+static inline AsciiVector
+VFold(AsciiVector x)
+{
+	AsciiVector upper = VAnd(VGreater(x, VSet('A' - 1)), VGreater(VSet('Z' + 1), x));
+
+	return VAdd(x, VAnd(upper, VSet(0x20)));
+}
+#endif
+
+//
+//	AsciiRunCompare - Compare the leading characters of two strings, at most length
+//	of them, for as long as both strings have ASCII characters other than NUL.  Those
+//	are never ignorable, so the strings are compared in step; a vector of characters
+//	at a time where the compiler targets SSE2 or AVX2.
+//
+//	Returns -1 or +1, as FastUnicodeCompare would, at the first difference.  Otherwise
+//	returns 0, and sets *count to the number of characters compared in each string.
+//
+static SInt32
+AsciiRunCompare(ConstUniCharArrayPtr str1, ConstUniCharArrayPtr str2, ItemCount length, ItemCount *count)
+{
+	ItemCount i = 0;
+	UInt16 c1, c2;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	const AsciiVector notAscii = VSet(0xFF80);
+	AsciiVector a, b, bad;
+	UInt32 mask;
+
+	for (; i + kAsciiVectorChars <= length; i += kAsciiVectorChars) {
+		a = VLoad(str1 + i);
+		b = VLoad(str2 + i);
+
+		/* Leave anything but U+0001 to U+007F to the loop below */
+		bad = VOr(VAnd(VOr(a, b), notAscii),
+			  VOr(VEqual(a, VZero()), VEqual(b, VZero())));
+		if (VMask(VEqual(bad, VZero())) != kAllEqual)
+			break;
+
+		if (VMask(VEqual(a, b)) == kAllEqual)
+			continue;
+
+		mask = VMask(VEqual(VFold(a), VFold(b))) ^ kAllEqual;
+		if (mask) {
+			i += __builtin_ctz(mask) / 2;
+			goto differ;
+		}
+	}
+#endif
+
+	for (; i < length; i++) {
+		c1 = str1[i];
+		c2 = str2[i];
+		if (!IsAsciiChar(c1) || !IsAsciiChar(c2))
+			break;
+		if (c1 != c2 && AsciiFold(c1) != AsciiFold(c2))
+			goto differ;
+	}
+
+	*count = i;
+	return 0;
+
+differ:
+	c1 = AsciiFold(str1[i]);
+	c2 = AsciiFold(str2[i]);
+	*count = i;
+	return (c1 < c2) ? -1 : 1;
+}
+
+//_______________________________________________________________________
+//
+//	Routine:	FastRelString
+//
+//	Output:		returns -1 if str1 < str2
+//				returns  1 if str1 > str2
+//				return	 0 if equal
+//
+//_______________________________________________________________________
+
+SInt32	FastRelString( ConstStr255Param str1, ConstStr255Param str2 )
+{
+	SInt32 bestGuess;
+	UInt8 length, length2;
+
+	
+	length = *(str1++);
+	length2 = *(str2++);
+
+	if (length == length2)
+		bestGuess = 0;
+	else if (length < length2)
+		bestGuess = -1;
+	else
+	{
+		bestGuess = 1;
+		length = length2;
+	}
+
+	while (length--)
+	{
+		UInt32	aChar, bChar;
+
+		aChar = *(str1++);
+		bChar = *(str2++);
+		
+		if (aChar != bChar)	/* If they don't match exacly, do case conversion */
+		{	
+			UInt16	aSortWord, bSortWord;
+
+			aSortWord = gCompareTable[aChar];
+			bSortWord = gCompareTable[bChar];
+
+			if (aSortWord > bSortWord)
+				return 1;
+
+			if (aSortWord < bSortWord)
+				return -1;
+		}
+		
+		/*
+		 * If characters match exactly, then go on to next character
+		 * immediately without doing any extra work.
+		 */
+	}
+	
+	/* if you got to here, then return bestGuess */
+	return bestGuess;
+}	
+
+
+
+//
+//	FastUnicodeCompare - Compare two Unicode strings; produce a relative ordering
+//
+//	    IF				RESULT
+//	--------------------------
+//	str1 < str2		=>	-1
+//	str1 = str2		=>	 0
+//	str1 > str2		=>	+1
+//
+//	The lower case table starts with 256 entries (one for each of the upper bytes
+//	of the original Unicode char).  If that entry is zero, then all characters with
+//	that upper byte are already case folded.  If the entry is non-zero, then it is
+//	the _index_ (not byte offset) of the start of the sub-table for the characters
+//	with that upper byte.  All ignorable characters are folded to the value zero.
+//
+//	In pseudocode:
+//
+//		Let c = source Unicode character
+//		Let table[] = lower case table
+//
+//		lower = table[highbyte(c)]
+//		if (lower == 0)
+//			lower = c
+//		else
+//			lower = table[lower+lowbyte(c)]
+//
+//		if (lower == 0)
+//			ignore this character
+//
+//	To handle ignorable characters, we now need a loop to find the next valid character.
+//	Also, we can't pre-compute the number of characters to compare; the string length might
+//	be larger than the number of non-ignorable characters.  Further, we must be able to handle
+//	ignorable characters at any point in the string, including as the first or last characters.
+//	We use a zero value as a sentinel to detect both end-of-string and ignorable characters.
+//	Since the File Manager doesn't prevent the NUL character (value zero) as part of a filename,
+//	the case mapping table is assumed to map u+0000 to some non-zero value (like 0xFFFF, which is
+//	an invalid Unicode character).
+//
+//	Most names are ASCII, though, and no ASCII character is ignorable, so runs of ASCII are
+//	compared first, in step, by AsciiRunCompare; the table is only used past the first
+//	character that is not ASCII (or is NUL) in either string.
+//
+//	Pseudocode:
+//
+//		while (1) {
+//			c1 = GetNextValidChar(str1)			//	returns zero if at end of string
+//			c2 = GetNextValidChar(str2)
+//
+//			if (c1 != c2) break					//	found a difference
+//
+//			if (c1 == 0)						//	reached end of string on both strings at once?
+//				return 0;						//	yes, so strings are equal
+//		}
+//
+//		// When we get here, c1 != c2.  So, we just need to determine which one is less.
+//		if (c1 < c2)
+//			return -1;
+//		else
+//			return 1;
+//
+
+SInt32 FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
+							register ConstUniCharArrayPtr str2, register ItemCount length2)
+{
+	register UInt16 c1,c2;
+	register UInt16 temp;
+	ItemCount run;
+	SInt32 result;
+
+	while (1) {
+		/* Compare any run of ASCII in both strings without the table */
+		if (length1 && length2) {
+			result = AsciiRunCompare(str1, str2,
+						 length1 < length2 ? length1 : length2, &run);
+			if (result != 0)
+				return result;
+			str1 += run;
+			str2 += run;
+			length1 -= run;
+			length2 -= run;
+		}
+
+		/* Set default values for c1, c2 in case there are no more valid chars */
+		c1 = 0;
+		c2 = 0;
+		
+		/* Find next non-ignorable char from str1, or zero if no more */
+		while (length1 && c1 == 0) {
+			c1 = *(str1++);
+			--length1;
+			if ((temp = gLowerCaseTable[c1>>8]) != 0)		// is there a subtable for this upper byte?
+				c1 = gLowerCaseTable[temp + (c1 & 0x00FF)];	// yes, so fold the char
+		}
+		
+		
+		/* Find next non-ignorable char from str2, or zero if no more */
+		while (length2 && c2 == 0) {
+			c2 = *(str2++);
+			--length2;
+			if ((temp = gLowerCaseTable[c2>>8]) != 0)		// is there a subtable for this upper byte?
+				c2 = gLowerCaseTable[temp + (c2 & 0x00FF)];	// yes, so fold the char
+		}
+		
+		if (c1 != c2)	/* found a difference, so stop looping */
+			break;
+		
+		if (c1 == 0)		/* did we reach the end of both strings at the same time? */
+			return 0;	/* yes, so strings are equal */
+	}
+	
+	if (c1 < c2)
+		return -1;
+	else
+		return 1;
+}
+
+
+const char *
+UnicodeCompareKind( void )
+{
+#if defined(__AVX2__)
+	return ("avx2");
+#elif defined(__SSE2__)
+	return ("sse2");
+#else
+	return ("scalar");
+#endif
+}
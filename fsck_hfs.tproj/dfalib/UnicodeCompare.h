@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 1999-2003 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+#ifndef __UNICODECOMPARE__
+#define __UNICODECOMPARE__
+
+/*
+ * UnicodeCompare.h
+ *
+ * Case-insensitive comparison of HFS and HFS Plus catalog node names, in
+ * the order of the case folding tables in CaseFolding.h.  Nothing here
+ * depends on the rest of fsck, so fsck_keybench can be built from
+ * UnicodeCompare.c alone.
+ */
+#include "SRuntime.h"
+
+SInt32	FastRelString( ConstStr255Param str1, ConstStr255Param str2 );
+
+SInt32	FastUnicodeCompare( ConstUniCharArrayPtr str1, ItemCount length1,
+			    ConstUniCharArrayPtr str2, ItemCount length2 );
+
+/* How runs of ASCII are compared, for fsck_keybench */
+const char *	UnicodeCompareKind( void );
+
+#endif /* __UNICODECOMPARE__ */
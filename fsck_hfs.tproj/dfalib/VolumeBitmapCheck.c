@@ -22,9 +22,9 @@
  */
 
 /* Summary for in-memory volume bitmap:
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
- * can be assumed to be in the following state:
+ * A two-level table, indexed by segment number, is used to store
+ * bitmap segments that are partially full.  If a segment does not
+ * exist in the table, it can be assumed to be in the following state:
  *	1. Full if the coresponding segment map bit is set
  *	2. Empty (implied)
  */
@@ -33,6 +33,8 @@
 
 #include <bitstring.h>
 
+#include "VolumeBitmapOps.h"
+
 #define	bit_dealloc(p)	free(p)
 
 #define _VBC_DEBUG_	0
@@ -48,7 +50,9 @@ enum {
 	kBitsWithinSegmentMask	= kBitsPerSegment-1,
 	
 	kBMS_NodesPerPool	= 450,
-	kBMS_PoolMax		= 2000
+	kBMS_SegmentsPerTable	= 1024,		/* Second level of the segment table */
+	kBMS_TableShift		= 10,
+	kBMS_TableMask		= kBMS_SegmentsPerTable - 1
 };
 
 
@@ -78,38 +82,60 @@ UInt32*   gFullBitmapSegment;   /* points to a FULL bitmap segment*/
 UInt32*   gEmptyBitmapSegment;  /* points to an EMPTY bitmap segment*/
 
 /*
- * Bitmap Segment (BMS) Tree node
+ * Bitmap Segment (BMS) node
  * Bitmap segments that are partially full are
- * saved in the BMS Tree.
+ * saved in the BMS Table.  A free node is linked
+ * to the next through its first word.
  */
-typedef struct BMS_Node {
-	struct BMS_Node *left;
-	struct BMS_Node *right;
-	UInt32 segment;
+typedef union BMS_Node {
+	union BMS_Node *next;
 	UInt32 bitmap[kWordsPerSegment];
 } BMS_Node;
 
-BMS_Node *gBMS_Root;           /* root of BMS tree */
+/*
+ * gBMS_Table[segment >> kBMS_TableShift] is NULL, or points to
+ * kBMS_SegmentsPerTable node pointers, one for each segment.
+ */
+BMS_Node ***gBMS_Table;        /* BMS table, first level */
+UInt32 gBMS_TableCount;        /* entries in the first level */
 BMS_Node *gBMS_FreeNodes;      /* list of free BMS nodes */
-BMS_Node *gBMS_PoolList[kBMS_PoolMax];  /* list of BMS node pools */
+BMS_Node **gBMS_PoolList;      /* list of BMS node pools */
 int gBMS_PoolCount;            /* count of pools allocated */
+int gBMS_PoolListSize;         /* room in gBMS_PoolList */
+
+/*
+ * When the verify tables are spilled (see SSpill.c), the second level of
+ * every table, and every node, come from one block each, sized for all
+ * the segments; the blocks are sparse files, so only what is used of
+ * them takes memory or disk.
+ */
+BMS_Node **gBMS_TableBlock;    /* second levels, or NULL */
+BMS_Node *gBMS_NodeBlock;      /* nodes, or NULL */
+UInt32 gBMS_NodeBlockUsed;     /* nodes taken from gBMS_NodeBlock */
+
+/*
+ * A run of blocks that differ between the in-memory and on-disk
+ * bitmaps in the same way, so that differences are listed as extents.
+ */
+typedef struct BitmapDiffRun {
+	UInt64 start;
+	UInt64 count;
+	int    used;		/* should be marked used on disk */
+} BitmapDiffRun;
 
 /* Bitmap operations routines */
 static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBlock);
+static void AddBitmapDifferences(BitmapDiffRun *run, UInt8 *memory, UInt8 *disk, UInt64 startBit);
+static void PrintBitmapDiffRun(BitmapDiffRun *run);
 
-/* Segment Tree routines (binary search tree) */
-static int        BMS_InitTree(void);
-static int        BMS_DisposeTree(void);
+/* Segment Table routines (two-level table) */
+static int        BMS_InitTable(void);
+static int        BMS_DisposeTable(void);
 static BMS_Node * BMS_Lookup(UInt32 segment);
 static BMS_Node * BMS_Insert(UInt32 segment, int segmentType);
 static BMS_Node * BMS_Delete(UInt32 segment);
 static void	  BMS_GrowNodePool(void);
 
-#if _VBC_DEBUG_
-static void       BMS_PrintTree(BMS_Node * root);
-static void       BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth);
-#endif
-
 /*
  * Initialize our volume bitmap data structures
  */
@@ -136,7 +162,8 @@ int BitMapCheckBegin(SGlobPtr g)
 	gFullSegmentList = bit_alloc(gTotalSegments);
 	bit_nclear(gFullSegmentList, 0, gTotalSegments - 1);
 
-	BMS_InitTree();
+	if (BMS_InitTable() != 0)
+		return (R_NoMem);
 	gBitMapInited = 1;
 	gBitsMarked = 0;
 
@@ -176,11 +203,8 @@ int BitMapCheckEnd(void)
 {
 	if (gBitMapInited) {
 #if _VBC_DEBUG_
-		int maxdepth = 0;
-
-		BMS_MaxDepth(gBMS_Root, 0, &maxdepth);
-		plog("   %d full segments, %d segment nodes (max depth was %d nodes)\n",
-		       gFullSegments, gSegmentNodes, maxdepth);
+		plog("   %d full segments, %d segment nodes (%d pools)\n",
+		       gFullSegments, gSegmentNodes, gBMS_PoolCount);
 #endif
 		free(gFullBitmapSegment);
 		gFullBitmapSegment = NULL;
@@ -191,12 +215,107 @@ int BitMapCheckEnd(void)
 		bit_dealloc(gFullSegmentList);
 		gFullSegmentList = NULL;
 
-		BMS_DisposeTree();
+		BMS_DisposeTable();
 		gBitMapInited = 0;
 	}
 	return (0);
 }
 
+/*
+ * How the in-memory volume bitmap is kept in a checkpoint (see
+ * SCheckpoint.c).  The header is followed by gFullSegmentList, as it
+ * is, and then by each partially full segment: its number, then its
+ * bitmap.  Empty segments take no room at all.
+ */
+typedef struct BitMapCheckpoint {
+	UInt32	totalBits;
+	UInt32	totalSegments;
+	UInt32	bitsMarked;
+	UInt32	partialSegments;
+} BitMapCheckpoint;
+
+/*
+ * Write the in-memory volume bitmap to a checkpoint file.
+ * Returns zero on success, or an errno.
+ */
+int BitMapCheckSave(FILE *fp)
+{
+	BitMapCheckpoint header;
+	BMS_Node *segNode;
+	UInt32 segment;
+
+	if (!gBitMapInited)
+		return (EINVAL);
+
+	header.totalBits = gTotalBits;
+	header.totalSegments = gTotalSegments;
+	header.bitsMarked = gBitsMarked;
+	header.partialSegments = 0;
+	for (segment = 0; segment < gTotalSegments; segment++)
+		if (BMS_Lookup(segment) != NULL)
+			header.partialSegments++;
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+	    fwrite(gFullSegmentList, bitstr_size(gTotalSegments), 1, fp) != 1)
+		return (errno ? errno : EIO);
+
+	for (segment = 0; segment < gTotalSegments; segment++) {
+		if ((segNode = BMS_Lookup(segment)) == NULL)
+			continue;
+		if (fwrite(&segment, sizeof(segment), 1, fp) != 1 ||
+		    fwrite(segNode->bitmap, kBytesPerSegment, 1, fp) != 1)
+			return (errno ? errno : EIO);
+	}
+
+	return (0);
+}
+
+/*
+ * Replace the in-memory volume bitmap with one written by
+ * BitMapCheckSave.  BitMapCheckBegin must have been called for the
+ * same volume.  Returns zero on success, EINVAL with the bitmap
+ * untouched if the checkpoint is for a different number of blocks,
+ * and any other errno if the bitmap could only be partly read.
+ */
+int BitMapCheckRestore(FILE *fp)
+{
+	BitMapCheckpoint header;
+	BMS_Node *segNode;
+	UInt32 segment;
+	UInt32 i;
+
+	if (!gBitMapInited)
+		return (EINVAL);
+
+	if (fread(&header, sizeof(header), 1, fp) != 1)
+		return (EINVAL);
+	if (header.totalBits != gTotalBits ||
+	    header.totalSegments != gTotalSegments ||
+	    header.partialSegments > gTotalSegments)
+		return (EINVAL);
+
+	/* Drop what has been captured so far; the checkpoint has it too */
+	BMS_DisposeTable();
+	if (BMS_InitTable() != 0)
+		return (ENOMEM);
+
+	if (fread(gFullSegmentList, bitstr_size(gTotalSegments), 1, fp) != 1)
+		return (EIO);
+
+	for (i = 0; i < header.partialSegments; i++) {
+		if (fread(&segment, sizeof(segment), 1, fp) != 1 ||
+		    segment >= gTotalSegments)
+			return (EIO);
+		if ((segNode = BMS_Insert(segment, kEmptySegment)) == NULL)
+			return (ENOMEM);
+		if (fread(segNode->bitmap, kBytesPerSegment, 1, fp) != 1)
+			return (EIO);
+	}
+	gBitsMarked = header.bitsMarked;
+
+	return (0);
+}
+
 /* Function: GetSegmentBitmap
  *
  * Description: Return bitmap segment corresponding to given startBit.
@@ -205,12 +324,12 @@ int BitMapCheckEnd(void)
  *	2. If the segment exists in full segment list,
  *			If bitOperation is to clear bits, 
  *			a. Remove segment from full segment list.
- *			b. Insert a full segment in the bitmap tree.
+ *			b. Insert a full segment in the bitmap table.
  *			Else return pointer to dummy full segment
- *	3. If segment found in tree, it is partially full.  Return it.
+ *	3. If segment found in table, it is partially full.  Return it.
  *	4. If (2) and (3) are not true, it is a empty segment.
  *			If bitOperation is to set bits,
- *			a. Insert empty segment in the bitmap tree.
+ *			a. Insert empty segment in the bitmap table.
  *			Else return pointer to dummy empty segment.
  *
  * Input:	
@@ -266,8 +385,7 @@ static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
 #if 0
 	if (segNode) {
 		int i;
-		plog("  segment %d: L=0x%08x, R=0x%08x \n< ",
-			(int)segNode->segment, (int)segNode->left, segNode->right);
+		plog("  segment %d: \n< ", (int)segment);
 		for (i = 0; i < kWordsPerSegment; ++i) {
 			plog("0x%08x ", segNode->bitmap[i]);
 			if ((i & 0x3) == 0x3)
@@ -325,16 +443,14 @@ void TestSegmentBitmap(UInt32 startBit)
 		}
 		plog("\n");
 #endif
-		if (segment != 0 && bcmp(&segNode->bitmap[0], gFullBitmapSegment, kBytesPerSegment) == 0) {
+		if (bcmp(&segNode->bitmap[0], gFullBitmapSegment, kBytesPerSegment) == 0) {
 			if (BMS_Delete(segment) != NULL) {
 				bit_set(gFullSegmentList, segment);
 				/* debugging stats */
 				++gFullSegments;
 				--gSegmentNodes;
 			}
-		}
-		
-		if (segment != 0 && bcmp(&segNode->bitmap[0], gEmptyBitmapSegment, kBytesPerSegment) == 0) {
+		} else if (bcmp(&segNode->bitmap[0], gEmptyBitmapSegment, kBytesPerSegment) == 0) {
 			if (BMS_Delete(segment) != NULL) {
 				/* debugging stats */
 				--gSegmentNodes;
@@ -657,7 +773,8 @@ Exit:
  * volume bitmap. 
  * If repair is true, update the on-disk bitmap with the in-memory bitmap.
  * If repair is false and the bitmaps don't match, an error message is 
- * printed and check stops.
+ * printed and check stops.  When debugging (-d), the check goes on to
+ * list every block that differs, as extents.
  *
  * Input:
  *	1. g - global scavenger structure
@@ -678,6 +795,8 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 	SFCB * fcb;
 	SVCB * vcb;
 	Boolean	 isHFSPlus;
+	Boolean	 mismatch = false;
+	BitmapDiffRun diffRun = { 0, 0, 0 };
 	int err = 0;
 	
 	vcb = g->calculatedVCB;
@@ -714,13 +833,13 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 					err = ReleaseFileBlock(fcb, &block, relOpt);
 					ReturnIfError(err);
 				}
-				err = GetFileBlock(fcb, fileBlk, kGetBlock, &block);
+				err = GetFileBlock(fcb, fileBlk, kGetBlock | kStreamBlock, &block);
 			} else /* plain HFS */ {
 				if (block.buffer) {
 					err = ReleaseVolumeBlock(vcb, &block, relOpt | kSkipEndianSwap);
 					ReturnIfError(err);
 				}
-				err = GetVolumeBlock(vcb, fileBlk, kGetBlock | kSkipEndianSwap, &block);
+				err = GetVolumeBlock(vcb, fileBlk, kGetBlock | kSkipEndianSwap | kStreamBlock, &block);
 			}
 			ReturnIfError(err);
 
@@ -729,82 +848,33 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			g->TarBlock = fileBlk;
 			++fileBlk;
 		}
-		if (memcmp(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, kBytesPerSegment) == 0)
+		if (BitmapEqual(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, kBytesPerSegment))
 			continue;
 
 		if (repair) {
 			bcopy(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, kBytesPerSegment);
 			relOpt = kForceWriteBlock;
 		} else {
-			int underalloc = 0;
-			int indx;
-#if _VBC_DEBUG_
-			int i, j;
-			UInt32 *disk_buffer;
-			UInt32 dummy, block_num;
-
-			plog("  disk buffer + %d\n", (bit & bitsWithinFileBlkMask)/8);
-			plog("start block number for segment = %qu\n", bit);
-			plog("segment %qd\n", bit / kBitsPerSegment);
-
-			plog("Memory:\n");
-			for (i = 0; i < kWordsPerSegment; ++i) {
-				plog("0x%08x ", buffer[i]);
-				if ((i & 0x7) == 0x7)
-					plog("\n");
-			}
-
-			disk_buffer = (UInt32*) (vbmBlockP + (bit & bitsWithinFileBlkMask)/8);
-			plog("Disk:\n");
-			for (i = 0; i < kWordsPerSegment; ++i) {
-				plog("0x%08x ", disk_buffer[i]);
-				if ((i & 0x7) == 0x7)
-					plog("\n");
+			UInt8 *diskp = vbmBlockP + (bit & bitsWithinFileBlkMask)/8;
+
+			if (!mismatch) {
+				/*
+				 * We have at least one difference.  If we have over-allocated (that is, the
+				 * volume bitmap says a block is allocated, but our counts say it isn't), then
+				 * this is a lessor error.  If we've under-allocated (that is, the volume bitmap
+				 * says a block is available, but our counts say it is in use), then this is a
+				 * bigger problem -- it can lead to overlapping extents.
+				 */
+				fsckPrint(g->context, BitmapHasBitsNotIn(buffer, diskp, kBytesPerSegment) ?
+					  E_VBMDamaged : E_VBMDamagedOverAlloc);
+				g->VIStat = g->VIStat | S_VBM;
+				mismatch = true;
 			}
+			if (!debug)
+				break; /* stop checking after first miss */
 
-			plog ("\n");
-			for (i = 0; i < kWordsPerSegment; ++i) {
-				/* Compare each word in the segment */
-				if (buffer[i] != disk_buffer[i]) {
-					dummy = 0x80000000;
-					/* If two words are different, compare each bit in the word */
-					for (j = 0; j < kBitsPerWord; ++j) {
-						/* If two bits are different, calculate allocation block number */
-						if ((buffer[i] & dummy) != (disk_buffer[i] & dummy)) {
-							block_num = bit + (i * kBitsPerWord) + j;
-							if (buffer[i] & dummy) {
-								plog ("Allocation block %u should be marked used on disk.\n", block_num);
-							} else {
-								plog ("Allocation block %u should be marked free on disk.\n", block_num);
-							}
-						}
-						dummy = dummy >> 1;
-					}
-				}
-			}
-#endif
-			/*
-			 * We have at least one difference.  If we have over-allocated (that is, the
-			 * volume bitmap says a block is allocated, but our counts say it isn't), then
-			 * this is a lessor error.  If we've under-allocated (that is, the volume bitmap
-			 * says a block is available, but our counts say it is in use), then this is a
-			 * bigger problem -- it can lead to overlapping extents.
-			 *
-			 * Once we determine we have under-allocated, we can just stop and print out
-			 * the message.
-			 */
-			for (indx = 0; indx < kBytesPerSegment; indx++) {
-				uint8_t *bufp, *diskp;
-				bufp = buffer;
-				diskp = vbmBlockP + (bit & bitsWithinFileBlkMask)/8;
-				if (bufp[indx] & ~diskp[indx]) {
-					underalloc++;
-					break;
-				}
-			}
-			fsckPrint(g->context, underalloc ? E_VBMDamaged : E_VBMDamagedOverAlloc);
-			g->VIStat = g->VIStat | S_VBM;
-			break; /* stop checking after first miss */
+			/* When debugging, go on to list every difference, as extents */
+			AddBitmapDifferences(&diffRun, (UInt8 *)buffer, diskp, bit);
 		}
 		++g->itemsProcessed;
 	}
@@ -816,9 +886,79 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			(void) ReleaseVolumeBlock(vcb, &block, relOpt | kSkipEndianSwap);
 	}
 
+	PrintBitmapDiffRun(&diffRun);
+
 	return (0);
 }
 
+/* Function: AddBitmapDifferences
+ *
+ * Description: Add the blocks that differ between an in-memory bitmap
+ * segment and the on-disk bitmap to the current run of differences.
+ * When a block doesn't extend the run, the run is printed and a new
+ * one started.  Equal stretches are skipped a vector at a time.
+ *
+ * Input:
+ *	1. run - the current run of differences
+ *	2. memory - the in-memory bitmap segment
+ *	3. disk - the corresponding part of the on-disk bitmap
+ *	4. startBit - the first block of the segment
+ *
+ * Output:
+ *	nothing (void)
+ */
+static void AddBitmapDifferences(BitmapDiffRun *run, UInt8 *memory, UInt8 *disk, UInt64 startBit)
+{
+	UInt32 i;
+	UInt8 mask;
+	int64_t diff;
+	int used;
+
+	for (i = 0; i < kBitsPerSegment; i++) {
+		if ((i % kBitsPerByte) == 0) {
+			diff = BitmapFirstDifference(memory + i/kBitsPerByte, disk + i/kBitsPerByte,
+						     (kBitsPerSegment - i)/kBitsPerByte);
+			if (diff < 0)
+				break;
+			i += diff;
+		}
+
+		mask = 0x80 >> (i % kBitsPerByte);
+		if (((memory[i/kBitsPerByte] ^ disk[i/kBitsPerByte]) & mask) == 0)
+			continue;
+
+		used = (memory[i/kBitsPerByte] & mask) != 0;
+		if (run->count != 0 && run->used == used && run->start + run->count == startBit + i) {
+			++run->count;
+		} else {
+			PrintBitmapDiffRun(run);
+			run->start = startBit + i;
+			run->count = 1;
+			run->used = used;
+		}
+	}
+}
+
+/* Function: PrintBitmapDiffRun
+ *
+ * Description: Print a run of blocks that differ between the in-memory
+ * and on-disk bitmaps, if there is one, and empty it.
+ */
+static void PrintBitmapDiffRun(BitmapDiffRun *run)
+{
+	if (run->count == 0)
+		return;
+
+	if (run->count == 1)
+		plog("Allocation block %qu should be marked %s on disk.\n",
+			run->start, run->used ? "used" : "free");
+	else
+		plog("Allocation blocks %qu-%qu (%qu blocks) should be marked %s on disk.\n",
+			run->start, run->start + run->count - 1, run->count,
+			run->used ? "used" : "free");
+	run->count = 0;
+}
+
 /* Function: UpdateFreeBlockCount
  *
  * Description: Re-calculate the total bits marked in in-memory bitmap 
@@ -838,11 +978,9 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
  */
 void UpdateFreeBlockCount(SGlobPtr g)
 {
-	int i;
 	UInt32 newBitsMarked = 0;
 	UInt32 bit;
 	UInt32 *buffer;
-	UInt32 curWord;
 	SVCB * vcb = g->calculatedVCB;
 	
 	/* Loop through all the bitmap segments */
@@ -861,17 +999,7 @@ void UpdateFreeBlockCount(SGlobPtr g)
 		}
 
 		/* Segment is partially full */
-		for (i = 0; i < kWordsPerSegment; i++) {
-			if (buffer[i] == kAllBitsSetInWord) {
-				newBitsMarked += kBitsPerWord;
-			} else {
-				curWord = SWAP_BE32(buffer[i]);
-				while (curWord) {
-					newBitsMarked += curWord & 1;
-					curWord >>= 1;
-				}
-			}
-		} 
+		newBitsMarked += (UInt32)BitmapCountBits(buffer, kBytesPerSegment);
 	} 
 	
 	/* Update total bits marked count for in-memory bitmap */
@@ -1072,36 +1200,73 @@ int AllocateContigBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBl
 }
 
 /*
- * BITMAP SEGMENT TREE
+ * BITMAP SEGMENT TABLE
  *
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
- * can be assumed to be in the following state:
+ * A two-level table, indexed by segment number, is used to store
+ * bitmap segments that are partially full.  If a segment does not
+ * exist in the table, it can be assumed to be in the following state:
  *	1. Full if the coresponding segment map bit is set
  *	2. Empty (implied)
+ *
+ * The second level of the table is only allocated for the parts of
+ * the volume which have partially full segments, and the nodes come
+ * from pools, so that a lookup is two loads and no pool limit applies.
  */
 
 static int
-BMS_InitTree(void)
+BMS_InitTable(void)
 {
-	gBMS_PoolCount = 0;
-	BMS_GrowNodePool();
+	gBMS_TableCount = (gTotalSegments + kBMS_SegmentsPerTable - 1) >> kBMS_TableShift;
+	gBMS_Table = (BMS_Node ***)calloc(gBMS_TableCount ? gBMS_TableCount : 1, sizeof(BMS_Node **));
+	if (gBMS_Table == NULL)
+		return (-1);
 
-	gBMS_Root = gBMS_FreeNodes;
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
-	gBMS_Root->right = NULL; 
+	gBMS_PoolCount = 0;
+	gBMS_PoolListSize = 0;
+	gBMS_PoolList = NULL;
+	gBMS_FreeNodes = NULL;
+
+	/* Either block may fail; the heap is used instead */
+	gBMS_TableBlock = NULL;
+	gBMS_NodeBlock = NULL;
+	gBMS_NodeBlockUsed = 0;
+	if (gSpillVerifyState && gTotalSegments != 0) {
+		gBMS_TableBlock = (BMS_Node **)SpillAllocate((size_t)gBMS_TableCount *
+			kBMS_SegmentsPerTable * sizeof(BMS_Node *));
+		gBMS_NodeBlock = (BMS_Node *)SpillAllocate((size_t)gTotalSegments * sizeof(BMS_Node));
+	}
 
 	return (0);
 }
 
 
 static int
-BMS_DisposeTree(void)
+BMS_DisposeTable(void)
 {
+	UInt32 i;
+
+	if (gBMS_Table != NULL) {
+		if (gBMS_TableBlock == NULL)
+			for (i = 0; i < gBMS_TableCount; i++)
+				free(gBMS_Table[i]);
+		free(gBMS_Table);
+	}
+	gBMS_Table = NULL;
+	gBMS_TableCount = 0;
+
+	SpillDispose(gBMS_TableBlock);
+	gBMS_TableBlock = NULL;
+	SpillDispose(gBMS_NodeBlock);
+	gBMS_NodeBlock = NULL;
+	gBMS_NodeBlockUsed = 0;
+
 	while(gBMS_PoolCount > 0)
 		free(gBMS_PoolList[--gBMS_PoolCount]);
+	free(gBMS_PoolList);
+	gBMS_PoolList = NULL;
+	gBMS_PoolListSize = 0;
 
-	gBMS_Root = gBMS_FreeNodes = 0;
+	gBMS_FreeNodes = NULL;
 	return (0);
 }
 
@@ -1109,140 +1274,71 @@ BMS_DisposeTree(void)
 static BMS_Node *
 BMS_Lookup(UInt32 segment)
 {
-	BMS_Node *ptree = gBMS_Root;
+	BMS_Node **table;
 
-	while (ptree && ptree->segment != segment) {
-
-		if (segment > ptree->segment)
-			ptree = ptree->right;
-		else
-			ptree = ptree->left;
-	}
-
-	return ((BMS_Node *)ptree);
-}
-
-
-static BMS_Node *
-BMS_InsertTree(BMS_Node *NewEntry)
-{
-	BMS_Node *ptree;
-	register UInt32 segment;
-
-	segment = NewEntry->segment;
-	ptree = gBMS_Root;
-	if (ptree == (BMS_Node *)NULL) {
-		*ptree = *NewEntry;
-		return (NewEntry);
-	}
+	if ((segment >> kBMS_TableShift) >= gBMS_TableCount)
+		return ((BMS_Node *)NULL);
 
-	while (ptree) {
-		if (segment > ptree->segment) { /* walk the right sub-tree */
-			if (ptree->right)
-				ptree = ptree->right;
-			else {
-				ptree->right = NewEntry;
-				return (ptree);
-			}
-		}
-		else { /* walk the left sub-tree */
-			if (ptree->left) 
-				ptree = ptree->left;
-			else {
-			    	ptree->left = NewEntry;
-				return (ptree);
-			}
-		}
-	}	
+	table = gBMS_Table[segment >> kBMS_TableShift];
+	if (table == NULL)
+		return ((BMS_Node *)NULL);
 
-	return ((BMS_Node *)NULL);
+	return (table[segment & kBMS_TableMask]);
 }
 
 
-/* insert a new segment into the tree */
+/* insert a new segment into the table */
 static BMS_Node *
 BMS_Insert(UInt32 segment, int segmentType) 
 {
+	BMS_Node **table;
 	BMS_Node *new; 
 
+	if ((segment >> kBMS_TableShift) >= gBMS_TableCount)
+		return ((BMS_Node *)NULL);
+
+	table = gBMS_Table[segment >> kBMS_TableShift];
+	if (table == NULL) {
+		if (gBMS_TableBlock != NULL)
+			table = &gBMS_TableBlock[(segment >> kBMS_TableShift) << kBMS_TableShift];
+		else
+			table = (BMS_Node **)calloc(kBMS_SegmentsPerTable, sizeof(BMS_Node *));
+		if (table == NULL)
+			return ((BMS_Node *)NULL);
+		gBMS_Table[segment >> kBMS_TableShift] = table;
+	}
+
 	if ((new = gBMS_FreeNodes) == NULL) {
 		BMS_GrowNodePool();
 		if ((new = gBMS_FreeNodes) == NULL)
 			return ((BMS_Node *)NULL);
 	}
 
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
+	gBMS_FreeNodes = gBMS_FreeNodes->next; 
 
 	++gSegmentNodes;  /* debugging stats */
 
-	new->right = NULL; 
-	new->segment = segment;
 	if (segmentType == kFullSegment)
 		bcopy(gFullBitmapSegment, new->bitmap, kBytesPerSegment);
 	else
 		bzero(new->bitmap, sizeof(new->bitmap));	
 
-	if (BMS_InsertTree(new) != NULL)
-		return (new);
-	else
-		return ((BMS_Node *)NULL);
+	table[segment & kBMS_TableMask] = new;
+	return (new);
 }
 
 
 static BMS_Node *
 BMS_Delete(UInt32 segment)
 {
-	BMS_Node *seg_found, *pprevious, *pnext, *pnextl, *psub;
-
-	pprevious = NULL; 
-	seg_found = gBMS_Root;
-	
-	/* don't allow the root to be deleted! */
-	if (seg_found->segment == segment)
-		return ((BMS_Node *)NULL);
-
-	while (seg_found && seg_found->segment != segment) {
-		pprevious = seg_found;
-		if (segment > seg_found->segment)
-			seg_found = seg_found->right;
-		else
-			seg_found = seg_found->left;
-	}
+	BMS_Node *seg_found;
 
+	seg_found = BMS_Lookup(segment);
 	if (seg_found) {
-		/*
-		 * we found the entry, now reorg the sub-trees
-		 * spanning from our node.
-		 */
-		if ((pnext = seg_found->right)) {
-			/*
-			 * Tree pruning: take the left branch of the
-			 * current node and place it at the lowest
-			 * left branch of the current right branch 
-			 */
-			psub = pnext;
-			
-			/* walk the Right/Left sub tree from current node */
-			while ((pnextl = psub->left))
-				psub = pnextl;	
-			
-			/* plug the old left tree to the new ->Right leftmost node */	
-			psub->left = seg_found->left;
-		} else {  /* only left sub-tree, simple case */
-			pnext = seg_found->left;
-		}
-		/* 
-		 * Now, plug the current node sub tree to
-		 * the good pointer of our parent node.
-		 */
-		if (pprevious->left == seg_found)
-			pprevious->left = pnext;
-		else
-			pprevious->right = pnext;	
-		
+		gBMS_Table[segment >> kBMS_TableShift][segment & kBMS_TableMask] = NULL;
+
 		/* add node back to the free-list */
-		bzero(seg_found, sizeof(BMS_Node));
-		seg_found->right = gBMS_FreeNodes; 
+		seg_found->next = gBMS_FreeNodes; 
 		gBMS_FreeNodes = seg_found; 		
 	}
 	
@@ -1254,45 +1350,44 @@ static void
 BMS_GrowNodePool(void)
 {
 	BMS_Node *nodePool;
+	BMS_Node **poolList;
+	UInt32 count;
 	short i;
 
-	if (gBMS_PoolCount > kBMS_PoolMax)
+	/* Never more nodes are in use than there are segments */
+	if (gBMS_NodeBlock != NULL && gBMS_NodeBlockUsed < gTotalSegments) {
+		nodePool = &gBMS_NodeBlock[gBMS_NodeBlockUsed];
+		count = gTotalSegments - gBMS_NodeBlockUsed;
+		if (count > kBMS_NodesPerPool)
+			count = kBMS_NodesPerPool;
+		gBMS_NodeBlockUsed += count;
+
+		for (i = 1 ; i < count ; i++) {
+			(&nodePool[i-1])->next = &nodePool[i];
+		}
+		(&nodePool[count-1])->next = gBMS_FreeNodes;
+		gBMS_FreeNodes = &nodePool[0];
 		return;
+	}
+
+	if (gBMS_PoolCount == gBMS_PoolListSize) {
+		poolList = (BMS_Node **)realloc(gBMS_PoolList,
+			sizeof(BMS_Node *) * (gBMS_PoolListSize ? gBMS_PoolListSize * 2 : 64));
+		if (poolList == NULL)
+			return;
+		gBMS_PoolList = poolList;
+		gBMS_PoolListSize = gBMS_PoolListSize ? gBMS_PoolListSize * 2 : 64;
+	}
 
 	nodePool = (BMS_Node *)malloc(sizeof(BMS_Node) * kBMS_NodesPerPool);
 	if (nodePool != NULL) {
-		bzero(&nodePool[0], sizeof(BMS_Node) * kBMS_NodesPerPool);
 		for (i = 1 ; i < kBMS_NodesPerPool ; i++) {
-			(&nodePool[i-1])->right = &nodePool[i];
+			(&nodePool[i-1])->next = &nodePool[i];
 		}
+		(&nodePool[kBMS_NodesPerPool-1])->next = gBMS_FreeNodes;
 	
 		gBMS_FreeNodes = &nodePool[0];
 		gBMS_PoolList[gBMS_PoolCount++] = nodePool;
 	}
 }
 
-
-#if _VBC_DEBUG_
-static void
-BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth)
-{
-	if (root) {
-		depth++;
-		if (depth > *maxdepth)
-			*maxdepth = depth;
-		BMS_MaxDepth(root->left, depth, maxdepth);
-		BMS_MaxDepth(root->right, depth, maxdepth);
-	}
-}
-
-static void
-BMS_PrintTree(BMS_Node * root)
-{
-	if (root) {
-		BMS_PrintTree(root->left);
-		plog("seg %d\n", root->segment);
-		BMS_PrintTree(root->right);
-	}
-}
-#endif
-
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Operations on runs of volume bitmap.
+ *
+ * Each routine works through the bitmap a vector at a time where the
+ * compiler targets a vector unit, then eight bytes at a time, then a
+ * byte at a time for whatever is left.  Nothing here depends on the rest
+ * of fsck, so fsck_bitmapbench can be built from this file alone.
+ */
+
+#include "VolumeBitmapOps.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Eight bytes, from wherever they are */
+static inline uint64_t
+Load64(const uint8_t *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+	return (x);
+}
+
+/* Bit number, in bitmap order, of the first bit set in a non-zero byte */
+#define	FirstBitInByte(x)	(__builtin_clz((unsigned int)(x)) - 24)
+
+
+/*
+ * BitmapEqual
+ *
+ * The differences over 64 bytes are ORed together, so that there is
+ * one test, and one branch, for each 64 bytes.
+ */
+int
+BitmapEqual(const void *a, const void *b, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)a;
+	const uint8_t *q = (const uint8_t *)b;
+	size_t i = 0;
+
+#if defined(__AVX2__)
+#define	XOR256(n)	_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i + (n))), \
+					 _mm256_loadu_si256((const __m256i *)(q + i + (n))))
+	for (; i + 64 <= length; i += 64) {
+		__m256i x = _mm256_or_si256(XOR256(0), XOR256(32));
+		if (!_mm256_testz_si256(x, x))
+			return (0);
+	}
+#undef XOR256
+#elif defined(__SSE2__)
+#define	XOR128(n)	_mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i + (n))), \
+				      _mm_loadu_si128((const __m128i *)(q + i + (n))))
+	for (; i + 64 <= length; i += 64) {
+		__m128i x = _mm_or_si128(_mm_or_si128(XOR128(0), XOR128(16)),
+					 _mm_or_si128(XOR128(32), XOR128(48)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+			return (0);
+	}
+#undef XOR128
+#endif
+	for (; i + 8 <= length; i += 8)
+		if (Load64(p + i) != Load64(q + i))
+			return (0);
+	for (; i < length; i++)
+		if (p[i] != q[i])
+			return (0);
+
+	return (1);
+}
+
+
+/*
+ * BitmapFirstDifference
+ *
+ * Find the first byte that differs, then the first bit within it.
+ */
+int64_t
+BitmapFirstDifference(const void *a, const void *b, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)a;
+	const uint8_t *q = (const uint8_t *)b;
+	size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+	unsigned int mask;
+#endif
+
+#if defined(__AVX2__)
+	for (; i + 32 <= length; i += 32) {
+		mask = ~(unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)),
+					  _mm256_loadu_si256((const __m256i *)(q + i))));
+		if (mask) {
+			i += __builtin_ctz(mask);
+			goto found;
+		}
+	}
+#elif defined(__SSE2__)
+	for (; i + 16 <= length; i += 16) {
+		mask = ~(unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)),
+				       _mm_loadu_si128((const __m128i *)(q + i)))) & 0xFFFF;
+		if (mask) {
+			i += __builtin_ctz(mask);
+			goto found;
+		}
+	}
+#endif
+	for (; i + 8 <= length; i += 8)
+		if (Load64(p + i) != Load64(q + i))
+			break;
+	for (; i < length; i++)
+		if (p[i] != q[i])
+			goto found;
+
+	return (-1);
+
+found:
+	return ((int64_t)i * 8 + FirstBitInByte(p[i] ^ q[i]));
+}
+
+
+/*
+ * BitmapHasBitsNotIn
+ *
+ * For CheckVolumeBitMap: a block we found in use but which is free on
+ * disk is the worse kind of difference.
+ */
+int
+BitmapHasBitsNotIn(const void *a, const void *b, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)a;
+	const uint8_t *q = (const uint8_t *)b;
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= length; i += 32) {
+		__m256i x = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(q + i)),
+						_mm256_loadu_si256((const __m256i *)(p + i)));
+		if (!_mm256_testz_si256(x, x))
+			return (1);
+	}
+#elif defined(__SSE2__)
+	for (; i + 16 <= length; i += 16) {
+		__m128i x = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(q + i)),
+					     _mm_loadu_si128((const __m128i *)(p + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+			return (1);
+	}
+#endif
+	for (; i + 8 <= length; i += 8)
+		if (Load64(p + i) & ~Load64(q + i))
+			return (1);
+	for (; i < length; i++)
+		if (p[i] & ~q[i])
+			return (1);
+
+	return (0);
+}
+
+
+/*
+ * BitmapCountBits
+ *
+ * With SSSE3 or AVX2, count each nibble by table lookup and sum the
+ * bytes of each 64-bit lane; otherwise count eight bytes at a time.
+ */
+uint64_t
+BitmapCountBits(const void *p, size_t length)
+{
+	const uint8_t *s = (const uint8_t *)p;
+	uint64_t count = 0;
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	{
+		const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+						       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+		const __m256i low = _mm256_set1_epi8(0x0f);
+		__m256i total = _mm256_setzero_si256();
+		uint64_t lanes[4];
+
+		for (; i + 32 <= length; i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+			__m256i c = _mm256_add_epi8(
+				_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+				_mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+			total = _mm256_add_epi64(total, _mm256_sad_epu8(c, _mm256_setzero_si256()));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, total);
+		count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+#elif defined(__SSSE3__)
+	{
+		const __m128i table = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+		const __m128i low = _mm_set1_epi8(0x0f);
+		__m128i total = _mm_setzero_si128();
+		uint64_t lanes[2];
+
+		for (; i + 16 <= length; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+			__m128i c = _mm_add_epi8(
+				_mm_shuffle_epi8(table, _mm_and_si128(v, low)),
+				_mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(v, 4), low)));
+			total = _mm_add_epi64(total, _mm_sad_epu8(c, _mm_setzero_si128()));
+		}
+		_mm_storeu_si128((__m128i *)lanes, total);
+		count = lanes[0] + lanes[1];
+	}
+#endif
+	for (; i + 8 <= length; i += 8)
+		count += __builtin_popcountll(Load64(s + i));
+	for (; i < length; i++)
+		count += __builtin_popcount(s[i]);
+
+	return (count);
+}
+
+
+const char *
+BitmapOpsKind(void)
+{
+#if defined(__AVX2__)
+	return ("avx2");
+#elif defined(__SSSE3__)
+	return ("ssse3");
+#elif defined(__SSE2__)
+	return ("sse2");
+#else
+	return ("scalar");
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+#ifndef __VOLUMEBITMAPOPS_H__
+#define __VOLUMEBITMAPOPS_H__
+
+/*
+ * VolumeBitmapOps.h
+ *
+ * Operations on runs of volume bitmap, as used by CheckVolumeBitMap and
+ * UpdateFreeBlockCount.  The bitmaps are in on-disk order: bit 0 is the
+ * high-order bit of the first byte.  They need no particular alignment.
+ * The routines use SSE2, SSSE3 or AVX2 when the compiler targets them,
+ * and plain C otherwise; fsck_bitmapbench times them.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Non-zero if the length bytes at a and b are the same */
+int		BitmapEqual(const void *a, const void *b, size_t length);
+
+/* The first bit that differs between a and b, or -1 if none does */
+int64_t		BitmapFirstDifference(const void *a, const void *b, size_t length);
+
+/* Non-zero if any bit set in a is clear in b */
+int		BitmapHasBitsNotIn(const void *a, const void *b, size_t length);
+
+/* The number of bits set */
+uint64_t	BitmapCountBits(const void *p, size_t length);
+
+/* Which of the above are vectorized, for fsck_bitmapbench */
+const char *	BitmapOpsKind(void);
+
+#endif /* __VOLUMEBITMAPOPS_H__ */
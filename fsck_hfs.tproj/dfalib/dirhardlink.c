@@ -552,13 +552,18 @@ struct link_list {
  * correctly, parent is the private metadata directory, first link ID 
  * is stored correctly, and the doubly linked * list of hard links is valid.  
  *
+ * If links is not NULL, it is the sorted table of the hard links found 
+ * in the catalog, and the links in the chain are looked up there rather 
+ * than in the catalog btree, and marked as reached.  Otherwise the links 
+ * are added to the prime bucket, if there is one.
+ *
  * Returns - 
  * 	zero - 	if no corruption is detected, or the corruption detected is 
  *		such that a repair order can be created. 
  *  non-zero - 	if the corruption detected requires complete knowledge of 
  *		all the related directory hard links to suggest repair.
  */
-int inode_check(SGlobPtr gptr, PrimeBuckets *bucket, 
+int inode_check(SGlobPtr gptr, PrimeBuckets *bucket, HardLinkTable *links,
 		CatalogRecord *rec, CatalogKey *key, Boolean isdir)
 {
 	int retval = 0;
@@ -577,6 +582,9 @@ int inode_check(SGlobPtr gptr, PrimeBuckets *bucket,
 	int flags;
 	uint32_t parentid;
 	uint32_t link_ref_num = 0;
+	uint32_t link_prev_id;
+	uint32_t link_next_id;
+	HardLinkTuple *link;
 
 	struct link_list *head = NULL;
 	struct link_list *cur;
@@ -638,7 +646,7 @@ int inode_check(SGlobPtr gptr, PrimeBuckets *bucket,
 			(void) record_inode_badflags(gptr, inode_id, isdir, 
 					flags, flags | kHFSHasLinkChainMask, false);
 		} else {
-			filelink_hash_inode(link_ref_num, linkCount);
+			filelink_add_inode(link_ref_num, linkCount);
 			retval = 0;
 			goto out;
 		}
@@ -657,8 +665,26 @@ int inode_check(SGlobPtr gptr, PrimeBuckets *bucket,
 	/* Check doubly linked list of hard links that point to this inode */
 	prev_link_id = 0;
 	count = 0;
+	if (links) {
+		hardlink_table_begin_walk(links);
+	}
 
 	while (cur_link_id != 0) {
+		/* A link in the table is a file record with the hard link 
+		 * bit and finder info set, and points to this inode, so 
+		 * only its place in the list is left to check.
+		 */
+		link = NULL;
+		if (links) {
+			link = hardlink_table_find(links, 
+					isdir ? inode_id : link_ref_num, cur_link_id);
+		}
+		if (link) {
+			link_prev_id = link->prev;
+			link_next_id = link->next;
+			goto check_prev;
+		}
+
 		/* Lookup the current directory link record */
 		retval = GetCatalogRecordByID(gptr, cur_link_id, true, 
 				&linkkey, &linkrec, &recsize);
@@ -739,25 +765,44 @@ int inode_check(SGlobPtr gptr, PrimeBuckets *bucket,
 		/* For directory hard links, add the directory inode ID and 
 		 * the current link ID pair to the prime bucket.  For file 
 		 * hard links, add the link reference number and current 
-		 * link ID pair to the prime bucket.
+		 * link ID pair to the prime bucket.  A link that is not in 
+		 * the table means the chains do not match the links found.
 		 */
-		if (isdir) {
-			hardlink_add_bucket(bucket, inode_id, cur_link_id);
-		} else {
-			hardlink_add_bucket(bucket, link_ref_num, cur_link_id);
+		if (links) {
+			links->mismatch = true;
+		} else if (bucket) {
+			if (isdir) {
+				hardlink_add_bucket(bucket, inode_id, cur_link_id);
+			} else {
+				hardlink_add_bucket(bucket, link_ref_num, cur_link_id);
+			}
 		}
+		link_prev_id = linkrec.hfsPlusFile.hl_prevLinkID;
+		link_next_id = linkrec.hfsPlusFile.hl_nextLinkID;
 
+check_prev:
 		/* Check the previous directory hard link */
-		if (prev_link_id != linkrec.hfsPlusFile.hl_prevLinkID) {
+		if (prev_link_id != link_prev_id) {
 			record_link_badchain(gptr, isdir);
 			if (fsckGetVerbosity(gptr->context) >= kDebugLog) {
-				plog ("\tIncorrect prevLinkID for link=%u for inode=%u (expected=%u, found=%u)\n", cur_link_id, inode_id, prev_link_id, linkrec.hfsPlusFile.hl_prevLinkID);
+				plog ("\tIncorrect prevLinkID for link=%u for inode=%u (expected=%u, found=%u)\n", cur_link_id, inode_id, prev_link_id, link_prev_id);
 			}
 			retval = 1;
 			goto out;
 		}
 		
 		/* Check if we saw this directory hard link previously */
+		if (link) {
+			if (hardlink_table_visit(links, link)) {
+				if (fsckGetVerbosity(gptr->context) >= kDebugLog) {
+					plog ("\tDuplicate link=%u found in list for inode=%u\n", cur_link_id, inode_id);
+				}
+				record_link_badchain(gptr, isdir);
+				retval = 1;
+				goto out;
+			}
+			goto next_link;
+		}
 		cur = head;
 		while (cur) {
 			if (cur->link_id == cur_link_id) {
@@ -781,9 +826,10 @@ int inode_check(SGlobPtr gptr, PrimeBuckets *bucket,
 		cur->next = head;
 		head = cur;
 
+next_link:
 		count++;
 		prev_link_id = cur_link_id;
-		cur_link_id = linkrec.hfsPlusFile.hl_nextLinkID;
+		cur_link_id = link_next_id;
 	}
 
 	/* If the entire chain looks good, match the link count */
@@ -1440,7 +1486,7 @@ int dirhardlink_check(SGlobPtr gptr)
 			/* Check directory inode */
 			if ((catrec.hfsPlusFolder.flags & kHFSHasLinkChainMask) ||
 			    (catkey.hfsPlus.parentID == gptr->dirlink_priv_dir_id)) {
-				retval = inode_check(gptr, inode_view,
+				retval = inode_check(gptr, inode_view, NULL,
 						&catrec,
 						&catkey,
 						true);
@@ -42,6 +42,100 @@
 
 #undef ENDIAN_DEBUG
 
+/*
+ * Most of a node is runs of values of one size: the record offsets, the
+ * characters of names, extent records, and the dates and IDs of catalog
+ * records.  On a little endian host, these are swapped a vector at a time
+ * where the compiler targets SSE2 or AVX2.  Define HFS_SWAP_SCALAR to swap
+ * them one at a time (fsck_swapbench builds both, to compare them).
+ */
+#if BYTE_ORDER == LITTLE_ENDIAN && !defined(HFS_SWAP_SCALAR) && (defined(__AVX2__) || defined(__SSE2__))
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define kSwapVectorBytes	32
+#define VLoad(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define VStore(p, x)		_mm256_storeu_si256((__m256i *)(p), (x))
+#define VSwap16(x)		_mm256_shuffle_epi8((x), _mm256_setr_epi8( \
+					1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, \
+					1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14))
+#define VSwap32(x)		_mm256_shuffle_epi8((x), _mm256_setr_epi8( \
+					3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, \
+					3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12))
+#else
+#include <emmintrin.h>
+#define kSwapVectorBytes	16
+#define VLoad(p)		_mm_loadu_si128((const __m128i *)(p))
+#define VStore(p, x)		_mm_storeu_si128((__m128i *)(p), (x))
+#define VSwap16(x)		_mm_or_si128(_mm_slli_epi16((x), 8), _mm_srli_epi16((x), 8))
+/* Swap the halves of each 32 bit value, then the bytes of each half */
+#define VSwap32(x)		VSwap16(_mm_shufflehi_epi16(_mm_shufflelo_epi16((x), 0xB1), 0xB1))
+#endif
+#endif
+
+/*
+ * The number of 32 bit fields in a row in a structure, from field first
+ * up to (but not including) field end.
+ */
+#define RUN32(type, first, end)	((offsetof(type, end) - offsetof(type, first)) / sizeof(UInt32))
+
+/*
+ * hfs_swap_BE16_array
+ * hfs_swap_BE32_array
+ *
+ * Swap count values in place, between big endian and host order.  The
+ * values need only be aligned to their own size.
+ */
+static void
+hfs_swap_BE16_array (
+    UInt16 *src,
+    UInt32 count
+)
+{
+    UInt32 i = 0;
+
+#if defined(kSwapVectorBytes)
+    for (; i + kSwapVectorBytes / sizeof(UInt16) <= count; i += kSwapVectorBytes / sizeof(UInt16))
+        VStore(src + i, VSwap16(VLoad(src + i)));
+#endif
+    for (; i < count; i++)
+        src[i] = SWAP_BE16 (src[i]);
+}
+
+static void
+hfs_swap_BE32_array (
+    UInt32 *src,
+    UInt32 count
+)
+{
+    UInt32 i = 0;
+
+#if defined(kSwapVectorBytes)
+    for (; i + kSwapVectorBytes / sizeof(UInt32) <= count; i += kSwapVectorBytes / sizeof(UInt32))
+        VStore(src + i, VSwap32(VLoad(src + i)));
+#endif
+    for (; i < count; i++)
+        src[i] = SWAP_BE32 (src[i]);
+}
+
+/*
+ * hfs_swap_kind
+ *
+ * How runs of values are swapped; reported by fsck_swapbench.
+ */
+const char *
+hfs_swap_kind (void)
+{
+#if BYTE_ORDER == BIG_ENDIAN
+    return ("none");
+#elif defined(kSwapVectorBytes) && defined(__AVX2__)
+    return ("avx2");
+#elif defined(kSwapVectorBytes)
+    return ("sse2");
+#else
+    return ("scalar");
+#endif
+}
+
 /*
  * Internal swapping routines
  *
@@ -63,17 +157,12 @@ hfs_swap_HFSPlusForkData (
     HFSPlusForkData *src
 )
 {
-    int i;
-
 	src->logicalSize		= SWAP_BE64 (src->logicalSize);
 
 	src->clumpSize			= SWAP_BE32 (src->clumpSize);
 	src->totalBlocks		= SWAP_BE32 (src->totalBlocks);
 
-    for (i = 0; i < kHFSPlusExtentDensity; i++) {
-        src->extents[i].startBlock	= SWAP_BE32 (src->extents[i].startBlock);
-        src->extents[i].blockCount	= SWAP_BE32 (src->extents[i].blockCount);
-    }
+	hfs_swap_BE32_array ((UInt32 *)src->extents, 2 * kHFSPlusExtentDensity);
 }
 
 /*
@@ -260,11 +349,10 @@ hfs_swap_BTNode (
         }
 
 		/*
-		 * Swap and sanity check each of the record offsets.
+		 * Swap all of the record offsets, then sanity check each of them.
 		 */
+        hfs_swap_BE16_array (srcOffs, srcDesc->numRecords + 1);
         for (i = 0; i <= srcDesc->numRecords; i++) {
-            srcOffs[i]	= SWAP_BE16 (srcOffs[i]);
-
             /*
              * Sanity check: must be even, and within the node itself.
              *
@@ -385,7 +473,7 @@ hfs_swap_BTNode (
         }
 
 		/*
-		 * Swap and sanity check each of the record offsets.
+		 * Sanity check each of the record offsets, then swap all of them.
 		 */
         for (i = 0; i <= srcDesc->numRecords; i++) {
             /*
@@ -412,9 +500,8 @@ hfs_swap_BTNode (
             	error = E_BadNode;
             	goto fail;
             }
-
-            srcOffs[i]	= SWAP_BE16 (srcOffs[i]);
         }
+        hfs_swap_BE16_array (srcOffs, srcDesc->numRecords + 1);
         
         srcDesc->numRecords	= SWAP_BE16 (srcDesc->numRecords);
     }
@@ -423,6 +510,119 @@ fail:
     return (error);
 }
 
+/*
+ * hfs_swap_BTIndexRecord
+ *
+ * Swap just one record of an HFS Plus index node that is otherwise left in
+ * big endian (on disk) order, for a search that only compares a few keys.
+ * The key of record "index" is copied to keyBuffer (a BTreeKey) in host
+ * order, and its child node number returned in *childNode.
+ *
+ * Only that record's offsets and key are looked at.  They are sanity checked
+ * as hfs_swap_BTNode would, and more strictly, but nothing is reported: if
+ * anything is wrong, fsBTInvalidNodeErr is returned, and the caller should
+ * get the whole node swapped by hfs_swap_BTNode, which reports what it finds.
+ */
+int
+hfs_swap_BTIndexRecord (
+    BlockDescriptor *src,
+    SFCB *fcb,
+    UInt16 index,
+    void *keyBuffer,
+    UInt32 *childNode
+)
+{
+    HFSCatalogNodeID fileID = fcb->fcbFileID;
+    BTNodeDescriptor *srcDesc = src->buffer;
+    UInt16 *srcOffs;
+    UInt16 numRecords;
+    UInt16 offset, nextOffset;
+    u_int16_t keyLength;
+    char *srcKey;
+    char *nextRecord;
+
+    if (fcb->fcbVolume->vcbSignature != kHFSPlusSigWord || srcDesc->kind != kBTIndexNode)
+        return fsBTInvalidNodeErr;
+
+    /*
+     * The record's offset and the next one (or the free space offset) must be
+     * even, in the node, and in order, and the offsets must not run into the
+     * node descriptor.
+     */
+    numRecords = SWAP_BE16 (srcDesc->numRecords);
+    if (index >= numRecords ||
+        (numRecords + 1) * sizeof(UInt16) > src->blockSize - sizeof(BTNodeDescriptor))
+        return fsBTInvalidNodeErr;
+
+    srcOffs = (UInt16 *)((char *)src->buffer + src->blockSize) - (index + 2);
+    offset = SWAP_BE16 (srcOffs[1]);
+    nextOffset = SWAP_BE16 (srcOffs[0]);
+    if ((offset & 1) || (nextOffset & 1) || offset < sizeof(BTNodeDescriptor) ||
+        offset >= nextOffset || nextOffset >= src->blockSize)
+        return fsBTInvalidNodeErr;
+
+    srcKey = (char *)src->buffer + offset;
+    nextRecord = (char *)src->buffer + nextOffset;
+    keyLength = SWAP_BE16 (*(UInt16 *)srcKey);
+
+    /*
+     * An odd key length would put the child node number where hfs_swap_BTNode
+     * does not swap it.
+     */
+    if ((keyLength & 1) || srcKey + sizeof(keyLength) + keyLength + sizeof(UInt32) > nextRecord)
+        return fsBTInvalidNodeErr;
+
+    if (fileID == kHFSExtentsFileID) {
+        HFSPlusExtentKey *key = keyBuffer;
+
+        if (keyLength != sizeof(*key) - sizeof(key->keyLength))
+            return fsBTInvalidNodeErr;
+
+        memcpy (key, srcKey, sizeof(*key));
+        key->keyLength = keyLength;
+        key->fileID = SWAP_BE32 (key->fileID);
+        key->startBlock = SWAP_BE32 (key->startBlock);
+
+    } else if (fileID == kHFSCatalogFileID || fileID == kHFSRepairCatalogFileID) {
+        HFSPlusCatalogKey *key = keyBuffer;
+
+        if (keyLength < kHFSPlusCatalogKeyMinimumLength || keyLength > kHFSPlusCatalogKeyMaximumLength)
+            return fsBTInvalidNodeErr;
+
+        memcpy (key, srcKey, sizeof(key->keyLength) + keyLength);
+        key->keyLength = keyLength;
+        key->parentID = SWAP_BE32 (key->parentID);
+        key->nodeName.length = SWAP_BE16 (key->nodeName.length);
+        if (keyLength < sizeof(key->parentID) + sizeof(key->nodeName.length) +
+            key->nodeName.length * sizeof(key->nodeName.unicode[0]))
+            return fsBTInvalidNodeErr;
+        hfs_swap_BE16_array (key->nodeName.unicode, key->nodeName.length);
+
+    } else if (fileID == kHFSAttributesFileID) {
+        HFSPlusAttrKey *key = keyBuffer;
+
+        if (keyLength < kHFSPlusAttrKeyMinimumLength || keyLength > kHFSPlusAttrKeyMaximumLength)
+            return fsBTInvalidNodeErr;
+
+        memcpy (key, srcKey, sizeof(key->keyLength) + keyLength);
+        key->keyLength = keyLength;
+        key->fileID = SWAP_BE32 (key->fileID);
+        key->startBlock = SWAP_BE32 (key->startBlock);
+        key->attrNameLen = SWAP_BE16 (key->attrNameLen);
+        if (key->attrNameLen > kHFSMaxAttrNameLen ||
+            keyLength < kHFSPlusAttrKeyMinimumLength + sizeof(u_int16_t) * key->attrNameLen)
+            return fsBTInvalidNodeErr;
+        hfs_swap_BE16_array (key->attrName, key->attrNameLen);
+
+    } else {
+        return fsBTInvalidNodeErr;
+    }
+
+    *childNode = SWAP_BE32 (*(UInt32 *)(srcKey + sizeof(keyLength) + keyLength));
+
+    return (0);
+}
+
 static int
 hfs_swap_HFSPlusBTInternalNode (
     BlockDescriptor *src,
@@ -435,7 +635,6 @@ hfs_swap_HFSPlusBTInternalNode (
     UInt16 *srcOffs = (UInt16 *)((char *)src->buffer + (src->blockSize - (srcDesc->numRecords * sizeof (UInt16))));
 	char *nextRecord;	/*  Points to start of record following current one */
     int32_t i;
-    UInt32 j;
 
     if (fileID == kHFSExtentsFileID) {
         HFSPlusExtentKey *srcKey;
@@ -492,10 +691,7 @@ hfs_swap_HFSPlusBTInternalNode (
                 *((UInt32 *)srcRec) = SWAP_BE32 (*((UInt32 *)srcRec));
             } else {
 				/* Swap the extent data */
-				for (j = 0; j < kHFSPlusExtentDensity; j++) {
-					srcRec[j].startBlock	= SWAP_BE32 (srcRec[j].startBlock);
-					srcRec[j].blockCount	= SWAP_BE32 (srcRec[j].blockCount);
-				}
+				hfs_swap_BE32_array ((UInt32 *)srcRec, 2 * kHFSPlusExtentDensity);
             }
         }
 
@@ -566,9 +762,7 @@ hfs_swap_HFSPlusBTInternalNode (
 				WriteError(fcb->fcbVolume->vcbGPtr, E_KeyLen, fcb->fcbFileID, src->blockNum);
 				return E_KeyLen;
             }
-            for (j = 0; j < srcKey->nodeName.length; j++) {
-                srcKey->nodeName.unicode[j]	= SWAP_BE16 (srcKey->nodeName.unicode[j]);
-            }
+            hfs_swap_BE16_array (srcKey->nodeName.unicode, srcKey->nodeName.length);
             if (direction == kSwapBTNodeHostToBig)
             	srcKey->nodeName.length	= SWAP_BE16 (srcKey->nodeName.length);
  
@@ -594,16 +788,12 @@ hfs_swap_HFSPlusBTInternalNode (
                 }
 
                 srcRec->flags				= SWAP_BE16 (srcRec->flags);
-                srcRec->valence				= SWAP_BE32 (srcRec->valence);
-                srcRec->folderID			= SWAP_BE32 (srcRec->folderID);
-                srcRec->createDate			= SWAP_BE32 (srcRec->createDate);
-                srcRec->contentModDate		= SWAP_BE32 (srcRec->contentModDate);
-                srcRec->attributeModDate	= SWAP_BE32 (srcRec->attributeModDate);
-                srcRec->accessDate			= SWAP_BE32 (srcRec->accessDate);
-                srcRec->backupDate			= SWAP_BE32 (srcRec->backupDate);
-                
-                srcRec->bsdInfo.ownerID		= SWAP_BE32 (srcRec->bsdInfo.ownerID);
-                srcRec->bsdInfo.groupID		= SWAP_BE32 (srcRec->bsdInfo.groupID);
+
+                /*
+                 * Swap valence, folderID, the five dates, and bsdInfo.ownerID
+                 * and groupID, which lie in a row.
+                 */
+                hfs_swap_BE32_array (&srcRec->valence, RUN32(HFSPlusCatalogFolder, valence, bsdInfo.adminFlags));
     
                 /* Don't swap srcRec->bsdInfo.adminFlags; it's only one byte */
                 /* Don't swap srcRec->bsdInfo.ownerFlags; it's only one byte */
@@ -628,16 +818,11 @@ hfs_swap_HFSPlusBTInternalNode (
                 
                 srcRec->flags				= SWAP_BE16 (srcRec->flags);
     
-                srcRec->fileID				= SWAP_BE32 (srcRec->fileID);
-    
-                srcRec->createDate			= SWAP_BE32 (srcRec->createDate);
-                srcRec->contentModDate		= SWAP_BE32 (srcRec->contentModDate);
-                srcRec->attributeModDate	= SWAP_BE32 (srcRec->attributeModDate);
-                srcRec->accessDate			= SWAP_BE32 (srcRec->accessDate);
-                srcRec->backupDate			= SWAP_BE32 (srcRec->backupDate);
-    
-                srcRec->bsdInfo.ownerID		= SWAP_BE32 (srcRec->bsdInfo.ownerID);
-                srcRec->bsdInfo.groupID		= SWAP_BE32 (srcRec->bsdInfo.groupID);
+                /*
+                 * Swap hl_firstLinkID (reserved1), fileID, the five dates, and
+                 * bsdInfo.ownerID and groupID, which lie in a row.
+                 */
+                hfs_swap_BE32_array (&srcRec->reserved1, RUN32(HFSPlusCatalogFile, reserved1, bsdInfo.adminFlags));
     
                 /* Don't swap srcRec->bsdInfo.adminFlags; it's only one byte */
                 /* Don't swap srcRec->bsdInfo.ownerFlags; it's only one byte */
@@ -646,8 +831,6 @@ hfs_swap_HFSPlusBTInternalNode (
                 srcRec->bsdInfo.special.iNodeNum	= SWAP_BE32 (srcRec->bsdInfo.special.iNodeNum);
     
                 srcRec->textEncoding		= SWAP_BE32 (srcRec->textEncoding);
-    
-    			srcRec->hl_firstLinkID 		= SWAP_BE32 (srcRec->hl_firstLinkID);
 
     			srcRec->userInfo.fdType		= SWAP_BE32 (srcRec->userInfo.fdType);
 				srcRec->userInfo.fdCreator	= SWAP_BE32 (srcRec->userInfo.fdCreator);
@@ -691,9 +874,7 @@ hfs_swap_HFSPlusBTInternalNode (
 					WriteError(fcb->fcbVolume->vcbGPtr, E_BadNode, fcb->fcbFileID, src->blockNum);
 					return E_BadNode;
 				}
-                for (j = 0; j < srcRec->nodeName.length; j++) {
-                    srcRec->nodeName.unicode[j]	= SWAP_BE16 (srcRec->nodeName.unicode[j]);
-                }
+                hfs_swap_BE16_array (srcRec->nodeName.unicode, srcRec->nodeName.length);
                 
                 if (direction == kSwapBTNodeHostToBig)
                 	srcRec->nodeName.length = SWAP_BE16 (srcRec->nodeName.length);
@@ -763,8 +944,7 @@ hfs_swap_HFSPlusBTInternalNode (
 				WriteError(fcb->fcbVolume->vcbGPtr, E_BadNode, fcb->fcbFileID, src->blockNum);
 				return E_BadNode;
     		}
-    		for (j = 0; j < srcKey->attrNameLen; j++)
-    			srcKey->attrName[j] = SWAP_BE16(srcKey->attrName[j]);
+    		hfs_swap_BE16_array (srcKey->attrName, srcKey->attrNameLen);
     		if (direction == kSwapBTNodeHostToBig)
     			srcKey->attrNameLen = SWAP_BE16(srcKey->attrNameLen);
     		
@@ -831,12 +1011,7 @@ hfs_swap_HFSPlusBTInternalNode (
             		
             		/* We're not swapping the reserved field */
             		
-            		for (j = 0; j < kHFSPlusExtentDensity; j++) {
-            			srcRec->overflowExtents.extents[j].startBlock =
-            				SWAP_BE32(srcRec->overflowExtents.extents[j].startBlock);
-            			srcRec->overflowExtents.extents[j].blockCount =
-            				SWAP_BE32(srcRec->overflowExtents.extents[j].blockCount);
-            		}
+            		hfs_swap_BE32_array ((UInt32 *)srcRec->overflowExtents.extents, 2 * kHFSPlusExtentDensity);
             		break;
             	default:
 					if (debug) plog ("hfs_swap_BTNode: unrecognized attribute record type (%d)\n", srcRec->recordType);
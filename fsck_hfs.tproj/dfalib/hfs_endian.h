@@ -89,6 +89,8 @@ enum HFSBTSwapDirection {
 void hfs_swap_HFSMasterDirectoryBlock (void *buf);
 void hfs_swap_HFSPlusVolumeHeader (void *buf);
 int  hfs_swap_BTNode (BlockDescriptor *src, SFCB *fcb, enum HFSBTSwapDirection direction);
+int  hfs_swap_BTIndexRecord (BlockDescriptor *src, SFCB *fcb, UInt16 index, void *keyBuffer, UInt32 *childNode);
+const char *hfs_swap_kind (void);
 
 #ifdef __cplusplus
 }
@@ -31,6 +31,8 @@
 #include <setjmp.h>
 
 #include <hfs/hfs_mount.h>
+#include <hfs/hfs_format.h>
+#include <libkern/OSByteOrder.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -73,9 +75,21 @@ char	rebuildBTree;  	/* Rebuild requested btree files */
 int	rebuildOptions;	/* Options to indicate which btree should be rebuilt */
 char	modeSetting;	/* set the mode when creating "lost+found" directory */
 char	errorOnExit = 0;	/* Exit on first error */
+char	threadedVerify;	/* Verify the B-trees' structure on worker threads (-t) */
+char	scanVerify;	/* Verify the B-trees' structure from a scan in disk order (-s) */
+char	lazyIndexSwap;	/* Swap only the keys of index nodes that searches compare (-L) */
 int		upgrading;		/* upgrading format */
 int		lostAndFoundMode = 0; /* octal mode used when creating "lost+found" directory */
 uint64_t reqCacheSize;;	/* Cache size requested by the caller (may be specified by the user via -c) */
+uint32_t reqCacheBlockSize;	/* Cache block size; 0 matches the catalog node size (may be specified by the user via -P) */
+int	cachePolicy = kCachePolicyLRU;	/* Cache replacement policy (may be specified by the user via -C) */
+uint32_t readAheadWindow = DefaultReadAheadWindow;	/* Cache readahead window in blocks (may be specified by the user via -a) */
+uint64_t reqDirtyLimit;	/* Most lazy write data to hold in the cache (may be specified by the user via -W) */
+char	*cacheReportFile;	/* File to write the JSON cache report to, "-" for stdout (-j) */
+char	*cacheTraceFile;	/* File to record cache requests in (-T) */
+char	*checkpointFile;	/* File to keep verify checkpoints in, and resume from (-k) */
+uint64_t memoryBudget;	/* Most memory for the cache and verify tables together; 0 is no limit (-M) */
+FILE	*cacheTrace;		/* The open trace, closed by ckfini */
 
 int	fsmodified;		/* 1 => write done to file system */
 int	fsreadfd;		/* file descriptor for reading file system */
@@ -98,6 +112,7 @@ static int checkfilesys __P((char * filesys));
 static int setup __P(( char *dev, int *canWritePtr ));
 static void usage __P((void));
 static void getWriteAccess __P(( char *dev, int *canWritePtr ));
+static uint32_t GetCatalogNodeSize __P(( int fd, int devBlockSize, uint64_t *verifyBytes ));
 extern char *unrawname __P((char *name));
 
 int
@@ -116,8 +131,17 @@ main(argc, argv)
 	else
 		progname = *argv;
 
-	while ((ch = getopt(argc, argv, "b:B:c:D:Edfglm:npqruyx")) != EOF) {
+	while ((ch = getopt(argc, argv, "a:b:B:c:C:D:Edfgj:k:lLm:M:nP:pqrstuT:W:yx")) != EOF) {
 		switch (ch) {
+		case 'a':
+			/* Cache readahead window, in cache blocks (0 to disable) */
+			readAheadWindow = strtoul(optarg, &lastChar, 0);
+			if (*lastChar) {
+				(void) fplog(stderr, "%s: invalid readahead window `%s'\n", progname, optarg);
+				usage();
+			}
+			break;
+
 		case 'b':
 			gBlockSize = atoi(optarg);
 			if ((gBlockSize < 512) || (gBlockSize & (gBlockSize-1))) {
@@ -150,10 +174,105 @@ main(argc, argv)
 			}
 			break;
 
+		case 'P':
+			/* Cache block size to use in fsck_hfs */
+			reqCacheBlockSize = strtoul(optarg, &lastChar, 0);
+			if (*lastChar) {
+				switch (tolower(*lastChar)) {
+					case 'm':
+						reqCacheBlockSize *= 1024;
+						/* fall through */
+					case 'k':
+						reqCacheBlockSize *= 1024;
+						break;
+					default:
+						reqCacheBlockSize = 0;
+						break;
+				};
+			}
+			break;
+
+		case 'W':
+			/* Dirty data allowed in the cache before it is flushed */
+			reqDirtyLimit = strtoull(optarg, &lastChar, 0);
+			if (*lastChar) {
+				switch (tolower(*lastChar)) {
+					case 'g':
+						reqDirtyLimit *= 1024ULL;
+						/* fall through */
+					case 'm':
+						reqDirtyLimit *= 1024ULL;
+						/* fall through */
+					case 'k':
+						reqDirtyLimit *= 1024ULL;
+						break;
+					default:
+						reqDirtyLimit = 0;
+						break;
+				};
+			}
+			break;
+
+		case 'C':
+			/* Cache replacement policy */
+			if (strcasecmp(optarg, "lru") == 0)
+				cachePolicy = kCachePolicyLRU;
+			else if (strcasecmp(optarg, "2q") == 0)
+				cachePolicy = kCachePolicy2Q;
+			else {
+				(void) fplog(stderr, "%s: unknown cache policy `%s'\n", progname, optarg);
+				usage();
+			}
+			break;
+
 		case 'd':
 			debug++;
 			break;
 
+		case 'j':
+			/* Write a JSON cache report when done */
+			cacheReportFile = optarg;
+			break;
+
+		case 'k':
+			/* Checkpoint the verify, and resume from the last checkpoint */
+			checkpointFile = optarg;
+			break;
+
+		case 'M':
+			/* Memory budget for the cache and the verify tables */
+			memoryBudget = strtoull(optarg, &lastChar, 0);
+			if (*lastChar) {
+				switch (tolower(*lastChar)) {
+					case 'g':
+						memoryBudget *= 1024ULL;
+						/* fall through */
+					case 'm':
+						memoryBudget *= 1024ULL;
+						/* fall through */
+					case 'k':
+						memoryBudget *= 1024ULL;
+						break;
+					default:
+						memoryBudget = 0;
+						break;
+				};
+			}
+			break;
+
+		case 's':
+			scanVerify++;
+			break;
+
+		case 't':
+			threadedVerify++;
+			break;
+
+		case 'T':
+			/* Record cache requests for replay by fsck_cachesim */
+			cacheTraceFile = optarg;
+			break;
+
 		case 'D':
 			/* Input value should be in hex example: -D 0x5 */
 			cur_debug_level = strtoul(optarg, NULL, 0);
@@ -186,6 +305,10 @@ main(argc, argv)
 			force++;
 			break;
 			
+		case 'L':
+			lazyIndexSwap++;
+			break;
+
 		case 'm':
 			modeSetting++;
 			lostAndFoundMode = strtol( optarg, NULL, 8 );
@@ -538,6 +661,9 @@ setup( char *dev, int *canWritePtr )
 	int devBlockSize;
 	uint32_t cacheBlockSize;
 	uint32_t cacheTotalBlocks;
+	uint32_t catalogNodeSize = 0;
+	uint64_t verifyBytes = 0;
+	uint64_t budgetCacheSize;
 	int preTouchMem = 0;
 
 	fswritefd = -1;
@@ -547,7 +673,8 @@ setup( char *dev, int *canWritePtr )
 		plog("Can't stat %s: %s\n", dev, strerror(errno));
 		return (0);
 	}
-	if ((statb.st_mode & S_IFMT) != S_IFCHR) {
+	if ((statb.st_mode & S_IFMT) != S_IFCHR &&
+	    (statb.st_mode & S_IFMT) != S_IFREG) {
 		pfatal("%s is not a character device", dev);
 		if (reply("CONTINUE") == 0)
 			return (0);
@@ -583,8 +710,10 @@ setup( char *dev, int *canWritePtr )
 	}
 
 
-	/* Get device block size to initialize cache */
-	if (ioctl(fsreadfd, DKIOCGETBLOCKSIZE, &devBlockSize) < 0) {
+	/* Get device block size to initialize cache (disk images use 512) */
+	if ((statb.st_mode & S_IFMT) == S_IFREG) {
+		devBlockSize = 512;
+	} else if (ioctl(fsreadfd, DKIOCGETBLOCKSIZE, &devBlockSize) < 0) {
 		pfatal ("Can't get device block size\n");
 		return (0);
 	}
@@ -621,7 +750,29 @@ setup( char *dev, int *canWritePtr )
 		}
 	}
 	
-	CalculateCacheSizes(reqCacheSize, &cacheBlockSize, &cacheTotalBlocks, debug);
+	/*
+	 * Size cache blocks to fit the catalog's B-tree nodes, so that a random
+	 * descent reads and holds no more than the nodes it visits.  Scans are
+	 * still read in large clusters (see CacheSetStreamCluster).
+	 */
+	if (reqCacheBlockSize == 0 || (memoryBudget && quick == 0))
+		catalogNodeSize = GetCatalogNodeSize(fsreadfd, devBlockSize, &verifyBytes);
+	if (reqCacheBlockSize == 0)
+		reqCacheBlockSize = catalogNodeSize;
+
+	/*
+	 * Within a memory budget (-M), the cache gets no more than what the
+	 * verify tables are estimated to leave of it (see dfalib/SSpill.c).
+	 */
+	if (memoryBudget && quick == 0) {
+		budgetCacheSize = BudgetCacheSize(memoryBudget, verifyBytes);
+		if (reqCacheSize == 0 || reqCacheSize > budgetCacheSize)
+			reqCacheSize = budgetCacheSize;
+		if (debug)
+			plog("\tverify tables estimated at %lluK of the %lluK memory budget\n",
+			     (unsigned long long)(verifyBytes / 1024), (unsigned long long)(memoryBudget / 1024));
+	}
+	CalculateCacheSizes(reqCacheSize, reqCacheBlockSize, &cacheBlockSize, &cacheTotalBlocks, debug);
 
 	preTouchMem = (hotroot != 0) && (lflag != 0);
 	/* Initialize the cache */
@@ -630,11 +781,109 @@ setup( char *dev, int *canWritePtr )
 		pfatal("Can't initialize disk cache\n");
 		return (0);
 	}	
+	if (CacheSetPolicy (&fscache, cachePolicy) != EOK) {
+		pfatal("Can't set disk cache policy\n");
+		return (0);
+	}
+	/* Not fatal; the check runs without readahead, as it did before */
+	if (CacheSetReadAhead (&fscache, readAheadWindow, DefaultReadAheadThreads) != EOK)
+		(void)fplog(stderr, "%s: can't start disk cache readahead, continuing without it\n",
+		            progname);
+	(void) CacheSetDirtyLimit (&fscache, reqDirtyLimit);
+	(void) CacheSetStreamCluster (&fscache, DefaultStreamCluster);
+	if (cacheTraceFile != NULL) {
+		/* Not fatal; the check is worth more than the trace */
+		if ((cacheTrace = fopen(cacheTraceFile, "w")) == NULL) {
+			(void)fplog(stderr, "%s: can't create cache trace %s: %s\n",
+			            progname, cacheTraceFile, strerror(errno));
+		} else {
+			(void) setvbuf(cacheTrace, NULL, _IOFBF, 1024 * 1024);
+			if (CacheSetTrace (&fscache, cacheTrace) != EOK)
+				(void)fplog(stderr, "%s: can't write cache trace %s\n",
+				            progname, cacheTraceFile);
+		}
+	}
 
 	return (1);
 }
 
 
+/*
+ * GetCatalogNodeSize
+ *
+ * Read the node size of the catalog B-tree straight off the disk, before
+ * the cache is set up.  Handles HFS Plus and HFSX volumes, including ones
+ * wrapped in an HFS volume.  Returns 0 if it can't be found (a plain HFS
+ * volume, or a damaged one); the check itself will deal with that.
+ *
+ * The verify tables' needs are estimated from the same volume header for
+ * -M, and returned in *verifyBytes (left alone if there is no header).
+ */
+static uint32_t
+GetCatalogNodeSize( int fd, int devBlockSize, uint64_t *verifyBytes )
+{
+	HFSMasterDirectoryBlock	*mdb;
+	HFSPlusVolumeHeader		*vh;
+	BTNodeDescriptor		*desc;
+	BTHeaderRec				*header;
+	char					*buf;
+	uint64_t				embedOffset = 0;
+	uint64_t				offset;
+	uint32_t				blockSize;
+	uint32_t				nodeSize = 0;
+	size_t					len;
+
+	/* Reads must be whole device blocks; enough for 512 bytes at any offset */
+	len = 2 * (devBlockSize > 512 ? devBlockSize : 512);
+	if ((buf = valloc(len)) == NULL)
+		return (0);
+
+#define READ_SECTOR(off)	(pread(fd, buf, len, (off) - (off) % devBlockSize) == (ssize_t)len ? \
+				 buf + (off) % devBlockSize : NULL)
+
+	if ((mdb = (HFSMasterDirectoryBlock *)READ_SECTOR(1024ULL)) == NULL)
+		goto out;
+	if (OSSwapBigToHostInt16(mdb->drSigWord) == kHFSSigWord &&
+	    OSSwapBigToHostInt16(mdb->drEmbedSigWord) == kHFSPlusSigWord) {
+		embedOffset = (uint64_t)OSSwapBigToHostInt16(mdb->drAlBlSt) * 512 +
+		              (uint64_t)OSSwapBigToHostInt16(mdb->drEmbedExtent.startBlock) *
+		              OSSwapBigToHostInt32(mdb->drAlBlkSiz);
+		offset = embedOffset + 1024;
+		if ((mdb = (HFSMasterDirectoryBlock *)READ_SECTOR(offset)) == NULL)
+			goto out;
+	}
+
+	vh = (HFSPlusVolumeHeader *)mdb;
+	if (OSSwapBigToHostInt16(vh->signature) != kHFSPlusSigWord &&
+	    OSSwapBigToHostInt16(vh->signature) != kHFSXSigWord)
+		goto out;
+	blockSize = OSSwapBigToHostInt32(vh->blockSize);
+	*verifyBytes = EstimateVerifyMemory(OSSwapBigToHostInt32(vh->totalBlocks),
+	                                    OSSwapBigToHostInt32(vh->fileCount),
+	                                    OSSwapBigToHostInt32(vh->folderCount));
+
+	/* The header node is the first node of the catalog file */
+	offset = embedOffset +
+	         (uint64_t)OSSwapBigToHostInt32(vh->catalogFile.extents[0].startBlock) * blockSize;
+	if ((desc = (BTNodeDescriptor *)READ_SECTOR(offset)) == NULL)
+		goto out;
+	if (desc->kind != kBTHeaderNode)
+		goto out;
+	header = (BTHeaderRec *)(desc + 1);
+
+	nodeSize = OSSwapBigToHostInt16(header->nodeSize);
+	if (nodeSize < 512 || nodeSize > 32768 || (nodeSize & (nodeSize - 1)) != 0)
+		nodeSize = 0;
+#undef READ_SECTOR
+
+out:
+	free(buf);
+	if (debug && nodeSize)
+		plog("\tcatalog node size %u\n", nodeSize);
+	return (nodeSize);
+}
+
+
 // This routine will attempt to open the block device with write access for the target 
 // volume in order to block others from mounting the volume with write access while we
 // check / repair it.  If we cannot get write access then we check to see if the volume
@@ -716,20 +965,31 @@ ExitThisRoutine:
 static void
 usage()
 {
-	(void) fplog(stderr, "usage: %s [-b [size] B [path] c [size] Edfl m [mode] npqruy] special-device\n", progname);
+	(void) fplog(stderr, "usage: %s [-a [blocks] b [size] B [path] c [size] C [policy] Edf j [file] k [file] lL m [mode] M [size] n P [size] pqrstu T [file] W [size] y] special-device\n", progname);
+	(void) fplog(stderr, "  a blocks = cache readahead window (0 disables)\n");
 	(void) fplog(stderr, "  b size = size of physical blocks (in bytes) for -B option\n");
 	(void) fplog(stderr, "  B path = file containing physical block numbers to map to paths\n");
 	(void) fplog(stderr, "  c size = cache size (ex. 512m, 1g)\n");
+	(void) fplog(stderr, "  C policy = cache replacement policy (lru, 2q)\n");
 	(void) fplog(stderr, "  E = exit on first major error\n");
 	(void) fplog(stderr, "  d = output debugging info\n");
 	(void) fplog(stderr, "  f = force fsck even if clean (preen only) \n");
+	(void) fplog(stderr, "  j file = write a JSON cache report to file (- for stdout)\n");
+	(void) fplog(stderr, "  k file = checkpoint the verify to file, and resume from it\n");
 	(void) fplog(stderr, "  l = live fsck (lock down and test-only)\n");
+	(void) fplog(stderr, "  L = swap only the index node keys that btree searches compare\n");
 	(void) fplog(stderr, "  m arg = octal mode used when creating lost+found directory \n");
+	(void) fplog(stderr, "  M size = memory budget for the cache and verify tables (ex. 2g)\n");
 	(void) fplog(stderr, "  n = assume a no response \n");
+	(void) fplog(stderr, "  P size = cache block size, 4k to 1m (default: the catalog node size)\n");
 	(void) fplog(stderr, "  p = just fix normal inconsistencies \n");
 	(void) fplog(stderr, "  q = quick check returns clean, dirty, or failure \n");
 	(void) fplog(stderr, "  r = rebuild catalog btree \n");
+	(void) fplog(stderr, "  s = verify the btrees from a scan in disk order\n");
+	(void) fplog(stderr, "  t = verify (and salvage) the btrees on worker threads\n");
+	(void) fplog(stderr, "  T file = record cache requests to file (see fsck_cachesim)\n");
 	(void) fplog(stderr, "  u = usage \n");
+	(void) fplog(stderr, "  W size = most dirty data to cache before writing it out (ex. 64m)\n");
 	(void) fplog(stderr, "  y = assume a yes response \n");
 	
 	exit(1);
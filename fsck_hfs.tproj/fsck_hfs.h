@@ -31,6 +31,9 @@ extern char	yflag;			/* assume a yes response */
 extern char	preen;			/* just fix normal inconsistencies */
 extern char	force;			/* force fsck even if clean */
 extern char	debug;			/* output debugging info */
+extern char	threadedVerify;		/* verify the B-trees on worker threads */
+extern char	scanVerify;		/* verify the B-trees from a scan in disk order */
+extern char	lazyIndexSwap;		/* swap only the index node keys searches compare */
 extern char	hotroot;		/* checking root device */
 
 extern int	upgrading;		/* upgrading format */
@@ -39,6 +42,10 @@ extern int	fsmodified;		/* 1 => write done to file system */
 extern int	fsreadfd;		/* file descriptor for reading file system */
 extern int	fswritefd;		/* file descriptor for writing file system */
 extern Cache_t	fscache;
+extern char	*cacheReportFile;	/* where to write the cache report (-j) */
+extern FILE	*cacheTrace;		/* cache request trace (-T) */
+extern char	*checkpointFile;	/* where to keep verify checkpoints (-k) */
+extern uint64_t	memoryBudget;	/* memory for the cache and verify tables (-M) */
 
 
 #define DIRTYEXIT  3		/* Filesystem Dirty, no checks */
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * fsck_keybench
+ *
+ *  Times FastUnicodeCompare in dfalib/UnicodeCompare.c against the
+ *  table-only loop it replaced, and checks that both give the same
+ *  answer for every comparison made.
+ *
+ *  The names are read from a file, one UTF-8 name per line (for
+ *  instance, the output of "find / -exec basename {} \;"), or else
+ *  made up to look like a typical volume: mostly ASCII, some accented,
+ *  a few in other scripts.  Each name is looked up by binary search in
+ *  the sorted names, as a catalog B-tree search compares a key against
+ *  the keys in each node, and compared against its neighbour.  Random
+ *  strings full of ignorable, NUL and non-ASCII characters are checked
+ *  as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "UnicodeCompare.h"
+
+#define kMaxNameLength	255
+
+typedef struct {
+	UniChar		unicode[kMaxNameLength];
+	ItemCount	length;
+} Name;
+
+char *progname = "fsck_keybench";
+
+extern UInt16 gLowerCaseTable[];
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* The old FastUnicodeCompare: every character through the table */
+static SInt32
+OldUnicodeCompare(ConstUniCharArrayPtr str1, ItemCount length1,
+		  ConstUniCharArrayPtr str2, ItemCount length2)
+{
+	UInt16 c1, c2;
+	UInt16 temp;
+
+	while (1) {
+		c1 = 0;
+		c2 = 0;
+		while (length1 && c1 == 0) {
+			c1 = *(str1++);
+			--length1;
+			if ((temp = gLowerCaseTable[c1>>8]) != 0)
+				c1 = gLowerCaseTable[temp + (c1 & 0x00FF)];
+		}
+		while (length2 && c2 == 0) {
+			c2 = *(str2++);
+			--length2;
+			if ((temp = gLowerCaseTable[c2>>8]) != 0)
+				c2 = gLowerCaseTable[temp + (c2 & 0x00FF)];
+		}
+		if (c1 != c2)
+			break;
+		if (c1 == 0)
+			return 0;
+	}
+	if (c1 < c2)
+		return -1;
+	else
+		return 1;
+}
+
+/* Decode a line of UTF-8; malformed bytes are taken as Latin-1 */
+static void
+DecodeName(const unsigned char *s, Name *name)
+{
+	UInt32 c;
+	int extra;
+
+	name->length = 0;
+	while (*s && *s != '\n' && name->length < kMaxNameLength) {
+		c = *s++;
+		extra = 0;
+		if (c >= 0xF0 && c < 0xF8) {
+			c &= 0x07; extra = 3;
+		} else if (c >= 0xE0) {
+			c &= 0x0F; extra = 2;
+		} else if (c >= 0xC0) {
+			c &= 0x1F; extra = 1;
+		}
+		for (; extra > 0 && (*s & 0xC0) == 0x80; extra--)
+			c = (c << 6) | (*s++ & 0x3F);
+		if (c >= 0x10000) {
+			if (name->length + 2 > kMaxNameLength)
+				break;
+			c -= 0x10000;
+			name->unicode[name->length++] = 0xD800 + (c >> 10);
+			c = 0xDC00 + (c & 0x3FF);
+		}
+		name->unicode[name->length++] = (UniChar)c;
+	}
+}
+
+static void
+AppendAscii(Name *name, const char *s)
+{
+	while (*s && name->length < kMaxNameLength)
+		name->unicode[name->length++] = (unsigned char)*s++;
+}
+
+/* A made-up name, in roughly the mix found on a system volume */
+static void
+MakeName(Name *name)
+{
+	static const char *words[] = {
+		"Contents", "Resources", "Info", "Localizable", "English", "lib",
+		"System", "Library", "Frameworks", "Application Support", "Preferences",
+		"IMG_", "Document", "Untitled", "Makefile", "README", "index", "main",
+		"CoreServices", "PrivateFrameworks", "Caches", "com.apple.", "Desktop",
+	};
+	static const char *exts[] = {
+		"", ".plist", ".strings", ".h", ".c", ".dylib", ".nib", ".png", ".JPG",
+		".tiff", ".lproj", ".app", ".txt", ".html",
+	};
+	static const UniChar accented[] = { 0x00E9, 0x00C9, 0x00FC, 0x00F1, 0x00E5, 0x00D6, 0x00E7 };
+	char buf[32];
+	long kind = random() % 100;
+	int i, n;
+
+	name->length = 0;
+	n = 1 + random() % 3;
+	for (i = 0; i < n; i++) {
+		AppendAscii(name, words[random() % (sizeof(words) / sizeof(words[0]))]);
+		if (random() % 3 == 0) {
+			snprintf(buf, sizeof(buf), "%ld", random() % 10000);
+			AppendAscii(name, buf);
+		}
+	}
+	if (kind >= 80 && kind < 95) {
+		/* Accented Latin somewhere in the name */
+		name->unicode[random() % name->length] = accented[random() % 7];
+	} else if (kind >= 95) {
+		/* CJK */
+		for (i = 0; i < 4 && name->length < kMaxNameLength; i++)
+			name->unicode[name->length++] = 0x4E00 + random() % 0x5000;
+	}
+	AppendAscii(name, exts[random() % (sizeof(exts) / sizeof(exts[0]))]);
+}
+
+/* A random string of the characters most likely to trip up the ASCII runs */
+static void
+MakeNastyName(Name *name, const Name *like)
+{
+	static const UniChar nasty[] = {
+		0x0000, 0x0001, 'A', 'Z', 'a', 'z', '@', '[', '`', '{', 0x007F,
+		0x0080, 0x00C0, 0x00E0, 0x0100, 0x0130, 0x00AD, 0x200C, 0x200D,
+		0x202A, 0x206F, 0xFEFF, 0xFF21, 0xFF41, 0xFFFF, 0x0345, 0x01C4,
+	};
+	ItemCount i;
+
+	/* Often share a prefix, so that the differences come late */
+	name->length = random() % 40;
+	for (i = 0; i < name->length; i++) {
+		if (like && i < like->length && random() % 4)
+			name->unicode[i] = like->unicode[i];
+		else if (random() % 2)
+			name->unicode[i] = nasty[random() % (sizeof(nasty) / sizeof(nasty[0]))];
+		else
+			name->unicode[i] = 0x20 + random() % 0x60;
+	}
+}
+
+static int
+CompareNames(const void *a, const void *b)
+{
+	const Name *x = (const Name *)a;
+	const Name *y = (const Name *)b;
+
+	return (OldUnicodeCompare(x->unicode, x->length, y->unicode, y->length));
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-f names] [-n count] [-p passes]\n", progname);
+	fprintf(stderr, "  f names = file of names, one UTF-8 name a line (default: made up)\n");
+	fprintf(stderr, "  n count = number of names to make up (default 200000)\n");
+	fprintf(stderr, "  p passes = times over the names for each timing (default 4)\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	Name *names, *a, *b;
+	Name x, y;
+	char line[4 * kMaxNameLength + 2];
+	FILE *fp;
+	const char *file = NULL;
+	long count = 200000, size, nasty = 4000000, ascii = 0;
+	long i, compares, lo, hi, mid;
+	double start, oldTime, newTime;
+	SInt32 oldResult, newResult;
+	int passes = 4, pass, ch, errors = 0;
+
+	while ((ch = getopt(argc, argv, "f:n:p:")) != -1) {
+		switch (ch) {
+		case 'f':
+			file = optarg;
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (count <= 0 || passes <= 0)
+		usage();
+
+	srandom(1);
+	if (file) {
+		if ((fp = fopen(file, "r")) == NULL) {
+			perror(file);
+			exit(1);
+		}
+		size = 1024;
+		names = malloc(size * sizeof(Name));
+		for (count = 0; names && fgets(line, sizeof(line), fp); ) {
+			if (count == size)
+				names = realloc(names, (size *= 2) * sizeof(Name));
+			if (names)
+				DecodeName((unsigned char *)line, &names[count++]);
+		}
+		fclose(fp);
+	} else {
+		names = malloc(count * sizeof(Name));
+		for (i = 0; names && i < count; i++)
+			MakeName(&names[i]);
+	}
+	if (names == NULL || count < 2) {
+		fprintf(stderr, "%s: no names\n", progname);
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		ItemCount j;
+
+		for (j = 0; j < names[i].length; j++)
+			if (names[i].unicode[j] == 0 || names[i].unicode[j] > 0x7F)
+				break;
+		ascii += (j == names[i].length);
+	}
+	qsort(names, count, sizeof(Name), CompareNames);
+
+	printf("%ld names (%ld%% ASCII), %d passes, %s ASCII runs\n",
+		count, ascii * 100 / count, passes, UnicodeCompareKind());
+	printf("%-22s %10s %10s %8s\n", "operation", "old Mcmp/s", "new Mcmp/s", "speedup");
+
+#define REPORT(name) \
+	printf("%-22s %10.1f %10.1f %7.1fx\n", name, \
+		compares / oldTime / 1e6, compares / newTime / 1e6, oldTime / newTime)
+
+	/* Binary search for every name, as SearchNode does */
+#define SEARCH(compare, result) \
+	for (pass = 0; pass < passes; pass++) { \
+		for (i = 0; i < count; i++) { \
+			for (lo = 0, hi = count - 1; lo <= hi; ) { \
+				mid = (lo + hi) / 2; \
+				result = compare(names[i].unicode, names[i].length, \
+						 names[mid].unicode, names[mid].length); \
+				compares++; \
+				if (result == 0) \
+					break; \
+				if (result < 0) \
+					hi = mid - 1; \
+				else \
+					lo = mid + 1; \
+			} \
+		} \
+	}
+	compares = 0;
+	start = now();
+	SEARCH(OldUnicodeCompare, oldResult);
+	oldTime = now() - start;
+	compares = 0;
+	start = now();
+	SEARCH(FastUnicodeCompare, newResult);
+	newTime = now() - start;
+	REPORT("binary search");
+
+	/* Neighbours, which share the longest prefixes */
+	compares = 0;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 1; i < count; i++, compares++)
+			oldResult += OldUnicodeCompare(names[i - 1].unicode, names[i - 1].length,
+						       names[i].unicode, names[i].length);
+	oldTime = now() - start;
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 1; i < count; i++)
+			newResult += FastUnicodeCompare(names[i - 1].unicode, names[i - 1].length,
+							names[i].unicode, names[i].length);
+	newTime = now() - start;
+	REPORT("neighbours");
+
+	/* Every comparison above, and random ones, must agree exactly */
+	for (i = 0; i < count * 4 + nasty; i++) {
+		if (i < count * 4) {
+			a = &names[random() % count];
+			b = (i & 1) ? &names[random() % count] : &names[(a - names + 1) % count];
+		} else {
+			MakeNastyName(&x, NULL);
+			MakeNastyName(&y, &x);
+			a = &x;
+			b = &y;
+		}
+		oldResult = OldUnicodeCompare(a->unicode, a->length, b->unicode, b->length);
+		newResult = FastUnicodeCompare(a->unicode, a->length, b->unicode, b->length);
+		if (oldResult != newResult) {
+			if (errors++ < 10) {
+				printf("  MISMATCH: %d, expected %d for names of length %u and %u\n",
+					(int)newResult, (int)oldResult,
+					(unsigned)a->length, (unsigned)b->length);
+			}
+		}
+	}
+	printf("%ld comparisons checked, %d mismatches\n", count * 4 + nasty, errors);
+
+	free(names);
+	return (errors ? 1 : 0);
+}
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * fsck_swapbench
+ *
+ *  Times hfs_swap_BTNode in dfalib/hfs_endian.c, a node at a time, against
+ *  the same code built with HFS_SWAP_SCALAR (the one-value-at-a-time loops),
+ *  and times a search of an index node swapped whole against the lazy search
+ *  of fsck_hfs -L, which swaps only the keys it compares.
+ *
+ *  The nodes are made up to look like those of an HFS+ volume: extents and
+ *  catalog leaf and index nodes, the catalog leaves holding a mix of folder,
+ *  file and thread records.  Every node must swap to host order exactly as
+ *  the scalar code swaps it, and back to the bytes it started as, and the
+ *  lazy search must pick the same record and child as the whole-node one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <sys/time.h>
+
+#include "Scavenger.h"
+
+/* fsck_hfs.h sends these to plog and fplog */
+#undef printf
+#undef fprintf
+
+/* The scalar build of hfs_endian.c, renamed by the Makefile */
+int  scalar_swap_BTNode (BlockDescriptor *src, SFCB *fcb, enum HFSBTSwapDirection direction);
+
+enum {
+	kExtentsLeaf,
+	kExtentsIndex,
+	kCatalogLeaf,
+	kCatalogIndex,
+	kNodeKinds
+};
+
+static const char *kindNames[kNodeKinds] = {
+	"extents leaf", "extents index", "catalog leaf", "catalog index"
+};
+
+typedef struct {
+	int		kind;
+	SFCB		*fcb;
+	UInt8		*image;		/* on-disk (big endian) bytes */
+	BTreeKey	*keys;		/* keys to search for, in host order */
+	int		keyCount;
+} Node;
+
+char *progname = "fsck_swapbench";
+char debug;
+
+/* hfs_endian.c reports damage through these; the made-up nodes have none */
+void
+WriteError(SGlobPtr GPtr, short msgID, UInt32 tarID, UInt64 tarBlock)
+{
+	fprintf(stderr, "%s: WriteError %d for node %llu\n", progname, msgID, (unsigned long long)tarBlock);
+}
+
+void
+plog(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static void
+RandomBytes(void *p, size_t n)
+{
+	UInt8 *b = p;
+
+	while (n--)
+		*b++ = random();
+}
+
+/* Key order for the made-up index nodes, as the compare procs would have it */
+static SInt32
+CompareBenchKeys(const BTreeKey *a, const BTreeKey *b, int catalog)
+{
+	const HFSPlusCatalogKey *ca = (const HFSPlusCatalogKey *)a;
+	const HFSPlusCatalogKey *cb = (const HFSPlusCatalogKey *)b;
+	const HFSPlusExtentKey *ea = (const HFSPlusExtentKey *)a;
+	const HFSPlusExtentKey *eb = (const HFSPlusExtentKey *)b;
+	int i;
+
+	if (catalog) {
+		if (ca->parentID != cb->parentID)
+			return (ca->parentID < cb->parentID ? -1 : 1);
+		for (i = 0; i < ca->nodeName.length && i < cb->nodeName.length; i++)
+			if (ca->nodeName.unicode[i] != cb->nodeName.unicode[i])
+				return (ca->nodeName.unicode[i] < cb->nodeName.unicode[i] ? -1 : 1);
+		return ((SInt32)ca->nodeName.length - cb->nodeName.length);
+	}
+	if (ea->fileID != eb->fileID)
+		return (ea->fileID < eb->fileID ? -1 : 1);
+	if (ea->forkType != eb->forkType)
+		return ((SInt32)ea->forkType - eb->forkType);
+	if (ea->startBlock != eb->startBlock)
+		return (ea->startBlock < eb->startBlock ? -1 : 1);
+	return (0);
+}
+
+static int
+SortCatalogKeys(const void *a, const void *b)
+{
+	return (CompareBenchKeys(a, b, 1));
+}
+
+static int
+SortExtentKeys(const void *a, const void *b)
+{
+	return (CompareBenchKeys(a, b, 0));
+}
+
+#define Offset(node, size, i)	(*(UInt16 *)((UInt8 *)(node) + (size) - 2 * ((i) + 1)))
+
+/* Append a record to a node in host order; returns 0 if it would not fit */
+static int
+AddRecord(UInt8 *node, UInt32 nodeSize, const void *key, UInt32 keySize,
+	  const void *data, UInt32 dataSize)
+{
+	BTNodeDescriptor *desc = (BTNodeDescriptor *)node;
+	UInt16 free = Offset(node, nodeSize, desc->numRecords);
+
+	if (free + keySize + dataSize + 2 * (desc->numRecords + 2) > nodeSize)
+		return (0);
+	memcpy(node + free, key, keySize);
+	memcpy(node + free + keySize, data, dataSize);
+	desc->numRecords++;
+	Offset(node, nodeSize, desc->numRecords) = free + keySize + dataSize;
+	return (1);
+}
+
+/* A catalog key with a name like those on a system volume, mostly short */
+static void
+MakeCatalogKey(HFSPlusCatalogKey *key, UInt32 parentID)
+{
+	int i, n;
+
+	n = (random() % 10) ? 4 + random() % 28 : 32 + random() % 224;
+	key->parentID = parentID;
+	key->nodeName.length = n;
+	for (i = 0; i < n; i++)
+		key->nodeName.unicode[i] = (random() % 20) ? 0x20 + random() % 0x5F : random();
+	key->keyLength = sizeof(key->parentID) + sizeof(key->nodeName.length) + 2 * n;
+}
+
+/*
+ * Fill a node, in host order, with records of the given kind, then swap it
+ * to big endian with the scalar code to make its on-disk image.
+ */
+static void
+MakeNode(Node *n, int kind, UInt32 nodeSize, SFCB *fcb, int searches)
+{
+	UInt8 *node = calloc(1, nodeSize);
+	BTNodeDescriptor *desc = (BTNodeDescriptor *)node;
+	BTreeKey *keys = calloc(nodeSize / 8, sizeof(BTreeKey));
+	BlockDescriptor block;
+	UInt8 record[sizeof(HFSPlusCatalogFile) + sizeof(HFSPlusCatalogKey)];
+	UInt32 recordSize, child, parentID;
+	int catalog = (kind == kCatalogLeaf || kind == kCatalogIndex);
+	int count, i;
+
+	if (node == NULL || keys == NULL) {
+		fprintf(stderr, "%s: no memory\n", progname);
+		exit(1);
+	}
+	desc->fLink = random() % 1000;
+	desc->bLink = random() % 1000;
+	desc->kind = (kind == kExtentsIndex || kind == kCatalogIndex) ? kBTIndexNode : kBTLeafNode;
+	desc->height = (desc->kind == kBTIndexNode) ? 2 : 1;
+	Offset(node, nodeSize, 0) = sizeof(BTNodeDescriptor);
+
+	/* Index nodes need their keys in order: make more than fit, and sort them */
+	count = nodeSize / 8;
+	parentID = 16 + random() % 100000;
+	for (i = 0; i < count; i++) {
+		if (catalog) {
+			if (random() % 4 == 0)
+				parentID += 1 + random() % 50;
+			MakeCatalogKey((HFSPlusCatalogKey *)&keys[i], parentID);
+		} else {
+			HFSPlusExtentKey *key = (HFSPlusExtentKey *)&keys[i];
+
+			key->keyLength = kHFSPlusExtentKeyMaximumLength;
+			key->forkType = (random() % 4) ? 0 : 0xFF;
+			key->fileID = 16 + random() % 100000;
+			key->startBlock = random() % 4 ? 0 : random();
+		}
+	}
+	if (desc->kind == kBTIndexNode)
+		qsort(keys, count, sizeof(BTreeKey), catalog ? SortCatalogKeys : SortExtentKeys);
+
+	for (i = 0; i < count; i++) {
+		UInt32 keySize = keys[i].length16 + sizeof(UInt16);
+
+		if (desc->kind == kBTIndexNode) {
+			/* Leave out repeats; the keys must be strictly in order */
+			if (i > 0 && CompareBenchKeys(&keys[i - 1], &keys[i], catalog) == 0)
+				continue;
+			child = 1 + random() % 1000;
+			if (!AddRecord(node, nodeSize, &keys[i], keySize, &child, sizeof(child)))
+				break;
+			continue;
+		}
+		if (kind == kExtentsLeaf) {
+			RandomBytes(record, sizeof(HFSPlusExtentRecord));
+			recordSize = sizeof(HFSPlusExtentRecord);
+		} else {
+			/* A catalog leaf: two files to each folder and two threads */
+			switch (random() % 5) {
+			case 0:
+			case 1:
+				RandomBytes(record, sizeof(HFSPlusCatalogFile));
+				((HFSPlusCatalogFile *)record)->recordType = kHFSPlusFileRecord;
+				recordSize = sizeof(HFSPlusCatalogFile);
+				break;
+			case 2:
+				RandomBytes(record, sizeof(HFSPlusCatalogFolder));
+				((HFSPlusCatalogFolder *)record)->recordType = kHFSPlusFolderRecord;
+				recordSize = sizeof(HFSPlusCatalogFolder);
+				break;
+			default: {
+				HFSPlusCatalogThread *thread = (HFSPlusCatalogThread *)record;
+				HFSPlusCatalogKey name;
+
+				MakeCatalogKey(&name, random());
+				thread->recordType = (random() % 2) ? kHFSPlusFileThreadRecord : kHFSPlusFolderThreadRecord;
+				thread->reserved = 0;
+				thread->parentID = name.parentID;
+				thread->nodeName = name.nodeName;
+				recordSize = offsetof(HFSPlusCatalogThread, nodeName.unicode[name.nodeName.length]);
+				break;
+			}
+			}
+		}
+		if (!AddRecord(node, nodeSize, &keys[i], keySize, record, recordSize))
+			break;
+	}
+
+	/* What to search for: keys in the node, and keys between them */
+	n->keyCount = 0;
+	if (desc->kind == kBTIndexNode) {
+		n->keys = calloc(searches, sizeof(BTreeKey));
+		for (i = 0; n->keys && i < searches; i++) {
+			BTreeKey *key = (BTreeKey *)(node + Offset(node, nodeSize, random() % desc->numRecords));
+
+			memcpy(&n->keys[i], key, key->length16 + sizeof(UInt16));
+			if (i & 1) {
+				if (catalog)
+					MakeCatalogKey((HFSPlusCatalogKey *)&n->keys[i],
+						       ((HFSPlusCatalogKey *)&n->keys[i])->parentID);
+				else
+					((HFSPlusExtentKey *)&n->keys[i])->startBlock += 1;
+			}
+		}
+		n->keyCount = n->keys ? searches : 0;
+	}
+	free(keys);
+
+	memset(&block, 0, sizeof(block));
+	block.buffer = node;
+	block.blockSize = nodeSize;
+	if (scalar_swap_BTNode(&block, fcb, kSwapBTNodeHostToBig) != 0) {
+		fprintf(stderr, "%s: made a bad %s node\n", progname, kindNames[kind]);
+		exit(1);
+	}
+	n->kind = kind;
+	n->fcb = fcb;
+	n->image = node;
+}
+
+/* SearchNode and the choice of record SearchTree makes, on a swapped node */
+static UInt16
+SearchSwapped(BTNodeDescriptor *node, UInt32 nodeSize, const BTreeKey *searchKey,
+	      int catalog, UInt32 *child)
+{
+	SInt32 lower = 0, upper = node->numRecords - 1, index, result;
+	BTreeKey *trialKey;
+
+	while (lower <= upper) {
+		index = (lower + upper) >> 1;
+		trialKey = (BTreeKey *)((UInt8 *)node + Offset(node, nodeSize, index));
+		result = CompareBenchKeys(searchKey, trialKey, catalog);
+		if (result < 0)
+			upper = index - 1;
+		else if (result > 0)
+			lower = index + 1;
+		else
+			break;
+	}
+	if (lower > upper) {
+		index = lower;
+		if (index != 0)
+			--index;
+	}
+	trialKey = (BTreeKey *)((UInt8 *)node + Offset(node, nodeSize, index));
+	*child = *(UInt32 *)((UInt8 *)trialKey + trialKey->length16 + sizeof(UInt16));
+	return (index);
+}
+
+/* SearchIndexNode, on the node as it is on disk */
+static UInt16
+SearchLazily(BlockDescriptor *block, SFCB *fcb, const BTreeKey *searchKey,
+	     int catalog, UInt32 *child)
+{
+	SInt32 lower = 0, upper = OSSwapBigToHostInt16(((BTNodeDescriptor *)block->buffer)->numRecords) - 1;
+	SInt32 index = 0, result, lastIndex = -1;
+	UInt32 lastChild = 0;
+	BTreeKey trialKey;
+
+	while (lower <= upper) {
+		index = (lower + upper) >> 1;
+		if (hfs_swap_BTIndexRecord(block, fcb, index, &trialKey, &lastChild) != 0)
+			return (0xFFFF);
+		lastIndex = index;
+		result = CompareBenchKeys(searchKey, &trialKey, catalog);
+		if (result < 0)
+			upper = index - 1;
+		else if (result > 0)
+			lower = index + 1;
+		else
+			break;
+	}
+	if (lower > upper) {
+		index = lower;
+		if (index != 0)
+			--index;
+	}
+	if (index == lastIndex)
+		*child = lastChild;
+	else if (hfs_swap_BTIndexRecord(block, fcb, index, &trialKey, child) != 0)
+		return (0xFFFF);
+	return (index);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n nodes] [-p passes] [-s size] [-k searches]\n", progname);
+	fprintf(stderr, "  n nodes = nodes of each kind to make up (default 256)\n");
+	fprintf(stderr, "  p passes = times over the nodes for each timing (default 200)\n");
+	fprintf(stderr, "  s size = node size in bytes, 512 to 32768 (default 8192)\n");
+	fprintf(stderr, "  k searches = searches of each index node (default 16)\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	SVCB vcb;
+	SFCB fcbs[2];
+	BTreeControlBlock btcbs[2];
+	Node *nodes;
+	UInt8 *work, *copy;
+	BlockDescriptor block, other;
+	long nodeCount = 256, total, i, j, searches;
+	UInt32 nodeSize = 8192, child, lazyChild;
+	UInt16 index, lazyIndex;
+	int passes = 200, searchCount = 16, pass, ch, kind, errors = 0;
+	double start, oldTime, newTime;
+
+	while ((ch = getopt(argc, argv, "n:p:s:k:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nodeCount = atol(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 's':
+			nodeSize = atoi(optarg);
+			break;
+		case 'k':
+			searchCount = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nodeCount <= 0 || passes <= 0 || searchCount <= 0 ||
+	    nodeSize < 512 || nodeSize > 32768 || (nodeSize & (nodeSize - 1)))
+		usage();
+
+	memset(&vcb, 0, sizeof(vcb));
+	vcb.vcbSignature = kHFSPlusSigWord;
+	memset(fcbs, 0, sizeof(fcbs));
+	memset(btcbs, 0, sizeof(btcbs));
+	for (i = 0; i < 2; i++) {
+		btcbs[i].totalNodes = 1000;
+		btcbs[i].treeDepth = 2;
+		btcbs[i].nodeSize = nodeSize;
+		fcbs[i].fcbVolume = &vcb;
+		fcbs[i].fcbBtree = &btcbs[i];
+	}
+	fcbs[0].fcbFileID = kHFSExtentsFileID;
+	fcbs[1].fcbFileID = kHFSCatalogFileID;
+
+	srandom(1);
+	total = nodeCount * kNodeKinds;
+	nodes = calloc(total, sizeof(Node));
+	work = malloc(total * nodeSize);
+	copy = malloc(nodeSize);
+	if (nodes == NULL || work == NULL || copy == NULL) {
+		fprintf(stderr, "%s: no memory\n", progname);
+		exit(1);
+	}
+	for (i = 0; i < total; i++) {
+		kind = i / nodeCount;
+		MakeNode(&nodes[i], kind, nodeSize, &fcbs[kind >= kCatalogLeaf], searchCount);
+		memcpy(work + i * nodeSize, nodes[i].image, nodeSize);
+	}
+
+	printf("%ld nodes of %u bytes of each kind, %d passes, %s swapping\n",
+		nodeCount, nodeSize, passes, hfs_swap_kind());
+	printf("%-22s %10s %10s %8s\n", "to host and back", "old ns", "new ns", "speedup");
+
+	memset(&block, 0, sizeof(block));
+	block.blockSize = nodeSize;
+	for (kind = 0; kind < kNodeKinds; kind++) {
+#define ROUNDTRIP(swap) \
+		for (pass = 0; pass < passes; pass++) { \
+			for (i = kind * nodeCount; i < (kind + 1) * nodeCount; i++) { \
+				block.buffer = work + i * nodeSize; \
+				(void) swap(&block, nodes[i].fcb, kSwapBTNodeBigToHost); \
+				(void) swap(&block, nodes[i].fcb, kSwapBTNodeHostToBig); \
+			} \
+		}
+		start = now();
+		ROUNDTRIP(scalar_swap_BTNode);
+		oldTime = now() - start;
+		start = now();
+		ROUNDTRIP(hfs_swap_BTNode);
+		newTime = now() - start;
+		printf("%-22s %10.1f %10.1f %7.2fx\n", kindNames[kind],
+			oldTime * 1e9 / passes / nodeCount, newTime * 1e9 / passes / nodeCount,
+			oldTime / newTime);
+	}
+
+	/* An index node searched as SearchTree did, and as it does with -L */
+	printf("%-22s %10s %10s %8s\n", "index node search", "whole ns", "lazy ns", "speedup");
+	for (kind = kExtentsIndex; kind <= kCatalogIndex; kind += kCatalogIndex - kExtentsIndex) {
+		searches = 0;
+		start = now();
+		for (pass = 0; pass < passes; pass++) {
+			for (i = kind * nodeCount; i < (kind + 1) * nodeCount; i++) {
+				block.buffer = work + i * nodeSize;
+				for (j = 0; j < nodes[i].keyCount; j++, searches++) {
+					(void) hfs_swap_BTNode(&block, nodes[i].fcb, kSwapBTNodeBigToHost);
+					(void) SearchSwapped(block.buffer, nodeSize, &nodes[i].keys[j],
+							     kind == kCatalogIndex, &child);
+					(void) hfs_swap_BTNode(&block, nodes[i].fcb, kSwapBTNodeHostToBig);
+				}
+			}
+		}
+		oldTime = now() - start;
+		start = now();
+		for (pass = 0; pass < passes; pass++) {
+			for (i = kind * nodeCount; i < (kind + 1) * nodeCount; i++) {
+				block.buffer = work + i * nodeSize;
+				for (j = 0; j < nodes[i].keyCount; j++)
+					(void) SearchLazily(&block, nodes[i].fcb, &nodes[i].keys[j],
+							    kind == kCatalogIndex, &child);
+			}
+		}
+		newTime = now() - start;
+		if (searches)
+			printf("%-22s %10.1f %10.1f %7.2fx\n", kindNames[kind],
+				oldTime * 1e9 / searches, newTime * 1e9 / searches, oldTime / newTime);
+	}
+
+	/* Every node must swap as the scalar code swaps it, and back again */
+	memset(&other, 0, sizeof(other));
+	other.blockSize = nodeSize;
+	for (i = 0; i < total; i++) {
+		block.buffer = work + i * nodeSize;
+		other.buffer = copy;
+		memcpy(copy, nodes[i].image, nodeSize);
+		if (memcmp(block.buffer, nodes[i].image, nodeSize) != 0 ||
+		    hfs_swap_BTNode(&block, nodes[i].fcb, kSwapBTNodeBigToHost) != 0 ||
+		    scalar_swap_BTNode(&other, nodes[i].fcb, kSwapBTNodeBigToHost) != 0 ||
+		    memcmp(block.buffer, copy, nodeSize) != 0) {
+			if (errors++ < 10)
+				printf("  MISMATCH: %s node %ld swapped to host order\n",
+					kindNames[nodes[i].kind], i % nodeCount);
+			continue;
+		}
+
+		/* The lazy search must pick the record the whole-node one does */
+		other.buffer = nodes[i].image;
+		for (j = 0; j < nodes[i].keyCount; j++) {
+			index = SearchSwapped(block.buffer, nodeSize, &nodes[i].keys[j],
+					      nodes[i].kind == kCatalogIndex, &child);
+			lazyIndex = SearchLazily(&other, nodes[i].fcb, &nodes[i].keys[j],
+						 nodes[i].kind == kCatalogIndex, &lazyChild);
+			if (index != lazyIndex || child != lazyChild) {
+				if (errors++ < 10)
+					printf("  MISMATCH: %s node %ld search %ld found record %u child %u, expected %u child %u\n",
+						kindNames[nodes[i].kind], i % nodeCount, j,
+						lazyIndex, lazyChild, index, child);
+			}
+		}
+
+		if (hfs_swap_BTNode(&block, nodes[i].fcb, kSwapBTNodeHostToBig) != 0 ||
+		    memcmp(block.buffer, nodes[i].image, nodeSize) != 0) {
+			if (errors++ < 10)
+				printf("  MISMATCH: %s node %ld swapped back to big endian\n",
+					kindNames[nodes[i].kind], i % nodeCount);
+		}
+	}
+	printf("%ld nodes checked, %d mismatches\n", total, errors);
+
+	return (errors ? 1 : 0);
+}
@@ -113,7 +113,30 @@ ckfini(markclean)
 //	register struct bufarea *bp, *nbp;
 //	int ofsmodified, cnt = 0;
 
+	if (cacheReportFile != NULL) {
+		FILE *fp;
+
+		if (strcmp(cacheReportFile, "-") == 0)
+			fp = stdout;
+		else
+			fp = fopen(cacheReportFile, "w");
+		if (fp == NULL) {
+			plog("Can't write cache report to %s: %s\n", cacheReportFile, strerror(errno));
+		} else {
+			(void) CacheWriteReport(&fscache, fp);
+			if (fp != stdout)
+				fclose(fp);
+			else
+				fflush(fp);
+		}
+	}
+
 	(void) CacheDestroy(&fscache);
+	if (cacheTrace != NULL) {
+		if (fclose(cacheTrace) != 0)
+			plog("Can't write cache trace: %s\n", strerror(errno));
+		cacheTrace = NULL;
+	}
 
 	if (fswritefd < 0) {
 		(void)close(fsreadfd);